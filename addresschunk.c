@@ -68,13 +68,13 @@ struct sockaddr *AddressChunk_GetDedicated(AddressChunk *ac, sa_family_t *family
 	}
 }
 
-struct sockaddr *AddressChunk_GetOne(AddressChunk *ac, sa_family_t *family, DNSQuaryProtocol Protocol)
+struct sockaddr *AddressChunk_GetOne(AddressChunk *ac, sa_family_t *family, DNSQuaryProtocol Protocol, int *Subscript)
 {
 	if( Protocol == DNS_QUARY_PROTOCOL_UDP )
 	{
-		return AddressList_GetOne(&(ac -> UDPAddresses), family);
+		return AddressList_GetBest(&(ac -> UDPAddresses), family, Subscript);
 	} else {
-		return AddressList_GetOne(&(ac -> TCPAddresses), family);
+		return AddressList_GetBest(&(ac -> TCPAddresses), family, Subscript);
 	}
 }
 
@@ -83,14 +83,58 @@ struct sockaddr *AddressChunk_GetOneUDPBySubscript(AddressChunk *ac, sa_family_t
 	return AddressList_GetOneBySubscript(&(ac -> UDPAddresses), family, Subscript);
 }
 
-int AddressChunk_Advance(AddressChunk *ac, DNSQuaryProtocol Protocol)
+int AddressChunk_Find(AddressChunk *ac, DNSQuaryProtocol Protocol, const struct sockaddr *Address)
 {
 	if( Protocol == DNS_QUARY_PROTOCOL_UDP )
 	{
-		AddressList_Advance(&(ac -> UDPAddresses));
+		return AddressList_Find(&(ac -> UDPAddresses), Address);
 	} else {
-		AddressList_Advance(&(ac -> TCPAddresses));
+		return AddressList_Find(&(ac -> TCPAddresses), Address);
 	}
+}
 
-	return 0;
+void AddressChunk_Answered(AddressChunk *ac, DNSQuaryProtocol Protocol, int Subscript, int64_t RoundTrip)
+{
+	if( Subscript < 0 )
+	{
+		return;
+	}
+
+	if( Protocol == DNS_QUARY_PROTOCOL_UDP )
+	{
+		AddressList_Answered(&(ac -> UDPAddresses), Subscript, RoundTrip);
+	} else {
+		AddressList_Answered(&(ac -> TCPAddresses), Subscript, RoundTrip);
+	}
+}
+
+void AddressChunk_Failed(AddressChunk *ac, DNSQuaryProtocol Protocol, int Subscript, int64_t TimeSent)
+{
+	if( Subscript < 0 )
+	{
+		return;
+	}
+
+	if( Protocol == DNS_QUARY_PROTOCOL_UDP )
+	{
+		AddressList_Failed(&(ac -> UDPAddresses), Subscript, TimeSent);
+	} else {
+		AddressList_Failed(&(ac -> TCPAddresses), Subscript, TimeSent);
+	}
+}
+
+struct sockaddr *AddressChunk_GetHedge(AddressChunk *ac, sa_family_t family, uint32_t Asked, int *Subscript)
+{
+	return AddressList_GetHedge(&(ac -> UDPAddresses), family, Asked, Subscript);
+}
+
+int64_t AddressChunk_HedgeDelay(AddressChunk *ac, int Subscript)
+{
+	return AddressList_HedgeDelay(&(ac -> UDPAddresses), Subscript);
+}
+
+void AddressChunk_PrintStatistic(AddressChunk *ac, FILE *fp)
+{
+	AddressList_PrintStatistic(&(ac -> UDPAddresses), "UDP", fp);
+	AddressList_PrintStatistic(&(ac -> TCPAddresses), "TCP", fp);
 }
@@ -22,10 +22,31 @@ int AddressChunk_AddADedicatedAddress_FromString(AddressChunk *ac, const char *D
 
 struct sockaddr *AddressChunk_GetDedicated(AddressChunk *ac, sa_family_t *family, const char *RequestingDomain, int *HashValue);
 
-struct sockaddr *AddressChunk_GetOne(AddressChunk *ac, sa_family_t *family, DNSQuaryProtocol Protocol);
+struct sockaddr *AddressChunk_GetOne(AddressChunk *ac, sa_family_t *family, DNSQuaryProtocol Protocol, int *Subscript);
+/* Description:
+ *  Fetch the best server of `Protocol', see AddressList_GetBest().
+ */
 
 struct sockaddr *AddressChunk_GetOneUDPBySubscript(AddressChunk *ac, sa_family_t *family, int Subscript);
 
-int AddressChunk_Advance(AddressChunk *ac, DNSQuaryProtocol Protocol);
+int AddressChunk_Find(AddressChunk *ac, DNSQuaryProtocol Protocol, const struct sockaddr *Address);
+
+void AddressChunk_Answered(AddressChunk *ac, DNSQuaryProtocol Protocol, int Subscript, int64_t RoundTrip);
+
+void AddressChunk_Failed(AddressChunk *ac, DNSQuaryProtocol Protocol, int Subscript, int64_t TimeSent);
+/* Description:
+ *  Record how a server is doing, see AddressList_Answered() and
+ *  AddressList_Failed(). Do nothing if `Subscript' is negative.
+ */
+
+struct sockaddr *AddressChunk_GetHedge(AddressChunk *ac, sa_family_t family, uint32_t Asked, int *Subscript);
+
+int64_t AddressChunk_HedgeDelay(AddressChunk *ac, int Subscript);
+/* Description:
+ *  Hedge a UDP query, see AddressList_GetHedge() and
+ *  AddressList_HedgeDelay().
+ */
+
+void AddressChunk_PrintStatistic(AddressChunk *ac, FILE *fp);
 
 #endif // ADDRESSCHUNK_H_INCLUDED
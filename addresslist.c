@@ -5,6 +5,13 @@
 #include "common.h"
 #include "utils.h"
 
+/* A server failing is not asked for 1, 2, 4 ... up to 64 seconds */
+#define	BACKOFF(Failures)	((int64_t)1000000 << ((Failures) < 6 ? (Failures) : 6))
+
+/* Hedging delays, in microseconds, see AddressList_HedgeDelay() */
+#define	HEDGE_DELAY_UNKNOWN	100000
+#define	HEDGE_DELAY_MIN		2000
+
 int AddressList_Init(AddressList *a)
 {
 	if( a == NULL )
@@ -17,6 +24,12 @@ int AddressList_Init(AddressList *a)
 		return -1;
 	}
 
+	if( Array_Init(&(a -> Stats), sizeof(AddressList_Stat), 8, FALSE, NULL) != 0 )
+	{
+		Array_Free(&(a -> AddressList));
+		return -1;
+	}
+
 	a -> Counter = 0;
 	return 0;
 }
@@ -24,10 +37,20 @@ int AddressList_Init(AddressList *a)
 
 int AddressList_Add(AddressList *a, Address_Type	*Addr)
 {
+	AddressList_Stat	Stat;
+
 	if( a == NULL )
 	{
 		return -1;
 	}
+
+	memset(&Stat, 0, sizeof(Stat));
+
+	/* Stats are kept at the same subscripts as the addresses */
+	if( Array_SetToSubscript(&(a -> Stats), Array_GetUsed(&(a -> AddressList)), &Stat) == NULL )
+	{
+		return -1;
+	}
 
 	if( Array_PushBack(&(a -> AddressList), Addr, NULL) < 0 )
 	{
@@ -129,6 +152,44 @@ int AddressList_Add_From_String(AddressList *a, const char *Addr_Port, int Defau
 
 }
 
+int AddressList_Find(AddressList *a, const struct sockaddr *Address)
+{
+	int	loop;
+
+	for( loop = 0; loop != Array_GetUsed(&(a -> AddressList)); ++loop )
+	{
+		const Address_Type	*Itr = (const Address_Type *)Array_GetBySubscript(&(a -> AddressList), loop);
+
+		if( Itr -> family != Address -> sa_family )
+		{
+			continue;
+		}
+
+		if( Itr -> family == AF_INET )
+		{
+			const struct sockaddr_in	*Address4 = (const struct sockaddr_in *)Address;
+
+			if( Itr -> Addr.Addr4.sin_port == Address4 -> sin_port &&
+				memcmp(&(Itr -> Addr.Addr4.sin_addr), &(Address4 -> sin_addr), sizeof(Address4 -> sin_addr)) == 0
+				)
+			{
+				return loop;
+			}
+		} else {
+			const struct sockaddr_in6	*Address6 = (const struct sockaddr_in6 *)Address;
+
+			if( Itr -> Addr.Addr6.sin6_port == Address6 -> sin6_port &&
+				memcmp(&(Itr -> Addr.Addr6.sin6_addr), &(Address6 -> sin6_addr), sizeof(Address6 -> sin6_addr)) == 0
+				)
+			{
+				return loop;
+			}
+		}
+	}
+
+	return -1;
+}
+
 int AddressList_Advance(AddressList *a)
 {
 	if( a == NULL )
@@ -165,3 +226,302 @@ struct sockaddr *AddressList_GetOne(AddressList *a, sa_family_t *family)
 {
 	return AddressList_GetOneBySubscript(a, family, a -> Counter % Array_GetUsed(&(a -> AddressList)));
 }
+
+struct sockaddr *AddressList_GetBest(AddressList *a, sa_family_t *family, int *Subscript)
+{
+	int		Count = Array_GetUsed(&(a -> AddressList));
+	int		Best = -1;
+	int64_t	BestScore = 0;
+	int64_t	Now;
+	int		loop;
+
+	const AddressList_Stat	*Stat;
+
+	if( Count <= 1 )
+	{
+		Best = 0;
+		goto Done;
+	}
+
+	Now = GetMicroseconds();
+
+	/* A failing server whose backoff is over is given one query to probe it,
+	 * and is held back again until the probe is answered */
+	for( loop = 0; loop != Count; ++loop )
+	{
+		AddressList_Stat	*Failing = Array_GetBySubscript(&(a -> Stats), loop);
+
+		if( Failing -> Failures > 0 && Failing -> RetryAt <= Now )
+		{
+			Failing -> RetryAt = Now + BACKOFF(Failing -> Failures);
+			Best = loop;
+			goto Done;
+		}
+	}
+
+	++(a -> Counter);
+	if( a -> Counter % 64 == 0 )
+	{
+		for( loop = 0; loop != Count; ++loop )
+		{
+			int	Candidate = (a -> Counter / 64 + loop) % Count;
+
+			Stat = Array_GetBySubscript(&(a -> Stats), Candidate);
+			if( Stat -> RetryAt <= Now )
+			{
+				Best = Candidate;
+				goto Done;
+			}
+		}
+	}
+
+	for( loop = 0; loop != Count; ++loop )
+	{
+		int64_t	Score;
+
+		Stat = Array_GetBySubscript(&(a -> Stats), loop);
+		if( Stat -> RetryAt > Now )
+		{
+			continue;
+		}
+
+		Score = (int64_t)Stat -> SRTT + Stat -> RTTVar;
+		if( Best < 0 || Score < BestScore )
+		{
+			Best = loop;
+			BestScore = Score;
+		}
+	}
+
+	/* All are failing, take the one to be retried the soonest */
+	if( Best < 0 )
+	{
+		for( loop = 0; loop != Count; ++loop )
+		{
+			Stat = Array_GetBySubscript(&(a -> Stats), loop);
+			if( Best < 0 || Stat -> RetryAt < BestScore )
+			{
+				Best = loop;
+				BestScore = Stat -> RetryAt;
+			}
+		}
+	}
+
+Done:
+	if( Subscript != NULL )
+	{
+		*Subscript = Best;
+	}
+
+	return AddressList_GetOneBySubscript(a, family, Best);
+}
+
+struct sockaddr *AddressList_GetHedge(AddressList *a, sa_family_t family, uint32_t Asked, int *Subscript)
+{
+	int		Count = Array_GetUsed(&(a -> AddressList));
+	int		Best = -1;
+	int64_t	BestScore = 0;
+	int64_t	Now = GetMicroseconds();
+	int		loop;
+
+	if( Count > 32 )
+	{
+		Count = 32;
+	}
+
+	for( loop = 0; loop != Count; ++loop )
+	{
+		const Address_Type		*Address = Array_GetBySubscript(&(a -> AddressList), loop);
+		const AddressList_Stat	*Stat = Array_GetBySubscript(&(a -> Stats), loop);
+		int64_t	Score;
+
+		if( (Asked & ((uint32_t)1 << loop)) != 0 ||
+			Address -> family != family ||
+			Stat -> RetryAt > Now
+			)
+		{
+			continue;
+		}
+
+		Score = (int64_t)Stat -> SRTT + Stat -> RTTVar;
+		if( Best < 0 || Score < BestScore )
+		{
+			Best = loop;
+			BestScore = Score;
+		}
+	}
+
+	if( Best < 0 )
+	{
+		return NULL;
+	}
+
+	if( Subscript != NULL )
+	{
+		*Subscript = Best;
+	}
+
+	return AddressList_GetOneBySubscript(a, NULL, Best);
+}
+
+int64_t AddressList_HedgeDelay(AddressList *a, int Subscript)
+{
+	const AddressList_Stat	*Stat = Array_GetBySubscript(&(a -> Stats), Subscript);
+	int64_t	Delay;
+	uint64_t	Total = 0, Count = 0;
+	int		Bucket;
+
+	if( Stat == NULL || (Stat -> SRTT == 0 && Stat -> RTTVar == 0) )
+	{
+		return HEDGE_DELAY_UNKNOWN;
+	}
+
+	/* The retransmission timeout of RFC 6298, which few answers exceed */
+	Delay = (int64_t)Stat -> SRTT + 4 * (int64_t)Stat -> RTTVar;
+
+	/* A few very slow answers inflate it, so the 95th percentile is taken if
+	 * smaller, as the upper bound of its bucket in the histogram */
+	for( Bucket = 0; Bucket != ADDRESSLIST_HISTOGRAM_BUCKETS; ++Bucket )
+	{
+		Total += Stat -> Histogram[Bucket];
+	}
+
+	if( Total >= 20 )
+	{
+		for( Bucket = 0; Bucket != ADDRESSLIST_HISTOGRAM_BUCKETS; ++Bucket )
+		{
+			Count += Stat -> Histogram[Bucket];
+			if( Count * 20 >= Total * 19 )
+			{
+				break;
+			}
+		}
+
+		if( ((int64_t)1000 << Bucket) < Delay )
+		{
+			Delay = (int64_t)1000 << Bucket;
+		}
+	}
+
+	return Delay < HEDGE_DELAY_MIN ? HEDGE_DELAY_MIN : Delay;
+}
+
+void AddressList_Answered(AddressList *a, int Subscript, int64_t RoundTrip)
+{
+	AddressList_Stat	*Stat = Array_GetBySubscript(&(a -> Stats), Subscript);
+	int32_t	Milliseconds;
+	int		Bucket = 0;
+
+	if( Stat == NULL )
+	{
+		return;
+	}
+
+	++(Stat -> Answered);
+	Stat -> Failures = 0;
+	Stat -> RetryAt = 0;
+
+	/* Not known which of several queries is answered */
+	if( RoundTrip < 0 )
+	{
+		return;
+	}
+
+	if( RoundTrip > 0x7FFFFFFF )
+	{
+		RoundTrip = 0x7FFFFFFF;
+	}
+
+	if( Stat -> SRTT == 0 && Stat -> RTTVar == 0 )
+	{
+		Stat -> SRTT = RoundTrip;
+		Stat -> RTTVar = RoundTrip / 2;
+	} else {
+		int64_t	Deviation = RoundTrip - Stat -> SRTT;
+
+		if( Deviation < 0 )
+		{
+			Deviation = -Deviation;
+		}
+
+		/* RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R */
+		Stat -> RTTVar += (Deviation - Stat -> RTTVar) / 4;
+		Stat -> SRTT += (RoundTrip - Stat -> SRTT) / 8;
+	}
+
+	for( Milliseconds = RoundTrip / 1000; Milliseconds > 0 && Bucket < ADDRESSLIST_HISTOGRAM_BUCKETS - 1; Milliseconds >>= 1 )
+	{
+		++Bucket;
+	}
+
+	++(Stat -> Histogram[Bucket]);
+}
+
+void AddressList_Failed(AddressList *a, int Subscript, int64_t TimeSent)
+{
+	AddressList_Stat	*Stat = Array_GetBySubscript(&(a -> Stats), Subscript);
+	int64_t	Now;
+
+	if( Stat == NULL )
+	{
+		return;
+	}
+
+	++(Stat -> Failed);
+
+	if( TimeSent < Stat -> FailedAt )
+	{
+		return;
+	}
+
+	Now = GetMicroseconds();
+
+	Stat -> FailedAt = Now;
+	Stat -> RetryAt = Now + BACKOFF(Stat -> Failures);
+	++(Stat -> Failures);
+}
+
+void AddressList_PrintStatistic(AddressList *a, const char *Protocol, FILE *fp)
+{
+	int64_t	Now = GetMicroseconds();
+	int		loop;
+
+	for( loop = 0; loop != Array_GetUsed(&(a -> AddressList)); ++loop )
+	{
+		const Address_Type		*Address = Array_GetBySubscript(&(a -> AddressList), loop);
+		const AddressList_Stat	*Stat = Array_GetBySubscript(&(a -> Stats), loop);
+		char	Text[LENGTH_OF_IPV6_ADDRESS_ASCII + 1];
+		int		Bucket;
+
+		if( Address -> family == AF_INET )
+		{
+			strcpy(Text, inet_ntoa(Address -> Addr.Addr4.sin_addr));
+			fprintf(fp, "%s server %s:%d : ", Protocol, Text, ntohs(Address -> Addr.Addr4.sin_port));
+		} else {
+			IPv6AddressToAsc(&(Address -> Addr.Addr6.sin6_addr), Text);
+			fprintf(fp, "%s server [%s]:%d : ", Protocol, Text, ntohs(Address -> Addr.Addr6.sin6_port));
+		}
+
+		fprintf(fp,
+				"SRTT %.3f ms, RTTVAR %.3f ms, %u answered, %u failed",
+				Stat -> SRTT / 1000.0,
+				Stat -> RTTVar / 1000.0,
+				Stat -> Answered,
+				Stat -> Failed
+				);
+
+		if( Stat -> RetryAt > Now )
+		{
+			fprintf(fp, ", backed off for %d s", (int)((Stat -> RetryAt - Now) / 1000000) + 1);
+		}
+
+		fprintf(fp, "\n    RTT (ms) : <1 %u", Stat -> Histogram[0]);
+
+		for( Bucket = 1; Bucket != ADDRESSLIST_HISTOGRAM_BUCKETS - 1; ++Bucket )
+		{
+			fprintf(fp, " | %d-%d %u", 1 << (Bucket - 1), 1 << Bucket, Stat -> Histogram[Bucket]);
+		}
+
+		fprintf(fp, " | >%d %u\n", 1 << (Bucket - 1), Stat -> Histogram[Bucket]);
+	}
+}
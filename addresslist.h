@@ -7,14 +7,42 @@
 #ifndef ADDRESSLIST_H_INCLUDED
 #define ADDRESSLIST_H_INCLUDED
 
+#include <stdio.h>
 #include "array.h"
 #include "common.h"
 
+/* Answers are counted by round-trip time into buckets of powers of 2
+ * milliseconds: under 1 ms, [1, 2), [2, 4), ... and the last one for all
+ * longer */
+#define ADDRESSLIST_HISTOGRAM_BUCKETS	12
+
+/* How an address is doing as a server */
+typedef struct _AddressList_Stat {
+	/* Smoothed round-trip time and its variation (RFC 6298), in microseconds,
+	 * 0 until the first round trip is measured */
+	int32_t		SRTT;
+	int32_t		RTTVar;
+
+	uint32_t	Answered;
+	uint32_t	Failed;
+
+	/* Failures since the last answer. The address is not chosen before
+	 * `RetryAt', a time which doubles its distance with each failure. */
+	int32_t		Failures;
+	int64_t		FailedAt;
+	int64_t		RetryAt;
+
+	uint32_t	Histogram[ADDRESSLIST_HISTOGRAM_BUCKETS];
+} AddressList_Stat;
+
 typedef struct _AddressList {
 
 	/* An array of `Address_Type' */
 	Array		AddressList;
 
+	/* An array of `AddressList_Stat', one for each address */
+	Array		Stats;
+
 	/* The `Counter' is used by `AddressList_Advance' and `AddressList_GetOne',
 	 * see them.
 	 */
@@ -69,6 +97,13 @@ int AddressList_Add_From_String(__in	AddressList	*a,
  *  0 on success, a non-zero value otherwise.
  */
 
+int AddressList_Find(__in AddressList *a, __in const struct sockaddr *Address);
+/* Description:
+ *  Find an address in an AddressList.
+ * Return value:
+ *  The subscript of the address, or -1 if it is not found.
+ */
+
 int AddressList_Advance(__in AddressList *a);
 /* Description:
  *  Increase a -> Counter by 1 .
@@ -92,7 +127,63 @@ struct sockaddr *AddressList_GetOne(__in		AddressList	*a,
  *  The pointer to the fetched address.
  */
 
-#define AddressList_Free(a_ptr)	(Array_Free(&((a_ptr) -> AddressList)))
+struct sockaddr *AddressList_GetBest(__in			AddressList	*a,
+									 __out_opt	sa_family_t	*family,
+									 __out_opt	int			*Subscript);
+/* Description:
+ *  Fetch the address which has been answering the fastest, by its smoothed
+ *  round-trip time plus the variation. Addresses not tried yet come first,
+ *  and those failing are skipped until they are due for a retry. One in
+ *  every 64 calls takes the addresses in turn instead, so the times of the
+ *  slower ones are kept up to date.
+ * Parameters:
+ *  a         : The AddressList fetched from.
+ *  family    : The family of the returned address. Can be NULL.
+ *  Subscript : The subscript of the returned address. Can be NULL.
+ * Return value:
+ *  The pointer to the fetched address.
+ */
+
+struct sockaddr *AddressList_GetHedge(__in		AddressList	*a,
+									  __in		sa_family_t	family,
+									  __in		uint32_t	Asked,
+									  __out_opt	int			*Subscript);
+/* Description:
+ *  Fetch the fastest address of `family' to hedge a query with, one not
+ *  backed off and not in `Asked', where bit `i' stands for the address of
+ *  subscript `i'. Only the first 32 addresses are considered.
+ * Return value:
+ *  The pointer to the fetched address, NULL if there is none.
+ */
+
+int64_t AddressList_HedgeDelay(__in AddressList *a, __in int Subscript);
+/* Description:
+ *  How long to wait for an address to answer before hedging the query, in
+ *  microseconds. It is the smoothed round-trip time plus 4 times the
+ *  variation, or the 95th percentile of the histogram if smaller.
+ */
+
+void AddressList_Answered(__in AddressList *a, __in int Subscript, __in int64_t RoundTrip);
+/* Description:
+ *  Record an answer from an address, `RoundTrip' microseconds after the
+ *  query was sent, or negative if not known. Ends the backoff of the address.
+ */
+
+void AddressList_Failed(__in AddressList *a, __in int Subscript, __in int64_t TimeSent);
+/* Description:
+ *  Record a query to an address, sent at `TimeSent' (see GetMicroseconds()),
+ *  not answered. The address is backed off for 1 second, doubled by each
+ *  failure after the retry up to 64 seconds. Queries sent before the last
+ *  failure was recorded only count, they do not extend the backoff.
+ */
+
+void AddressList_PrintStatistic(__in AddressList *a, __in const char *Protocol, __in FILE *fp);
+/* Description:
+ *  Print the statistic of every address, with the histogram of round-trip
+ *  times.
+ */
+
+#define AddressList_Free(a_ptr)	(Array_Free(&((a_ptr) -> AddressList)), Array_Free(&((a_ptr) -> Stats)))
 /* Description:
  *  Free an initialized AddressList.
  * Return value:
@@ -1,46 +1,136 @@
 #include <string.h>
-#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
 #include "cacheht.h"
 #include "common.h"
 #include "utils.h"
 
-typedef struct _Cht_Slot{
-	int32_t	Next;
-} Cht_Slot;
+/* Control bytes. A used slot holds the lowest 7 bits of the hash. */
+#define	CTRL_EMPTY		0x80
+#define	CTRL_DELETED	0xFE
 
-static int CacheHT_CalculateSlotCount(int CacheSize)
+#define	CTRL_OF(Hash)	((unsigned char)((Hash) & 0x7F))
+#define	GROUP_OF(h, Hash)	(((Hash) >> 7) % (uint32_t)((h) -> Groups))
+
+/* Both a node and the data in its chunk take at least 32 bytes, so one slot
+ * for every 64 bytes of the region is enough, leaving an eighth of the slots
+ * empty to keep probing short */
+#define	BYTES_PER_SLOT	64
+
+/* FNV-1a */
+static uint32_t CacheHT_Hash(const char *Key)
 {
-	int PreValue;
-	if( CacheSize < 1048576 )
+	uint32_t	Hash = 2166136261U;
+
+	while( *Key != '\0' )
 	{
-		PreValue = CacheSize / 4979 - 18;
-	} else {
-		PreValue = pow(log((double)CacheSize), 2);
+		Hash ^= *(const unsigned char *)Key;
+		Hash *= 16777619U;
+
+		++Key;
+	}
+
+	return Hash;
+}
+
+/* The slots in a group whose control bytes are `Value', as a bit mask */
+static uint32_t CacheHT_Match(const unsigned char *Group, unsigned char Value)
+{
+#ifdef __SSE2__
+	__m128i	Ctrl = _mm_loadu_si128((const __m128i *)Group);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(Ctrl, _mm_set1_epi8((char)Value)));
+#else /* __SSE2__ */
+	uint32_t	Mask = 0;
+	int			loop;
+
+	for( loop = 0; loop != CACHEHT_GROUP_WIDTH; ++loop )
+	{
+		if( Group[loop] == Value )
+		{
+			Mask |= 1 << loop;
+		}
+	}
+
+	return Mask;
+#endif /* __SSE2__ */
+}
+
+/* The slots in a group which are empty or deleted, as a bit mask */
+static uint32_t CacheHT_MatchFree(const unsigned char *Group)
+{
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)Group));
+#else /* __SSE2__ */
+	uint32_t	Mask = 0;
+	int			loop;
+
+	for( loop = 0; loop != CACHEHT_GROUP_WIDTH; ++loop )
+	{
+		if( Group[loop] & 0x80 )
+		{
+			Mask |= 1 << loop;
+		}
 	}
 
-	return ROUND(PreValue, 10) + 7;
+	return Mask;
+#endif /* __SSE2__ */
 }
 
+static int CacheHT_LowestBit(uint32_t Mask)
+{
+	int	Bit = 0;
+
+	while( (Mask & 1) == 0 )
+	{
+		Mask >>= 1;
+		++Bit;
+	}
+
+	return Bit;
+}
+
+#define	CacheHT_SlotOf(h, i)	((int32_t *)Array_GetBySubscript(&((h) -> Slots), (i)))
+
 int CacheHT_Init(CacheHT *h, char *BaseAddr, int CacheSize)
 {
-	int loop;
+	int32_t	SlotCount;
+	int		loop;
+
+	h -> Groups = CacheSize / BYTES_PER_SLOT / CACHEHT_GROUP_WIDTH;
+	if( h -> Groups < 1 )
+	{
+		h -> Groups = 1;
+	}
+
+	SlotCount = h -> Groups * CACHEHT_GROUP_WIDTH;
 
-	h -> Slots.Used = CacheHT_CalculateSlotCount(CacheSize);
-	h -> Slots.DataLength = sizeof(Cht_Slot);
+	h -> Entries = 0;
+	h -> Tombstones = 0;
+	h -> MaxEntries = SlotCount - SlotCount / 8;
+
+	h -> Slots.Used = SlotCount;
+	h -> Slots.DataLength = sizeof(int32_t);
 	h -> Slots.Data = BaseAddr + CacheSize - (h -> Slots.DataLength) * (h -> Slots.Used);
 	h -> Slots.Allocated = h -> Slots.Used;
 
-	for(loop = 0; loop != h -> Slots.Allocated; ++loop)
-	{
-		((Cht_Slot *)Array_GetBySubscript(&(h -> Slots), loop)) -> Next = -1;
-	}
+	h -> Control = (unsigned char *)(h -> Slots.Data) - SlotCount;
+	memset(h -> Control, CTRL_EMPTY, SlotCount);
 
 	h -> NodeChunk.DataLength = sizeof(Cht_Node);
-	h -> NodeChunk.Data = h -> Slots.Data - h -> NodeChunk.DataLength;
+	h -> NodeChunk.Data = (char *)(h -> Control) - h -> NodeChunk.DataLength;
 	h -> NodeChunk.Used = 0;
 	h -> NodeChunk.Allocated = -1;
 
-	h -> FreeList = -1;
+	for(loop = 0; loop != CACHEHT_SIZE_CLASSES; ++loop)
+	{
+		h -> FreeLists[loop] = -1;
+		h -> FreeCount[loop] = 0;
+	}
+
+	h -> UsedBytes = 0;
+	h -> DataBytes = 0;
 
 	return 0;
 }
@@ -48,11 +138,77 @@ int CacheHT_Init(CacheHT *h, char *BaseAddr, int CacheSize)
 int CacheHT_ReInit(CacheHT *h, char *BaseAddr, int CacheSize)
 {
 	h -> Slots.Data = BaseAddr + CacheSize - (h -> Slots.DataLength) * (h -> Slots.Used);
-	h -> NodeChunk.Data = h -> Slots.Data - h -> NodeChunk.DataLength;
+	h -> Control = (unsigned char *)(h -> Slots.Data) - h -> Slots.Used;
+	h -> NodeChunk.Data = (char *)(h -> Control) - h -> NodeChunk.DataLength;
 
 	return 0;
 }
 
+static int CacheHT_SizeClass(uint32_t Length)
+{
+	int			Class = 8;
+	uint32_t	Limit = 64;
+
+	if( Length <= 64 )
+	{
+		return Length <= 8 ? 0 : (Length - 1) / 8;
+	}
+
+	while( Length > Limit * 2 )
+	{
+		Limit *= 2;
+		Class += 4;
+	}
+
+	return Class + (Length - Limit - 1) / (Limit / 4);
+}
+
+uint32_t CacheHT_ClassSize(int Class)
+{
+	uint32_t	Base;
+
+	if( Class < 8 )
+	{
+		return (Class + 1) * 8;
+	}
+
+	Base = 64 << ((Class - 8) / 4);
+
+	return Base + ((Class - 8) % 4 + 1) * (Base / 4);
+}
+
+uint32_t CacheHT_RoundChunkSize(uint32_t Length)
+{
+	if( Length > CACHEHT_MAX_CHUNK_SIZE )
+	{
+		return 0;
+	}
+
+	return CacheHT_ClassSize(CacheHT_SizeClass(Length));
+}
+
+static void CacheHT_UnlinkFreeNode(CacheHT *h, Cht_Node *Node)
+{
+	int	Class = CacheHT_SizeClass(Node -> Length);
+
+	if( Node -> Link.Prev < 0 )
+	{
+		h -> FreeLists[Class] = Node -> Chain.Next;
+	} else {
+		((Cht_Node *)Array_GetBySubscript(&(h -> NodeChunk), Node -> Link.Prev)) -> Chain.Next = Node -> Chain.Next;
+	}
+
+	if( Node -> Chain.Next >= 0 )
+	{
+		((Cht_Node *)Array_GetBySubscript(&(h -> NodeChunk), Node -> Chain.Next)) -> Link.Prev = Node -> Link.Prev;
+	}
+
+	Node -> Chain.Next = -1;
+	Node -> Link.Prev = -1;
+
+	--(h -> FreeCount[Class]);
+}
+
 static int CacheHT_CreateNewNode(CacheHT *h, uint32_t ChunkSize, Cht_Node **Out, void *Boundary)
 {
 	int			NewNode_i;
@@ -67,7 +223,8 @@ static int CacheHT_CreateNewNode(CacheHT *h, uint32_t ChunkSize, Cht_Node **Out,
 	}
 
 	NewNode = (Cht_Node *)Array_GetBySubscript(NodeChunk, NewNode_i);
-	NewNode -> Next = -1;
+	NewNode -> Chain.Next = -1;
+	NewNode -> Link.Prev = -1;
 
 	NewNode -> Length = ChunkSize;
 
@@ -80,65 +237,127 @@ static int CacheHT_CreateNewNode(CacheHT *h, uint32_t ChunkSize, Cht_Node **Out,
 }
 
 int32_t CacheHT_FindUnusedNode(CacheHT		*h,
-								uint32_t	ChunkSize,
+								uint32_t	DataLength,
 								Cht_Node	**Out,
 								void		*Boundary,
 								BOOL		*NewCreated
 								)
 {
-	int32_t	Subscript = h -> FreeList;
-	Cht_Node	*FirstNode = NULL;
-	Cht_Node	*SecondNode = NULL;
+	int32_t		Subscript;
+	Cht_Node	*Node;
+	uint32_t	ChunkSize = CacheHT_RoundChunkSize(DataLength);
 
-	Array		*NodeChunk = &(h -> NodeChunk);
+	if( ChunkSize == 0 || h -> Entries >= h -> MaxEntries )
+	{
+		return -1;
+	}
 
-	while ( Subscript >= 0 )
+	Subscript = h -> FreeLists[CacheHT_SizeClass(ChunkSize)];
+	if( Subscript >= 0 )
 	{
-		FirstNode = SecondNode;
-		SecondNode = (Cht_Node *)Array_GetBySubscript(NodeChunk, Subscript);
-		if( SecondNode -> Length == ChunkSize )
+		Node = (Cht_Node *)Array_GetBySubscript(&(h -> NodeChunk), Subscript);
+
+		CacheHT_UnlinkFreeNode(h, Node);
+
+		*NewCreated = FALSE;
+	} else {
+		Subscript = CacheHT_CreateNewNode(h, ChunkSize, &Node, Boundary);
+		if( Subscript >= 0 )
 		{
-			if( FirstNode == NULL )
+			*NewCreated = TRUE;
+		} else {
+			/* No room for a new chunk, take a free one of a larger class */
+			int	Class;
+
+			for( Class = CacheHT_SizeClass(ChunkSize) + 1; Class < CACHEHT_SIZE_CLASSES; ++Class )
 			{
-				h -> FreeList = SecondNode -> Next;
-			} else {
-				FirstNode -> Next = SecondNode -> Next;
+				if( h -> FreeLists[Class] >= 0 )
+				{
+					break;
+				}
 			}
 
-			SecondNode -> Next = -1;
-
-			if( Out != NULL )
+			if( Class >= CACHEHT_SIZE_CLASSES )
 			{
-				*Out = SecondNode;
+				return -1;
 			}
 
-			*NewCreated = FALSE;
+			Subscript = h -> FreeLists[Class];
+			Node = (Cht_Node *)Array_GetBySubscript(&(h -> NodeChunk), Subscript);
+
+			CacheHT_UnlinkFreeNode(h, Node);
 
-			return Subscript;
+			*NewCreated = FALSE;
 		}
+	}
+
+	Node -> Slot = -1;
+	Node -> DataLength = DataLength;
+	Node -> Link.Referenced = 0;
+
+	h -> UsedBytes += Node -> Length;
+	h -> DataBytes += DataLength;
 
-		Subscript = SecondNode -> Next;
+	if( Out != NULL )
+	{
+		*Out = Node;
 	}
 
-	*NewCreated = TRUE;
-	return CacheHT_CreateNewNode(h, ChunkSize, Out, Boundary);
+	return Subscript;
 }
 
-static void ThereIsAnEnd(CacheHT *h, int Slot_i, Cht_Slot *Slot)
+/* Put a node into the first free slot on the probe sequence of its hash */
+static void CacheHT_Place(CacheHT *h, int32_t Node_index, Cht_Node *Node)
 {
-	int i = Slot -> Next;
-	Cht_Node *Node;
+	int32_t	Group = GROUP_OF(h, Node -> Chain.Hash);
 
-	while( i >= 0 )
+	while( TRUE )
 	{
-		Node = Array_GetBySubscript(&(h -> NodeChunk), i);
+		unsigned char	*Ctrl = h -> Control + Group * CACHEHT_GROUP_WIDTH;
+		uint32_t		Free = CacheHT_MatchFree(Ctrl);
+
+		if( Free != 0 )
+		{
+			int	Slot_i = Group * CACHEHT_GROUP_WIDTH + CacheHT_LowestBit(Free);
+
+			if( h -> Control[Slot_i] == CTRL_DELETED )
+			{
+				--(h -> Tombstones);
+			}
+
+			h -> Control[Slot_i] = CTRL_OF(Node -> Chain.Hash);
+			*CacheHT_SlotOf(h, Slot_i) = Node_index;
+			Node -> Slot = Slot_i;
+
+			++(h -> Entries);
 
-		if( Node -> Slot != Slot_i )
+			return;
+		}
+
+		if( ++Group == h -> Groups )
 		{
-			printf("--------------------ERROR\n");
+			Group = 0;
 		}
+	}
+}
+
+/* Drop all the deleted slots by placing every used node again */
+static void CacheHT_Rebuild(CacheHT *h)
+{
+	int32_t	loop;
+
+	memset(h -> Control, CTRL_EMPTY, h -> Slots.Used);
+	h -> Entries = 0;
+	h -> Tombstones = 0;
+
+	for( loop = 0; loop != h -> NodeChunk.Used; ++loop )
+	{
+		Cht_Node	*Node = (Cht_Node *)Array_GetBySubscript(&(h -> NodeChunk), loop);
 
-		i = Node -> Next;
+		if( Node -> Slot >= 0 )
+		{
+			CacheHT_Place(h, loop, Node);
+		}
 	}
 }
 
@@ -149,90 +368,90 @@ int CacheHT_InsertToSlot(CacheHT	*h,
 						 int		*HashValue
 						 )
 {
-	int			Slot_i;
-	Cht_Slot	*Slot;
-
 	if( h == NULL || Key == NULL || Node_index < 0 || Node == NULL )
 		return -1;
 
-	if( HashValue != NULL )
-	{
-		Slot_i = (*HashValue) % (h -> Slots.Allocated);
-	} else {
-		Slot_i = ELFHash(Key, 0) % (h -> Slots.Allocated);
-	}
-
-	Node -> Slot = Slot_i;
-
-	Slot = (Cht_Slot *)Array_GetBySubscript(&(h -> Slots), Slot_i);
-	if( Slot == NULL )
+	if( h -> Entries >= h -> MaxEntries )
 		return -2;
 
-	Node -> Next = Slot -> Next;
-	Slot -> Next = Node_index;
-
-	return 0;
-}
-
-static Cht_Node *CacheHT_FindPredecesor(CacheHT *h, Cht_Slot *Slot, int32_t SubScriptOfNode)
-{
-	int Next = Slot -> Next;
-	Cht_Node *Node;
-
-	if( Next == SubScriptOfNode )
+	/* Too few empty slots are left for a probe to stop soon */
+	if( h -> Entries + h -> Tombstones >= h -> MaxEntries )
 	{
-		return NULL;
+		CacheHT_Rebuild(h);
 	}
 
-	while( Next >= 0 )
+	if( HashValue != NULL )
 	{
-		Node = Array_GetBySubscript(&(h -> NodeChunk), Next);
-		Next = Node -> Next;
-
-		if( Next == SubScriptOfNode )
-		{
-			return Node;
-		}
+		Node -> Chain.Hash = *HashValue;
+	} else {
+		Node -> Chain.Hash = CacheHT_Hash(Key);
 	}
 
-	return NULL;
+	CacheHT_Place(h, Node_index, Node);
+
+	return 0;
 }
 
 int CacheHT_RemoveFromSlot(CacheHT *h, int32_t SubScriptOfNode, Cht_Node *Node)
 {
 	Array		*NodeChunk = &(h -> NodeChunk);
-	Cht_Slot	*Slot;
-	Cht_Node	*Predecesor;
+	unsigned char	*Group;
 
 	if( Node -> Slot < 0 )
 	{
 		return 0;
 	}
 
-	Slot = (Cht_Slot *)Array_GetBySubscript(&(h -> Slots), Node -> Slot);
-	if( Slot == NULL )
+	/* A probe never goes past a group with an empty slot, so if there is one
+	 * in the group, the slot can be emptied as well */
+	Group = h -> Control + ROUND_DOWN(Node -> Slot, CACHEHT_GROUP_WIDTH);
+	if( CacheHT_Match(Group, CTRL_EMPTY) != 0 )
 	{
-		return -1;
-	}
-
-	Predecesor = CacheHT_FindPredecesor(h, Slot, SubScriptOfNode);
-	if( Predecesor == NULL )
-	{
-		Slot -> Next = Node -> Next;
+		h -> Control[Node -> Slot] = CTRL_EMPTY;
 	} else {
-		Predecesor -> Next = Node -> Next;
+		h -> Control[Node -> Slot] = CTRL_DELETED;
+		++(h -> Tombstones);
 	}
 
-	/* If this node is not the last one of NodeChunk, add it into free list,
-	 * or simply delete it from NodeChunk
+	--(h -> Entries);
+
+	h -> UsedBytes -= Node -> Length;
+	h -> DataBytes -= Node -> DataLength;
+
+	/* If this node is not the last one of NodeChunk, add it into the free
+	 * list of its class, or simply delete it from NodeChunk, along with the
+	 * free nodes before it
 	 */
 	if( SubScriptOfNode != NodeChunk -> Used - 1 )
 	{
-		Node -> Next = h -> FreeList;
-		h -> FreeList = SubScriptOfNode;
+		int	Class = CacheHT_SizeClass(Node -> Length);
+
 		Node -> Slot = -1;
+		Node -> Link.Prev = -1;
+		Node -> Chain.Next = h -> FreeLists[Class];
+
+		if( Node -> Chain.Next >= 0 )
+		{
+			((Cht_Node *)Array_GetBySubscript(NodeChunk, Node -> Chain.Next)) -> Link.Prev = SubScriptOfNode;
+		}
+
+		h -> FreeLists[Class] = SubScriptOfNode;
+		++(h -> FreeCount[Class]);
 	} else {
+		Node -> Slot = -1;
 		--(NodeChunk -> Used);
+
+		while( NodeChunk -> Used > 0 )
+		{
+			Node = (Cht_Node *)Array_GetBySubscript(NodeChunk, NodeChunk -> Used - 1);
+			if( Node -> Slot >= 0 )
+			{
+				break;
+			}
+
+			CacheHT_UnlinkFreeNode(h, Node);
+			--(NodeChunk -> Used);
+		}
 	}
 
 	return 0;
@@ -240,44 +459,98 @@ int CacheHT_RemoveFromSlot(CacheHT *h, int32_t SubScriptOfNode, Cht_Node *Node)
 
 Cht_Node *CacheHT_Get(CacheHT *h, const char *Key, Cht_Node *Start, int *HashValue)
 {
-	Cht_Node	*Node;
+	uint32_t	Hash;
+	int32_t		Group;
+	int32_t		Probed;
+	int			Skip;
 
 	if( h == NULL || Key == NULL)
 		return NULL;
 
+	if( HashValue != NULL )
+	{
+		Hash = *HashValue;
+	} else {
+		Hash = CacheHT_Hash(Key);
+	}
+
 	if( Start == NULL )
 	{
-		int			Slot_i;
-		Cht_Slot	*Slot;
+		Group = GROUP_OF(h, Hash);
+		Skip = 0;
+	} else {
+		/* Go on from the slot after `Start' */
+		Group = Start -> Slot / CACHEHT_GROUP_WIDTH;
+		Skip = Start -> Slot % CACHEHT_GROUP_WIDTH + 1;
+	}
+
+	for( Probed = 0; Probed != h -> Groups; ++Probed )
+	{
+		const unsigned char	*Ctrl = h -> Control + Group * CACHEHT_GROUP_WIDTH;
+		uint32_t	Candidates = CacheHT_Match(Ctrl, CTRL_OF(Hash)) >> Skip << Skip;
 
-		if( HashValue != NULL )
+		while( Candidates != 0 )
 		{
-			Slot_i = (*HashValue) % (h -> Slots.Allocated);
-		} else {
-			Slot_i = ELFHash(Key, 0) % (h -> Slots.Allocated);
-		}
+			int32_t		Slot_i = Group * CACHEHT_GROUP_WIDTH + CacheHT_LowestBit(Candidates);
+			Cht_Node	*Node = (Cht_Node *)Array_GetBySubscript(&(h -> NodeChunk), *CacheHT_SlotOf(h, Slot_i));
 
-		Slot = (Cht_Slot *)Array_GetBySubscript(&(h -> Slots), Slot_i);
+			if( Node -> Chain.Hash == Hash )
+			{
+				return Node;
+			}
+
+			Candidates &= Candidates - 1;
+		}
 
-		Node = (Cht_Node *)Array_GetBySubscript(&(h -> NodeChunk), Slot -> Next);
-		if( Node == NULL )
+		if( CacheHT_Match(Ctrl, CTRL_EMPTY) != 0 )
+		{
 			return NULL;
+		}
 
-		return Node;
+		Skip = 0;
 
-	} else {
-		Node = (Cht_Node *)Array_GetBySubscript(&(h -> NodeChunk), Start -> Next);
-		if( Node == NULL )
-			return NULL;
+		if( ++Group == h -> Groups )
+		{
+			Group = 0;
+		}
+	}
+
+	return NULL;
+}
+
+int32_t CacheHT_GetSubscript(CacheHT *h, const Cht_Node *Node)
+{
+	/* NodeChunk grows down */
+	return (h -> NodeChunk.Data - (const char *)Node) / h -> NodeChunk.DataLength;
+}
+
+void CacheHT_AddStatistic(CacheHT *h, CacheHT_Statistic *Sum)
+{
+	int	loop;
+	int32_t	FreeChunks = 0;
 
-		return Node;
+	for( loop = 0; loop != CACHEHT_SIZE_CLASSES; ++loop )
+	{
+		Sum -> FreeChunks[loop] += h -> FreeCount[loop];
+		Sum -> FreeBytes += h -> FreeCount[loop] * CacheHT_ClassSize(loop);
+		FreeChunks += h -> FreeCount[loop];
 	}
 
+	Sum -> UsedChunks += h -> NodeChunk.Used - FreeChunks;
+	Sum -> UsedBytes += h -> UsedBytes;
+	Sum -> DataBytes += h -> DataBytes;
 }
 
 void CacheHT_Free(CacheHT *h)
 {
+	int	loop;
+
 	Array_Free(&(h -> NodeChunk));
 	Array_Free(&(h -> Slots));
-	h -> FreeList = -1;
+
+	for( loop = 0; loop != CACHEHT_SIZE_CLASSES; ++loop )
+	{
+		h -> FreeLists[loop] = -1;
+		h -> FreeCount[loop] = 0;
+	}
 }
@@ -4,31 +4,89 @@
 #include <time.h>
 #include "array.h"
 
+/* Chunks are allocated in size classes: 8, 16, ..., 64 bytes, then four
+ * classes for each doubling (80, 96, 112, 128, 160, ...) up to 4096 bytes.
+ * Each class has its own free list, so both allocating and freeing a chunk
+ * take O(1) time, and a freed chunk can be reused by any data of its class. */
+#define	CACHEHT_SIZE_CLASSES	32
+#define	CACHEHT_MAX_CHUNK_SIZE	4096
+
+/* Nodes are indexed by an open addressing table of CACHEHT_GROUP_WIDTH slot
+ * groups. Each slot has a control byte, holding 7 bits of the hash of the
+ * node in it, so a group is probed by comparing its control bytes at once,
+ * and most of the nodes not wanted are told without touching them, let alone
+ * their data. */
+#define	CACHEHT_GROUP_WIDTH		16
+
 typedef struct _Cht_Node{
-	int32_t		Slot;
-	int32_t		Next;
+	int32_t		Slot; /* -1 if the node is free */
+	union {
+		int32_t		Next; /* Free nodes, the next one in the free list */
+		uint32_t	Hash; /* Used nodes, the hash of the key */
+	} Chain;
+	union {
+		int32_t	Prev; /* Free nodes, the previous one in the free list */
+		int32_t	Referenced; /* Used nodes, the reference bit of eviction */
+	} Link;
 	int32_t		Offset;
 	uint32_t	TTL;
+	uint16_t	Length; /* The size of the chunk */
+	uint16_t	DataLength; /* How many bytes of the chunk are used */
 	time_t		TimeAdded;
-	uint32_t	Length;
 } Cht_Node;
 
 typedef struct _HashTable{
 	Array	NodeChunk;
-	Array	Slots;
-	int32_t	FreeList;
+
+	/* The subscripts of the nodes in the slots, and the control bytes */
+	Array			Slots;
+	unsigned char	*Control;
+	int32_t	Groups;
+	int32_t	Entries;
+	int32_t	Tombstones;
+	int32_t	MaxEntries;
+
+	int32_t	FreeLists[CACHEHT_SIZE_CLASSES];
+
+	/* Statistics */
+	int32_t	FreeCount[CACHEHT_SIZE_CLASSES];
+	int32_t	UsedBytes;
+	int32_t	DataBytes;
 }CacheHT;
 
+typedef struct _CacheHT_Statistic{
+	int32_t	UsedChunks;
+	int32_t	UsedBytes; /* Sum of the sizes of used chunks */
+	int32_t	DataBytes; /* Sum of the data in used chunks */
+	int32_t	FreeChunks[CACHEHT_SIZE_CLASSES];
+	int32_t	FreeBytes;
+} CacheHT_Statistic;
+
 int CacheHT_Init(CacheHT *h, char *BaseAddr, int CacheSize);
 
 int CacheHT_ReInit(CacheHT *h, char *BaseAddr, int CacheSize);
 
+uint32_t CacheHT_RoundChunkSize(uint32_t Length);
+/* Description:
+ *  Get the size of the chunk a piece of data of `Length' bytes is put in.
+ * Return value:
+ *  The size, or 0 if `Length' is larger than CACHEHT_MAX_CHUNK_SIZE.
+ */
+
 int32_t CacheHT_FindUnusedNode(CacheHT		*h,
-								uint32_t	ChunkSize,
+								uint32_t	DataLength,
 								Cht_Node	**Out,
 								void		*Boundary,
 								BOOL		*NewCreated
 								);
+/* Description:
+ *  Take a free node of the size class of `DataLength', or create a new one if
+ *  there is none, or take a free one of a larger class if there is no room
+ *  for a new one. The offset of a created node is left for the caller to set.
+ * Return value:
+ *  The subscript of the node, or -1 on failures, including that the table is
+ *  full.
+ */
 
 int CacheHT_InsertToSlot(CacheHT	*h,
 						 const char	*Key,
@@ -38,8 +96,35 @@ int CacheHT_InsertToSlot(CacheHT	*h,
 						 );
 
 int CacheHT_RemoveFromSlot(CacheHT *h, int32_t SubScriptOfNode, Cht_Node *Node);
+/* Description:
+ *  Remove a node from its slot and free its chunk. Free nodes at the end of
+ *  the node list are dropped, so that the space of their chunks is returned.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
 
 Cht_Node *CacheHT_Get(CacheHT *h, const char *Key, Cht_Node *Start, int *HashValue);
+/* Description:
+ *  Find the next node which may hold `Key', after `Start' or from the first
+ *  one if `Start' is NULL. The caller compares the key to tell.
+ * Return value:
+ *  The node, or NULL if there is no more.
+ */
+
+int32_t CacheHT_GetSubscript(CacheHT *h, const Cht_Node *Node);
+/* Description:
+ *  Get the subscript of a node got from CacheHT_Get().
+ */
+
+uint32_t CacheHT_ClassSize(int Class);
+/* Description:
+ *  Get the chunk size of a size class.
+ */
+
+void CacheHT_AddStatistic(CacheHT *h, CacheHT_Statistic *Sum);
+/* Description:
+ *  Add the allocation statistics of `h' to `Sum'.
+ */
 
 void CacheHT_Free(CacheHT *h);
 
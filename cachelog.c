@@ -0,0 +1,561 @@
+#include <stdio.h>
+#include <string.h>
+#include "cachelog.h"
+#include "utils.h"
+#include "debug.h"
+
+#ifdef WIN32
+#include <io.h>
+#define	SYNC_FILE(fp)			_commit(_fileno(fp))
+#define	REPLACE_FILE(from, to)	(MoveFileEx((from), (to), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : -1)
+#else /* WIN32 */
+#define	SYNC_FILE(fp)			fsync(fileno(fp))
+#define	REPLACE_FILE(from, to)	rename((from), (to))
+#endif /* WIN32 */
+
+#define	GET_MILLISECONDS()		(GetMicroseconds() / 1000)
+
+#define	CACHELOG_MAGIC	0x474F4C43 /* "CLOG" */
+
+struct _LogHeader{
+	uint32_t	Magic;
+	uint32_t	Ver;
+	uint32_t	Generation;
+	char		Comment[64 - 4 * sizeof(uint32_t)];
+	uint32_t	Checksum; /* Of all the fields above */
+};
+
+/* Followed by the entry */
+struct _LogRecord{
+	uint32_t	Checksum; /* Of all the fields below and the entry */
+	uint16_t	Length;
+	uint16_t	KeyLength;
+	uint32_t	TTL;
+
+	/* The generation of the file the record is written into, so a record
+	 * left by an older file is never taken */
+	uint32_t	Generation;
+	int64_t		TimeAdded;
+};
+
+static char					*Path = NULL;
+static char					*TempPath = NULL;
+static uint32_t				Ver;
+static uint32_t				Generation;
+
+static CacheLog_DumpFunc	DumpFunc;
+
+/* Where records are appended, NULL if no log is opened */
+static FILE					*Stream = NULL;
+static int64_t				Size;
+static BOOL					Dirty;
+static BOOL					Closed = FALSE;
+
+/* Compacting. The live entries are dumped into the new file without `Lock'
+ * held, while the records appended meanwhile go on being written into
+ * `Stream', and are kept in `Pending' as well, to be written into the new
+ * file when it takes the place of the old one. */
+static BOOL					Compacting = FALSE;
+static uint32_t				CompactGeneration;
+static char					*Pending = NULL;
+static int32_t				PendingLength = 0;
+static int32_t				PendingCapacity = 0;
+
+/* Guards all the above */
+static MutexHandle			Lock;
+
+/* Warming up. The records in the file when it is opened are loaded by a
+ * background thread, while the ones added meanwhile are appended after them.
+ * The log is not compacted until all are loaded. */
+static volatile BOOL		Loading = FALSE;
+static CacheLog_LoadFunc	LoadFunc;
+static FILE					*LoadStream;
+static int64_t				LoadStart;
+static CacheLog_Progress	Progress;
+
+/* FNV-1a, continuing from `Hash' */
+static uint32_t CacheLog_Checksum(uint32_t Hash, const void *Data, int Length)
+{
+	const unsigned char	*Itr = (const unsigned char *)Data;
+
+	while( Length > 0 )
+	{
+		Hash ^= *Itr;
+		Hash *= 16777619U;
+
+		++Itr;
+		--Length;
+	}
+
+	return Hash;
+}
+
+static uint32_t CacheLog_RecordChecksum(const struct _LogRecord *Record, const char *Entry)
+{
+	uint32_t	Hash = 2166136261U;
+
+	Hash = CacheLog_Checksum(Hash, (const char *)Record + sizeof(Record -> Checksum), sizeof(struct _LogRecord) - sizeof(Record -> Checksum));
+
+	return CacheLog_Checksum(Hash, Entry, Record -> Length);
+}
+
+static int CacheLog_WriteRecordOf(FILE *fp, uint32_t Gen, const char *Entry, int Length, int KeyLength, uint32_t TTL, time_t TimeAdded)
+{
+	struct _LogRecord	Record;
+
+	memset(&Record, 0, sizeof(Record));
+
+	Record.Length = Length;
+	Record.KeyLength = KeyLength;
+	Record.TTL = TTL;
+	Record.Generation = Gen;
+	Record.TimeAdded = TimeAdded;
+	Record.Checksum = CacheLog_RecordChecksum(&Record, Entry);
+
+	if( fwrite(&Record, sizeof(Record), 1, fp) != 1 ||
+		fwrite(Entry, Length, 1, fp) != 1
+		)
+	{
+		return -1;
+	}
+
+	return sizeof(Record) + Length;
+}
+
+/* Only called by `DumpFunc', the records go into the file being compacted
+ * into */
+int CacheLog_WriteRecord(FILE *fp, const char *Entry, int Length, int KeyLength, uint32_t TTL, time_t TimeAdded)
+{
+	return CacheLog_WriteRecordOf(fp, CompactGeneration, Entry, Length, KeyLength, TTL, TimeAdded);
+}
+
+/* Keep a record appended while compacting, called with `Lock' held */
+static void CacheLog_KeepPending(const char *Entry, int Length, int KeyLength, uint32_t TTL, time_t TimeAdded)
+{
+	struct _LogRecord	Record;
+	int32_t				Needed = PendingLength + sizeof(Record) + Length;
+
+	if( Needed > PendingCapacity )
+	{
+		int32_t	NewCapacity = PendingCapacity > 0 ? PendingCapacity * 2 : 4096;
+
+		while( NewCapacity < Needed )
+		{
+			NewCapacity *= 2;
+		}
+
+		if( SafeRealloc((void **)&Pending, NewCapacity) != 0 )
+		{
+			/* The record is still in the old file, only the new one misses
+			 * it */
+			return;
+		}
+
+		PendingCapacity = NewCapacity;
+	}
+
+	memset(&Record, 0, sizeof(Record));
+	Record.Length = Length;
+	Record.KeyLength = KeyLength;
+	Record.TTL = TTL;
+	Record.TimeAdded = TimeAdded;
+
+	memcpy(Pending + PendingLength, &Record, sizeof(Record));
+	memcpy(Pending + PendingLength + sizeof(Record), Entry, Length);
+	PendingLength = Needed;
+}
+
+/* Write the records kept by CacheLog_KeepPending() into `fp', called with
+ * `Lock' held */
+static int CacheLog_WritePending(FILE *fp)
+{
+	int32_t	Itr = 0;
+
+	while( Itr < PendingLength )
+	{
+		const struct _LogRecord	*Record = (const struct _LogRecord *)(Pending + Itr);
+
+		if( CacheLog_WriteRecordOf(fp,
+								   CompactGeneration,
+								   (const char *)(Record + 1),
+								   Record -> Length,
+								   Record -> KeyLength,
+								   Record -> TTL,
+								   (time_t)Record -> TimeAdded
+								   )
+			< 0 )
+		{
+			return -1;
+		}
+
+		Itr += sizeof(*Record) + Record -> Length;
+	}
+
+	return 0;
+}
+
+/* Check the header of a log, returns 0 if it can be loaded */
+static int CacheLog_ReadHeader(FILE *fp)
+{
+	struct _LogHeader	Header;
+
+	if( fread(&Header, sizeof(Header), 1, fp) != 1 ||
+		Header.Magic != CACHELOG_MAGIC ||
+		Header.Checksum != CacheLog_Checksum(2166136261U, &Header, sizeof(Header) - sizeof(Header.Checksum))
+		)
+	{
+		ERRORMSG("The existing cache is damaged.\n");
+		return -1;
+	}
+
+	if( Header.Ver != Ver )
+	{
+		ERRORMSG("The existing cache is not compatible with this version of program.\n");
+		return -1;
+	}
+
+	Generation = Header.Generation;
+
+	return 0;
+}
+
+/* Write the live entries into a new file, which then replaces the log. `Lock'
+ * is only held to start and to finish, not while dumping and syncing. */
+static int CacheLog_Compact(void)
+{
+	struct _LogHeader	Header;
+	FILE				*New;
+
+	GET_MUTEX(Lock);
+
+	if( Compacting == TRUE || Closed == TRUE )
+	{
+		RELEASE_MUTEX(Lock);
+		return -1;
+	}
+
+	Compacting = TRUE;
+	CompactGeneration = Generation + 1;
+	PendingLength = 0;
+
+	RELEASE_MUTEX(Lock);
+
+	New = fopen(TempPath, "wb");
+	if( New == NULL )
+	{
+		ERRORMSG("Compacting the cache file failed, %s can not be created.\n", TempPath);
+		goto Abandoned;
+	}
+
+	memset(&Header, 0, sizeof(Header));
+	Header.Magic = CACHELOG_MAGIC;
+	Header.Ver = Ver;
+	Header.Generation = CompactGeneration;
+	strcpy(Header.Comment, "\nDo not edit this file.\n");
+	Header.Checksum = CacheLog_Checksum(2166136261U, &Header, sizeof(Header) - sizeof(Header.Checksum));
+
+	if( fwrite(&Header, sizeof(Header), 1, New) != 1 )
+	{
+		goto Failed;
+	}
+
+	DumpFunc(New);
+
+	if( ferror(New) || fflush(New) != 0 || SYNC_FILE(New) != 0 )
+	{
+		goto Failed;
+	}
+
+	GET_MUTEX(Lock);
+
+	Compacting = FALSE;
+
+	/* Closed meanwhile, the old file has all the records */
+	if( Closed == TRUE )
+	{
+		RELEASE_MUTEX(Lock);
+		fclose(New);
+		remove(TempPath);
+		return -1;
+	}
+
+	/* The records appended meanwhile are left unsynced, as those appended
+	 * after a checkpoint are */
+	if( CacheLog_WritePending(New) != 0 || fclose(New) != 0 )
+	{
+		RELEASE_MUTEX(Lock);
+		ERRORMSG("Compacting the cache file failed, %s can not be written.\n", TempPath);
+		remove(TempPath);
+		return -1;
+	}
+
+	/* The old file must be closed before being replaced on Windows */
+	if( Stream != NULL )
+	{
+		fflush(Stream);
+		fclose(Stream);
+		Stream = NULL;
+	}
+
+	if( REPLACE_FILE(TempPath, Path) != 0 )
+	{
+		ERRORMSG("Compacting the cache file failed, %s can not be replaced.\n", Path);
+		remove(TempPath);
+		Stream = fopen(Path, "ab");
+		RELEASE_MUTEX(Lock);
+		return -1;
+	}
+
+	Generation = CompactGeneration;
+
+	Stream = fopen(Path, "ab");
+	if( Stream == NULL )
+	{
+		ERRORMSG("The cache file %s can not be opened, the cache will not be saved.\n", Path);
+		RELEASE_MUTEX(Lock);
+		return -1;
+	}
+
+	fseek(Stream, 0, SEEK_END);
+	Size = ftell(Stream);
+	Dirty = PendingLength > 0;
+
+	RELEASE_MUTEX(Lock);
+
+	return 0;
+
+Failed:
+	ERRORMSG("Compacting the cache file failed, %s can not be written.\n", TempPath);
+	fclose(New);
+	remove(TempPath);
+
+Abandoned:
+	GET_MUTEX(Lock);
+	Compacting = FALSE;
+	RELEASE_MUTEX(Lock);
+	return -1;
+}
+
+/* Load the records up to `Progress.BytesTotal', then compact the log */
+static void CacheLog_Load_Thread(void)
+{
+	struct _LogRecord	Record;
+	char				*Entry = SafeMalloc(65536);
+
+	while( Entry != NULL &&
+			Progress.BytesLoaded + (int32_t)sizeof(Record) <= Progress.BytesTotal &&
+			fread(&Record, sizeof(Record), 1, LoadStream) == 1
+			)
+	{
+		if( Progress.BytesLoaded + (int32_t)sizeof(Record) + Record.Length > Progress.BytesTotal ||
+			fread(Entry, Record.Length, 1, LoadStream) != 1 ||
+			Record.Checksum != CacheLog_RecordChecksum(&Record, Entry)
+			)
+		{
+			INFO("A torn record at the end of the existing cache is dropped.\n");
+			break;
+		}
+
+		if( Record.Generation == Generation &&
+			Record.KeyLength < Record.Length &&
+			LoadFunc(Entry, Record.Length, Record.KeyLength, Record.TTL, (time_t)Record.TimeAdded) == 0
+			)
+		{
+			++(Progress.Kept);
+		} else {
+			++(Progress.Dropped);
+		}
+
+		Progress.BytesLoaded += sizeof(Record) + Record.Length;
+	}
+
+	SafeFree(Entry);
+	fclose(LoadStream);
+
+	/* Only the records kept and the ones added meanwhile are written into
+	 * the new file */
+	CacheLog_Compact();
+
+	GET_MUTEX(Lock);
+
+	Progress.Milliseconds = GET_MILLISECONDS() - LoadStart;
+	Loading = FALSE;
+
+	RELEASE_MUTEX(Lock);
+
+	INFO("Cache warmed up in %d ms, %d entries loaded, %d expired or replaced.\n", Progress.Milliseconds, Progress.Kept, Progress.Dropped);
+}
+
+int CacheLog_Open(const char			*File,
+				  uint32_t				Version,
+				  BOOL					Reload,
+				  BOOL					Overwrite,
+				  CacheLog_LoadFunc		Load,
+				  CacheLog_DumpFunc		Dump
+				  )
+{
+	Path = StringDup(File);
+	TempPath = SafeMalloc(strlen(File) + sizeof(".tmp"));
+	if( Path == NULL || TempPath == NULL )
+	{
+		return -1;
+	}
+
+	sprintf(TempPath, "%s.tmp", File);
+
+	Ver = Version;
+	Generation = 0;
+	DumpFunc = Dump;
+
+	memset(&Progress, 0, sizeof(Progress));
+
+	CREATE_MUTEX(Lock);
+
+	if( Reload == TRUE && FileIsReadable(File) )
+	{
+		FILE	*fp = fopen(File, "rb");
+
+		if( fp != NULL && CacheLog_ReadHeader(fp) == 0 )
+		{
+			fseek(fp, 0, SEEK_END);
+			Size = ftell(fp);
+			fseek(fp, sizeof(struct _LogHeader), SEEK_SET);
+
+			Stream = fopen(File, "ab");
+			if( Stream == NULL )
+			{
+				fclose(fp);
+				return -3;
+			}
+
+			Progress.BytesTotal = Size - sizeof(struct _LogHeader);
+			Dirty = FALSE;
+
+			LoadFunc = Load;
+			LoadStream = fp;
+			LoadStart = GET_MILLISECONDS();
+			Loading = TRUE;
+
+			INFO("Warming up the cache in the background ...\n");
+
+			{
+				ThreadHandle	t;
+
+				CREATE_THREAD(CacheLog_Load_Thread, NULL, t);
+				DETACH_THREAD(t);
+			}
+
+			return 0;
+		}
+
+		if( fp != NULL )
+		{
+			fclose(fp);
+		}
+
+		if( Overwrite == FALSE )
+		{
+			return -2;
+		}
+
+		INFO("The existing cache has been overwritten.\n");
+	}
+
+	if( CacheLog_Compact() != 0 )
+	{
+		return -3;
+	}
+
+	return 0;
+}
+
+void CacheLog_Append(const char *Entry, int Length, int KeyLength, uint32_t TTL, time_t TimeAdded)
+{
+	if( Stream == NULL )
+	{
+		return;
+	}
+
+	GET_MUTEX(Lock);
+
+	if( Stream != NULL )
+	{
+		int	Written = CacheLog_WriteRecordOf(Stream, Generation, Entry, Length, KeyLength, TTL, TimeAdded);
+
+		if( Written > 0 )
+		{
+			Size += Written;
+			Dirty = TRUE;
+		}
+
+		if( Compacting == TRUE )
+		{
+			CacheLog_KeepPending(Entry, Length, KeyLength, TTL, TimeAdded);
+		}
+	}
+
+	RELEASE_MUTEX(Lock);
+}
+
+void CacheLog_Checkpoint(int64_t CompactSize)
+{
+	BOOL	ToCompact = FALSE;
+
+	if( Stream == NULL )
+	{
+		return;
+	}
+
+	GET_MUTEX(Lock);
+
+	if( Stream != NULL && Dirty == TRUE )
+	{
+		fflush(Stream);
+		SYNC_FILE(Stream);
+		Dirty = FALSE;
+
+		ToCompact = Loading == FALSE && Compacting == FALSE && Size > CompactSize;
+	}
+
+	RELEASE_MUTEX(Lock);
+
+	if( ToCompact == TRUE )
+	{
+		CacheLog_Compact();
+	}
+}
+
+void CacheLog_Close(void)
+{
+	if( Stream == NULL )
+	{
+		return;
+	}
+
+	GET_MUTEX(Lock);
+
+	fflush(Stream);
+	SYNC_FILE(Stream);
+	fclose(Stream);
+	Stream = NULL;
+	Closed = TRUE;
+
+	SafeFree(Pending);
+	Pending = NULL;
+	PendingLength = 0;
+	PendingCapacity = 0;
+
+	RELEASE_MUTEX(Lock);
+}
+
+void CacheLog_GetProgress(CacheLog_Progress *Out)
+{
+	memcpy(Out, &Progress, sizeof(Progress));
+
+	Out -> Loading = Loading;
+
+	if( Out -> Loading == TRUE )
+	{
+		Out -> Milliseconds = GET_MILLISECONDS() - LoadStart;
+	}
+}
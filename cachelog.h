@@ -0,0 +1,76 @@
+#ifndef CACHELOG_H_INCLUDED
+#define CACHELOG_H_INCLUDED
+
+#include <stdio.h>
+#include <time.h>
+#include "common.h"
+
+/* A CacheLog keeps the cache on disk as a log. Every entry added to the cache
+ * is appended to the end of it and the file is never modified in place, so a
+ * crash can at most leave a torn record at the end, which is told by its
+ * checksum and dropped on loading.
+ *
+ * Replaced and expired entries stay in the log, so it is compacted from time
+ * to time: the live entries are written into a new file, which then takes the
+ * place of the old one by renaming. The header of the file carries a
+ * generation number, increased by each compaction, and its own checksum.
+ */
+
+typedef struct _CacheLog_Progress {
+	BOOL	Loading;
+	int32_t	BytesLoaded;
+	int32_t	BytesTotal;
+	int32_t	Kept;
+	int32_t	Dropped;
+	int32_t	Milliseconds; /* Spent on loading, so far if not finished */
+} CacheLog_Progress;
+
+typedef int (*CacheLog_LoadFunc)(const char *Entry, int Length, int KeyLength, uint32_t TTL, time_t TimeAdded);
+/* Takes a record loaded, returns 0 if it was kept */
+
+typedef void (*CacheLog_DumpFunc)(FILE *Stream);
+/* Writes all live entries with CacheLog_WriteRecord() */
+
+int CacheLog_Open(const char			*File,
+				  uint32_t				Version,
+				  BOOL					Reload,
+				  BOOL					Overwrite,
+				  CacheLog_LoadFunc		Load,
+				  CacheLog_DumpFunc		Dump
+				  );
+/* Description:
+ *  Open a log. The records in it are loaded by a background thread with
+ *  `Load', which may be called while the cache is being used. When all are
+ *  loaded, the log is compacted, so that the file holds only the valid
+ *  records kept.
+ * Parameters:
+ *  Version   : A log of another version is not loaded.
+ *  Reload    : Whether to load the records in the existing log.
+ *  Overwrite : Whether to start a new log if the existing one can not be
+ *              loaded.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+int CacheLog_WriteRecord(FILE *fp, const char *Entry, int Length, int KeyLength, uint32_t TTL, time_t TimeAdded);
+
+void CacheLog_Append(const char *Entry, int Length, int KeyLength, uint32_t TTL, time_t TimeAdded);
+/* Description:
+ *  Append a record, buffered until the next checkpoint. Does nothing if no
+ *  log is opened.
+ */
+
+void CacheLog_Checkpoint(int64_t CompactSize);
+/* Description:
+ *  Write the buffered records to the disk, then compact the log if it has
+ *  grown larger than `CompactSize' bytes.
+ */
+
+void CacheLog_GetProgress(CacheLog_Progress *Out);
+/* Description:
+ *  Get how far the loading of the existing log is.
+ */
+
+void CacheLog_Close(void);
+
+#endif // CACHELOG_H_INCLUDED
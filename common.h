@@ -101,6 +101,7 @@
 #else /* For Linux below */
 
 	#include <netinet/in.h>	/* For struct 'sockaddr_in' */
+	#include <netinet/tcp.h>	/* TCP_NODELAY */
 
 	/* For function 'socket', 'bind', 'connect', 'send', 'recv',
 	 * 'sendto', 'recvfrom', 'setsockopt', 'shutdown'. */
@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
 #include "dnscache.h"
 #include "dnsparser.h"
@@ -8,188 +10,570 @@
 #include "querydnsbase.h"
 #include "rwlock.h"
 #include "cacheht.h"
+#include "responsecache.h"
+#include "cachelog.h"
 
-#define	CACHE_VERSION		22
+#define	CACHE_VERSION		26
 
 #define	CACHE_END	'\x0A'
 #define	CACHE_START	'\xFF'
 
-static BOOL				Inited = FALSE;
+/* A cache entry holds a whole RRset :
+ *  CACHE_START
+ *  "Name\1Type\1Class\0"
+ *  Number of records (16-bit, network order)
+ *  For each record, the RDATA length (16-bit, network order) and the RDATA
+ *  with all names in it uncompressed
+ *  CACHE_END
+ * So answering from the cache only copies the RDATA and patches the TTL.
+ */
+#define	CACHE_ENTRY_MAX_LENGTH	4096
 
-static RWLock			CacheLock;
+static BOOL				Inited = FALSE;
 
-static FileHandle		CacheFileHandle;
-static MappingHandle	CacheMappingHandle;
 static char				*MapStart;
 
-static ThreadHandle		TTLCountdown_Thread;
+/* How the region of the cache is backed, see `HugePageCache' */
+#define	CACHE_PAGES_NORMAL		0
+#define	CACHE_PAGES_TRANSPARENT	1
+#define	CACHE_PAGES_HUGETLB		2
+
+#define	HUGE_PAGE_SIZE			2097152
+
+/* From linux/mempolicy.h, for calling mbind() without libnuma */
+#ifdef SYS_mbind
+#define	NUMA_MPOL_PREFERRED		1
+#define	NUMA_MPOL_MF_MOVE		(1 << 1)
+#endif /* SYS_mbind */
+
+static int				CachePages;
+
+/* The mapping holding the region, NULL if it is taken from the heap */
+static char				*MapRegion = NULL;
+static size_t			MapLength;
+
+/* Whether the cache is saved in the `CacheFile' */
+static BOOL				FileCache;
+
+static ThreadHandle		Maintenance_Thread;
 
 static int32_t			CacheSize;
 static int				OverrideTTL;
 static int				TTLMultiple;
 static BOOL				IgnoreTTL;
 
-static int32_t			*CacheCount;
-
-static volatile int32_t	*CacheEnd; /* Offset */
-
-static CacheHT			*CacheInfo;
-
-struct _Header{
-	uint32_t	Ver;
-	int32_t		CacheSize;
-	int32_t		End;
+/* The cache is made up of the regions of the shards. Each region begins with
+ * a `struct _ShardHeader' and is managed by its own CacheHT, with all offsets
+ * relative to the start of the region.
+ *
+ * A file cache is kept in memory as well, and every entry added is appended
+ * to a CacheLog in the `CacheFile', which is loaded on starting. */
+struct _ShardHeader{
+	int32_t		End; /* Offset */
 	int32_t		CacheCount;
 	CacheHT		ht;
-	char		Comment[128 - sizeof(uint32_t) - sizeof(int32_t) - sizeof(int32_t) - sizeof(int32_t) - sizeof(CacheHT)];
 };
 
-static void DNSCacheTTLCountdown_Thread(void)
+#define	SHARD_HEADER_LENGTH	ROUND_UP(sizeof(struct _ShardHeader), 8)
+
+/* The smallest region a CacheHT works with */
+#define	SHARD_MIN_SIZE		102400
+
+/* Expiry index, a min-heap of nodes ordered by the time they expire. */
+typedef struct _ExpiryEntry {
+	time_t	Expire;
+	int32_t	Subscript;
+} ExpiryEntry;
+
+/* A shard is a independent cache holding the names hashed to it, so threads
+ * working with different names seldom wait for each other. Everything in it,
+ * including the expiry index, is guarded by `Lock'. */
+typedef struct _CacheShard {
+	RWLock			Lock;
+
+	char			*Base;
+	volatile int32_t	*CacheEnd; /* Offset */
+	int32_t			*CacheCount;
+	CacheHT			*CacheInfo;
+
+	Array			ExpiryIndex;
+
+	/* Where the eviction stopped last time */
+	int32_t			Hand;
+	int32_t			Evictions;
+} CacheShard;
+
+static CacheShard		*Shards = NULL;
+static int				NumberOfShards;
+static int32_t			ShardSize;
+
+/* How many nodes may be evicted to make room for a new one */
+#define	EVICTION_LIMIT	16
+
+/* Lookup counters, updated without holding any lock */
+#ifdef WIN32
+#define	COUNTER_INCREASE(ptr)	InterlockedIncrement(ptr)
+#else /* WIN32 */
+#define	COUNTER_INCREASE(ptr)	__sync_fetch_and_add((ptr), 1)
+#endif /* WIN32 */
+
+static volatile long	Hits = 0;
+static volatile long	Misses = 0;
+
+/* Prefetching and serving stale answers, in seconds. 0 to disable them. */
+static int				PrefetchThreshold;
+static int				ServeStale;
+
+/* The TTL of stale answers, as RFC 8767 suggests */
+#define	STALE_ANSWER_TTL	30
+
+/* When a question was last refreshed, by hash, so that a popular name is not
+ * refreshed again while the last refresh is still in flight */
+#define	REFRESH_TABLE_SIZE	1024
+#define	REFRESH_HOLD		5
+
+static time_t			RefreshIssued[REFRESH_TABLE_SIZE];
+
+static volatile long	Prefetches = 0;
+static volatile long	StaleAnswers = 0;
+
+/* The longest time a negative answer is cached, 0 to disable caching them */
+static int				NegativeMaxTTL;
+
+static volatile long	NegativeHits = 0;
+
+/* FNV-1a over the name part of a key, so all RRsets of a name are in the same
+ * shard */
+static CacheShard *DNSCache_GetShard(const char *Key)
 {
-	register	int			loop;
-	register	BOOL		GotMutex	=	FALSE;
-	register	Cht_Node	*Node	=	NULL;
+	uint32_t	Hash = 2166136261U;
 
-	register	Array		*ChunkList	=	&(CacheInfo -> NodeChunk);
+	while( *Key != '\0' && *Key != '\1' )
+	{
+		Hash ^= *(const unsigned char *)Key;
+		Hash *= 16777619U;
 
-	register	time_t		CurrentTime;
+		++Key;
+	}
 
-	while( Inited )
+	return Shards + (Hash % NumberOfShards);
+}
+
+/* How many nodes are removed each time the lock is taken */
+#define	EXPIRY_SLICE	64
+
+#define	ExpiryIndex_Get(a, i)	((ExpiryEntry *)Array_GetBySubscript((a), (i)))
+
+static void ExpiryIndex_Swap(Array *Index, int32_t a, int32_t b)
+{
+	ExpiryEntry	Tmp = *ExpiryIndex_Get(Index, a);
+
+	*ExpiryIndex_Get(Index, a) = *ExpiryIndex_Get(Index, b);
+	*ExpiryIndex_Get(Index, b) = Tmp;
+}
+
+static int ExpiryIndex_Push(Array *Index, int32_t Subscript, const Cht_Node *Node)
+{
+	ExpiryEntry	New;
+	int32_t		Current;
+
+	New.Expire = Node -> TimeAdded + Node -> TTL;
+	New.Subscript = Subscript;
+
+	Current = Array_PushBack(Index, &New, NULL);
+	if( Current < 0 )
 	{
-		CurrentTime = time(NULL);
-		loop = ChunkList -> Used - 1;
+		return -1;
+	}
 
-		Node = (Cht_Node *)Array_GetBySubscript(ChunkList, loop);
+	while( Current > 0 )
+	{
+		int32_t	Parent = (Current - 1) / 2;
 
-		while( Node != NULL )
+		if( ExpiryIndex_Get(Index, Parent) -> Expire <= New.Expire )
 		{
-			if( Node -> TTL > 0 )
-			{
-				if( CurrentTime - Node -> TimeAdded >= Node -> TTL )
-				{
-					if(GotMutex == FALSE)
-					{
-						RWLock_WrLock(CacheLock);
-						GotMutex = TRUE;
-					}
+			break;
+		}
 
-					Node -> TTL = 0;
+		ExpiryIndex_Swap(Index, Parent, Current);
+		Current = Parent;
+	}
 
-					*(char *)(MapStart + Node -> Offset) = 0xFD;
+	return 0;
+}
 
-					CacheHT_RemoveFromSlot(CacheInfo, loop, Node);
+static void ExpiryIndex_Pop(Array *Index)
+{
+	int32_t	Current = 0;
 
-					--(*CacheCount);
+	if( Array_IsEmpty(Index) )
+	{
+		return;
+	}
 
-				}
-			}
+	/* Move the last one to the top, then sift it down */
+	*ExpiryIndex_Get(Index, 0) = *ExpiryIndex_Get(Index, Index -> Used - 1);
+	--(Index -> Used);
 
-			Node = (Cht_Node *)Array_GetBySubscript(ChunkList, --loop);
+	while( TRUE )
+	{
+		int32_t	Smallest = Current;
+		int32_t	Child = Current * 2 + 1;
+
+		if( Child < Index -> Used && ExpiryIndex_Get(Index, Child) -> Expire < ExpiryIndex_Get(Index, Smallest) -> Expire )
+		{
+			Smallest = Child;
 		}
 
-		if(GotMutex == TRUE)
+		++Child;
+		if( Child < Index -> Used && ExpiryIndex_Get(Index, Child) -> Expire < ExpiryIndex_Get(Index, Smallest) -> Expire )
 		{
-			if( ChunkList -> Used == 0 )
-			{
-				(*CacheEnd) = sizeof(struct _Header);
-			} else {
-				Node = (Cht_Node *)(Cht_Node *)Array_GetBySubscript(ChunkList, ChunkList -> Used - 1);
-				(*CacheEnd) = Node -> Offset + Node -> Length;
-			}
+			Smallest = Child;
+		}
 
-			RWLock_UnWLock(CacheLock);
-			GotMutex = FALSE;
+		if( Smallest == Current )
+		{
+			break;
 		}
 
-		SLEEP(59000);
+		ExpiryIndex_Swap(Index, Smallest, Current);
+		Current = Smallest;
 	}
+}
 
-	TTLCountdown_Thread = INVALID_THREAD;
+static void ExpiryIndex_Rebuild(CacheShard *Shard)
+{
+	int32_t		loop;
+	Cht_Node	*Node;
+
+	Array_Clear(&(Shard -> ExpiryIndex));
+
+	for( loop = 0; loop != Shard -> CacheInfo -> NodeChunk.Used; ++loop )
+	{
+		Node = (Cht_Node *)Array_GetBySubscript(&(Shard -> CacheInfo -> NodeChunk), loop);
+		if( Node -> Slot >= 0 && Node -> TTL > 0 )
+		{
+			ExpiryIndex_Push(&(Shard -> ExpiryIndex), loop, Node);
+		}
+	}
 }
 
-static BOOL IsReloadable(void)
+/* Take a node out of the cache. Its chunk goes back to the allocator, call
+ * DNSCache_ResetEnd() when done. */
+static void DNSCache_RemoveNode(CacheShard *Shard, int32_t Subscript, Cht_Node *Node)
 {
-	struct _Header	*Header = (struct _Header *)MapStart;
+	Node -> TTL = 0;
+
+	*(char *)(Shard -> Base + Node -> Offset) = 0xFD;
+
+	CacheHT_RemoveFromSlot(Shard -> CacheInfo, Subscript, Node);
 
-	if( Header -> Ver != CACHE_VERSION )
+	--(*(Shard -> CacheCount));
+}
+
+/* Return the space after the last node */
+static void DNSCache_ResetEnd(CacheShard *Shard)
+{
+	Array	*ChunkList = &(Shard -> CacheInfo -> NodeChunk);
+
+	if( ChunkList -> Used == 0 )
 	{
-		ERRORMSG("The existing cache is not compatible with this version of program.\n");
-		return FALSE;
+		*(Shard -> CacheEnd) = SHARD_HEADER_LENGTH;
+	} else {
+		Cht_Node *Last = (Cht_Node *)Array_GetBySubscript(ChunkList, ChunkList -> Used - 1);
+		*(Shard -> CacheEnd) = Last -> Offset + Last -> Length;
 	}
+}
+
+/* Remove at most EXPIRY_SLICE expired nodes of a shard, returns whether there
+ * are more */
+static BOOL DNSCache_RemoveExpired(CacheShard *Shard, time_t CurrentTime)
+{
+	int			Removed = 0;
+	Array		*ChunkList = &(Shard -> CacheInfo -> NodeChunk);
+	Array		*Index = &(Shard -> ExpiryIndex);
+
+	RWLock_WrLock(Shard -> Lock);
 
-	if( Header -> CacheSize != CacheSize )
+	/* Nodes evicted or replaced before they expire leave their entries in
+	 * the index, which would pile up while their TTLs last */
+	if( Index -> Used > *(Shard -> CacheCount) * 2 + EXPIRY_SLICE )
 	{
-		ERRORMSG("The size of the existing cache and the value of `CacheSize' should be equal.\n");
-		return FALSE;
+		ExpiryIndex_Rebuild(Shard);
 	}
 
-	return TRUE;
+	while( Removed != EXPIRY_SLICE && !Array_IsEmpty(Index) )
+	{
+		ExpiryEntry	*Top = ExpiryIndex_Get(Index, 0);
+		Cht_Node	*Node;
+
+		/* Stale entries are kept for a while */
+		if( Top -> Expire + ServeStale > CurrentTime )
+		{
+			break;
+		}
+
+		Node = (Cht_Node *)Array_GetBySubscript(ChunkList, Top -> Subscript);
+
+		/* Skip entries no longer describing the node */
+		if( Node != NULL && Node -> TTL > 0 && Node -> Slot >= 0 && Node -> TimeAdded + Node -> TTL == Top -> Expire )
+		{
+			DNSCache_RemoveNode(Shard, Top -> Subscript, Node);
+
+			++Removed;
+		}
+
+		ExpiryIndex_Pop(Index);
+	}
+
+	if( Removed > 0 )
+	{
+		DNSCache_ResetEnd(Shard);
+	}
+
+	RWLock_UnWLock(Shard -> Lock);
+
+	return Removed == EXPIRY_SLICE;
 }
 
-static void ReloadCache(void)
+static void DNSCacheMaintenance_Thread(void)
 {
-	struct _Header	*Header = (struct _Header *)MapStart;
+	while( Inited )
+	{
+		time_t	CurrentTime = time(NULL);
+		int		loop;
+
+		/* Release the locks between slices, so lookups are never blocked
+		 * for long */
+		for( loop = 0; loop != NumberOfShards && IgnoreTTL == FALSE; ++loop )
+		{
+			while( Inited && DNSCache_RemoveExpired(Shards + loop, CurrentTime) );
+		}
+
+		/* The live entries take at most `CacheSize' bytes, so at least half
+		 * of a log twice as large are dead */
+		if( FileCache == TRUE )
+		{
+			CacheLog_Checkpoint((int64_t)CacheSize * 2);
+		}
 
-	INFO("Reloading the cache ...\n");
+		SLEEP(1000);
+	}
 
-	CacheInfo = &(Header -> ht);
+	Maintenance_Thread = INVALID_THREAD;
+}
 
-	CacheHT_ReInit(CacheInfo, MapStart, CacheSize);
+static void AttachShards(void)
+{
+	int	loop;
+
+	for( loop = 0; loop != NumberOfShards; ++loop )
+	{
+		CacheShard			*Shard = Shards + loop;
+		struct _ShardHeader	*ShardHeader;
 
-	CacheEnd = &(Header -> End);
-	CacheCount = &(Header -> CacheCount);
+		Shard -> Base = MapStart + loop * ShardSize;
 
-	INFO("Cache reloaded, containing %d entries for %d items.\n", CacheInfo -> NodeChunk.Used, (*CacheCount));
+		ShardHeader = (struct _ShardHeader *)(Shard -> Base);
+
+		Shard -> CacheEnd = &(ShardHeader -> End);
+		Shard -> CacheCount = &(ShardHeader -> CacheCount);
+		Shard -> CacheInfo = &(ShardHeader -> ht);
+	}
 }
 
-static void CreateNewCache(void)
+/* Get the region of the cache. Random probes into a large cache take a TLB
+ * miss almost every time with 4K pages, so it may be backed by huge pages. */
+static char *DNSCache_AllocRegion(int Pages)
 {
-	struct _Header	*Header = (struct _Header *)MapStart;
+#ifndef WIN32
+#ifdef MAP_HUGETLB
+	if( Pages == CACHE_PAGES_HUGETLB )
+	{
+		MapLength = ROUND_UP(CacheSize, HUGE_PAGE_SIZE);
+		MapRegion = mmap(NULL,
+						 MapLength,
+						 PROT_READ | PROT_WRITE,
+						 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+						 -1,
+						 0
+						 );
+		if( MapRegion != MAP_FAILED )
+		{
+			CachePages = CACHE_PAGES_HUGETLB;
+			return MapRegion;
+		}
 
-	memset(MapStart, 0, CacheSize);
+		ERRORMSG("Huge pages are not available (vm.nr_hugepages), transparent huge pages are used instead.\n");
+		Pages = CACHE_PAGES_TRANSPARENT;
+	}
+#endif /* MAP_HUGETLB */
 
-	Header -> Ver = CACHE_VERSION;
-	Header -> CacheSize = CacheSize;
-	Header -> CacheCount = 0;
-	CacheEnd = &(Header -> End);
-	*CacheEnd = sizeof(struct _Header);
-	memset(Header -> Comment, 0, sizeof(Header -> Comment));
-	strcpy(Header -> Comment, "\nDo not edit this file.\n");
+#ifdef MADV_HUGEPAGE
+	if( Pages == CACHE_PAGES_TRANSPARENT )
+	{
+		/* One more huge page, so that the region can start at a boundary */
+		MapLength = ROUND_UP(CacheSize, HUGE_PAGE_SIZE) + HUGE_PAGE_SIZE;
+		MapRegion = mmap(NULL,
+						 MapLength,
+						 PROT_READ | PROT_WRITE,
+						 MAP_PRIVATE | MAP_ANONYMOUS,
+						 -1,
+						 0
+						 );
+		if( MapRegion != MAP_FAILED )
+		{
+			char	*Start = (char *)ROUND_UP((size_t)MapRegion, HUGE_PAGE_SIZE);
 
-	CacheInfo = &(Header -> ht);
-	CacheCount = &(Header -> CacheCount);
+			if( madvise(Start, ROUND_UP(CacheSize, HUGE_PAGE_SIZE), MADV_HUGEPAGE) != 0 )
+			{
+				ERRORMSG("Transparent huge pages are not available.\n");
+			}
 
-	CacheHT_Init(CacheInfo, MapStart, CacheSize);
+			CachePages = CACHE_PAGES_TRANSPARENT;
+			return Start;
+		}
+	}
+#endif /* MADV_HUGEPAGE */
+#endif /* WIN32 */
 
+	MapRegion = NULL;
+	CachePages = CACHE_PAGES_NORMAL;
+	return SafeMalloc(CacheSize);
 }
 
-static int InitCacheInfo(ConfigFileInfo *ConfigInfo, BOOL Reload)
+/* With several threads listening, spread the shards over the NUMA nodes, one
+ * node each, rather than have all of the region on the node of the thread
+ * creating it. Any thread looks up any shard, so the nodes share the load.
+ * The pages faulted in already are moved. */
+static void DNSCache_BindShards(int Threads)
 {
-	if( Reload == TRUE )
+#ifdef SYS_mbind
+	FILE	*fp;
+	char	Online[128];
+	char	*Itr;
+	int		Nodes = 0;
+	int		Bound = 0;
+	size_t	Alignment;
+	int		loop;
+
+	if( Threads < 2 || NumberOfShards < 2 )
+	{
+		return;
+	}
+
+	/* Like `0-3', nodes are taken as numbered from 0 to the highest one */
+	fp = fopen("/sys/devices/system/node/online", "r");
+	if( fp == NULL )
+	{
+		return;
+	}
+
+	if( fgets(Online, sizeof(Online), fp) != NULL )
 	{
-		if( IsReloadable() )
+		for( Itr = Online; *Itr != '\0'; )
 		{
-			ReloadCache();
-		} else {
-			if( ConfigGetBoolean(ConfigInfo, "OverwriteCache") == FALSE )
+			if( isdigit((unsigned char)*Itr) )
 			{
-				return -1;
+				int	Node = strtol(Itr, &Itr, 10);
+
+				if( Node + 1 > Nodes )
+				{
+					Nodes = Node + 1;
+				}
 			} else {
-				CreateNewCache();
-				INFO("The existing cache has been overwritten.\n");
+				++Itr;
 			}
 		}
+	}
+
+	fclose(fp);
+
+	if( Nodes < 2 )
+	{
+		return;
+	}
+
+	if( Nodes > (int)sizeof(unsigned long) * 8 )
+	{
+		Nodes = sizeof(unsigned long) * 8;
+	}
+
+	/* A policy applies to whole pages, the pages shared by two shards are
+	 * left as they are */
+	Alignment = CachePages == CACHE_PAGES_NORMAL ? (size_t)sysconf(_SC_PAGESIZE) : HUGE_PAGE_SIZE;
+
+	for( loop = 0; loop != NumberOfShards; ++loop )
+	{
+		size_t	Start = ROUND_UP((size_t)(MapStart + loop * ShardSize), Alignment);
+		size_t	End = ROUND_DOWN((size_t)(MapStart + (loop + 1) * ShardSize), Alignment);
+		unsigned long	Mask = 1UL << (loop % Nodes);
+
+		if( End <= Start )
+		{
+			continue;
+		}
+
+		/* Preferred, so that a node running short of memory is not fatal */
+		if( syscall(SYS_mbind, (void *)Start, End - Start, NUMA_MPOL_PREFERRED, &Mask, sizeof(Mask) * 8 + 1, NUMA_MPOL_MF_MOVE) == 0 )
+		{
+			++Bound;
+		}
+	}
+
+	if( Bound > 0 )
+	{
+		INFO("Cache shards are spread over %d NUMA nodes.\n", Nodes);
 	} else {
-		CreateNewCache();
+		ERRORMSG("Cache shards cannot be bound to NUMA nodes.\n");
 	}
-	return 0;
+#endif /* SYS_mbind */
+}
+
+static void DNSCache_FreeRegion(void)
+{
+#ifndef WIN32
+	if( MapRegion != NULL )
+	{
+		munmap(MapRegion, MapLength);
+		MapRegion = NULL;
+		return;
+	}
+#endif /* WIN32 */
+
+	SafeFree(MapStart);
 }
 
+static void CreateNewCache(void)
+{
+	int	loop;
+
+	/* Also faults all the pages in, so that no lookup waits for it */
+	memset(MapStart, 0, CacheSize);
+
+	AttachShards();
+
+	for( loop = 0; loop != NumberOfShards; ++loop )
+	{
+		CacheShard	*Shard = Shards + loop;
+
+		*(Shard -> CacheEnd) = SHARD_HEADER_LENGTH;
+		*(Shard -> CacheCount) = 0;
+
+		CacheHT_Init(Shard -> CacheInfo, Shard -> Base, ShardSize);
+	}
+}
+
+/* Callbacks of the CacheLog, defined after DNSCache_AddEntry() */
+static int DNSCache_LoadEntry(const char *Entry, int Length, int KeyLength, uint32_t TTL, time_t TimeAdded);
+
+static void DNSCache_DumpEntries(FILE *Stream);
+
 int DNSCache_Init(ConfigFileInfo *ConfigInfo)
 {
 	int			_CacheSize = ConfigGetInt32(ConfigInfo, "CacheSize");
 	const char	*CacheFile = ConfigGetRawString(ConfigInfo, "CacheFile");
-	int			InitCacheInfoState;
+	int			loop;
 
 	if( ConfigGetBoolean(ConfigInfo, "UseCache") == FALSE )
 	{
@@ -224,270 +608,701 @@ int DNSCache_Init(ConfigFileInfo *ConfigInfo)
 		return 1;
 	}
 
-	if( ConfigGetBoolean(ConfigInfo, "MemoryCache") == TRUE )
+	NumberOfShards = ConfigGetInt32(ConfigInfo, "CacheShards");
+	if( NumberOfShards < 1 )
+	{
+		NumberOfShards = 1;
+	}
+
+	/* Each shard should be big enough */
+	while( NumberOfShards > 1 && CacheSize / NumberOfShards < SHARD_MIN_SIZE )
+	{
+		--NumberOfShards;
+	}
+
+	ShardSize = ROUND_DOWN(CacheSize / NumberOfShards, 8);
+
+	Shards = SafeMalloc(sizeof(CacheShard) * NumberOfShards);
+	if( Shards == NULL )
+	{
+		ERRORMSG("Cache initializing failed.\n");
+		return 2;
+	}
+
+	MapStart = DNSCache_AllocRegion(ConfigGetInt32(ConfigInfo, "HugePageCache"));
+	if( MapStart == NULL )
+	{
+		ERRORMSG("Cache initializing failed.\n");
+		return 2;
+	}
+
+	/* Before the pages are faulted in by creating the cache */
+	DNSCache_BindShards(ConfigGetInt32(ConfigInfo, "UDPThreads"));
+
+	CreateNewCache();
+
+	for( loop = 0; loop != NumberOfShards; ++loop )
 	{
-		MapStart = SafeMalloc(CacheSize);
+		CacheShard	*Shard = Shards + loop;
 
-		if( MapStart == NULL )
+		if( IgnoreTTL == FALSE )
 		{
-			ERRORMSG("Cache initializing failed.\n");
-			return 2;
+			if( Array_Init(&(Shard -> ExpiryIndex), sizeof(ExpiryEntry), 128, FALSE, NULL) != 0 )
+			{
+				ERRORMSG("Cache initializing failed.\n");
+				return 7;
+			}
+
+			ExpiryIndex_Rebuild(Shard);
 		}
 
-		InitCacheInfoState = InitCacheInfo(ConfigInfo, FALSE);
-	} else {
-		BOOL FileExists;
+		RWLock_Init(Shard -> Lock);
+
+		Shard -> Hand = 0;
+		Shard -> Evictions = 0;
+	}
 
+	INFO("Cache is split into %d shards.\n", NumberOfShards);
+
+	switch( CachePages )
+	{
+		case CACHE_PAGES_HUGETLB:
+			INFO("Cache is backed by huge pages.\n");
+			break;
+
+		case CACHE_PAGES_TRANSPARENT:
+			INFO("Cache is backed by transparent huge pages.\n");
+			break;
+
+		default:
+			break;
+	}
+
+	PrefetchThreshold = ConfigGetInt32(ConfigInfo, "PrefetchThreshold");
+	if( PrefetchThreshold < 0 )
+	{
+		PrefetchThreshold = 0;
+	}
+
+	ServeStale = ConfigGetInt32(ConfigInfo, "ServeStale");
+	if( ServeStale < 0 || IgnoreTTL == TRUE )
+	{
+		ServeStale = 0;
+	}
+
+	memset(RefreshIssued, 0, sizeof(RefreshIssued));
+
+	/* Negative answers would never expire if TTLs are ignored */
+	NegativeMaxTTL = ConfigGetInt32(ConfigInfo, "NegativeCacheMaxTTL");
+	if( NegativeMaxTTL < 0 || IgnoreTTL == TRUE )
+	{
+		NegativeMaxTTL = 0;
+	}
+
+	if( ResponseCache_Init(ConfigGetInt32(ConfigInfo, "ResponseCacheSize"), IgnoreTTL, PrefetchThreshold) != 0 )
+	{
+		ERRORMSG("Response cache initializing failed.\n");
+	}
+
+	FileCache = !ConfigGetBoolean(ConfigInfo, "MemoryCache");
+	if( FileCache == TRUE )
+	{
 		INFO("Cache File : %s\n", CacheFile);
 
-		FileExists = FileIsReadable(CacheFile);
+		if( CacheLog_Open(CacheFile,
+						  CACHE_VERSION,
+						  ConfigGetBoolean(ConfigInfo, "ReloadCache"),
+						  ConfigGetBoolean(ConfigInfo, "OverwriteCache"),
+						  DNSCache_LoadEntry,
+						  DNSCache_DumpEntries
+						  )
+			!= 0 )
+		{
+			ERRORMSG("Cache initializing failed.\n");
+			return 6;
+		}
+	}
+
+	Inited = TRUE;
+
+	if( IgnoreTTL == FALSE || FileCache == TRUE )
+	{
+		CREATE_THREAD(DNSCacheMaintenance_Thread, NULL, Maintenance_Thread);
+	}
+
+	return 0;
+}
+
+BOOL Cache_IsInited(void)
+{
+	return Inited;
+}
 
-		CacheFileHandle = OPEN_FILE(CacheFile);
-		if(CacheFileHandle == INVALID_FILE)
+/* Evict a node with CLOCK. Nodes referenced since the hand passed them last
+ * time are given a second chance. In the first two rounds only nodes of
+ * `ChunkSize' are taken, as their chunks can be reused at once, after that
+ * any cold one large enough is. Returns whether a node was evicted. */
+static BOOL DNSCache_EvictOne(CacheShard *Shard, uint32_t ChunkSize)
+{
+	Array	*ChunkList = &(Shard -> CacheInfo -> NodeChunk);
+	int32_t	Steps;
+
+	for( Steps = 0; Steps < ChunkList -> Used * 3; ++Steps )
+	{
+		int32_t		Subscript;
+		Cht_Node	*Node;
+
+		if( Shard -> Hand >= ChunkList -> Used )
 		{
-			int ErrorNum = GET_LAST_ERROR();
-			char ErrorMessage[320];
+			Shard -> Hand = 0;
+		}
 
-			GetErrorMsg(ErrorNum, ErrorMessage, sizeof(ErrorMessage));
+		Subscript = Shard -> Hand;
+		Node = (Cht_Node *)Array_GetBySubscript(ChunkList, Subscript);
 
-			ERRORMSG("Cache initializing failed : %d : %s.\n", ErrorNum, ErrorMessage);
+		++(Shard -> Hand);
 
-			return 3;
+		if( Node -> Slot < 0 )
+		{
+			continue;
 		}
 
-		CacheMappingHandle = CREATE_FILE_MAPPING(CacheFileHandle, CacheSize);
-		if(CacheMappingHandle == INVALID_MAP)
+		if( Node -> Link.Referenced != 0 )
 		{
-			int ErrorNum = GET_LAST_ERROR();
-			char ErrorMessage[320];
+			Node -> Link.Referenced = 0;
+			continue;
+		}
 
-			GetErrorMsg(ErrorNum, ErrorMessage, sizeof(ErrorMessage));
+		if( Steps < ChunkList -> Used * 2 ? Node -> Length != ChunkSize : Node -> Length < ChunkSize )
+		{
+			continue;
+		}
 
-			ERRORMSG("Cache initializing failed : %d : %s.\n", ErrorNum, ErrorMessage);
-			return 4;
+		DNSCache_RemoveNode(Shard, Subscript, Node);
+		++(Shard -> Evictions);
+
+		return TRUE;
+	}
+
+	/* No cold node is large enough, give up the one at the end of the
+	 * region, so that the space there is returned */
+	if( ChunkList -> Used > 0 )
+	{
+		DNSCache_RemoveNode(Shard,
+							ChunkList -> Used - 1,
+							(Cht_Node *)Array_GetBySubscript(ChunkList, ChunkList -> Used - 1)
+							);
+		++(Shard -> Evictions);
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static int32_t DNSCache_GetAviliableChunk(CacheShard *Shard, uint32_t Length, Cht_Node **Out)
+{
+	int32_t	NodeNumber;
+	Cht_Node	*Node;
+	uint32_t	RoundedLength = CacheHT_RoundChunkSize(Length);
+
+	BOOL	NewCreated;
+	int		Evicted = 0;
+
+	if( RoundedLength == 0 )
+	{
+		*Out = NULL;
+		return -1;
+	}
+
+	while( TRUE )
+	{
+		NodeNumber = CacheHT_FindUnusedNode(Shard -> CacheInfo, Length, &Node, Shard -> Base + *(Shard -> CacheEnd) + RoundedLength, &NewCreated);
+		if( NodeNumber >= 0 )
+		{
+			break;
 		}
 
-		MapStart = (char *)MPA_FILE(CacheMappingHandle, CacheSize);
-		if(MapStart == INVALID_MAPPING_FILE)
+		/* The shard is full, make room for it */
+		if( Evicted == EVICTION_LIMIT || DNSCache_EvictOne(Shard, RoundedLength) == FALSE )
 		{
-			int ErrorNum = GET_LAST_ERROR();
-			char ErrorMessage[320];
+			*Out = NULL;
+			return -1;
+		}
 
-			GetErrorMsg(ErrorNum, ErrorMessage, sizeof(ErrorMessage));
+		++Evicted;
+		DNSCache_ResetEnd(Shard);
+	}
 
-			ERRORMSG("Cache initializing failed : %d : %s.\n", ErrorNum, ErrorMessage);
-			return 5;
+	if( NewCreated == TRUE )
+	{
+		Node -> Offset = *(Shard -> CacheEnd);
+		*(Shard -> CacheEnd) += RoundedLength;
+	}
+
+	memset(Shard -> Base + Node -> Offset + Length, 0xFE, Node -> Length - Length);
+
+	*Out = Node;
+	return NodeNumber;
+}
+
+static Cht_Node *DNSCache_FindFromCache(CacheShard *Shard, char *Content, size_t Length, Cht_Node *Start, time_t CurrentTime)
+{
+	Cht_Node *Node = Start;
+
+	do{
+		Node = CacheHT_Get(Shard -> CacheInfo, Content, Node, NULL);
+		if( Node == NULL )
+		{
+			return NULL;
 		}
 
-		if( FileExists == FALSE )
+		if( IgnoreTTL == TRUE || (CurrentTime - Node -> TimeAdded < (time_t)Node -> TTL + ServeStale) )
 		{
-			InitCacheInfoState = InitCacheInfo(ConfigInfo, FALSE);
-		} else {
-			InitCacheInfoState = InitCacheInfo(ConfigInfo, ConfigGetBoolean(ConfigInfo, "ReloadCache"));
+			if( memcmp(Content, Shard -> Base + Node -> Offset + 1, Length) == 0 )
+			{
+				/* Only written when changed, to keep the line clean for
+				 * other readers */
+				if( Node -> Link.Referenced == 0 )
+				{
+					Node -> Link.Referenced = 1;
+				}
+
+				return Node;
+			}
 		}
+
+	} while( TRUE );
+
+}
+
+/* Copy a name in uncompressed form, returns the length copied or -1 */
+static int DNSCache_CopyName(const char *DNSBody, const char *Name, char *Buffer, int BufferLength)
+{
+	int		Length = 0;
+	int		Jumps = 0;
+	unsigned char	LabelLength;
+
+	while( TRUE )
+	{
+		LabelLength = *(const unsigned char *)Name;
+
+		if( (LabelLength & 0xC0) == 0xC0 )
+		{
+			if( ++Jumps > 64 )
+			{
+				return -1;
+			}
+
+			Name = DNSBody + (GET_16_BIT_U_INT(Name) & 0x3FFF);
+			continue;
+		}
+
+		if( Length + LabelLength + 1 > BufferLength || Length + LabelLength + 1 > 255 )
+		{
+			return -1;
+		}
+
+		memcpy(Buffer + Length, Name, LabelLength + 1);
+		Length += LabelLength + 1;
+
+		if( LabelLength == 0 )
+		{
+			return Length;
+		}
+
+		Name += LabelLength + 1;
 	}
+}
+
+/* Copy the RDATA of a record with names in it uncompressed, returns the
+ * length copied or -1 */
+static int DNSCache_CopyRData(const char *DNSBody, const char *RecordBody, char *Buffer, int BufferLength)
+{
+	const char	*Data = DNSGetResourceDataPos(RecordBody);
+	const char	*DataEnd = Data + DNSGetResourceDataLength(RecordBody);
+	char		*BufferItr = Buffer;
+	char		*BufferEnd = Buffer + BufferLength;
 
-	if( InitCacheInfoState != 0 )
+	const ElementDescriptor *Descriptor;
+	int DescriptorCount;
+	int loop;
+
+	DescriptorCount = DNSGetDescriptor((DNSRecordType)DNSGetRecordType(RecordBody), TRUE, &Descriptor);
+	if( DescriptorCount == 0 )
 	{
-		return 6;
+		return -1;
 	}
 
-	RWLock_Init(CacheLock);
+	for( loop = 0; loop != DescriptorCount && Data < DataEnd; ++loop )
+	{
+		int	Length;
 
-	Inited = TRUE;
+		switch( Descriptor[loop].element )
+		{
+			case DNS_LABELED_NAME:
+				Length = DNSCache_CopyName(DNSBody, Data, BufferItr, BufferEnd - BufferItr);
+				if( Length < 0 )
+				{
+					return -1;
+				}
 
-	if(IgnoreTTL == FALSE)
-		CREATE_THREAD(DNSCacheTTLCountdown_Thread, NULL, TTLCountdown_Thread);
+				BufferItr += Length;
+				Data = DNSJumpOverName(Data);
+				continue;
+				break;
 
-	return 0;
+			case DNS_32BIT_UINT:
+				Length = 4;
+				break;
+
+			case DNS_16BIT_UINT:
+				Length = 2;
+				break;
+
+			case DNS_8BIT_UINT:
+				Length = 1;
+				break;
+
+			default:
+				/* No more names in the rest */
+				Length = DataEnd - Data;
+				break;
+		}
+
+		if( Length > DataEnd - Data || Length > BufferEnd - BufferItr )
+		{
+			return -1;
+		}
+
+		memcpy(BufferItr, Data, Length);
+		BufferItr += Length;
+		Data += Length;
+	}
+
+	if( Data < DataEnd )
+	{
+		if( DataEnd - Data > BufferEnd - BufferItr )
+		{
+			return -1;
+		}
+
+		memcpy(BufferItr, Data, DataEnd - Data);
+		BufferItr += DataEnd - Data;
+	}
+
+	return BufferItr - Buffer;
 }
 
-BOOL Cache_IsInited(void)
+/* Generate `Name\1Type\1Class' of a record, returns its length */
+static int DNSCache_GenerateKey(const char *DNSBody, const char *RecordBody, char *Buffer)
 {
-	return Inited;
+	DNSGetHostName(DNSBody, RecordBody, Buffer);
+
+	return strlen(Buffer) + sprintf(Buffer + strlen(Buffer), "\1%d\1%d", (int)DNSGetRecordType(RecordBody), (int)DNSGetRecordClass(RecordBody));
 }
 
-static int32_t DNSCache_GetAviliableChunk(uint32_t Length, Cht_Node **Out)
+/* Store an entry made up of CACHE_START, the key, the records and CACHE_END,
+ * replacing an older copy of it. `Logged' tells whether to append it to the
+ * cache file. */
+static int DNSCache_AddEntry(const char *Entry, int Length, int KeyLength, uint32_t TTL, time_t CurrentTime, BOOL Logged)
 {
-	int32_t	NodeNumber;
+	CacheShard	*Shard = DNSCache_GetShard(Entry + 1);
+	int32_t	Subscript;
 	Cht_Node	*Node;
-	uint32_t	RoundedLength = ROUND_UP(Length, 8);
 
-	BOOL	NewCreated;
+	RWLock_WrLock(Shard -> Lock);
 
-	NodeNumber = CacheHT_FindUnusedNode(CacheInfo, RoundedLength, &Node, MapStart + (*CacheEnd) + RoundedLength, &NewCreated);
-	if( NodeNumber >= 0 )
+	Node = DNSCache_FindFromCache(Shard, (char *)Entry + 1, KeyLength + 1, NULL, CurrentTime);
+	if( Node != NULL )
 	{
-		if( NewCreated == TRUE )
+		/* Added with an earlier record of this RRset, or from another
+		 * response just now. While warming up, the one loaded may also be
+		 * older than the one in the cache. */
+		if( Node -> TimeAdded >= CurrentTime )
 		{
-			Node -> Offset = (*CacheEnd);
-			(*CacheEnd) += RoundedLength;
+			RWLock_UnWLock(Shard -> Lock);
+			return 0;
 		}
 
-		memset(MapStart + Node -> Offset + Length, 0xFE, RoundedLength - Length);
+		/* A refreshed one, replace the old */
+		DNSCache_RemoveNode(Shard, CacheHT_GetSubscript(Shard -> CacheInfo, Node), Node);
+		DNSCache_ResetEnd(Shard);
+	}
 
-		*Out = Node;
-		return NodeNumber;
-	} else {
-		*Out = NULL;
+	Subscript = DNSCache_GetAviliableChunk(Shard, Length, &Node);
+	if( Subscript < 0 )
+	{
+		RWLock_UnWLock(Shard -> Lock);
 		return -1;
 	}
 
+	memcpy(Shard -> Base + Node -> Offset, Entry, Length);
+
+	Node -> TTL = TTL;
+	Node -> TimeAdded = CurrentTime;
+
+	CacheHT_InsertToSlot(Shard -> CacheInfo, Entry + 1, Subscript, Node, NULL);
+
+	++(*(Shard -> CacheCount));
+
+	if( IgnoreTTL == FALSE )
+	{
+		ExpiryIndex_Push(&(Shard -> ExpiryIndex), Subscript, Node);
+	}
+
+	RWLock_UnWLock(Shard -> Lock);
+
+	if( Logged == TRUE )
+	{
+		CacheLog_Append(Entry, Length, KeyLength, TTL, CurrentTime);
+	}
+
+	return 0;
 }
 
-static Cht_Node *DNSCache_FindFromCache(char *Content, size_t Length, Cht_Node *Start, time_t CurrentTime)
+/* Take an entry loaded from the cache file, unless it is malformed or expired.
+ * Called by the warming up thread, while the cache is being used. */
+static int DNSCache_LoadEntry(const char *Entry, int Length, int KeyLength, uint32_t TTL, time_t TimeAdded)
 {
-	Cht_Node *Node = Start;
+	if( Length > CACHE_ENTRY_MAX_LENGTH ||
+		Length < KeyLength + 5 ||
+		Entry[0] != CACHE_START ||
+		Entry[KeyLength + 1] != '\0' ||
+		Entry[Length - 1] != CACHE_END ||
+		(int)strlen(Entry + 1) != KeyLength
+		)
+	{
+		return -1;
+	}
+
+	if( IgnoreTTL == FALSE && TimeAdded + (time_t)TTL + ServeStale <= time(NULL) )
+	{
+		return 1;
+	}
+
+	return DNSCache_AddEntry(Entry, Length, KeyLength, TTL, TimeAdded, FALSE);
+}
+
+/* Write all live entries into a cache file being compacted */
+static void DNSCache_DumpEntries(FILE *Stream)
+{
+	time_t	CurrentTime = time(NULL);
+	int		loop;
+
+	for( loop = 0; loop != NumberOfShards; ++loop )
+	{
+		CacheShard	*Shard = Shards + loop;
+		Array		*ChunkList = &(Shard -> CacheInfo -> NodeChunk);
+		int32_t		Subscript;
+
+		RWLock_RdLock(Shard -> Lock);
+
+		for( Subscript = 0; Subscript != ChunkList -> Used; ++Subscript )
+		{
+			Cht_Node	*Node = (Cht_Node *)Array_GetBySubscript(ChunkList, Subscript);
+			const char	*Entry = Shard -> Base + Node -> Offset;
+
+			if( Node -> Slot < 0 ||
+				(IgnoreTTL == FALSE && Node -> TimeAdded + (time_t)Node -> TTL + ServeStale <= CurrentTime)
+				)
+			{
+				continue;
+			}
+
+			CacheLog_WriteRecord(Stream, Entry, Node -> DataLength, strlen(Entry + 1), Node -> TTL, Node -> TimeAdded);
+		}
+
+		RWLock_UnRLock(Shard -> Lock);
+	}
+}
+
+/* Add the RRset the `Number'th answer record belongs to, which consists of
+ * that record and all the records after it with the same name, type and
+ * class */
+static int DNSCache_AddAnRRsetToCache(const char *DNSBody, int Number, time_t CurrentTime)
+{
+	char	Buffer[CACHE_ENTRY_MAX_LENGTH];
+	char	*BufferItr = Buffer;
+	char	*BufferEnd = Buffer + sizeof(Buffer) - 1; /* Leave room for CACHE_END */
+
+	const char	*RecordBody = DNSGetAnswerRecordPosition(DNSBody, Number);
+	int		KeyLength;
+
+	int		AnswerCount = DNSGetAnswerCount(DNSBody);
+	int		RecordCount = 0;
+	char	*RecordCountPos;
+
+	uint32_t	RecordTTL = 0xFFFFFFFF;
+
+	const ElementDescriptor *Descriptor;
+
+	if( DNSGetDescriptor((DNSRecordType)DNSGetRecordType(RecordBody), TRUE, &Descriptor) == 0 )
+	{
+		return 0;
+	}
+
+	*BufferItr++ = CACHE_START;
+
+	KeyLength = DNSCache_GenerateKey(DNSBody, RecordBody, BufferItr);
+
+	BufferItr += KeyLength + 1;
+
+	RecordCountPos = BufferItr;
+	BufferItr += 2;
 
-	do{
-		Node = CacheHT_Get(CacheInfo, Content, Node, NULL);
-		if( Node == NULL )
+	for( ; Number <= AnswerCount; ++Number, RecordBody += DNSGetARecordLength(RecordBody) )
+	{
+		char	Key[300];
+		int		DataLength;
+		uint32_t	TTL;
+
+		if( DNSCache_GenerateKey(DNSBody, RecordBody, Key) != KeyLength || memcmp(Key, Buffer + 1, KeyLength) != 0 )
 		{
-			return NULL;
+			continue;
 		}
 
-		if( IgnoreTTL == TRUE || (CurrentTime - Node -> TimeAdded < Node -> TTL) )
+		if( BufferEnd - BufferItr < 2 )
 		{
-			if( memcmp(Content, MapStart + Node -> Offset + 1, Length) == 0 )
-			{
-				return Node;
-			}
+			return 0;
 		}
 
-	} while( TRUE );
-
-}
-
-static char *DNSCache_GenerateTextFromRawRecord(const char *DNSBody, const char *DataBody, int DataLangth, char *Buffer, DNSRecordType ResourceType)
-{
-	int loop2;
+		DataLength = DNSCache_CopyRData(DNSBody, RecordBody, BufferItr + 2, BufferEnd - BufferItr - 2);
+		if( DataLength < 0 )
+		{
+			return 0;
+		}
 
-	const ElementDescriptor *Descriptor;
-	int DescriptorCount;
+		SET_16_BIT_U_INT(BufferItr, DataLength);
+		BufferItr += 2 + DataLength;
 
-	if(Buffer == NULL) return NULL;
+		++RecordCount;
 
-	DescriptorCount = DNSGetDescriptor(ResourceType, TRUE, &Descriptor);
+		if( OverrideTTL < 0 )
+		{
+			TTL = DNSGetTTL(RecordBody) * TTLMultiple;
+		} else {
+			TTL = OverrideTTL;
+		}
 
-	if(DescriptorCount != 0)
-	{
-		char InnerBuffer[512];
-		DNSDataInfo Data;
-		for(loop2 = 0; loop2 != DescriptorCount; ++loop2)
+		if( TTL < RecordTTL )
 		{
-			Data = DNSParseData(DNSBody, DataBody, DataLangth, InnerBuffer, sizeof(InnerBuffer), Descriptor, DescriptorCount, loop2 + 1);
-			switch(Data.DataType)
-			{
-				case DNS_DATA_TYPE_INT:
-					if(Data.DataLength == 1)Buffer += sprintf(Buffer, "%d", (int)*(char *)InnerBuffer);
-					if(Data.DataLength == 2)Buffer += sprintf(Buffer, "%d", (int)*(int16_t *)InnerBuffer);
-					if(Data.DataLength == 4)Buffer += sprintf(Buffer, "%u", *(int32_t *)InnerBuffer);
-					break;
-				case DNS_DATA_TYPE_UINT:
-					if(Data.DataLength == 1)Buffer += sprintf(Buffer, "%d", (int)*(unsigned char *)InnerBuffer);
-					if(Data.DataLength == 2)Buffer += sprintf(Buffer, "%d", (int)*(uint16_t *)InnerBuffer);
-					if(Data.DataLength == 4)Buffer += sprintf(Buffer, "%u", *(uint32_t *)InnerBuffer);
-					break;
-				case DNS_DATA_TYPE_STRING:
-					Buffer += sprintf(Buffer, "%s", InnerBuffer);
-					break;
-				default:
-					break;
-			}
-			*Buffer++ = '\0';
+			RecordTTL = TTL;
 		}
+	}
 
-		return Buffer;
-	} else {
-		return NULL;
+	if( RecordTTL == 0 )
+	{
+		return 0;
 	}
-}
 
-static int DNSCache_AddAItemToCache(const char *DNSBody, const char *RecordBody, time_t CurrentTime)
-{
-	/* used to store cache data temporarily, no bounds checking here */
-	char			Buffer[512];
+	SET_16_BIT_U_INT(RecordCountPos, RecordCount);
 
-	/* Iterator of `Buffer' */
-	char			*BufferItr = Buffer;
+	*BufferItr++ = CACHE_END;
 
-	/* Assign start byte of the cache */
-	Buffer[0] = CACHE_START;
+	return DNSCache_AddEntry(Buffer, BufferItr - Buffer, KeyLength, RecordTTL, CurrentTime, TRUE);
+}
 
-	/* Assign the name of the cache */
-	DNSGetHostName(DNSBody, RecordBody, Buffer + 1);
+/* A negative entry is keyed `Name\1-Type\1Class', with type 0 for NXDOMAIN,
+ * which denies all types of the name. Its only record is the SOA from the
+ * authority section, the owner name followed by the RDATA. */
+static int DNSCache_GenerateNegativeKey(const char *Name, int Type, int Class, char *Buffer)
+{
+	return sprintf(Buffer, "%s\1-%d\1%d", Name, Type, Class);
+}
 
-	/* Jump just over the name */
-	BufferItr += strlen(Buffer);
+/* Add a response without answers, as RFC 2308 describes */
+static int DNSCache_AddNegativeToCache(const char *DNSBody, time_t CurrentTime)
+{
+	char	Buffer[CACHE_ENTRY_MAX_LENGTH];
+	char	*BufferItr = Buffer;
+	char	*BufferEnd = Buffer + sizeof(Buffer) - 1; /* Leave room for CACHE_END */
 
-	/* Set record type and class */
-	BufferItr += sprintf(BufferItr, "\1%d\1%d", (int)DNSGetRecordType(RecordBody), (int)DNSGetRecordClass(RecordBody));
+	const char	*Question = DNSJumpHeader(DNSBody);
+	char	Name[260];
+	int		Type;
+	int		KeyLength;
 
-	/* End of class */
-	*BufferItr++ = '\0';
+	const char	*RecordBody = DNSGetAnswerRecordPosition(DNSBody, 1);
+	int		NameServerCount = DNSGetNameServerCount(DNSBody);
+	int		NameLength, DataLength;
+	uint32_t	TTL, Minimum;
 
-	/* Generate data and store them */
-	BufferItr = DNSCache_GenerateTextFromRawRecord(DNSBody, DNSGetResourceDataPos(RecordBody), DNSGetResourceDataLength(RecordBody), BufferItr, (DNSRecordType)DNSGetRecordType(RecordBody));
+	switch( ((DNSHeader *)DNSBody) -> Flags.ResponseCode )
+	{
+		case 0:
+			Type = DNSGetRecordType(Question);
+			break;
 
-	/* If it failed in generating data, stop everything else */
-	if(BufferItr == NULL) return 0;
+		case DNS_RCODE_NAME_ERROR:
+			Type = DNS_TYPE_UNKNOWN;
+			break;
 
-	/* Mark the end */
-	*BufferItr = CACHE_END;
+		default:
+			return 0;
+	}
 
-	/* The whole cache data generating completed */
+	/* Without an SOA, it is unknown how long the answer stays true */
+	for( ; NameServerCount > 0; --NameServerCount, RecordBody += DNSGetARecordLength(RecordBody) )
+	{
+		if( DNSGetRecordType(RecordBody) == DNS_TYPE_SOA )
+		{
+			break;
+		}
+	}
 
-	/* Add the cache item to the main cache zone below */
+	if( NameServerCount == 0 || DNSGetResourceDataLength(RecordBody) < 22 )
+	{
+		return 0;
+	}
 
-	/* Determine whether the cache item has existed in the main cache zone */
-	if(DNSCache_FindFromCache(Buffer + 1, BufferItr - Buffer, NULL, CurrentTime) == NULL)
+	/* The lesser of the TTL of the SOA and its MINIMUM field */
+	TTL = DNSGetTTL(RecordBody);
+	Minimum = GET_32_BIT_U_INT(DNSGetResourceDataPos(RecordBody) + DNSGetResourceDataLength(RecordBody) - 4);
+	if( Minimum < TTL )
 	{
-		/* If not, add it */
+		TTL = Minimum;
+	}
 
-		/* Subscript of a chunk in the main cache zone */
-		int32_t	Subscript;
+	if( TTL > (uint32_t)NegativeMaxTTL )
+	{
+		TTL = NegativeMaxTTL;
+	}
 
-		uint32_t RecordTTL;
+	if( TTL == 0 )
+	{
+		return 0;
+	}
 
-		/* Node with subscript `Subscript' */
-		Cht_Node	*Node;
+	DNSGetHostName(DNSBody, Question, Name);
 
-		if(OverrideTTL < 0)
-		{
-			RecordTTL = DNSGetTTL(RecordBody) * TTLMultiple;
-		} else {
-			RecordTTL = OverrideTTL;
-		}
+	*BufferItr++ = CACHE_START;
 
-		if( RecordTTL == 0 )
-		{
-			return 0;
-		}
+	KeyLength = DNSCache_GenerateNegativeKey(Name, Type, DNSGetRecordClass(Question), BufferItr);
 
-		/* Get a usable chunk and its subscript */
-		Subscript = DNSCache_GetAviliableChunk(BufferItr - Buffer + 1, &Node);
+	BufferItr += KeyLength + 1;
 
-		/* If there is a usable chunk */
-		if(Subscript >= 0)
-		{
-			/* Copy the cache to this entry */
-			memcpy(MapStart + Node -> Offset, Buffer, BufferItr - Buffer + 1);
+	SET_16_BIT_U_INT(BufferItr, 1);
+	BufferItr += 4;
 
-			/* Assign TTL */
-			Node -> TTL = RecordTTL;
+	NameLength = DNSCache_CopyName(DNSBody, RecordBody, BufferItr, BufferEnd - BufferItr);
+	if( NameLength < 0 )
+	{
+		return 0;
+	}
 
-			Node -> TimeAdded = CurrentTime;
+	DataLength = DNSCache_CopyRData(DNSBody, RecordBody, BufferItr + NameLength, BufferEnd - BufferItr - NameLength);
+	if( DataLength < 0 )
+	{
+		return 0;
+	}
 
-			/* Index this entry on the hash table */
-			CacheHT_InsertToSlot(CacheInfo, Buffer + 1, Subscript, Node, NULL);
+	SET_16_BIT_U_INT(BufferItr - 2, NameLength + DataLength);
+	BufferItr += NameLength + DataLength;
 
-			++(*CacheCount);
-		} else {
-			return -1;
-		}
-	}
+	*BufferItr++ = CACHE_END;
 
-	return 0;
+	return DNSCache_AddEntry(Buffer, BufferItr - Buffer, KeyLength, TTL, CurrentTime, TRUE);
 }
 
 int DNSCache_AddItemsToCache(char *DNSBody, time_t CurrentTime)
@@ -497,54 +1312,91 @@ int DNSCache_AddItemsToCache(char *DNSBody, time_t CurrentTime)
 	if(Inited == FALSE) return 0;
 	if(TTLMultiple < 1) return 0;
 	AnswerCount = DNSGetAnswerCount(DNSBody);
-	RWLock_WrLock(CacheLock);
 
+	if( AnswerCount == 0 )
+	{
+		if( NegativeMaxTTL > 0 )
+		{
+			return DNSCache_AddNegativeToCache(DNSBody, CurrentTime);
+		}
+
+		return 0;
+	}
+
+	/* Each RRset locks the shard it goes to */
 	for(loop = 1; loop != AnswerCount + 1; ++loop)
 	{
-		if( DNSCache_AddAItemToCache(DNSBody, DNSGetAnswerRecordPosition(DNSBody, loop), CurrentTime) != 0 )
+		if( DNSCache_AddAnRRsetToCache(DNSBody, loop, CurrentTime) != 0 )
 		{
-			RWLock_UnWLock(CacheLock);
 			return -1;
 		}
 	}
 
-	RWLock_UnWLock(CacheLock);
-
 	return 0;
 }
 
-static int DNSCache_GenerateDatasFromCache(	__in			char				*Datas,
-											__inout			char				*Buffer,
-											__in			int					BufferLength,
-											__in	const	ElementDescriptor	*Descriptor,
-											__in			int					CountOfDescriptor
-											)
+/* Generate the records of a cached RRset, with a placeholder name to be
+ * replaced by DNSCompress(). Returns the length generated. */
+static int DNSCache_GenerateRRset(	__in	CacheShard	*Shard,
+									__in	Cht_Node	*Node,
+									__in	int			KeyLength,
+									__in	uint16_t	Type,
+									__in	uint16_t	Class,
+									__inout	char		*Buffer,
+									__in	int			BufferLength,
+									__out	int			*RecordCount,
+									__inout	int32_t		*Remaining,
+									__in	time_t		CurrentTime
+									)
 {
-	int		TotleLength = 0;
-	int		SingleLength;
-	int		loop;
+	static const char PlaceHolder[] = {1, 'a', 0};
+
+	/* Skip CACHE_START and the key */
+	const char	*CacheItr = Shard -> Base + Node -> Offset + 1 + KeyLength + 1;
+
+	int		Count = GET_16_BIT_U_INT(CacheItr);
+	int		TotalLength = 0;
+	uint32_t	NewTTL;
+
+	if( IgnoreTTL == TRUE )
+	{
+		NewTTL = Node -> TTL;
+	} else {
+		int32_t	Left = Node -> TTL - (CurrentTime - Node -> TimeAdded);
+
+		if( Left < *Remaining )
+		{
+			*Remaining = Left;
+		}
+
+		NewTTL = Left > 0 ? Left : STALE_ANSWER_TTL;
+	}
+
+	CacheItr += 2;
 
-	for(loop = 0; loop != CountOfDescriptor && *Datas != CACHE_END; ++loop)
+	for( *RecordCount = 0; *RecordCount != Count; ++(*RecordCount) )
 	{
-		SingleLength = DNSGenerateData(Datas, NULL, 0, Descriptor + loop);
+		int	DataLength = GET_16_BIT_U_INT(CacheItr);
+		int	SingleLength = sizeof(PlaceHolder) + 10 + DataLength;
 
 		if( BufferLength < SingleLength )
 		{
 			break;
 		}
 
-		DNSGenerateData(Datas, Buffer, SingleLength, Descriptor + loop);
+		memcpy(Buffer, PlaceHolder, sizeof(PlaceHolder));
+		SET_16_BIT_U_INT(Buffer + sizeof(PlaceHolder), Type);
+		SET_16_BIT_U_INT(Buffer + sizeof(PlaceHolder) + 2, Class);
+		SET_32_BIT_U_INT(Buffer + sizeof(PlaceHolder) + 4, NewTTL);
+		memcpy(Buffer + sizeof(PlaceHolder) + 8, CacheItr, 2 + DataLength);
 
-		TotleLength += SingleLength;
-		BufferLength -= SingleLength;
+		CacheItr += 2 + DataLength;
 		Buffer += SingleLength;
-
-		/* move to next record */
-		for(;*Datas != '\0'; ++Datas);
-		++Datas;
+		BufferLength -= SingleLength;
+		TotalLength += SingleLength;
 	}
 
-	return TotleLength;
+	return TotalLength;
 }
 
 static int DNSCache_GetRawRecordsFromCache(	__in	char				*Name,
@@ -553,31 +1405,29 @@ static int DNSCache_GetRawRecordsFromCache(	__in	char				*Name,
 											__inout char				*Buffer,
 											__in	int					BufferLength,
 											__out	int					*RecordsLength,
+											__inout	int32_t				*Remaining,
 											__in	time_t				CurrentTime
 											)
 {
-	int			SingleLength;
-	char		*CacheItr;
+	CacheShard	*Shard = DNSCache_GetShard(Name);
 	Cht_Node	*Node = NULL;
 
-	int			DatasLen;
-
-	uint32_t	NewTTL;
-
 	int 		RecordCount = 0;
 
-	const ElementDescriptor *Descriptor;
-	int CountOfDescriptor;
-
 	char Name_Type_Class[256];
+	int	KeyLength;
 
 	*RecordsLength = 0;
 
-	sprintf(Name_Type_Class, "%s\1%d\1%d", Name, Type, Class);
+	KeyLength = sprintf(Name_Type_Class, "%s\1%d\1%d", Name, Type, Class);
+
+	RWLock_RdLock(Shard -> Lock);
 
 	do
 	{
-		Node = DNSCache_FindFromCache(Name_Type_Class, strlen(Name_Type_Class) + 1, Node, CurrentTime);
+		int	SingleCount, SingleLength;
+
+		Node = DNSCache_FindFromCache(Shard, Name_Type_Class, KeyLength + 1, Node, CurrentTime);
 		if( Node == NULL )
 		{
 			break;
@@ -585,74 +1435,41 @@ static int DNSCache_GetRawRecordsFromCache(	__in	char				*Name,
 
 		if( Node -> TTL != 0 )
 		{
-			CountOfDescriptor = DNSGetDescriptor((DNSRecordType)Type, TRUE, &Descriptor);
-			if(CountOfDescriptor != 0)
-			{
-				++RecordCount;
-
-				CacheItr = MapStart + Node -> Offset + 1;
-
-				SingleLength = DNSGenResourceRecord(NULL, 0, "a", Type, Class, 0, NULL, 0, FALSE);
-
-				if( BufferLength < SingleLength )
-				{
-					break;
-				}
-
-				if( IgnoreTTL == TRUE )
-				{
-					NewTTL = Node -> TTL;
-				} else {
-					NewTTL = Node -> TTL - (CurrentTime - Node -> TimeAdded);
-				}
-
-				DNSGenResourceRecord(Buffer, SingleLength, "a", Type, Class, NewTTL, NULL, 0, FALSE);
-
-				for(; *CacheItr != '\0'; ++CacheItr);
-				/* Then *CacheItr == '\0' */
-				++CacheItr;
-				/* Then the data position */
-
-				Buffer += SingleLength;
-				BufferLength -= SingleLength;
+			SingleLength = DNSCache_GenerateRRset(Shard, Node, KeyLength, Type, Class, Buffer, BufferLength, &SingleCount, Remaining, CurrentTime);
 
-				DatasLen = DNSCache_GenerateDatasFromCache(CacheItr, Buffer, BufferLength, Descriptor, CountOfDescriptor);
-
-				SET_16_BIT_U_INT(Buffer - 2, DatasLen);
-				Buffer += DatasLen;
-
-				(*RecordsLength) += (SingleLength + DatasLen);
-
-			}
+			RecordCount += SingleCount;
+			Buffer += SingleLength;
+			BufferLength -= SingleLength;
+			(*RecordsLength) += SingleLength;
 		}
 	} while ( TRUE );
 
+	RWLock_UnRLock(Shard -> Lock);
+
 	return RecordCount;
 }
 
-static Cht_Node *DNSCache_GetCNameFromCache(__in char *Name, __out char *Buffer, __in time_t CurrentTime)
+/* Find the CNAME RRset of `Name', the canonical name is put into `Buffer' */
+static Cht_Node *DNSCache_GetCNameFromCache(__in CacheShard *Shard, __in char *Name, __out char *Buffer, __out int *KeyLength, __in time_t CurrentTime)
 {
 	char Name_Type_Class[256];
-	Cht_Node *Node = NULL;
+	Cht_Node *Node;
 
-	sprintf(Name_Type_Class, "%s\1%d\1%d", Name, DNS_TYPE_CNAME, 1);
+	*KeyLength = sprintf(Name_Type_Class, "%s\1%d\1%d", Name, DNS_TYPE_CNAME, 1);
 
-	do
+	Node = DNSCache_FindFromCache(Shard, Name_Type_Class, *KeyLength + 1, NULL, CurrentTime);
+	if( Node == NULL )
 	{
-		Node = DNSCache_FindFromCache(Name_Type_Class, strlen(Name_Type_Class) + 1, Node, CurrentTime);
-		if( Node == NULL )
-		{
-			return NULL;
-		}
-
-		strcpy(Buffer, MapStart + Node -> Offset + 1 + strlen(Name_Type_Class) + 1);
-		return Node;
+		return NULL;
+	}
 
-	} while( TRUE );
+	/* Skip the key, the number of records and the length of RDATA */
+	DNSGetHostName(NULL, Shard -> Base + Node -> Offset + 1 + *KeyLength + 1 + 2 + 2, Buffer);
 
+	return Node;
 }
 
-static int DNSCache_GetByQuestion(__in const char *Question, __inout char *Buffer, __in int BufferLength, __out int *RecordsLength, __in time_t CurrentTime)
+static int DNSCache_GetByQuestion(__in const char *Question, __inout char *Buffer, __in int BufferLength, __out int *RecordsLength, __inout int32_t *Remaining, __in time_t CurrentTime)
 {
 	int		SingleLength	=	0;
 	char	Name[260];
@@ -660,8 +1477,6 @@ static int DNSCache_GetByQuestion(__in const char *Question, __inout char *Buffe
 
 	Cht_Node *Node;
 
-	uint32_t	NewTTL;
-
 	int		RecordsCount	=	0;
 
 	DNSRecordType	Type;
@@ -678,31 +1493,33 @@ static int DNSCache_GetByQuestion(__in const char *Question, __inout char *Buffe
 	Class = (DNSRecordClass)DNSGetRecordClass(DNSJumpHeader(Question));
 
 
-	RWLock_RdLock(CacheLock);
-
-	/* If the intended type is not DNS_TYPE_CNAME, then first find its cname */
+	/* If the intended type is not DNS_TYPE_CNAME, then first find its cname.
+	 * Each name may be in a different shard. */
 	if(Type != DNS_TYPE_CNAME)
 	{
-		while( (Node = DNSCache_GetCNameFromCache(Name, CName, CurrentTime)) != NULL )
+		int	KeyLength;
+		int	SingleCount = 0;
+
+		while( TRUE )
 		{
+			CacheShard	*Shard = DNSCache_GetShard(Name);
 
-			SingleLength = DNSGenResourceRecord(NULL, 0, "a", DNS_TYPE_CNAME, 1, 0, CName, strlen(CName) + 1, TRUE);
+			RWLock_RdLock(Shard -> Lock);
 
-			if( BufferLength < SingleLength )
+			Node = DNSCache_GetCNameFromCache(Shard, Name, CName, &KeyLength, CurrentTime);
+			if( Node != NULL )
 			{
-				return RecordsCount;
+				SingleLength = DNSCache_GenerateRRset(Shard, Node, KeyLength, DNS_TYPE_CNAME, DNS_CLASS_IN, Buffer, BufferLength, &SingleCount, Remaining, CurrentTime);
 			}
 
-			++RecordsCount;
+			RWLock_UnRLock(Shard -> Lock);
 
-			if( IgnoreTTL == TRUE )
+			if( Node == NULL || SingleCount == 0 )
 			{
-				NewTTL = Node -> TTL;
-			} else {
-				NewTTL = Node -> TTL - (CurrentTime - Node -> TimeAdded);
+				break;
 			}
 
-			DNSGenResourceRecord(Buffer, SingleLength, "a", DNS_TYPE_CNAME, 1, NewTTL, CName, strlen(CName) + 1, TRUE);
+			RecordsCount += SingleCount;
 
 			BufferLength -= SingleLength;
 			Buffer += SingleLength;
@@ -713,9 +1530,7 @@ static int DNSCache_GetByQuestion(__in const char *Question, __inout char *Buffe
 		}
 	}
 
-	RecordsCount += DNSCache_GetRawRecordsFromCache(Name, Type, Class, Buffer, BufferLength, &SingleLength, CurrentTime);
-
-	RWLock_UnRLock(CacheLock);
+	RecordsCount += DNSCache_GetRawRecordsFromCache(Name, Type, Class, Buffer, BufferLength, &SingleLength, Remaining, CurrentTime);
 
 	if( RecordsCount == 0 || SingleLength == 0 )
 	{
@@ -727,10 +1542,114 @@ static int DNSCache_GetByQuestion(__in const char *Question, __inout char *Buffe
 	return RecordsCount;
 }
 
-int DNSCache_FetchFromCache(char *RequestContent, int RequestLength, int BufferLength)
+/* Answer a question with a negative entry, whose SOA record is generated into
+ * the authority section. Returns the number of records generated. */
+static int DNSCache_GetNegativeByQuestion(__in const char *Question, __inout char *Buffer, __in int BufferLength, __out int *RecordsLength, __out BOOL *NameError, __in time_t CurrentTime)
+{
+	char	Name[260];
+	char	Key[300];
+	int		KeyLength;
+	int		Class = DNSGetRecordClass(DNSJumpHeader(Question));
+
+	CacheShard	*Shard;
+	Cht_Node	*Node;
+
+	const char	*CacheItr;
+	int		DataLength, NameLength;
+
+	DNSGetHostName(Question, DNSJumpHeader(Question), Name);
+
+	Shard = DNSCache_GetShard(Name);
+
+	RWLock_RdLock(Shard -> Lock);
+
+	*NameError = TRUE;
+	KeyLength = DNSCache_GenerateNegativeKey(Name, DNS_TYPE_UNKNOWN, Class, Key);
+	Node = DNSCache_FindFromCache(Shard, Key, KeyLength + 1, NULL, CurrentTime);
+	if( Node == NULL )
+	{
+		*NameError = FALSE;
+		KeyLength = DNSCache_GenerateNegativeKey(Name, DNSGetRecordType(DNSJumpHeader(Question)), Class, Key);
+		Node = DNSCache_FindFromCache(Shard, Key, KeyLength + 1, NULL, CurrentTime);
+	}
+
+	/* Negative answers are never served stale */
+	if( Node == NULL || CurrentTime - Node -> TimeAdded >= (time_t)Node -> TTL )
+	{
+		RWLock_UnRLock(Shard -> Lock);
+		return 0;
+	}
+
+	/* Skip CACHE_START, the key and the record count */
+	CacheItr = Shard -> Base + Node -> Offset + 1 + KeyLength + 1 + 2;
+
+	DataLength = GET_16_BIT_U_INT(CacheItr);
+	CacheItr += 2;
+
+	if( BufferLength < DataLength + 10 )
+	{
+		RWLock_UnRLock(Shard -> Lock);
+		return 0;
+	}
+
+	for( NameLength = 0; CacheItr[NameLength] != 0; NameLength += (unsigned char)CacheItr[NameLength] + 1 );
+	++NameLength;
+
+	memcpy(Buffer, CacheItr, NameLength);
+	SET_16_BIT_U_INT(Buffer + NameLength, DNS_TYPE_SOA);
+	SET_16_BIT_U_INT(Buffer + NameLength + 2, Class);
+	SET_32_BIT_U_INT(Buffer + NameLength + 4, Node -> TTL - (CurrentTime - Node -> TimeAdded));
+	SET_16_BIT_U_INT(Buffer + NameLength + 8, DataLength - NameLength);
+	memcpy(Buffer + NameLength + 10, CacheItr + NameLength, DataLength - NameLength);
+
+	*RecordsLength = DataLength + 10;
+
+	RWLock_UnRLock(Shard -> Lock);
+
+	return 1;
+}
+
+/* Whether a question should be refreshed now, at most once each REFRESH_HOLD
+ * seconds */
+static BOOL DNSCache_ShouldRefresh(const char *RequestContent, time_t CurrentTime)
+{
+	const char	*Itr = DNSJumpHeader(RequestContent);
+	const char	*End = DNSJumpOverQuestionRecords(RequestContent);
+	uint32_t	Hash = 2166136261U;
+	time_t		*Issued;
+
+	while( Itr < End )
+	{
+		Hash ^= *(const unsigned char *)Itr;
+		Hash *= 16777619U;
+
+		++Itr;
+	}
+
+	Issued = RefreshIssued + (Hash % REFRESH_TABLE_SIZE);
+
+	if( CurrentTime - *Issued < REFRESH_HOLD )
+	{
+		return FALSE;
+	}
+
+	*Issued = CurrentTime;
+
+	return TRUE;
+}
+
+int DNSCache_FetchFromCache(char *RequestContent, int RequestLength, int BufferLength, BOOL *Refresh)
 {
 	BOOL	EDNSEnabled;
 	int		RecordsCount, RecordsLength;
+	int		CompressedLength;
+	time_t	CurrentTime;
+	BOOL	NameError = FALSE;
+
+	/* The least TTL left in the answers, not positive if stale */
+	int32_t	Remaining = 0x7FFFFFFF;
+
+	*Refresh = FALSE;
 
 	if( Inited == FALSE )
 	{
@@ -751,20 +1670,57 @@ int DNSCache_FetchFromCache(char *RequestContent, int RequestLength, int BufferL
 			return -1;
 	}
 
-	RecordsCount = DNSCache_GetByQuestion(RequestContent, RequestContent + RequestLength, BufferLength - RequestLength, &RecordsLength, time(NULL));
-	if( RecordsCount > 0 )
+	CurrentTime = time(NULL);
+
+	CompressedLength = ResponseCache_Fetch(RequestContent, RequestLength, BufferLength, CurrentTime);
+	if( CompressedLength < 0 )
 	{
-		int UnCompressedLength = RequestLength + RecordsLength;
-		int CompressedLength;
+		RecordsCount = DNSCache_GetByQuestion(RequestContent, RequestContent + RequestLength, BufferLength - RequestLength, &RecordsLength, &Remaining, CurrentTime);
+		if( RecordsCount > 0 )
+		{
+			((DNSHeader *)RequestContent) -> AnswerCount = htons(RecordsCount);
 
-		((DNSHeader *)RequestContent) -> AnswerCount = htons(RecordsCount);
+			CompressedLength = DNSCompress(RequestContent, RequestLength + RecordsLength);
 
-		CompressedLength = DNSCompress(RequestContent, UnCompressedLength);
+			/* Answers about to be refreshed are not kept there, or they would
+			 * be served without us noticing */
+			if( Remaining > PrefetchThreshold )
+			{
+				ResponseCache_Store(RequestContent, CompressedLength, CurrentTime);
+			}
+		} else if( NegativeMaxTTL > 0 &&
+					DNSCache_GetNegativeByQuestion(RequestContent, RequestContent + RequestLength, BufferLength - RequestLength, &RecordsLength, &NameError, CurrentTime) > 0
+					)
+		{
+			COUNTER_INCREASE(&NegativeHits);
+
+			DNSSetNameServerCount(RequestContent, 1);
+
+			CompressedLength = RequestLength + RecordsLength;
+		}
+	}
+
+	if( CompressedLength > 0 )
+	{
+		COUNTER_INCREASE(&Hits);
+
+		if( Remaining <= 0 )
+		{
+			COUNTER_INCREASE(&StaleAnswers);
+			*Refresh = DNSCache_ShouldRefresh(RequestContent, CurrentTime);
+		} else if( Remaining < PrefetchThreshold )
+		{
+			*Refresh = DNSCache_ShouldRefresh(RequestContent, CurrentTime);
+			if( *Refresh == TRUE )
+			{
+				COUNTER_INCREASE(&Prefetches);
+			}
+		}
 
 		((DNSHeader *)RequestContent) -> Flags.Direction = 1;
 		((DNSHeader *)RequestContent) -> Flags.AuthoritativeAnswer = 0;
 		((DNSHeader *)RequestContent) -> Flags.RecursionAvailable = 1;
-		((DNSHeader *)RequestContent) -> Flags.ResponseCode = 0;
+		((DNSHeader *)RequestContent) -> Flags.ResponseCode = NameError == TRUE ? DNS_RCODE_NAME_ERROR : 0;
 		((DNSHeader *)RequestContent) -> Flags.Type = 0;
 
 		if( EDNSEnabled == TRUE )
@@ -774,6 +1730,8 @@ int DNSCache_FetchFromCache(char *RequestContent, int RequestLength, int BufferL
 
 		return CompressedLength;
 	} else {
+		COUNTER_INCREASE(&Misses);
+
 		if( EDNSEnabled == TRUE )
 		{
 			DNSAppendEDNSPseudoRecord(RequestContent, &RequestLength);
@@ -782,23 +1740,138 @@ int DNSCache_FetchFromCache(char *RequestContent, int RequestLength, int BufferL
 	}
 }
 
+void DNSCache_PrintStatistic(FILE *Output)
+{
+	CacheHT_Statistic	Sum;
+	int32_t	Allocated = 0;
+	int32_t	Evictions = 0;
+	long	Lookups = Hits + Misses;
+	int		loop;
+
+	if( Inited == FALSE )
+	{
+		return;
+	}
+
+	memset(&Sum, 0, sizeof(Sum));
+
+	for( loop = 0; loop != NumberOfShards; ++loop )
+	{
+		CacheShard	*Shard = Shards + loop;
+
+		RWLock_RdLock(Shard -> Lock);
+
+		CacheHT_AddStatistic(Shard -> CacheInfo, &Sum);
+		Allocated += *(Shard -> CacheEnd) - SHARD_HEADER_LENGTH;
+		Evictions += Shard -> Evictions;
+
+		RWLock_UnRLock(Shard -> Lock);
+	}
+
+	fprintf(Output, "Cache : Lookups               : %ld\n"
+					"        Hits                  : %ld\n",
+			Lookups,
+			Hits
+			);
+
+	if( Lookups != 0 )
+	{
+		fprintf(Output, "        Hit ratio             : %.1f%%\n", (double)Hits / (double)Lookups * 100);
+	}
+
+	fprintf(Output, "        Prefetches            : %ld\n"
+					"        Stale answers         : %ld\n"
+					"        Negative hits         : %ld\n",
+			Prefetches,
+			StaleAnswers,
+			NegativeHits
+			);
+
+	fprintf(Output, "        Evictions             : %d\n"
+					"        Shards                : %d\n"
+					"        Items                 : %d\n"
+					"        Bytes allocated       : %d\n"
+					"        Bytes in used chunks  : %d (%d of data)\n"
+					"        Bytes in free chunks  : %d\n",
+			Evictions,
+			NumberOfShards,
+			Sum.UsedChunks,
+			Allocated,
+			Sum.UsedBytes,
+			Sum.DataBytes,
+			Sum.FreeBytes
+			);
+
+	if( Sum.UsedBytes != 0 )
+	{
+		fprintf(Output, "        Internal fragmentation: %.1f%%\n", (double)(Sum.UsedBytes - Sum.DataBytes) / (double)Sum.UsedBytes * 100);
+	}
+
+	if( Allocated != 0 )
+	{
+		fprintf(Output, "        External fragmentation: %.1f%%\n", (double)Sum.FreeBytes / (double)Allocated * 100);
+	}
+
+	if( FileCache == TRUE )
+	{
+		CacheLog_Progress	Progress;
+
+		CacheLog_GetProgress(&Progress);
+
+		if( Progress.Loading == TRUE )
+		{
+			fprintf(Output, "        Warming up            : %d of %d bytes, %d entries loaded in %d ms\n",
+					Progress.BytesLoaded,
+					Progress.BytesTotal,
+					Progress.Kept,
+					Progress.Milliseconds
+					);
+		} else {
+			fprintf(Output, "        Warmed up             : %d entries loaded, %d dropped, ready in %d ms\n",
+					Progress.Kept,
+					Progress.Dropped,
+					Progress.Milliseconds
+					);
+		}
+	}
+
+	fprintf(Output, "        Free chunks by size   :");
+
+	for( loop = 0; loop != CACHEHT_SIZE_CLASSES; ++loop )
+	{
+		if( Sum.FreeChunks[loop] != 0 )
+		{
+			fprintf(Output, " %d:%d", (int)CacheHT_ClassSize(loop), Sum.FreeChunks[loop]);
+		}
+	}
+
+	fprintf(Output, "\n");
+}
+
 void DNSCacheClose(ConfigFileInfo *ConfigInfo)
 {
 	if(Inited == TRUE)
 	{
+		int	loop;
+
 		Inited = FALSE;
-		RWLock_WrLock(CacheLock);
 
-		if( ConfigGetBoolean(ConfigInfo, "MemoryCache") == FALSE )
+		for( loop = 0; loop != NumberOfShards; ++loop )
 		{
-			UNMAP_FILE(MapStart, CacheSize);
-			DESTROY_MAPPING(CacheMappingHandle);
-			CLOSE_FILE(CacheFileHandle);
-		} else {
-			SafeFree(MapStart);
+			RWLock_WrLock(Shards[loop].Lock);
+		}
+
+		if( FileCache == TRUE )
+		{
+			CacheLog_Close();
 		}
 
-		RWLock_UnWLock(CacheLock);
-		RWLock_Destroy(CacheLock);
+		DNSCache_FreeRegion();
+
+		for( loop = 0; loop != NumberOfShards; ++loop )
+		{
+			RWLock_UnWLock(Shards[loop].Lock);
+			RWLock_Destroy(Shards[loop].Lock);
+		}
 	}
 }
@@ -1,6 +1,7 @@
 #ifndef _DNS_CACHE_
 #define _DNS_CACHE_
 
+#include <stdio.h>
 #include "dnsrelated.h"
 #include "extendablebuffer.h"
 #include "readconfig.h"
@@ -11,7 +12,20 @@ BOOL Cache_IsInited(void);
 
 int DNSCache_AddItemsToCache(char *DNSBody, time_t CurrentTime);
 
-int DNSCache_FetchFromCache(char *RequestContent, int RequestLength, int BufferLength);
+int DNSCache_FetchFromCache(char *RequestContent, int RequestLength, int BufferLength, BOOL *Refresh);
+/* Description:
+ *  Answer a request from the cache.
+ * Parameters:
+ *  Refresh : Set to TRUE if the answer is stale or about to expire, then the
+ *            question should be queried again to refresh the cache.
+ * Return value:
+ *  The length of the answer, or -1 if not found.
+ */
+
+void DNSCache_PrintStatistic(FILE *Output);
+/* Description:
+ *  Print the usage and fragmentation of the cache to `Output'.
+ */
 
 void DNSCacheClose(ConfigFileInfo *ConfigInfo);
 
@@ -26,6 +26,9 @@
 
 #define DNSGetAdditionalCount(dns_body)		GET_16_BIT_U_INT((char *)(dns_body) + 10)
 
+/* The response code telling that the domain name does not exist */
+#define DNS_RCODE_NAME_ERROR	3
+
 #define DNSJumpHeader(dns_body)				((char *)(dns_body) + DNS_HEADER_LENGTH)
 
 /* Handle question record */
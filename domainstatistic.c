@@ -7,6 +7,8 @@
 #include "domainstatistic.h"
 #include "utils.h"
 #include "querydnsbase.h"
+#include "dnscache.h"
+#include "request_response.h"
 
 typedef struct _DomainInfo{
 	int		Count;
@@ -307,6 +309,14 @@ int DomainStatistic_Hold(void)
 			fprintf(MainFile, "Cache utilization : %.1f%%\n", ((double)Sum.Cache / (double)(Sum.Udp + Sum.Tcp + Sum.Cache)) * 100);
 		}
 
+		fprintf(MainFile, "\n");
+
+		PrintServerStatistic(MainFile);
+
+		fprintf(MainFile, "\n");
+
+		DNSCache_PrintStatistic(MainFile);
+
 		fprintf(MainFile, "\n-----------------------------------------\n");
 
 		fflush(MainFile);
@@ -0,0 +1,424 @@
+#include <string.h>
+#include "domaintrie.h"
+#include "utils.h"
+
+#define	INITIAL_CAPACITY	64
+
+/* Find the label ending just before `End', hashing it on the way.
+ * Returns where the label starts. */
+static const char *DomainTrie_PreviousLabel(const char *Name, const char *End, uint32_t *Hash)
+{
+	uint32_t	h = 2166136261U;
+
+	while( End != Name && *(End - 1) != '.' )
+	{
+		--End;
+		h = (h ^ (unsigned char)*End) * 16777619U;
+	}
+
+	*Hash = h;
+
+	return End;
+}
+
+#define	MIX(Hash, Parent)	((Hash) ^ ((uint32_t)(Parent) * 2654435761U))
+
+/* Returns the slot holding the edge, or the empty slot where it would be */
+static DomainTrie_Edge *DomainTrie_Slot(DomainTrie_Edge *Edges,
+										int32_t Capacity,
+										const char *Labels,
+										int32_t Parent,
+										uint32_t Hash,
+										const char *Label,
+										int32_t Length
+										)
+{
+	int32_t	Mask = Capacity - 1;
+	int32_t	i = Hash & Mask;
+
+	while( Edges[i].Parent >= 0 )
+	{
+		if( Edges[i].Hash == Hash &&
+			Edges[i].Parent == Parent &&
+			Edges[i].Length == Length &&
+			memcmp(Labels + Edges[i].Label, Label, Length) == 0
+			)
+		{
+			break;
+		}
+
+		i = (i + 1) & Mask;
+	}
+
+	return Edges + i;
+}
+
+static int DomainTrie_Grow(DomainTrie *t)
+{
+	int32_t			NewCapacity = t -> Capacity * 2;
+	DomainTrie_Edge	*New;
+	int				loop;
+
+	New = SafeMalloc(sizeof(DomainTrie_Edge) * NewCapacity);
+	if( New == NULL )
+	{
+		return -1;
+	}
+
+	for( loop = 0; loop != NewCapacity; ++loop )
+	{
+		New[loop].Parent = -1;
+	}
+
+	for( loop = 0; loop != t -> Capacity; ++loop )
+	{
+		DomainTrie_Edge	*e = t -> Edges + loop;
+		int32_t			i;
+
+		if( e -> Parent < 0 )
+		{
+			continue;
+		}
+
+		i = e -> Hash & (NewCapacity - 1);
+		while( New[i].Parent >= 0 )
+		{
+			i = (i + 1) & (NewCapacity - 1);
+		}
+
+		New[i] = *e;
+	}
+
+	SafeFree(t -> Edges);
+	t -> Edges = New;
+	t -> Capacity = NewCapacity;
+
+	return 0;
+}
+
+int DomainTrie_Init(DomainTrie *t)
+{
+	char	Root = 0;
+	int		loop;
+
+	if( Array_Init(&(t -> Nodes), sizeof(char), INITIAL_CAPACITY, FALSE, NULL) != 0 )
+	{
+		return -1;
+	}
+
+	Array_PushBack(&(t -> Nodes), &Root, NULL);
+
+	t -> Edges = SafeMalloc(sizeof(DomainTrie_Edge) * INITIAL_CAPACITY);
+	if( t -> Edges == NULL )
+	{
+		Array_Free(&(t -> Nodes));
+		return -2;
+	}
+
+	for( loop = 0; loop != INITIAL_CAPACITY; ++loop )
+	{
+		t -> Edges[loop].Parent = -1;
+	}
+
+	t -> Capacity = INITIAL_CAPACITY;
+	t -> Used = 0;
+
+	if( ExtendableBuffer_Init(&(t -> Labels), 0, -1) != 0 )
+	{
+		SafeFree(t -> Edges);
+		Array_Free(&(t -> Nodes));
+		return -3;
+	}
+
+	if( StringList_Init(&(t -> WildCardDomains), NULL, ',') != 0 )
+	{
+		ExtendableBuffer_Free(&(t -> Labels));
+		SafeFree(t -> Edges);
+		Array_Free(&(t -> Nodes));
+		return -4;
+	}
+
+	if( StringChunk_Init(&(t -> WildCards), &(t -> WildCardDomains)) != 0 )
+	{
+		StringList_Free(&(t -> WildCardDomains));
+		ExtendableBuffer_Free(&(t -> Labels));
+		SafeFree(t -> Edges);
+		Array_Free(&(t -> Nodes));
+		return -5;
+	}
+
+	t -> Count = 0;
+	t -> Image.Start = NULL;
+
+	return 0;
+}
+
+int DomainTrie_Add(DomainTrie *t, const char *Domain)
+{
+	char		Flags = DOMAINTRIE_SELF | DOMAINTRIE_SUB;
+	int32_t		Node = 0;
+	const char	*End;
+	char		*NodeFlags;
+
+	if( ContainWildCard(Domain) )
+	{
+		if( StringChunk_Add(&(t -> WildCards), Domain, NULL, 0) != 0 )
+		{
+			return -4;
+		}
+
+		++(t -> Count);
+		return 0;
+	}
+
+	if( *Domain == '.' )
+	{
+		++Domain;
+		Flags = DOMAINTRIE_SUB;
+	}
+
+	if( *Domain == '\0' )
+	{
+		return 0;
+	}
+
+	End = Domain + strlen(Domain);
+
+	while( TRUE )
+	{
+		uint32_t		Hash;
+		const char		*Label = DomainTrie_PreviousLabel(Domain, End, &Hash);
+		int32_t			Length = End - Label;
+		DomainTrie_Edge	*e;
+
+		Hash = MIX(Hash, Node);
+
+		e = DomainTrie_Slot(t -> Edges,
+							t -> Capacity,
+							ExtendableBuffer_GetData(&(t -> Labels)),
+							Node,
+							Hash,
+							Label,
+							Length
+							);
+
+		if( e -> Parent < 0 )
+		{
+			char	NoFlags = 0;
+			int32_t	Child;
+			int32_t	Offset;
+
+			if( (t -> Used + 1) * 4 > t -> Capacity * 3 )
+			{
+				if( DomainTrie_Grow(t) != 0 )
+				{
+					return -1;
+				}
+
+				e = DomainTrie_Slot(t -> Edges,
+									t -> Capacity,
+									ExtendableBuffer_GetData(&(t -> Labels)),
+									Node,
+									Hash,
+									Label,
+									Length
+									);
+			}
+
+			Offset = ExtendableBuffer_Add(&(t -> Labels), Label, Length);
+			if( Offset < 0 )
+			{
+				return -2;
+			}
+
+			Child = Array_PushBack(&(t -> Nodes), &NoFlags, NULL);
+			if( Child < 0 )
+			{
+				return -3;
+			}
+
+			e -> Parent = Node;
+			e -> Child = Child;
+			e -> Hash = Hash;
+			e -> Label = Offset;
+			e -> Length = Length;
+
+			++(t -> Used);
+		}
+
+		Node = e -> Child;
+
+		if( Label == Domain )
+		{
+			break;
+		}
+
+		End = Label - 1;
+	}
+
+	NodeFlags = (char *)Array_GetBySubscript(&(t -> Nodes), Node);
+	*NodeFlags |= Flags;
+
+	++(t -> Count);
+
+	return 0;
+}
+
+BOOL DomainTrie_Match(DomainTrie *t, const char *Name)
+{
+	int32_t		Node = 0;
+	const char	*End = Name + strlen(Name);
+	const char	*Labels = ExtendableBuffer_GetData(&(t -> Labels));
+
+	if( t -> Used > 0 )
+	{
+		while( TRUE )
+		{
+			uint32_t		Hash;
+			const char		*Label = DomainTrie_PreviousLabel(Name, End, &Hash);
+			DomainTrie_Edge	*e;
+			char			Flags;
+
+			Hash = MIX(Hash, Node);
+
+			e = DomainTrie_Slot(t -> Edges,
+								t -> Capacity,
+								Labels,
+								Node,
+								Hash,
+								Label,
+								End - Label
+								);
+			if( e -> Parent < 0 )
+			{
+				break;
+			}
+
+			Node = e -> Child;
+			Flags = *(char *)Array_GetBySubscript(&(t -> Nodes), Node);
+
+			if( Label == Name )
+			{
+				if( Flags & DOMAINTRIE_SELF )
+				{
+					return TRUE;
+				}
+
+				break;
+			}
+
+			if( Flags & DOMAINTRIE_SUB )
+			{
+				return TRUE;
+			}
+
+			End = Label - 1;
+		}
+	}
+
+	return StringChunk_Match_OnlyWildCard(&(t -> WildCards), Name, NULL);
+}
+
+int DomainTrie_Save(DomainTrie *t, const char *File, const char *Source, uint32_t Kind)
+{
+	FILE	*fp = ListImage_Create(File, Source, Kind);
+	int32_t	Numbers[2];
+	BOOL	Completed;
+
+	if( fp == NULL )
+	{
+		return -1;
+	}
+
+	Numbers[0] = t -> Used;
+	Numbers[1] = t -> Count;
+
+	Completed = ListImage_PutArray(fp, &(t -> Nodes)) == 0 &&
+				ListImage_Put(fp, t -> Edges, t -> Capacity * sizeof(DomainTrie_Edge)) == 0 &&
+				ListImage_Put(fp, Numbers, sizeof(Numbers)) == 0 &&
+				ListImage_PutBuffer(fp, &(t -> Labels)) == 0 &&
+				ListImage_PutBuffer(fp, &(t -> WildCardDomains)) == 0 &&
+				StringChunk_Save(&(t -> WildCards), fp) == 0;
+
+	return ListImage_Close(fp, File, Completed);
+}
+
+int DomainTrie_Map(DomainTrie *t, const char *File, const char *Source, uint32_t Kind)
+{
+	const int32_t	*Numbers;
+	uint32_t		Length;
+
+	if( ListImage_Map(&(t -> Image), File, Source, Kind) != 0 )
+	{
+		return -1;
+	}
+
+	if( ListImage_TakeArray(&(t -> Image), &(t -> Nodes), sizeof(char)) != 0 ||
+		Array_GetUsed(&(t -> Nodes)) == 0
+		)
+	{
+		ListImage_Unmap(&(t -> Image));
+		return -2;
+	}
+
+	t -> Edges = (DomainTrie_Edge *)ListImage_Take(&(t -> Image), &Length);
+	if( t -> Edges == NULL ||
+		Length == 0 ||
+		Length % sizeof(DomainTrie_Edge) != 0
+		)
+	{
+		ListImage_Unmap(&(t -> Image));
+		return -3;
+	}
+
+	t -> Capacity = Length / sizeof(DomainTrie_Edge);
+
+	Numbers = (const int32_t *)ListImage_Take(&(t -> Image), &Length);
+	if( Numbers == NULL || Length != 2 * sizeof(int32_t) )
+	{
+		ListImage_Unmap(&(t -> Image));
+		return -4;
+	}
+
+	t -> Used = Numbers[0];
+	t -> Count = Numbers[1];
+
+	/* Not a power of 2 long, or full, the table would be probed past its end
+	 * or forever */
+	if( (t -> Capacity & (t -> Capacity - 1)) != 0 ||
+		t -> Used < 0 ||
+		t -> Used > t -> Capacity / 4 * 3
+		)
+	{
+		ListImage_Unmap(&(t -> Image));
+		return -4;
+	}
+
+	if( ListImage_TakeBuffer(&(t -> Image), &(t -> Labels)) != 0 ||
+		ListImage_TakeBuffer(&(t -> Image), &(t -> WildCardDomains)) != 0 ||
+		StringChunk_Map(&(t -> WildCards), &(t -> Image), &(t -> WildCardDomains)) != 0
+		)
+	{
+		ListImage_Unmap(&(t -> Image));
+		return -5;
+	}
+
+	return 0;
+}
+
+void DomainTrie_Free(DomainTrie *t)
+{
+	/* All in the image */
+	if( ListImage_IsMapped(&(t -> Image)) )
+	{
+		ListImage_Unmap(&(t -> Image));
+		return;
+	}
+
+	Array_Free(&(t -> Nodes));
+	SafeFree(t -> Edges);
+	t -> Edges = NULL;
+	ExtendableBuffer_Free(&(t -> Labels));
+	StringChunk_Free(&(t -> WildCards), FALSE);
+	StringList_Free(&(t -> WildCardDomains));
+}
@@ -0,0 +1,99 @@
+#ifndef DOMAINTRIE_H_INCLUDED
+#define DOMAINTRIE_H_INCLUDED
+
+#include "array.h"
+#include "extendablebuffer.h"
+#include "stringchunk.h"
+#include "listimage.h"
+#include "common.h"
+
+/* A DomainTrie holds a list of domains, and tells whether a name is one of
+ * them or under one of them. The labels of the domains are stored reversed,
+ * `www.example.com' as com -> example -> www, so a name is matched in one
+ * pass from its last label to its first, hashing each label once.
+ *
+ * The edges from a node to its children are kept together in one
+ * open-addressing table, keyed by the parent node and the label.
+ *
+ * Domains with wildcards can not be put in the trie, they are kept in a
+ * StringChunk and matched against the whole name.
+ *
+ * A DomainTrie can be saved to a ListImage, and mapped from it read-only.
+ */
+
+/* A name equal to the domain matches */
+#define	DOMAINTRIE_SELF	0x01
+/* A name under the domain matches */
+#define	DOMAINTRIE_SUB	0x02
+
+typedef struct _DomainTrie_Edge {
+	int32_t		Parent; /* -1 if the slot is empty */
+	int32_t		Child;
+	uint32_t	Hash; /* Of the label, with the parent mixed in */
+
+	/* The label, in `Labels' */
+	int32_t		Label;
+	int32_t		Length;
+} DomainTrie_Edge;
+
+typedef struct _DomainTrie {
+	/* Flags of every node, see above, the root is node 0 */
+	Array				Nodes;
+
+	DomainTrie_Edge		*Edges;
+	int32_t				Capacity; /* A power of 2 */
+	int32_t				Used;
+
+	/* Text of all labels */
+	ExtendableBuffer	Labels;
+
+	StringList			WildCardDomains;
+	StringChunk			WildCards;
+
+	/* How many domains have been added */
+	int32_t				Count;
+
+	/* Where all above are, if mapped */
+	ListImage			Image;
+} DomainTrie;
+
+int DomainTrie_Init(DomainTrie *t);
+/* Description:
+ *  Initialize an empty DomainTrie.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+int DomainTrie_Add(DomainTrie *t, const char *Domain);
+/* Description:
+ *  Add a domain. `example.com' matches itself and every name under it,
+ *  `.example.com' only the names under it.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+BOOL DomainTrie_Match(DomainTrie *t, const char *Name);
+/* Description:
+ *  Check whether a name is one of the domains added or under one of them,
+ *  or matches one with wildcards.
+ */
+
+int DomainTrie_Save(DomainTrie *t, const char *File, const char *Source, uint32_t Kind);
+/* Description:
+ *  Save a DomainTrie compiled from `Source' to the image `File'.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+int DomainTrie_Map(DomainTrie *t, const char *File, const char *Source, uint32_t Kind);
+/* Description:
+ *  Map a DomainTrie from the image `File', if it is up to date with
+ *  `Source', instead of initializing it. Nothing can be added to a
+ *  DomainTrie mapped.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+void DomainTrie_Free(DomainTrie *t);
+
+#endif // DOMAINTRIE_H_INCLUDED
@@ -3,7 +3,7 @@
 #include "excludedlist.h"
 #include "querydnsbase.h"
 #include "utils.h"
-#include "stringchunk.h"
+#include "domaintrie.h"
 #include "stringlist.h"
 #include "bst.h"
 #include "readline.h"
@@ -11,10 +11,12 @@
 
 static Bst			DisabledTypes;
 
-static StringChunk	*StaticDisabled = NULL;
-static StringChunk	*DynamicDisabled = NULL;
-static StringChunk	*StaticExcluded = NULL;
-static StringChunk	*DynamicExcluded = NULL;
+static DomainTrie	*StaticDisabled = NULL;
+static DomainTrie	*DynamicDisabled = NULL;
+static DomainTrie	*StaticExcluded = NULL;
+static DomainTrie	*DynamicExcluded = NULL;
+
+static BOOL			CompileLists;
 
 BOOL IsDisabledType(int Type)
 {
@@ -26,42 +28,23 @@ BOOL IsDisabledType(int Type)
 	}
 }
 
-BOOL MatchDomain(StringChunk *List, const char *Domain, int *HashValue)
+BOOL MatchDomain(DomainTrie *List, const char *Domain)
 {
 	if( List == NULL )
 	{
 		return FALSE;
 	}
 
-	if( StringChunk_Match(List, Domain, HashValue, NULL) == TRUE )
-	{
-		return TRUE;
-	}
-
-	Domain = strchr(Domain + 1, '.');
-
-	while( Domain != NULL )
-	{
-		if( StringChunk_Match_NoWildCard(List, Domain, NULL, NULL) == TRUE ||
-			StringChunk_Match_NoWildCard(List, Domain + 1, NULL, NULL) == TRUE
-			)
-		{
-			return TRUE;
-		}
-
-		Domain = strchr(Domain + 1, '.');
-	}
-
-	return FALSE;
+	return DomainTrie_Match(List, Domain);
 }
 
 BOOL IsDisabledDomain(const char *Domain, int *HashValue){
-	return MatchDomain(StaticDisabled, Domain, HashValue) || MatchDomain(DynamicDisabled, Domain, HashValue);
+	return MatchDomain(StaticDisabled, Domain) || MatchDomain(DynamicDisabled, Domain);
 }
 
 BOOL IsExcludedDomain(const char *Domain, int *HashValue)
 {
-	return MatchDomain(StaticExcluded, Domain, HashValue) || MatchDomain(DynamicExcluded, Domain, HashValue);
+	return MatchDomain(StaticExcluded, Domain) || MatchDomain(DynamicExcluded, Domain);
 }
 
 static int TypeCompare(const int *_1, const int *_2)
@@ -98,7 +81,7 @@ static int LoadDisableType(ConfigFileInfo *ConfigInfo)
 	return 0;
 }
 
-static int LoadDomainsFromList(StringChunk *List, const StringList *Domains)
+static int LoadDomainsFromList(DomainTrie *List, const StringList *Domains)
 {
 	const char *Str;
 
@@ -115,7 +98,7 @@ static int LoadDomainsFromList(StringChunk *List, const StringList *Domains)
 			Str++;
 		}
 
-		if( StringChunk_Add(List, Str, NULL, 0) != 0 )
+		if( DomainTrie_Add(List, Str) != 0 )
 		{
 			return -2;
 		}
@@ -125,7 +108,7 @@ static int LoadDomainsFromList(StringChunk *List, const StringList *Domains)
 	return 0;
 }
 
-static int LoadDomainsFromFile(StringChunk *List, const char *File)
+static int LoadDomainsFromFile(DomainTrie *List, const char *File)
 {
 	FILE *fp;
 	char	Domain[512];
@@ -142,7 +125,7 @@ static int LoadDomainsFromFile(StringChunk *List, const char *File)
 	{
 		if( Status == READ_DONE )
 		{
-			StringChunk_Add(List, Domain, NULL, 0);
+			DomainTrie_Add(List, Domain);
 		} else {
 			ReadLine_GoToNextLine(fp);
 		}
@@ -150,18 +133,20 @@ static int LoadDomainsFromFile(StringChunk *List, const char *File)
 		Status = ReadLine(fp, Domain, sizeof(Domain));
 	}
 
+	fclose(fp);
+
 	return 0;
 }
 
-static int InitContainer(StringChunk **List)
+static int InitContainer(DomainTrie **List)
 {
-	*List = malloc(sizeof(StringChunk));
+	*List = malloc(sizeof(DomainTrie));
 	if( *List == NULL )
 	{
 		return -1;
 	}
 
-	if( StringChunk_Init(*List, NULL) < 0 )
+	if( DomainTrie_Init(*List) != 0 )
 	{
 		return -1;
 	}
@@ -169,6 +154,91 @@ static int InitContainer(StringChunk **List)
 	return 0;
 }
 
+static int MapContainer(DomainTrie **List, const char *Image, const char *File)
+{
+	*List = malloc(sizeof(DomainTrie));
+	if( *List == NULL )
+	{
+		return -1;
+	}
+
+	if( DomainTrie_Map(*List, Image, File, LISTIMAGE_DOMAINS) != 0 )
+	{
+		free(*List);
+		*List = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Map the image of `File' if it is up to date, otherwise load `File', and
+ * compile it if `CompileLists' is set. */
+static int LoadContainerFromFile(DomainTrie **List, const char *File)
+{
+	char		Image[1024];
+	DomainTrie	*Mapped;
+
+	ListImage_GetPath(Image, sizeof(Image), File);
+
+	if( MapContainer(List, Image, File) == 0 )
+	{
+		INFO("Domain list image %s mapped.\n", Image);
+		return 0;
+	}
+
+	if( InitContainer(List) != 0 )
+	{
+		return -1;
+	}
+
+	LoadDomainsFromFile(*List, File);
+
+	if( CompileLists == TRUE )
+	{
+		if( DomainTrie_Save(*List, Image, File, LISTIMAGE_DOMAINS) == 0 &&
+			MapContainer(&Mapped, Image, File) == 0
+			)
+		{
+			INFO("Domain list image %s compiled.\n", Image);
+
+			DomainTrie_Free(*List);
+			free(*List);
+			*List = Mapped;
+		} else {
+			ERRORMSG("Compiling domain list image %s failed.\n", Image);
+		}
+	}
+
+	return 0;
+}
+
+int ExcludedList_Compile(const char *File)
+{
+	char		Image[1024];
+	DomainTrie	List;
+	int			Ret;
+
+	if( DomainTrie_Init(&List) != 0 )
+	{
+		return -1;
+	}
+
+	if( LoadDomainsFromFile(&List, File) != 0 )
+	{
+		DomainTrie_Free(&List);
+		return -2;
+	}
+
+	ListImage_GetPath(Image, sizeof(Image), File);
+
+	Ret = DomainTrie_Save(&List, Image, File, LISTIMAGE_DOMAINS);
+
+	DomainTrie_Free(&List);
+
+	return Ret;
+}
+
 int ExcludedList_Init(ConfigFileInfo *ConfigInfo)
 {
 	StringList *DisabledDomain;
@@ -176,6 +246,8 @@ int ExcludedList_Init(ConfigFileInfo *ConfigInfo)
 	const char *DisabledFile;
 	const char *ExcludedFile;
 
+	CompileLists = ConfigGetBoolean(ConfigInfo, "CompileLists");
+
 	DisabledDomain = ConfigGetStringList(ConfigInfo, "DisabledDomain");
 	if( DisabledDomain != NULL && InitContainer(&StaticDisabled) == 0 )
 	{
@@ -191,15 +263,15 @@ int ExcludedList_Init(ConfigFileInfo *ConfigInfo)
 	}
 
 	DisabledFile = ConfigGetRawString(ConfigInfo, "DisabledList");
-	if( DisabledFile != NULL && InitContainer(&DynamicDisabled) == 0 )
+	if( DisabledFile != NULL )
 	{
-		LoadDomainsFromFile(DynamicDisabled, DisabledFile);
+		LoadContainerFromFile(&DynamicDisabled, DisabledFile);
 	}
 
 	ExcludedFile = ConfigGetRawString(ConfigInfo, "ExcludedList");
-	if( ExcludedFile != NULL && InitContainer(&DynamicExcluded) == 0 )
+	if( ExcludedFile != NULL )
 	{
-		LoadDomainsFromFile(DynamicExcluded, ExcludedFile);
+		LoadContainerFromFile(&DynamicExcluded, ExcludedFile);
 	}
 
 	LoadDisableType(ConfigInfo);
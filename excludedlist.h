@@ -2,14 +2,16 @@
 #define EXCLUDEDLIST_H_INCLUDED
 
 #include "stringlist.h"
-#include "stringchunk.h"
+#include "domaintrie.h"
 #include "readconfig.h"
 
 int ExcludedList_Init(ConfigFileInfo *ConfigInfo);
 
+int ExcludedList_Compile(const char *File);
+
 BOOL IsDisabledType(int Type);
 
-BOOL MatchDomain(StringChunk *List, const char *Domain, int *HashValue);
+BOOL MatchDomain(DomainTrie *List, const char *Domain);
 
 BOOL IsDisabledDomain(const char *Domain, int *HashValue);
 
@@ -10,8 +10,10 @@
 static const char	*GfwList = NULL;
 static const char	*File = NULL;
 
+static BOOL			CompileLists;
+
 typedef struct _GFWListContainer{
-	StringChunk	GFWList;
+	DomainTrie	GFWList;
 } GFWListContainer;
 
 static volatile GFWListContainer *MainContainer = NULL;
@@ -72,9 +74,9 @@ static BOOL ParseGfwListItem(char *Item, GFWListContainer *Container)
 		return FALSE;
 	}
 
-	if( MatchDomain(&(Container -> GFWList), Item, NULL) == FALSE )
+	if( MatchDomain(&(Container -> GFWList), Item) == FALSE )
 	{
-		StringChunk_Add(&(Container -> GFWList), Item, NULL, 0);
+		DomainTrie_Add(&(Container -> GFWList), Item);
 		return TRUE;
 	} else {
 		return FALSE;
@@ -82,34 +84,22 @@ static BOOL ParseGfwListItem(char *Item, GFWListContainer *Container)
 
 }
 
-static int LoadGfwListFile(const char *File, BOOL NeedBase64Decode)
+static int ParseGfwListFile(const char *File, GFWListContainer *Container)
 {
 	FILE	*fp;
 	ReadLineStatus Status;
 	char	Buffer[256];
 	int		Count = 0;
 
-	GFWListContainer *Container;
-
-	if( (NeedBase64Decode == TRUE) && (Base64Decode(File) != 0) )
-	{
-		return -1;
-	}
-
 	fp = fopen(File, "r");
 	if( fp == NULL )
 	{
 		return -2;
 	}
 
-	Container = SafeMalloc(sizeof(GFWListContainer));
-	if( Container == NULL )
-	{
-		return -3;
-	}
-
-	if( StringChunk_Init(&(Container -> GFWList), NULL) != 0 )
+	if( DomainTrie_Init(&(Container -> GFWList)) != 0 )
 	{
+		fclose(fp);
 		return -4;
 	}
 
@@ -143,17 +133,92 @@ DONE:
 
 	if( Count == 0 )
 	{
-		StringChunk_Free((StringChunk *)&(Container -> GFWList), TRUE);
-		SafeFree(Container);
+		DomainTrie_Free(&(Container -> GFWList));
 		return -4;
 	}
 
+	return Count;
+}
+
+static GFWListContainer *MapGfwListImage(const char *Image, const char *File)
+{
+	GFWListContainer *Container = SafeMalloc(sizeof(GFWListContainer));
+
+	if( Container == NULL )
+	{
+		return NULL;
+	}
+
+	if( DomainTrie_Map(&(Container -> GFWList), Image, File, LISTIMAGE_GFWLIST) != 0 )
+	{
+		SafeFree(Container);
+		return NULL;
+	}
+
+	return Container;
+}
+
+static int LoadGfwListFile(const char *File, BOOL NeedBase64Decode)
+{
+	char	Image[1024];
+	int		Count;
+
+	GFWListContainer *Container;
+
+	if( (NeedBase64Decode == TRUE) && (Base64Decode(File) != 0) )
+	{
+		return -1;
+	}
+
+	ListImage_GetPath(Image, sizeof(Image), File);
+
+	Container = MapGfwListImage(Image, File);
+	if( Container != NULL )
+	{
+		INFO("GFW List image %s mapped.\n", Image);
+		Count = Container -> GFWList.Count;
+	} else {
+		Container = SafeMalloc(sizeof(GFWListContainer));
+		if( Container == NULL )
+		{
+			return -3;
+		}
+
+		Count = ParseGfwListFile(File, Container);
+		if( Count < 0 )
+		{
+			SafeFree(Container);
+			return Count;
+		}
+
+		if( CompileLists == TRUE )
+		{
+			GFWListContainer *Mapped = NULL;
+
+			if( DomainTrie_Save(&(Container -> GFWList), Image, File, LISTIMAGE_GFWLIST) == 0 )
+			{
+				Mapped = MapGfwListImage(Image, File);
+			}
+
+			if( Mapped != NULL )
+			{
+				INFO("GFW List image %s compiled.\n", Image);
+
+				DomainTrie_Free(&(Container -> GFWList));
+				SafeFree(Container);
+				Container = Mapped;
+			} else {
+				ERRORMSG("Compiling GFW List image %s failed.\n", Image);
+			}
+		}
+	}
+
 	/* Evict old container */
 	RWLock_WrLock(GFWListLock);
 
 	if( MainContainer != NULL )
 	{
-		StringChunk_Free((StringChunk *)&(MainContainer -> GFWList), TRUE);
+		DomainTrie_Free((DomainTrie *)&(MainContainer -> GFWList));
 		SafeFree((void *)MainContainer);
 	}
 
@@ -243,6 +308,7 @@ int GfwList_Init(ConfigFileInfo *ConfigInfo, BOOL StartPeriodWork)
 	}
 
 	File	=	ConfigGetRawString(ConfigInfo, "GfwListDownloadPath");
+	CompileLists	=	ConfigGetBoolean(ConfigInfo, "CompileLists");
 
 	RWLock_Init(GFWListLock);
 
@@ -277,6 +343,27 @@ int GfwList_Init(ConfigFileInfo *ConfigInfo, BOOL StartPeriodWork)
 	return 0;
 }
 
+int GfwList_Compile(const char *File)
+{
+	char	Image[1024];
+	int		Ret;
+
+	GFWListContainer Container;
+
+	if( ParseGfwListFile(File, &Container) < 0 )
+	{
+		return -1;
+	}
+
+	ListImage_GetPath(Image, sizeof(Image), File);
+
+	Ret = DomainTrie_Save(&(Container.GFWList), Image, File, LISTIMAGE_GFWLIST);
+
+	DomainTrie_Free(&(Container.GFWList));
+
+	return Ret;
+}
+
 BOOL GfwList_Match(const char *Domain, int *HashValue)
 {
 	BOOL Result;
@@ -288,7 +375,7 @@ BOOL GfwList_Match(const char *Domain, int *HashValue)
 
 	RWLock_RdLock(GFWListLock);
 
-	Result = MatchDomain(&(MainContainer -> GFWList), Domain, HashValue);
+	Result = MatchDomain((DomainTrie *)&(MainContainer -> GFWList), Domain);
 
 	RWLock_UnRLock(GFWListLock);
 
@@ -9,5 +9,7 @@ int GfwList_PeriodicWork(ConfigFileInfo *ConfigInfo);
 int GfwList_Init(ConfigFileInfo *ConfigInfo, BOOL StartPeriodWork);
 
 BOOL GfwList_Match(const char *Domain, int *HashValue);
+
+int GfwList_Compile(const char *File);
 
 #endif // GFWLIST_H_INCLUDED
@@ -10,6 +10,7 @@
 #include "readline.h"
 #include "internalsocket.h"
 #include "rwlock.h"
+#include "reactor.h"
 
 static BOOL			StaticHostsInited = FALSE;
 
@@ -18,6 +19,8 @@ static int			HostsRetryInterval;
 
 static const char 	*File = NULL;
 
+static BOOL			CompileLists;
+
 static ThreadHandle	GetHosts_Thread;
 static RWLock		HostsLock;
 
@@ -25,6 +28,13 @@ static volatile HostsContainer	*MainDynamicContainer = NULL;
 
 static void DynamicHosts_FreeHostsContainer(HostsContainer *Container)
 {
+	/* All in the image */
+	if( ListImage_IsMapped(&(Container -> Image)) )
+	{
+		ListImage_Unmap(&(Container -> Image));
+		return;
+	}
+
 	StringChunk_Free(&(Container -> Ipv4Hosts), FALSE);
 	StringChunk_Free(&(Container -> Ipv6Hosts), FALSE);
 	StringChunk_Free(&(Container -> CNameHosts), FALSE);
@@ -33,34 +43,33 @@ static void DynamicHosts_FreeHostsContainer(HostsContainer *Container)
 	ExtendableBuffer_Free(&(Container -> IPs));
 }
 
-static int DynamicHosts_Load(void)
+static HostsContainer *DynamicHosts_Parse(const char *File)
 {
 	FILE			*fp;
 	char			Buffer[320];
 	ReadLineStatus	Status;
 
-	int		IPv4Count = 0, IPv6Count = 0, CNameCount = 0, ExcludedCount = 0;
-
-	HostsContainer *TempContainer;
+	HostsContainer *Container;
 
 	fp = fopen(File, "r");
 	if( fp == NULL )
 	{
-		return -1;
+		return NULL;
 	}
 
-	TempContainer = (HostsContainer *)SafeMalloc(sizeof(HostsContainer));
-	if( TempContainer == NULL )
+	Container = (HostsContainer *)SafeMalloc(sizeof(HostsContainer));
+	if( Container == NULL )
 	{
-		return -1;
+		fclose(fp);
+		return NULL;
 	}
 
-	if( Hosts_InitContainer(TempContainer) != 0 )
+	if( Hosts_InitContainer(Container) != 0 )
 	{
 		fclose(fp);
 
-		SafeFree(TempContainer);
-		return -1;
+		SafeFree(Container);
+		return NULL;
 	}
 
 	while( TRUE )
@@ -69,32 +78,78 @@ static int DynamicHosts_Load(void)
 		if( Status == READ_FAILED_OR_END )
 			break;
 
-		switch( Hosts_LoadFromMetaLine(TempContainer, Buffer) )
+		Hosts_LoadFromMetaLine(Container, Buffer);
+
+		if( Status == READ_TRUNCATED )
 		{
-			case HOSTS_TYPE_AAAA:
-				++IPv6Count;
-				break;
+			ERRORMSG("Hosts is too long : %s\n", Buffer);
+			ReadLine_GoToNextLine(fp);
+		}
+	}
 
-			case HOSTS_TYPE_A:
-				++IPv4Count;
-				break;
+	fclose(fp);
 
-			case HOSTS_TYPE_CNAME:
-				++CNameCount;
-				break;
+	return Container;
+}
 
-			case HOSTS_TYPE_EXCLUEDE:
-				++ExcludedCount;
-				break;
+static HostsContainer *DynamicHosts_Map(const char *Image, const char *File)
+{
+	HostsContainer *Container;
 
-			default:
-				break;
+	Container = (HostsContainer *)SafeMalloc(sizeof(HostsContainer));
+	if( Container == NULL )
+	{
+		return NULL;
+	}
+
+	if( Hosts_MapContainer(Container, Image, File) != 0 )
+	{
+		SafeFree(Container);
+		return NULL;
+	}
+
+	return Container;
+}
+
+static int DynamicHosts_Load(void)
+{
+	char			Image[1024];
+
+	HostsContainer *TempContainer;
+
+	ListImage_GetPath(Image, sizeof(Image), File);
+
+	TempContainer = DynamicHosts_Map(Image, File);
+	if( TempContainer != NULL )
+	{
+		INFO("Hosts image %s mapped.\n", Image);
+	} else {
+		TempContainer = DynamicHosts_Parse(File);
+		if( TempContainer == NULL )
+		{
+			return -1;
 		}
 
-		if( Status == READ_TRUNCATED )
+		if( CompileLists == TRUE )
 		{
-			ERRORMSG("Hosts is too long : %s\n", Buffer);
-			ReadLine_GoToNextLine(fp);
+			HostsContainer *Mapped = NULL;
+
+			/* Serve from the image as well, so that the memory is shared */
+			if( Hosts_SaveContainer(TempContainer, Image, File) == 0 )
+			{
+				Mapped = DynamicHosts_Map(Image, File);
+			}
+
+			if( Mapped != NULL )
+			{
+				INFO("Hosts image %s compiled.\n", Image);
+
+				DynamicHosts_FreeHostsContainer(TempContainer);
+				SafeFree(TempContainer);
+				TempContainer = Mapped;
+			} else {
+				ERRORMSG("Compiling hosts image %s failed.\n", Image);
+			}
 		}
 	}
 
@@ -109,14 +164,35 @@ static int DynamicHosts_Load(void)
 	RWLock_UnWLock(HostsLock);
 
 	INFO("Loading hosts file completed, %d IPv4 Hosts, %d IPv6 Hosts, %d CName Redirections, %d items are excluded.\n",
-		IPv4Count,
-		IPv6Count,
-		CNameCount,
-		ExcludedCount);
+		StringChunk_Count(&(TempContainer -> Ipv4Hosts)),
+		StringChunk_Count(&(TempContainer -> Ipv6Hosts)),
+		StringChunk_Count(&(TempContainer -> CNameHosts)),
+		StringChunk_Count(&(TempContainer -> ExcludedDomains)));
 
 	return 0;
 }
 
+int DynamicHosts_Compile(const char *File)
+{
+	char			Image[1024];
+	HostsContainer	*Container = DynamicHosts_Parse(File);
+	int				Ret;
+
+	if( Container == NULL )
+	{
+		return -1;
+	}
+
+	ListImage_GetPath(Image, sizeof(Image), File);
+
+	Ret = Hosts_SaveContainer(Container, Image, File);
+
+	DynamicHosts_FreeHostsContainer(Container);
+	SafeFree(Container);
+
+	return Ret;
+}
+
 const char **GetURLs(StringList *s)
 {
 	const char **URLs;
@@ -359,31 +435,284 @@ static void GetAnswersByName(SOCKET Socket, Address_Type *BackAddress, int Ident
 	InternalInterface_SendTo(INTERNAL_INTERFACE_UDP_INCOME, Socket, (char *)&RequestEntity, RequestLength);
 }
 
-int DynamicHosts_SocketLoop(void)
+/* State of the hosts thread */
+static Reactor		HostsReactor;
+static QueryContext	HostsContext;
+
+static uint16_t		NewIdentifier;
+
+static SOCKET		HostsOutcomeSocket;
+static Address_Type	OutcomeAddress;
+static SOCKET		SendBackSocket;
+
+static char			RequestEntity[2048];
+
+static void HostsIncomeReady(SOCKET Socket, void *Arg)
 {
-	static uint16_t	NewIdentifier;
+	ControlHeader	*Header = (ControlHeader *)RequestEntity;
 
-	static QueryContext	Context;
+	int State;
+	int TotalLength = 0;
+	int	MatchState;
+	const char *MatchResult = NULL;
+	BOOL GotLock = FALSE;
+	BOOL NeededSendBack = TRUE;
 
-    SOCKET	HostsIncomeSocket;
-    SOCKET	HostsOutcomeSocket;
-    Address_Type	OutcomeAddress;
-    SOCKET	SendBackSocket;
+	State = InternalInterface_Receive(INTERNAL_INTERFACE_HOSTS,
+					RequestEntity,
+					sizeof(RequestEntity)
+					);
 
-	static fd_set	ReadSet, ReadySet;
+	if( State < 1 )
+	{
+		return;
+	}
 
-	static const struct timeval	LongTime = {3600, 0};
-	static const struct timeval	ShortTime = {10, 0};
+	MatchState = Hosts_Match(&MainStaticContainer, Header -> RequestingDomain, Header -> RequestingType, &MatchResult);
+	if( MatchState == MATCH_STATE_NONE && MainDynamicContainer != NULL )
+	{
+		RWLock_WrLock(HostsLock);
+		MatchState = Hosts_Match(MainDynamicContainer, Header -> RequestingDomain, Header -> RequestingType, &MatchResult);
 
-	struct timeval	TimeLimit = LongTime;
+		GotLock = TRUE;
+	}
+
+	switch( MatchState )
+	{
+		case MATCH_STATE_PERFECT:
+			{
+				BOOL EDNSEnabled = FALSE;
 
-	int		MaxFd;
+				if( DNSRemoveEDNSPseudoRecord(RequestEntity + sizeof(ControlHeader), &State) == EDNS_REMOVED )
+				{
+					EDNSEnabled = TRUE;
+				}
+
+				((DNSHeader *)(RequestEntity + sizeof(ControlHeader))) -> Flags.Direction = 1;
+				((DNSHeader *)(RequestEntity + sizeof(ControlHeader))) -> Flags.AuthoritativeAnswer = 0;
+				((DNSHeader *)(RequestEntity + sizeof(ControlHeader))) -> Flags.RecursionAvailable = 1;
+				((DNSHeader *)(RequestEntity + sizeof(ControlHeader))) -> Flags.ResponseCode = 0;
+				((DNSHeader *)(RequestEntity + sizeof(ControlHeader))) -> Flags.Type = 0;
+				DNSSetAnswerCount(RequestEntity + sizeof(ControlHeader), 1);
+				TotalLength = State;
+				TotalLength += Hosts_GenerateSingleRecord(Header -> RequestingType, MatchResult, RequestEntity + State);
+				NeededSendBack = TRUE;
+
+				if( EDNSEnabled == TRUE )
+				{
+					int	NewEntityLength = 0;
+
+					NewEntityLength = TotalLength - sizeof(ControlHeader);
+					DNSAppendEDNSPseudoRecord(RequestEntity + sizeof(ControlHeader), &NewEntityLength);
+					TotalLength = NewEntityLength + sizeof(ControlHeader);
+				}
+			}
+			break;
+
+		case MATCH_STATE_ONLY_CNAME:
+			InternalInterface_QueryContextAddHosts(&HostsContext,
+													Header,
+													NewIdentifier,
+													ELFHash(MatchResult, 0)
+													);
+
+			GetAnswersByName(HostsOutcomeSocket, &(OutcomeAddress), NewIdentifier, MatchResult, Header -> RequestingType);
+			++NewIdentifier;
+			NeededSendBack = FALSE;
+			break;
+	}
 
-	static char		RequestEntity[2048];
+	if( GotLock == TRUE )
+	{
+		RWLock_UnWLock(HostsLock);
+	}
+
+	if( NeededSendBack == TRUE )
+	{
+		if( Header -> NeededHeader == TRUE )
+		{
+			sendto(SendBackSocket,
+					(const char *)Header,
+					TotalLength,
+					0,
+					(const struct sockaddr *)&(Header -> BackAddress.Addr),
+					GetAddressLength(Header -> BackAddress.family)
+					);
+		} else {
+			sendto(SendBackSocket,
+					RequestEntity + sizeof(ControlHeader),
+					TotalLength - sizeof(ControlHeader),
+					0,
+					(const struct sockaddr *)&(Header -> BackAddress.Addr),
+					GetAddressLength(Header -> BackAddress.family)
+					);
+		}
+
+		ShowNormalMassage(Header -> Agent,
+							Header -> RequestingDomain,
+							RequestEntity + sizeof(ControlHeader),
+							TotalLength - sizeof(ControlHeader),
+							'H'
+							);
+	}
+}
+
+static void HostsOutcomeReady(SOCKET Socket, void *Arg)
+{
 	ControlHeader	*Header = (ControlHeader *)RequestEntity;
 
-    HostsIncomeSocket = InternalInterface_TryOpenLocal(10200, INTERNAL_INTERFACE_HOSTS);
-    HostsOutcomeSocket = InternalInterface_TryBindAddress(MAIN_WORKING_ADDRESS, 10225, &(OutcomeAddress));
+	int		State;
+	static char		NewlyGeneratedRocord[2048];
+	ControlHeader	*NewHeader = (ControlHeader *)NewlyGeneratedRocord;
+
+	int		RestLength;
+
+	int NewGeneratedLength = sizeof(ControlHeader);
+	int CompressedLength;
+
+	int32_t	EntryNumber;
+	QueryContextEntry	*Entry;
+
+	char	*DNSResult = RequestEntity + sizeof(ControlHeader);
+
+	char	*AnswersPos;
+
+	State = recvfrom(HostsOutcomeSocket,
+					RequestEntity,
+					sizeof(RequestEntity),
+					0,
+					NULL,
+					NULL
+					);
+
+	if( State < 1 )
+	{
+		return;
+	}
+
+	DNSSetNameServerCount(DNSResult, 0);
+
+	AnswersPos = DNSJumpOverQuestionRecords(DNSResult);
+
+	if( DNSExpandCName_MoreSpaceNeeded(DNSResult) > sizeof(RequestEntity) - State )
+	{
+		return;
+	}
+
+	DNSExpandCName(DNSResult);
+
+	EntryNumber = InternalInterface_QueryContextFind(&HostsContext,
+													*(uint16_t *)DNSResult,
+													Header -> RequestingDomainHashValue
+													);
+
+	if( EntryNumber < 0 )
+	{
+		return;
+	}
+
+	Entry = InternalInterface_QueryContextGetByNumber(&HostsContext, EntryNumber);
+
+	memcpy(NewlyGeneratedRocord + NewGeneratedLength, DNSResult, 12);
+	*(uint16_t *)(NewlyGeneratedRocord + sizeof(ControlHeader)) = Entry -> Context.Hosts.Identifier;
+	NewGeneratedLength += 12;
+
+	State = DNSGenQuestionRecord(NewlyGeneratedRocord + NewGeneratedLength,
+								 sizeof(NewlyGeneratedRocord) - NewGeneratedLength,
+								 Entry -> Domain,
+								 Entry -> Type,
+								 DNS_CLASS_IN
+								 );
+	if( State > 0 )
+	{
+		NewGeneratedLength += State;
+	} else {
+		return;
+	}
+
+	State = DNSGenResourceRecord(NewlyGeneratedRocord + NewGeneratedLength,
+								 sizeof(NewlyGeneratedRocord) - NewGeneratedLength,
+								 Entry -> Domain,
+								 DNS_TYPE_CNAME,
+								 DNS_CLASS_IN,
+								 60,
+								 DNSJumpHeader(DNSResult),
+								 strlen(DNSJumpHeader(DNSResult)) + 1,
+								 FALSE
+								 );
+	if( State > 0 )
+	{
+		NewGeneratedLength += State;
+	} else {
+		return;
+	}
+
+	RestLength = DNSJumpOverAnswerRecords(DNSResult) - AnswersPos;
+	if( RestLength >= 0 && sizeof(NewlyGeneratedRocord) - NewGeneratedLength > (unsigned int)RestLength )
+	{
+		memcpy(NewlyGeneratedRocord + NewGeneratedLength, AnswersPos, RestLength);
+		NewGeneratedLength += RestLength;
+	} else {
+		return;
+	}
+
+	DNSSetNameServerCount(NewlyGeneratedRocord + sizeof(ControlHeader), 0);
+	DNSSetAnswerCount(NewlyGeneratedRocord + sizeof(ControlHeader), DNSGetAnswerCount(NewlyGeneratedRocord + sizeof(ControlHeader)) + 1);
+
+	CompressedLength = DNSCompress(NewlyGeneratedRocord + sizeof(ControlHeader), NewGeneratedLength - sizeof(ControlHeader));
+
+	if( Entry -> EDNSEnabled == TRUE )
+	{
+		memcpy(NewlyGeneratedRocord + CompressedLength + sizeof(ControlHeader), OptPseudoRecord, OPT_PSEUDORECORD_LENGTH);
+		CompressedLength += OPT_PSEUDORECORD_LENGTH;
+		DNSSetAdditionalCount(NewlyGeneratedRocord + sizeof(ControlHeader), 1);
+	} else {
+		DNSSetAdditionalCount(NewlyGeneratedRocord + sizeof(ControlHeader), 0);
+	}
+
+	if( Entry -> NeededHeader == TRUE )
+	{
+		strcpy(NewHeader -> RequestingDomain, Entry -> Domain);
+		NewHeader -> RequestingDomainHashValue = Entry -> Context.Hosts.HashValue;
+
+		sendto(SendBackSocket,
+				NewlyGeneratedRocord,
+				CompressedLength + sizeof(ControlHeader),
+				0,
+				(const struct sockaddr *)&(Entry -> Context.Hosts.BackAddress.Addr),
+				GetAddressLength(Entry -> Context.Hosts.BackAddress.family)
+				);
+	} else {
+		sendto(SendBackSocket,
+				NewlyGeneratedRocord + sizeof(ControlHeader),
+				CompressedLength,
+				0,
+				(const struct sockaddr *)&(Entry -> Context.Hosts.BackAddress.Addr),
+				GetAddressLength(Entry -> Context.Hosts.BackAddress.family)
+				);
+	}
+
+	InternalInterface_QueryContextRemoveByNumber(&HostsContext, EntryNumber);
+
+	ShowNormalMassage(Entry -> Agent,
+						Entry -> Domain,
+						NewlyGeneratedRocord + sizeof(ControlHeader),
+						CompressedLength,
+						'H'
+						);
+}
+
+int DynamicHosts_SocketLoop(void)
+{
+	SOCKET	HostsIncomeSocket;
+
+	static const struct timeval	LongTime = {3600, 0};
+	static const struct timeval	ShortTime = {10, 0};
+
+	struct timeval	TimeLimit = LongTime;
+
+	HostsIncomeSocket = InternalInterface_OpenQueue(10200, INTERNAL_INTERFACE_HOSTS);
+	HostsOutcomeSocket = InternalInterface_TryBindAddress(MAIN_WORKING_ADDRESS, 10225, &(OutcomeAddress));
 
 	if( HostsOutcomeSocket == INVALID_SOCKET )
 	{
@@ -392,27 +721,27 @@ int DynamicHosts_SocketLoop(void)
 
 	SendBackSocket = InternalInterface_GetSocket(INTERNAL_INTERFACE_UDP_INCOME);
 
-	MaxFd = HostsIncomeSocket > HostsOutcomeSocket ? HostsIncomeSocket : HostsOutcomeSocket;
-	FD_ZERO(&ReadSet);
-	FD_ZERO(&ReadySet);
-	FD_SET(HostsIncomeSocket, &ReadSet);
-	FD_SET(HostsOutcomeSocket, &ReadSet);
+	if( Reactor_Init(&HostsReactor) != 0 )
+	{
+		return -1;
+	}
+
+	Reactor_Add(&HostsReactor, HostsIncomeSocket, HostsIncomeReady, NULL);
+	Reactor_Add(&HostsReactor, HostsOutcomeSocket, HostsOutcomeReady, NULL);
 
-	InternalInterface_InitQueryContext(&Context);
+	InternalInterface_InitQueryContext(&HostsContext);
 
 	NewIdentifier = rand();
 
 	while( TRUE )
 	{
-		ReadySet = ReadSet;
-
-		switch( select(MaxFd + 1, &ReadySet, NULL, NULL, &TimeLimit) )
+		switch( Reactor_Wait(&HostsReactor, &TimeLimit) )
 		{
 			case SOCKET_ERROR:
 				break;
 
 			case 0:
-				if( InternalInterface_QueryContextSwep(&Context, 10, NULL) == TRUE )
+				if( InternalInterface_QueryContextSwep(&HostsContext, 10, NULL) == TRUE )
 				{
 					TimeLimit = LongTime;
 				} else {
@@ -422,259 +751,7 @@ int DynamicHosts_SocketLoop(void)
 
 			default:
 				TimeLimit = ShortTime;
-
-				if( FD_ISSET(HostsIncomeSocket, &ReadySet) )
-				{
-					int State;
-					int TotalLength = 0;
-					int	MatchState;
-					const char *MatchResult = NULL;
-					BOOL GotLock = FALSE;
-					BOOL NeededSendBack = TRUE;
-
-					State = recvfrom(HostsIncomeSocket,
-									RequestEntity,
-									sizeof(RequestEntity),
-									0,
-									NULL,
-									NULL
-									);
-
-					if( State < 1 )
-					{
-						break;
-					}
-
-					MatchState = Hosts_Match(&MainStaticContainer, Header -> RequestingDomain, Header -> RequestingType, &MatchResult);
-					if( MatchState == MATCH_STATE_NONE && MainDynamicContainer != NULL )
-					{
-						RWLock_WrLock(HostsLock);
-						MatchState = Hosts_Match(MainDynamicContainer, Header -> RequestingDomain, Header -> RequestingType, &MatchResult);
-
-						GotLock = TRUE;
-					}
-
-					switch( MatchState )
-					{
-						case MATCH_STATE_PERFECT:
-							{
-								BOOL EDNSEnabled = FALSE;
-
-								if( DNSRemoveEDNSPseudoRecord(RequestEntity + sizeof(ControlHeader), &State) == EDNS_REMOVED )
-								{
-									EDNSEnabled = TRUE;
-								}
-
-								((DNSHeader *)(RequestEntity + sizeof(ControlHeader))) -> Flags.Direction = 1;
-								((DNSHeader *)(RequestEntity + sizeof(ControlHeader))) -> Flags.AuthoritativeAnswer = 0;
-								((DNSHeader *)(RequestEntity + sizeof(ControlHeader))) -> Flags.RecursionAvailable = 1;
-								((DNSHeader *)(RequestEntity + sizeof(ControlHeader))) -> Flags.ResponseCode = 0;
-								((DNSHeader *)(RequestEntity + sizeof(ControlHeader))) -> Flags.Type = 0;
-								DNSSetAnswerCount(RequestEntity + sizeof(ControlHeader), 1);
-								TotalLength = State;
-								TotalLength += Hosts_GenerateSingleRecord(Header -> RequestingType, MatchResult, RequestEntity + State);
-								NeededSendBack = TRUE;
-
-								if( EDNSEnabled == TRUE )
-								{
-									int	NewEntityLength = 0;
-
-									NewEntityLength = TotalLength - sizeof(ControlHeader);
-									DNSAppendEDNSPseudoRecord(RequestEntity + sizeof(ControlHeader), &NewEntityLength);
-									TotalLength = NewEntityLength + sizeof(ControlHeader);
-								}
-							}
-							break;
-
-						case MATCH_STATE_ONLY_CNAME:
-							InternalInterface_QueryContextAddHosts(&Context,
-																	Header,
-																	NewIdentifier,
-																	ELFHash(MatchResult, 0)
-																	);
-
-							GetAnswersByName(HostsOutcomeSocket, &(OutcomeAddress), NewIdentifier, MatchResult, Header -> RequestingType);
-							++NewIdentifier;
-							NeededSendBack = FALSE;
-							break;
-					}
-
-					if( GotLock == TRUE )
-					{
-						RWLock_UnWLock(HostsLock);
-					}
-
-					if( NeededSendBack == TRUE )
-					{
-						if( Header -> NeededHeader == TRUE )
-						{
-							sendto(SendBackSocket,
-									(const char *)Header,
-									TotalLength,
-									0,
-									(const struct sockaddr *)&(Header -> BackAddress.Addr),
-									GetAddressLength(Header -> BackAddress.family)
-									);
-						} else {
-							sendto(SendBackSocket,
-									RequestEntity + sizeof(ControlHeader),
-									TotalLength - sizeof(ControlHeader),
-									0,
-									(const struct sockaddr *)&(Header -> BackAddress.Addr),
-									GetAddressLength(Header -> BackAddress.family)
-									);
-						}
-
-						ShowNormalMassage(Header -> Agent,
-											Header -> RequestingDomain,
-											RequestEntity + sizeof(ControlHeader),
-											TotalLength - sizeof(ControlHeader),
-											'H'
-											);
-					}
-
-
-				} else {
-					int		State;
-					static char		NewlyGeneratedRocord[2048];
-					ControlHeader	*NewHeader = (ControlHeader *)NewlyGeneratedRocord;
-
-					int		RestLength;
-
-					int NewGeneratedLength = sizeof(ControlHeader);
-					int CompressedLength;
-
-					int32_t	EntryNumber;
-					QueryContextEntry	*Entry;
-
-					char	*DNSResult = RequestEntity + sizeof(ControlHeader);
-
-					char	*AnswersPos;
-
-					State = recvfrom(HostsOutcomeSocket,
-									RequestEntity,
-									sizeof(RequestEntity),
-									0,
-									NULL,
-									NULL
-									);
-
-					if( State < 1 )
-					{
-						break;
-					}
-
-					DNSSetNameServerCount(DNSResult, 0);
-
-					AnswersPos = DNSJumpOverQuestionRecords(DNSResult);
-
-					if( DNSExpandCName_MoreSpaceNeeded(DNSResult) > sizeof(RequestEntity) - State )
-					{
-						break;
-					}
-
-					DNSExpandCName(DNSResult);
-
-					EntryNumber = InternalInterface_QueryContextFind(&Context,
-																	*(uint16_t *)DNSResult,
-																	Header -> RequestingDomainHashValue
-																	);
-
-					if( EntryNumber < 0 )
-					{
-						break;
-					}
-
-					Entry = Bst_GetDataByNumber(&Context, EntryNumber);
-
-					memcpy(NewlyGeneratedRocord + NewGeneratedLength, DNSResult, 12);
-					*(uint16_t *)(NewlyGeneratedRocord + sizeof(ControlHeader)) = Entry -> Context.Hosts.Identifier;
-					NewGeneratedLength += 12;
-
-					State = DNSGenQuestionRecord(NewlyGeneratedRocord + NewGeneratedLength,
-												 sizeof(NewlyGeneratedRocord) - NewGeneratedLength,
-												 Entry -> Domain,
-												 Entry -> Type,
-												 DNS_CLASS_IN
-												 );
-					if( State > 0 )
-					{
-						NewGeneratedLength += State;
-					} else {
-						break;
-					}
-
-					State = DNSGenResourceRecord(NewlyGeneratedRocord + NewGeneratedLength,
-												 sizeof(NewlyGeneratedRocord) - NewGeneratedLength,
-												 Entry -> Domain,
-												 DNS_TYPE_CNAME,
-												 DNS_CLASS_IN,
-												 60,
-												 DNSJumpHeader(DNSResult),
-												 strlen(DNSJumpHeader(DNSResult)) + 1,
-												 FALSE
-												 );
-					if( State > 0 )
-					{
-						NewGeneratedLength += State;
-					} else {
-						break;
-					}
-
-					RestLength = DNSJumpOverAnswerRecords(DNSResult) - AnswersPos;
-					if( RestLength >= 0 && sizeof(NewlyGeneratedRocord) - NewGeneratedLength > (unsigned int)RestLength )
-					{
-						memcpy(NewlyGeneratedRocord + NewGeneratedLength, AnswersPos, RestLength);
-						NewGeneratedLength += RestLength;
-					} else {
-						break;
-					}
-
-					DNSSetNameServerCount(NewlyGeneratedRocord + sizeof(ControlHeader), 0);
-					DNSSetAnswerCount(NewlyGeneratedRocord + sizeof(ControlHeader), DNSGetAnswerCount(NewlyGeneratedRocord + sizeof(ControlHeader)) + 1);
-
-					CompressedLength = DNSCompress(NewlyGeneratedRocord + sizeof(ControlHeader), NewGeneratedLength - sizeof(ControlHeader));
-
-					if( Entry -> EDNSEnabled == TRUE )
-					{
-						memcpy(NewlyGeneratedRocord + CompressedLength + sizeof(ControlHeader), OptPseudoRecord, OPT_PSEUDORECORD_LENGTH);
-						CompressedLength += OPT_PSEUDORECORD_LENGTH;
-						DNSSetAdditionalCount(NewlyGeneratedRocord + sizeof(ControlHeader), 1);
-					} else {
-						DNSSetAdditionalCount(NewlyGeneratedRocord + sizeof(ControlHeader), 0);
-					}
-
-					if( Entry -> NeededHeader == TRUE )
-					{
-						strcpy(NewHeader -> RequestingDomain, Entry -> Domain);
-						NewHeader -> RequestingDomainHashValue = Entry -> Context.Hosts.HashValue;
-
-						sendto(SendBackSocket,
-								NewlyGeneratedRocord,
-								CompressedLength + sizeof(ControlHeader),
-								0,
-								(const struct sockaddr *)&(Entry -> Context.Hosts.BackAddress.Addr),
-								GetAddressLength(Entry -> Context.Hosts.BackAddress.family)
-								);
-					} else {
-						sendto(SendBackSocket,
-								NewlyGeneratedRocord + sizeof(ControlHeader),
-								CompressedLength,
-								0,
-								(const struct sockaddr *)&(Entry -> Context.Hosts.BackAddress.Addr),
-								GetAddressLength(Entry -> Context.Hosts.BackAddress.family)
-								);
-					}
-
-					InternalInterface_QueryContextRemoveByNumber(&Context, EntryNumber);
-
-					ShowNormalMassage(Entry -> Agent,
-										Entry -> Domain,
-										NewlyGeneratedRocord + sizeof(ControlHeader),
-										CompressedLength,
-										'H'
-										);
-				}
+				break;
 		}
 	}
 
@@ -762,6 +839,7 @@ int DynamicHosts_Init(ConfigFileInfo *ConfigInfo)
 
 	UpdateInterval = ConfigGetInt32(ConfigInfo, "HostsUpdateInterval");
 	HostsRetryInterval = ConfigGetInt32(ConfigInfo, "HostsRetryInterval");
+	CompileLists = ConfigGetBoolean(ConfigInfo, "CompileLists");
 
 	RWLock_Init(HostsLock);
 
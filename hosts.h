@@ -15,4 +15,6 @@ int DynamicHosts_Init(ConfigFileInfo *ConfigInfo);
 int Hosts_Try(char *Content, int *ContentLength);
 
 int DynamicHosts_Start(ConfigFileInfo *ConfigInfo);
+
+int DynamicHosts_Compile(const char *File);
 #endif // HOSTS_H_INCLUDED
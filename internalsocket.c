@@ -1,4 +1,5 @@
 #include <string.h>
+#include <ctype.h>
 #include "internalsocket.h"
 #include "addresslist.h"
 #include "querydnsbase.h"
@@ -16,6 +17,15 @@ static Address_Type			LocalWorkingAddress;
 
 static InternalInterface	Interfaces[7];
 
+#ifdef MESSAGEQUEUE_AVAILABLE
+static MessageQueue			Queues[7];
+
+/* Large enough for a request with two control headers (see
+ * querydnslistenudp.c) */
+#define	INTERNAL_QUEUE_MESSAGE_LENGTH	(2048 + 2 * sizeof(ControlHeader))
+#define	INTERNAL_QUEUE_CAPACITY			256
+#endif /* MESSAGEQUEUE_AVAILABLE */
+
 int InternalInterface_Init(int PrimaryProtocal, const char *WorkingAddress, int Port)
 {
 	int loop;
@@ -23,6 +33,9 @@ int InternalInterface_Init(int PrimaryProtocal, const char *WorkingAddress, int
 	for( loop = 0; loop != 7; ++loop )
 	{
 		Interfaces[loop].Socket = INVALID_SOCKET;
+#ifdef MESSAGEQUEUE_AVAILABLE
+		Interfaces[loop].Queue = NULL;
+#endif /* MESSAGEQUEUE_AVAILABLE */
 	}
 
     if( PrimaryProtocal == DNS_QUARY_PROTOCOL_UDP )
@@ -45,7 +58,7 @@ int InternalInterface_Init(int PrimaryProtocal, const char *WorkingAddress, int
 	return 0;
 }
 
-SOCKET InternalInterface_OpenASocket(sa_family_t Family, struct sockaddr *Address)
+static SOCKET InternalInterface_OpenASocketEx(sa_family_t Family, struct sockaddr *Address, BOOL ReusePort)
 {
 	SOCKET ret = socket(Family, SOCK_DGRAM, IPPROTO_UDP);
 
@@ -54,6 +67,24 @@ SOCKET InternalInterface_OpenASocket(sa_family_t Family, struct sockaddr *Addres
 		return INVALID_SOCKET;
 	}
 
+#ifdef INTERNAL_INTERFACE_REUSEPORT
+	if( ReusePort == TRUE )
+	{
+		int On = 1;
+
+		if( setsockopt(ret, SOL_SOCKET, SO_REUSEPORT, (const char *)&On, sizeof(On)) != 0 )
+		{
+			int	OriginalErrorCode;
+
+			OriginalErrorCode = GET_LAST_ERROR();
+			CLOSE_SOCKET(ret);
+			SET_LAST_ERROR(OriginalErrorCode);
+
+			return INVALID_SOCKET;
+		}
+	}
+#endif /* INTERNAL_INTERFACE_REUSEPORT */
+
 	if( Address != NULL && bind(ret, Address, GetAddressLength(Family)) != 0 )
 	{
 		int	OriginalErrorCode;
@@ -68,7 +99,17 @@ SOCKET InternalInterface_OpenASocket(sa_family_t Family, struct sockaddr *Addres
 	return ret;
 }
 
-SOCKET InternalInterface_Open(const char *AddressPort, InternalInterfaceType Type, int DefaultPort)
+SOCKET InternalInterface_OpenASocket(sa_family_t Family, struct sockaddr *Address)
+{
+	return InternalInterface_OpenASocketEx(Family, Address, FALSE);
+}
+
+SOCKET InternalInterface_OpenASocketReusePort(sa_family_t Family, struct sockaddr *Address)
+{
+	return InternalInterface_OpenASocketEx(Family, Address, TRUE);
+}
+
+static SOCKET InternalInterface_OpenEx(const char *AddressPort, InternalInterfaceType Type, int DefaultPort, BOOL ReusePort)
 {
 	sa_family_t	Family = AddressList_ConvertToAddressFromString(&(Interfaces[Type].Address), AddressPort, DefaultPort);
 
@@ -77,16 +118,26 @@ SOCKET InternalInterface_Open(const char *AddressPort, InternalInterfaceType Typ
 		return -1;
 	}
 
-	Interfaces[Type].Socket = InternalInterface_OpenASocket(Family, (struct sockaddr *)&(Interfaces[Type].Address));
+	Interfaces[Type].Socket = InternalInterface_OpenASocketEx(Family, (struct sockaddr *)&(Interfaces[Type].Address), ReusePort);
 
 	return Interfaces[Type].Socket;
 }
 
+SOCKET InternalInterface_Open(const char *AddressPort, InternalInterfaceType Type, int DefaultPort)
+{
+	return InternalInterface_OpenEx(AddressPort, Type, DefaultPort, FALSE);
+}
+
 SOCKET InternalInterface_Open2(const char *Address, int Port, InternalInterfaceType Type)
 {
 	return InternalInterface_Open(Address, Type, Port);
 }
 
+SOCKET InternalInterface_Open2ReusePort(const char *Address, int Port, InternalInterfaceType Type)
+{
+	return InternalInterface_OpenEx(Address, Type, Port, TRUE);
+}
+
 SOCKET InternalInterface_TryBindAddress(const char *Address_Str, int Port, Address_Type *Address)
 {
 	int MaxTime = 10000;
@@ -136,6 +187,28 @@ SOCKET InternalInterface_TryOpenLocal(int Port, InternalInterfaceType Type)
 	return Interfaces[Type].Socket;
 }
 
+/* Opens an interface that only this process sends to. It is an in-process
+ * queue where available, otherwise a loopback socket bound to `Port' or a
+ * port after it. The returned descriptor becomes readable when there are
+ * messages, which should be taken with InternalInterface_Receive(). */
+SOCKET InternalInterface_OpenQueue(int Port, InternalInterfaceType Type)
+{
+#ifdef MESSAGEQUEUE_AVAILABLE
+	if( MessageQueue_Init(Queues + Type, INTERNAL_QUEUE_CAPACITY, INTERNAL_QUEUE_MESSAGE_LENGTH) == 0 )
+	{
+		Interfaces[Type].Socket = MessageQueue_GetFd(Queues + Type);
+
+		/* Publish the queue after it is ready */
+		__sync_synchronize();
+		Interfaces[Type].Queue = Queues + Type;
+
+		return Interfaces[Type].Socket;
+	}
+#endif /* MESSAGEQUEUE_AVAILABLE */
+
+	return InternalInterface_TryOpenLocal(Port, Type);
+}
+
 SOCKET InternalInterface_OpenTCP(const char *AddressPort, InternalInterfaceType Type, int DefaultPort)
 {
 	sa_family_t	Family = AddressList_ConvertToAddressFromString(&(Interfaces[Type].Address), AddressPort, DefaultPort);
@@ -200,29 +273,265 @@ int InternalInterface_SendTo(InternalInterfaceType Type, SOCKET ThisSocket, char
 	struct sockaddr	*Address = NULL;
 	sa_family_t	Family;
 
+#ifdef MESSAGEQUEUE_AVAILABLE
+	if( Interfaces[Type].Queue != NULL )
+	{
+		return MessageQueue_Push(Interfaces[Type].Queue, Content, ContentLength);
+	}
+#endif /* MESSAGEQUEUE_AVAILABLE */
+
 	Family = InternalInterface_GetAddress(Type, &Address);
 
 	return sendto(ThisSocket, Content, ContentLength, 0, Address, GetAddressLength(Family));
 }
 
+int InternalInterface_Receive(InternalInterfaceType Type, char *Buffer, int BufferLength)
+{
+#ifdef MESSAGEQUEUE_AVAILABLE
+	if( Interfaces[Type].Queue != NULL )
+	{
+		return MessageQueue_Pop(Interfaces[Type].Queue, Buffer, BufferLength);
+	}
+#endif /* MESSAGEQUEUE_AVAILABLE */
+
+	return recvfrom(Interfaces[Type].Socket, Buffer, BufferLength, 0, NULL, NULL);
+}
+
 void InternalInterface_InitControlHeader(ControlHeader *Header)
 {
 	Header -> _Pad = CONTROLHEADER__PAD;
+	Header -> Refresh = FALSE;
+}
+
+#define	QUERY_CONTEXT_SLOT_EMPTY	0
+#define	QUERY_CONTEXT_SLOT_USED		1
+#define	QUERY_CONTEXT_SLOT_DELETED	2
+
+#define	QUERY_CONTEXT_INITIAL_CAPACITY	64
+#define	QUERY_CONTEXT_BUCKETS		(QUERY_CONTEXT_WHEEL_SIZE * 2)
+
+#define	QueryContextHash(Identifier, HashValue)	((uint32_t)(HashValue) * 2654435761U ^ (uint32_t)(Identifier))
+
+/* The key in place of the identifier of a query to be forwarded, its type,
+ * its class and whether EDNS is enabled, the domain is the hash value */
+static uint32_t QueryContextQuestion(const char *DNSBody, BOOL EDNSEnabled)
+{
+	const char	*Question = DNSJumpHeader(DNSBody);
+
+	return ((uint32_t)DNSGetRecordType(Question) << 16) |
+			(DNSGetRecordClass(Question) & 0x7FFF) |
+			(EDNSEnabled == TRUE ? 0x8000 : 0);
+}
+
+static void QueryContextResetWheel(QueryContext *Context)
+{
+	int	loop;
+
+	for( loop = 0; loop != QUERY_CONTEXT_BUCKETS; ++loop )
+	{
+		Context -> Wheel[loop].Second = 0;
+		Context -> Wheel[loop].Head = -1;
+		Context -> Wheel[loop].Tail = -1;
+	}
+}
+
+static void QueryContextLinkTo(QueryContext *Context, int32_t Number, int32_t BucketNumber)
+{
+	QueryContextBucket	*Bucket = Context -> Wheel + BucketNumber;
+	QueryContextSlot	*Slot = Context -> Slots + Number;
+
+	Slot -> Bucket = BucketNumber;
+	Slot -> Prev = Bucket -> Tail;
+	Slot -> Next = -1;
+
+	if( Bucket -> Tail >= 0 )
+	{
+		Context -> Slots[Bucket -> Tail].Next = Number;
+	} else {
+		Bucket -> Head = Number;
+	}
+
+	Bucket -> Tail = Number;
 }
 
-static int QueryContextCompare(const QueryContextEntry *_1, const QueryContextEntry *_2)
+static void QueryContextUnlink(QueryContext *Context, int32_t Number)
 {
-	if( _1 -> Identifier != _2 -> Identifier )
+	QueryContextSlot	*Slot = Context -> Slots + Number;
+	QueryContextBucket	*Bucket = Context -> Wheel + Slot -> Bucket;
+
+	if( Slot -> Prev >= 0 )
 	{
-		return (int)(_1 -> Identifier) - (int)(_2 -> Identifier);
+		Context -> Slots[Slot -> Prev].Next = Slot -> Next;
 	} else {
-		return (_1 -> HashValue) - (int)(_2 -> HashValue);
+		Bucket -> Head = Slot -> Next;
+	}
+
+	if( Slot -> Next >= 0 )
+	{
+		Context -> Slots[Slot -> Next].Prev = Slot -> Prev;
+	} else {
+		Bucket -> Tail = Slot -> Prev;
+	}
+}
+
+/* Link an entry older than the first level spans into the second level.
+ * Entries left longer than the second level spans share buckets with newer
+ * ones, sweeps tell them apart by the time each was added. */
+static void QueryContextLinkOld(QueryContext *Context, int32_t Number)
+{
+	time_t	Second = Context -> Slots[Number].Entry.TimeAdd;
+	int32_t	BucketNumber = QUERY_CONTEXT_WHEEL_SIZE +
+							(uint32_t)(Second / QUERY_CONTEXT_WHEEL_SIZE) % QUERY_CONTEXT_WHEEL_SIZE;
+	QueryContextBucket	*Bucket = Context -> Wheel + BucketNumber;
+
+	if( Bucket -> Head < 0 || Bucket -> Second > Second )
+	{
+		Bucket -> Second = Second;
+	}
+
+	QueryContextLinkTo(Context, Number, BucketNumber);
+}
+
+/* Move all entries of a first level bucket to the second level */
+static void QueryContextCascade(QueryContext *Context, int32_t BucketNumber)
+{
+	QueryContextBucket	*Bucket = Context -> Wheel + BucketNumber;
+
+	while( Bucket -> Head >= 0 )
+	{
+		int32_t	Number = Bucket -> Head;
+
+		QueryContextUnlink(Context, Number);
+		QueryContextLinkOld(Context, Number);
+	}
+}
+
+static void QueryContextLink(QueryContext *Context, int32_t Number)
+{
+	time_t	Second = Context -> Slots[Number].Entry.TimeAdd;
+	int32_t	BucketNumber = (uint32_t)Second % QUERY_CONTEXT_WHEEL_SIZE;
+	QueryContextBucket	*Bucket = Context -> Wheel + BucketNumber;
+
+	if( Bucket -> Head >= 0 && Bucket -> Second != Second )
+	{
+		if( Bucket -> Second > Second )
+		{
+			/* Older than what the bucket holds, happens only when rehashing */
+			QueryContextLinkOld(Context, Number);
+			return;
+		}
+
+		/* The wheel has turned around since the bucket was last used */
+		QueryContextCascade(Context, BucketNumber);
+	}
+
+	Bucket -> Second = Second;
+	QueryContextLinkTo(Context, Number, BucketNumber);
+}
+
+static int32_t QueryContextInsert(QueryContext *Context, const QueryContextEntry *Entry)
+{
+	uint32_t	Position = QueryContextHash(Entry -> Identifier, Entry -> HashValue);
+	QueryContextSlot	*Slot;
+
+	while( TRUE )
+	{
+		Position &= Context -> Capacity - 1;
+		Slot = Context -> Slots + Position;
+
+		if( Slot -> State != QUERY_CONTEXT_SLOT_USED )
+		{
+			break;
+		}
+
+		++Position;
+	}
+
+	if( Slot -> State == QUERY_CONTEXT_SLOT_DELETED )
+	{
+		--(Context -> Deleted);
 	}
+
+	Slot -> State = QUERY_CONTEXT_SLOT_USED;
+	memcpy(&(Slot -> Entry), Entry, sizeof(QueryContextEntry));
+	++(Context -> Used);
+
+	QueryContextLink(Context, Position);
+
+	return Position;
+}
+
+static int QueryContextRehash(QueryContext *Context, int32_t NewCapacity)
+{
+	QueryContextSlot	*Old = Context -> Slots;
+	int32_t	OldCapacity = Context -> Capacity;
+	int32_t	loop;
+
+	Context -> Slots = SafeMalloc(NewCapacity * sizeof(QueryContextSlot));
+	if( Context -> Slots == NULL )
+	{
+		Context -> Slots = Old;
+		return -1;
+	}
+
+	memset(Context -> Slots, 0, NewCapacity * sizeof(QueryContextSlot));
+	Context -> Capacity = NewCapacity;
+	Context -> Used = 0;
+	Context -> Deleted = 0;
+	QueryContextResetWheel(Context);
+
+	for( loop = 0; loop != OldCapacity; ++loop )
+	{
+		if( Old[loop].State == QUERY_CONTEXT_SLOT_USED )
+		{
+			QueryContextInsert(Context, &(Old[loop].Entry));
+		}
+	}
+
+	SafeFree(Old);
+
+	return 0;
+}
+
+static int QueryContextAdd(QueryContext *Context, const QueryContextEntry *Entry)
+{
+	/* Keep the load factor, counting deleted slots, under 3/4 */
+	if( (Context -> Used + Context -> Deleted + 1) * 4 > Context -> Capacity * 3 )
+	{
+		int32_t	NewCapacity = Context -> Capacity;
+
+		if( (Context -> Used + 1) * 2 > Context -> Capacity )
+		{
+			NewCapacity *= 2;
+		}
+
+		if( QueryContextRehash(Context, NewCapacity) != 0 )
+		{
+			return -1;
+		}
+	}
+
+	return QueryContextInsert(Context, Entry);
 }
 
 int InternalInterface_InitQueryContext(QueryContext *Context)
 {
-	return Bst_Init(Context, NULL, sizeof(QueryContextEntry), (int (*)(const void *, const void *))QueryContextCompare);
+	Context -> Capacity = QUERY_CONTEXT_INITIAL_CAPACITY;
+	Context -> Used = 0;
+	Context -> Deleted = 0;
+
+	Context -> Slots = SafeMalloc(Context -> Capacity * sizeof(QueryContextSlot));
+	if( Context -> Slots == NULL )
+	{
+		return -1;
+	}
+
+	memset(Context -> Slots, 0, Context -> Capacity * sizeof(QueryContextSlot));
+	QueryContextResetWheel(Context);
+
+	Context -> FreeWaiter = -1;
+
+	return Array_Init(&(Context -> Waiters), sizeof(QueryContextWaiter), 0, FALSE, NULL);
 }
 
 int InternalInterface_QueryContextAddUDP(QueryContext *Context, ControlHeader *Header)
@@ -230,25 +539,31 @@ int InternalInterface_QueryContextAddUDP(QueryContext *Context, ControlHeader *H
 	const char *RequestingEntity = (const char *)(Header + 1);
 	QueryContextEntry	New;
 
-	New.Identifier = *(uint16_t *)RequestingEntity;
+	if( DNSGetAdditionalCount(RequestingEntity) > 0 )
+	{
+		New.EDNSEnabled = TRUE;
+	} else {
+		New.EDNSEnabled = FALSE;
+	}
+
+	New.Identifier = QueryContextQuestion(RequestingEntity, New.EDNSEnabled);
 	New.HashValue = Header -> RequestingDomainHashValue;
+	New.QueryIdentifier = *(uint16_t *)RequestingEntity;
+	New.Waiters = -1;
 
 	New.TimeAdd = time(NULL);
+	New.TimeSent = GetMicroseconds();
+	New.Server = -1;
+	New.Hedge = -1;
 	New.NeededHeader = Header -> NeededHeader;
+	New.Refresh = Header -> Refresh;
 	strcpy(New.Agent, Header -> Agent);
 	New.Type = Header -> RequestingType;
 	strcpy(New.Domain, Header -> RequestingDomain);
 
-	if( DNSGetAdditionalCount(RequestingEntity) > 0 )
-	{
-		New.EDNSEnabled = TRUE;
-	} else {
-		New.EDNSEnabled = FALSE;
-	}
-
 	memcpy(&(New.Context.BackAddress), &(Header -> BackAddress), sizeof(Address_Type));
 
-	return Bst_Add(Context, &New);
+	return QueryContextAdd(Context, &New);
 }
 
 int InternalInterface_QueryContextAddTCP(QueryContext *Context, ControlHeader *Header, SOCKET Socket)
@@ -258,9 +573,15 @@ int InternalInterface_QueryContextAddTCP(QueryContext *Context, ControlHeader *H
 
 	New.Identifier = *(uint16_t *)RequestingEntity;
 	New.HashValue = Header -> RequestingDomainHashValue;
+	New.QueryIdentifier = *(uint16_t *)RequestingEntity;
+	New.Waiters = -1;
 
 	New.TimeAdd = time(NULL);
+	New.TimeSent = GetMicroseconds();
+	New.Server = -1;
+	New.Hedge = -1;
 	New.NeededHeader = Header -> NeededHeader;
+	New.Refresh = Header -> Refresh;
 	strcpy(New.Agent, Header -> Agent);
 
 	New.Type = Header -> RequestingType;
@@ -275,7 +596,7 @@ int InternalInterface_QueryContextAddTCP(QueryContext *Context, ControlHeader *H
 
 	New.Context.Socket = Socket;
 
-	return Bst_Add(Context, &New);
+	return QueryContextAdd(Context, &New);
 }
 
 int InternalInterface_QueryContextAddHosts(QueryContext *Context, ControlHeader *Header, uint32_t Identifier, int32_t HashValue)
@@ -285,9 +606,15 @@ int InternalInterface_QueryContextAddHosts(QueryContext *Context, ControlHeader
 
 	New.Identifier = Identifier;
 	New.HashValue = HashValue;
+	New.QueryIdentifier = *(uint16_t *)RequestingEntity;
+	New.Waiters = -1;
 
 	New.TimeAdd = time(NULL);
+	New.TimeSent = GetMicroseconds();
+	New.Server = -1;
+	New.Hedge = -1;
 	New.NeededHeader = Header -> NeededHeader;
+	New.Refresh = Header -> Refresh;
 	strcpy(New.Agent, Header -> Agent);
 
 	if( DNSGetAdditionalCount(RequestingEntity) > 0 )
@@ -304,56 +631,259 @@ int InternalInterface_QueryContextAddHosts(QueryContext *Context, ControlHeader
 	New.Type = Header -> RequestingType;
 	strcpy(New.Domain, Header -> RequestingDomain);
 
-	return Bst_Add(Context, &New);
+	return QueryContextAdd(Context, &New);
+}
+
+/* Domain names are compared case-insensitively, as servers may answer in
+ * another case than asked */
+static BOOL QueryContextSameDomain(const char *One, const char *Another)
+{
+	while( tolower((unsigned char)*One) == tolower((unsigned char)*Another) )
+	{
+		if( *One == '\0' )
+		{
+			return TRUE;
+		}
+
+		++One;
+		++Another;
+	}
+
+	return FALSE;
+}
+
+/* `QueryIdentifier' is to be matched as well unless it is negative, and
+ * `Domain' unless it is NULL. Different domains may share a hash value. */
+static int32_t QueryContextLookUp(QueryContext *Context,
+								  uint32_t Identifier,
+								  int32_t HashValue,
+								  int32_t QueryIdentifier,
+								  const char *Domain
+								  )
+{
+	uint32_t	Position = QueryContextHash(Identifier, HashValue);
+	QueryContextSlot	*Slot;
+
+	while( TRUE )
+	{
+		Position &= Context -> Capacity - 1;
+		Slot = Context -> Slots + Position;
+
+		switch( Slot -> State )
+		{
+			case QUERY_CONTEXT_SLOT_EMPTY:
+				return -1;
+				break;
+
+			case QUERY_CONTEXT_SLOT_USED:
+				if( Slot -> Entry.Identifier == Identifier &&
+					Slot -> Entry.HashValue == HashValue &&
+					(QueryIdentifier < 0 || Slot -> Entry.QueryIdentifier == QueryIdentifier) &&
+					(Domain == NULL || QueryContextSameDomain(Slot -> Entry.Domain, Domain))
+					)
+				{
+					return Position;
+				}
+				break;
+
+			default:
+				break;
+		}
+
+		++Position;
+	}
 }
 
 int32_t InternalInterface_QueryContextFind(QueryContext *Context, uint32_t Identifier, int32_t HashValue)
 {
-	QueryContextEntry	Key;
+	return QueryContextLookUp(Context, Identifier, HashValue, -1, NULL);
+}
 
-	Key.Identifier = Identifier;
-	Key.HashValue = HashValue;
+int32_t InternalInterface_QueryContextAttach(QueryContext *Context, ControlHeader *Header)
+{
+	const char *RequestingEntity = (const char *)(Header + 1);
+	int32_t	Number;
+	int32_t	Subscript;
+	QueryContextWaiter	*Waiter;
+
+	Number = QueryContextLookUp(Context,
+								QueryContextQuestion(RequestingEntity, DNSGetAdditionalCount(RequestingEntity) > 0),
+								Header -> RequestingDomainHashValue,
+								-1,
+								Header -> RequestingDomain
+								);
+	if( Number < 0 )
+	{
+		return -1;
+	}
 
-	return Bst_Search(Context, &Key, NULL);
+	if( Context -> FreeWaiter >= 0 )
+	{
+		Subscript = Context -> FreeWaiter;
+		Waiter = InternalInterface_QueryContextGetWaiter(Context, Subscript);
+		Context -> FreeWaiter = Waiter -> Next;
+	} else {
+		Subscript = Array_PushBack(&(Context -> Waiters), NULL, NULL);
+		if( Subscript < 0 )
+		{
+			return -1;
+		}
+
+		Waiter = InternalInterface_QueryContextGetWaiter(Context, Subscript);
+	}
+
+	Waiter -> Identifier = *(uint16_t *)RequestingEntity;
+	Waiter -> NeededHeader = Header -> NeededHeader;
+	Waiter -> Refresh = Header -> Refresh;
+	strcpy(Waiter -> Agent, Header -> Agent);
+	memcpy(&(Waiter -> BackAddress), &(Header -> BackAddress), sizeof(Address_Type));
+
+	Waiter -> Next = Context -> Slots[Number].Entry.Waiters;
+	Context -> Slots[Number].Entry.Waiters = Subscript;
+
+	return Number;
 }
 
-void InternalInterface_QueryContextRemove(QueryContext *Context, uint32_t Identifier, int32_t HashValue)
+int32_t InternalInterface_QueryContextFindAnswer(QueryContext *Context, const char *DNSBody, const char *Domain, int32_t HashValue)
 {
-	int32_t NodeNumber;
+	BOOL	EDNSEnabled = DNSGetAdditionalCount(DNSBody) > 0;
+	int32_t	Number;
+
+	Number = QueryContextLookUp(Context,
+								QueryContextQuestion(DNSBody, EDNSEnabled),
+								HashValue,
+								*(uint16_t *)DNSBody,
+								Domain
+								);
+
+	/* A server may answer a query with EDNS without it, or the other way
+	 * round */
+	if( Number < 0 )
+	{
+		Number = QueryContextLookUp(Context,
+									QueryContextQuestion(DNSBody, !EDNSEnabled),
+									HashValue,
+									*(uint16_t *)DNSBody,
+									Domain
+									);
+	}
+
+	return Number;
+}
 
-	NodeNumber = InternalInterface_QueryContextFind(Context, Identifier, HashValue);
+void InternalInterface_QueryContextRemoveByNumber(QueryContext *Context, int32_t Number)
+{
+	QueryContextSlot	*Slot = Context -> Slots + Number;
 
-	if( NodeNumber > 0 )
+	if( Slot -> State != QUERY_CONTEXT_SLOT_USED )
 	{
-		Bst_Delete_ByNumber(Context, NodeNumber);
+		return;
 	}
+
+	QueryContextUnlink(Context, Number);
+
+	/* Free the waiters */
+	if( Slot -> Entry.Waiters >= 0 )
+	{
+		QueryContextWaiter	*Last = InternalInterface_QueryContextGetWaiter(Context, Slot -> Entry.Waiters);
+
+		while( Last -> Next >= 0 )
+		{
+			Last = InternalInterface_QueryContextGetWaiter(Context, Last -> Next);
+		}
+
+		Last -> Next = Context -> FreeWaiter;
+		Context -> FreeWaiter = Slot -> Entry.Waiters;
+		Slot -> Entry.Waiters = -1;
+	}
+
+	Slot -> State = QUERY_CONTEXT_SLOT_DELETED;
+	--(Context -> Used);
+	++(Context -> Deleted);
 }
 
-BOOL InternalInterface_QueryContextSwep(QueryContext *Context, time_t TimeOut, void (*OutputFunction)(QueryContextEntry *, int))
+void InternalInterface_QueryContextRemove(QueryContext *Context, uint32_t Identifier, int32_t HashValue)
 {
-	int32_t Start = -1;
-	int		Number = 1;
+	int32_t Number;
 
-	QueryContextEntry	*Entry;
+	Number = InternalInterface_QueryContextFind(Context, Identifier, HashValue);
+
+	if( Number >= 0 )
+	{
+		InternalInterface_QueryContextRemoveByNumber(Context, Number);
+	}
+}
 
-	time_t	Now = time(NULL);
+/* Remove the entries of a bucket added before `Deadline', and note the
+ * oldest second of those left */
+static void QueryContextExpireBucket(QueryContext *Context,
+									int32_t BucketNumber,
+									time_t Deadline,
+									void (*OutputFunction)(QueryContextEntry *, int),
+									int *Number
+									)
+{
+	QueryContextBucket	*Bucket = Context -> Wheel + BucketNumber;
+	int32_t	Current = Bucket -> Head;
 
-	Entry = Bst_Enum(Context, &Start);
-	while( Entry != NULL )
+	while( Current >= 0 )
 	{
-		if( Now - Entry -> TimeAdd > TimeOut )
+		QueryContextSlot	*Slot = Context -> Slots + Current;
+		int32_t	Next = Slot -> Next;
+
+		if( Slot -> Entry.TimeAdd < Deadline )
 		{
 			if( OutputFunction != NULL )
 			{
-				OutputFunction(Entry, Number);
+				OutputFunction(&(Slot -> Entry), *Number);
 			}
-			Bst_Delete_ByNumber(Context, Start);
 
-			++Number;
+			InternalInterface_QueryContextRemoveByNumber(Context, Current);
+
+			++(*Number);
+		} else if( Bucket -> Second < Deadline || Bucket -> Second > Slot -> Entry.TimeAdd )
+		{
+			Bucket -> Second = Slot -> Entry.TimeAdd;
 		}
 
-		Entry = Bst_Enum(Context, &Start);
+		Current = Next;
 	}
+}
+
+BOOL InternalInterface_QueryContextSwep(QueryContext *Context, time_t TimeOut, void (*OutputFunction)(QueryContextEntry *, int))
+{
+	int		Number = 1;
+	int		loop;
+
+	time_t	Deadline = time(NULL) - TimeOut;
+
+	for( loop = 0; loop != QUERY_CONTEXT_BUCKETS; ++loop )
+	{
+		QueryContextBucket	*Bucket = Context -> Wheel + loop;
+
+		/* Only buckets holding something expired are visited */
+		if( Bucket -> Head >= 0 && Bucket -> Second < Deadline )
+		{
+			QueryContextExpireBucket(Context, loop, Deadline, OutputFunction, &Number);
+		}
+	}
+
+	if( Context -> Deleted * 2 > Context -> Capacity )
+	{
+		/* Get rid of deleted slots so that lookups stay short */
+		QueryContextRehash(Context, Context -> Capacity);
+	}
+
+	return InternalInterface_QueryContextIsEmpty(Context);
+}
+
+void InternalInterface_QueryContextReset(QueryContext *Context)
+{
+	memset(Context -> Slots, 0, Context -> Capacity * sizeof(QueryContextSlot));
+	Context -> Used = 0;
+	Context -> Deleted = 0;
+	QueryContextResetWheel(Context);
 
-	return Bst_IsEmpty(Context);
+	Array_Clear(&(Context -> Waiters));
+	Context -> FreeWaiter = -1;
 }
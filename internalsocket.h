@@ -3,12 +3,20 @@
 
 #include <time.h>
 #include "bst.h"
+#include "array.h"
 #include "common.h"
+#include "messagequeue.h"
 
 
 typedef struct _InternalInterface {
 	SOCKET			Socket;
 	Address_Type	Address;
+
+#ifdef MESSAGEQUEUE_AVAILABLE
+	/* Non-NULL if the interface is carried by an in-process queue instead
+	 * of a loopback socket, `Socket' is then the queue's eventfd */
+	MessageQueue	*Queue;
+#endif /* MESSAGEQUEUE_AVAILABLE */
 } InternalInterface;
 
 typedef enum _InternalInterfaceType {
@@ -29,18 +37,31 @@ extern int			MAIN_WORKING_PORT;
 
 int InternalInterface_Init(int PrimaryProtocal, const char *WorkingAddress, int Port);
 
+/* Several sockets bound to one address with SO_REUSEPORT get incoming
+ * datagrams spread among them by the kernel. Only Linux does the spreading,
+ * so other systems stay with a single socket. */
+#if defined(SO_REUSEPORT) && defined(__linux__)
+#define INTERNAL_INTERFACE_REUSEPORT
+#endif
+
 SOCKET InternalInterface_OpenASocket(sa_family_t Family, struct sockaddr *Address);
 
+SOCKET InternalInterface_OpenASocketReusePort(sa_family_t Family, struct sockaddr *Address);
+
 SOCKET InternalInterface_Open(const char *AddressPort, InternalInterfaceType Type, int DefaultPort);
 
 SOCKET InternalInterface_Open2(const char *Address, int Port, InternalInterfaceType Type);
 
+SOCKET InternalInterface_Open2ReusePort(const char *Address, int Port, InternalInterfaceType Type);
+
 SOCKET InternalInterface_TryBindAddress(const char *Address_Str, int Port, Address_Type *Address);
 
 SOCKET InternalInterface_TryBindLocal(int Port, Address_Type *Address);
 
 SOCKET InternalInterface_TryOpenLocal(int Port, InternalInterfaceType Type);
 
+SOCKET InternalInterface_OpenQueue(int Port, InternalInterfaceType Type);
+
 SOCKET InternalInterface_OpenTCP(const char *AddressPort, InternalInterfaceType Type, int DefaultPort);
 
 SOCKET InternalInterface_GetSocket(InternalInterfaceType Type);
@@ -51,6 +72,8 @@ Address_Type *InternalInterface_GetAddress_Union(InternalInterfaceType Type);
 
 int InternalInterface_SendTo(InternalInterfaceType Type, SOCKET ThisSocket, char *Content, int ContentLength);
 
+int InternalInterface_Receive(InternalInterfaceType Type, char *Buffer, int BufferLength);
+
 #define	CONTROLHEADER__PAD (~0)
 
 typedef struct _ControlHeader {
@@ -64,6 +87,9 @@ typedef struct _ControlHeader {
 
 	BOOL	NeededHeader;
 
+	/* A query issued to refresh the cache, whose response is only cached */
+	BOOL	Refresh;
+
 	char	Agent[LENGTH_OF_IPV6_ADDRESS_ASCII + 1];
 } ControlHeader;
 
@@ -73,8 +99,28 @@ typedef struct _QueryContextEntry {
 	uint32_t	Identifier;
 	int32_t		HashValue;
 
+	/* The identifier the query was sent with. Entries added by
+	 * InternalInterface_QueryContextAddUDP() are keyed by their question, see
+	 * below, so it is not `Identifier' for them. */
+	uint16_t	QueryIdentifier;
+
+	/* The first of the queries of the same question waiting for this one to
+	 * be answered, in QueryContext.Waiters, -1 if none */
+	int32_t		Waiters;
+
 	time_t		TimeAdd;
+
+	/* When the query was sent and the subscript of the server it was sent
+	 * to, -1 if not known, for keeping the statistic of servers */
+	int64_t		TimeSent;
+	int			Server;
+
+	/* The state of hedging the query in the UDP querying thread, -1 if it is
+	 * not hedged */
+	int32_t		Hedge;
+
 	BOOL		NeededHeader;
+	BOOL		Refresh;
 	char		Agent[LENGTH_OF_IPV6_ADDRESS_ASCII + 1];
 
 	int			Type;
@@ -94,23 +140,114 @@ typedef struct _QueryContextEntry {
 
 } QueryContextEntry;
 
-typedef Bst	QueryContext;
+/* A query attached to an in-flight one asking the same question, it is sent
+ * the same answer with its own identifier */
+typedef struct _QueryContextWaiter {
+	uint16_t	Identifier;
+	BOOL		NeededHeader;
+	BOOL		Refresh;
+	char		Agent[LENGTH_OF_IPV6_ADDRESS_ASCII + 1];
+	Address_Type	BackAddress;
+
+	int32_t		Next; /* The next waiter of the same query, -1 if none */
+} QueryContextWaiter;
+
+/* In-flight queries are kept in an open-addressing hash table keyed by
+ * (Identifier, HashValue). Besides, each entry is linked into a two-level
+ * timing wheel by the second it was added, so a sweep only visits the buckets
+ * and the entries actually expired, not every outstanding query. */
+#define	QUERY_CONTEXT_WHEEL_SIZE	64
+
+typedef struct _QueryContextSlot {
+	/* QUERY_CONTEXT_SLOT_EMPTY, _USED or _DELETED */
+	int32_t		State;
+
+	/* Links of the timing wheel bucket, slot numbers or -1 */
+	int32_t		Prev;
+	int32_t		Next;
+	int32_t		Bucket;
+
+	QueryContextEntry	Entry;
+} QueryContextSlot;
+
+typedef struct _QueryContextBucket {
+	time_t		Second;
+	int32_t		Head;
+	int32_t		Tail;
+} QueryContextBucket;
+
+typedef struct _QueryContext {
+	QueryContextSlot	*Slots;
+	int32_t		Capacity; /* A power of 2 */
+	int32_t		Used;
+	int32_t		Deleted;
+
+	/* The first level, bucket `i' holds the entries added at a second `s'
+	 * where s % QUERY_CONTEXT_WHEEL_SIZE == i. When it turns around, what is
+	 * left in a bucket moves to the second level, whose bucket `i' holds the
+	 * entries where s / QUERY_CONTEXT_WHEEL_SIZE % QUERY_CONTEXT_WHEEL_SIZE
+	 * == i. A bucket remembers the oldest second of its entries. */
+	QueryContextBucket	Wheel[QUERY_CONTEXT_WHEEL_SIZE * 2];
+
+	/* Of QueryContextWaiter, those freed are chained from `FreeWaiter' */
+	Array		Waiters;
+	int32_t		FreeWaiter;
+} QueryContext;
 
 int InternalInterface_InitQueryContext(QueryContext *Context);
 
 int InternalInterface_QueryContextAddUDP(QueryContext *Context, ControlHeader *Header);
+/* Description:
+ *  Add a query to be forwarded. It is keyed by its question, the domain, type,
+ *  class and whether EDNS is enabled, not by its identifier, so that the same
+ *  questions asked meanwhile can be attached to it.
+ * Return value:
+ *  The number of the entry, or a negative value on failure.
+ */
+
+int32_t InternalInterface_QueryContextAttach(QueryContext *Context, ControlHeader *Header);
+/* Description:
+ *  Attach a query to the one added by InternalInterface_QueryContextAddUDP()
+ *  of the same question, if there is one in flight.
+ * Return value:
+ *  The number of the entry attached to, or -1 if there is none.
+ */
+
+int32_t InternalInterface_QueryContextFindAnswer(QueryContext *Context, const char *DNSBody, const char *Domain, int32_t HashValue);
+/* Description:
+ *  Find the query added by InternalInterface_QueryContextAddUDP() which an
+ *  answer is to. `Domain' is the name asked in the answer and `HashValue' its
+ *  hash value.
+ * Return value:
+ *  The number of the entry, which stays valid until the next adding, or -1 if
+ *  not found.
+ */
+
+#define	InternalInterface_QueryContextGetWaiter(context_ptr, number)	((QueryContextWaiter *)Array_GetBySubscript(&((context_ptr) -> Waiters), (number)))
 
 int InternalInterface_QueryContextAddTCP(QueryContext *Context, ControlHeader *Header, SOCKET Socket);
 
 int InternalInterface_QueryContextAddHosts(QueryContext *Context, ControlHeader *Header, uint32_t Identifier, int32_t HashValue);
 
 int32_t InternalInterface_QueryContextFind(QueryContext *Context, uint32_t Identifier, int32_t HashValue);
+/* Description:
+ *  Find an in-flight query.
+ * Return value:
+ *  The number of the entry, which stays valid until the next adding, or -1 if
+ *  not found.
+ */
+
+#define	InternalInterface_QueryContextGetByNumber(context_ptr, number)	(&((context_ptr) -> Slots[(number)].Entry))
 
-#define	InternalInterface_QueryContextRemoveByNumber(context_ptr, number)	(Bst_Delete_ByNumber((context_ptr), (number)))
+void InternalInterface_QueryContextRemoveByNumber(QueryContext *Context, int32_t Number);
 
 void InternalInterface_QueryContextRemove(QueryContext *Context, uint32_t Identifier, int32_t HashValue);
 
 BOOL InternalInterface_QueryContextSwep(QueryContext *Context, time_t TimeOut, void (*OutputFunction)(QueryContextEntry *, int));
 
+void InternalInterface_QueryContextReset(QueryContext *Context);
+
+#define	InternalInterface_QueryContextIsEmpty(context_ptr)	((context_ptr) -> Used == 0)
+
 
 #endif // INTERNALSOCKET_H_INCLUDED
@@ -0,0 +1,374 @@
+#include <string.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "listimage.h"
+#include "utils.h"
+
+#define	LISTIMAGE_MAGIC		"DNSFLIST"
+#define	LISTIMAGE_VERSION	2
+
+/* Sections start at multiples of 8, so that what is in them is aligned */
+#define	SECTION_ALIGNMENT	8
+
+typedef struct _ListImageHeader{
+	char		Magic[8];
+	uint32_t	Order; /* 0x01020304, for the byte order */
+	uint32_t	Version;
+	uint32_t	Kind;
+	uint32_t	Length; /* Of the whole image */
+
+	/* Of the text file compiled from */
+	int64_t		SourceSize;
+	uint64_t	SourceChecksum;
+} ListImageHeader;
+
+static const char Padding[SECTION_ALIGNMENT] = {0};
+
+void ListImage_GetPath(char *Buffer, int BufferLength, const char *Source)
+{
+	snprintf(Buffer, BufferLength, "%s.bin", Source);
+}
+
+static void ListImage_GetTemporaryPath(char *Buffer, int BufferLength, const char *File)
+{
+	snprintf(Buffer, BufferLength, "%s.tmp", File);
+}
+
+/* Returns 0 and fills the size if `Source' can be read */
+static int ListImage_SourceSize(const char *Source, int64_t *Size)
+{
+	struct stat	s;
+
+	if( Source == NULL || stat(Source, &s) != 0 )
+	{
+		return -1;
+	}
+
+	*Size = s.st_size;
+
+	return 0;
+}
+
+/* The 64-bit FNV-1a hash of all in `Source'. Its modification time is not
+ * relied on, as a file changed twice within its resolution, or copied with
+ * the time kept, does not look changed by it. */
+static int ListImage_SourceChecksum(const char *Source, uint64_t *Checksum)
+{
+	FILE	*fp = fopen(Source, "rb");
+	char	Buffer[16384];
+	size_t	Read;
+	size_t	loop;
+
+	if( fp == NULL )
+	{
+		return -1;
+	}
+
+	*Checksum = 0xcbf29ce484222325ULL;
+
+	while( (Read = fread(Buffer, 1, sizeof(Buffer), fp)) > 0 )
+	{
+		for( loop = 0; loop != Read; ++loop )
+		{
+			*Checksum ^= (unsigned char)Buffer[loop];
+			*Checksum *= 0x100000001b3ULL;
+		}
+	}
+
+	if( ferror(fp) )
+	{
+		fclose(fp);
+		return -2;
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+FILE *ListImage_Create(const char *File, const char *Source, uint32_t Kind)
+{
+	char			Temporary[1024];
+	FILE			*fp;
+	ListImageHeader	Header;
+
+	memset(&Header, 0, sizeof(Header));
+	memcpy(Header.Magic, LISTIMAGE_MAGIC, sizeof(Header.Magic));
+	Header.Order = 0x01020304;
+	Header.Version = LISTIMAGE_VERSION;
+	Header.Kind = Kind;
+
+	if( ListImage_SourceSize(Source, &(Header.SourceSize)) != 0 ||
+		ListImage_SourceChecksum(Source, &(Header.SourceChecksum)) != 0
+		)
+	{
+		return NULL;
+	}
+
+	ListImage_GetTemporaryPath(Temporary, sizeof(Temporary), File);
+
+	fp = fopen(Temporary, "wb");
+	if( fp == NULL )
+	{
+		return NULL;
+	}
+
+	if( fwrite(&Header, sizeof(Header), 1, fp) != 1 )
+	{
+		fclose(fp);
+		remove(Temporary);
+		return NULL;
+	}
+
+	return fp;
+}
+
+int ListImage_Put(FILE *fp, const void *Data, uint32_t Length)
+{
+	uint32_t	Head[2];
+	uint32_t	Padded = ROUND_UP(Length, SECTION_ALIGNMENT);
+
+	Head[0] = Length;
+	Head[1] = 0;
+
+	if( fwrite(Head, sizeof(Head), 1, fp) != 1 )
+	{
+		return -1;
+	}
+
+	if( Length > 0 && fwrite(Data, Length, 1, fp) != 1 )
+	{
+		return -2;
+	}
+
+	if( Padded > Length && fwrite(Padding, Padded - Length, 1, fp) != 1 )
+	{
+		return -3;
+	}
+
+	return 0;
+}
+
+int ListImage_PutArray(FILE *fp, const Array *a)
+{
+	return ListImage_Put(fp, a -> Data, a -> Used * a -> DataLength);
+}
+
+int ListImage_PutBuffer(FILE *fp, const ExtendableBuffer *eb)
+{
+	return ListImage_Put(fp, eb -> Data, eb -> Used);
+}
+
+int ListImage_Close(FILE *fp, const char *File, BOOL Completed)
+{
+	char		Temporary[1024];
+	uint32_t	Length;
+
+	ListImage_GetTemporaryPath(Temporary, sizeof(Temporary), File);
+
+	if( Completed == TRUE )
+	{
+		Length = ftell(fp);
+
+		if( fseek(fp, offsetof(ListImageHeader, Length), SEEK_SET) != 0 ||
+			fwrite(&Length, sizeof(Length), 1, fp) != 1 ||
+			fflush(fp) != 0
+			)
+		{
+			Completed = FALSE;
+		}
+	}
+
+	if( fclose(fp) != 0 )
+	{
+		Completed = FALSE;
+	}
+
+	if( Completed == FALSE )
+	{
+		remove(Temporary);
+		return -1;
+	}
+
+#ifdef WIN32
+	/* rename() does not replace an existing file here */
+	remove(File);
+#endif /* WIN32 */
+
+	if( rename(Temporary, File) != 0 )
+	{
+		remove(Temporary);
+		return -2;
+	}
+
+	return 0;
+}
+
+int ListImage_Map(ListImage *i, const char *File, const char *Source, uint32_t Kind)
+{
+	const ListImageHeader	*Header;
+	int64_t					SourceSize;
+	uint64_t				SourceChecksum;
+	struct stat				s;
+
+	i -> Start = NULL;
+
+	if( stat(File, &s) != 0 || s.st_size < (off_t)sizeof(ListImageHeader) )
+	{
+		return -1;
+	}
+
+	i -> Length = s.st_size;
+
+#ifdef WIN32
+	{
+		HANDLE	f = CreateFile(File, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+		if( f == INVALID_HANDLE_VALUE )
+		{
+			return -2;
+		}
+
+		i -> Mapping = CreateFileMapping(f, NULL, PAGE_READONLY, 0, 0, NULL);
+		CloseHandle(f);
+
+		if( i -> Mapping == NULL )
+		{
+			return -3;
+		}
+
+		i -> Start = MapViewOfFile(i -> Mapping, FILE_MAP_READ, 0, 0, 0);
+		if( i -> Start == NULL )
+		{
+			CloseHandle(i -> Mapping);
+			return -4;
+		}
+	}
+#else /* WIN32 */
+	{
+		int		f = open(File, O_RDONLY);
+		void	*Start;
+
+		if( f < 0 )
+		{
+			return -2;
+		}
+
+		Start = mmap(NULL, i -> Length, PROT_READ, MAP_SHARED, f, 0);
+		close(f);
+
+		if( Start == MAP_FAILED )
+		{
+			return -4;
+		}
+
+		i -> Start = Start;
+	}
+#endif /* WIN32 */
+
+	Header = (const ListImageHeader *)(i -> Start);
+
+	if( memcmp(Header -> Magic, LISTIMAGE_MAGIC, sizeof(Header -> Magic)) != 0 ||
+		Header -> Order != 0x01020304 ||
+		Header -> Version != LISTIMAGE_VERSION ||
+		Header -> Kind != Kind ||
+		Header -> Length != i -> Length
+		)
+	{
+		ListImage_Unmap(i);
+		return -5;
+	}
+
+	/* Out of date, the whole source is read only if its size is the same */
+	if( ListImage_SourceSize(Source, &SourceSize) == 0 &&
+		(SourceSize != Header -> SourceSize ||
+		 ListImage_SourceChecksum(Source, &SourceChecksum) != 0 ||
+		 SourceChecksum != Header -> SourceChecksum)
+		)
+	{
+		ListImage_Unmap(i);
+		return -6;
+	}
+
+	i -> Next = sizeof(ListImageHeader);
+
+	return 0;
+}
+
+const char *ListImage_Take(ListImage *i, uint32_t *Length)
+{
+	const char	*Section;
+
+	if( i -> Next + 2 * sizeof(uint32_t) > i -> Length )
+	{
+		return NULL;
+	}
+
+	*Length = *(const uint32_t *)(i -> Start + i -> Next);
+
+	if( *Length > i -> Length - i -> Next - 2 * sizeof(uint32_t) )
+	{
+		return NULL;
+	}
+
+	Section = i -> Start + i -> Next + 2 * sizeof(uint32_t);
+
+	i -> Next += 2 * sizeof(uint32_t) + ROUND_UP(*Length, SECTION_ALIGNMENT);
+
+	return Section;
+}
+
+int ListImage_TakeArray(ListImage *i, Array *a, int DataLength)
+{
+	uint32_t	Length;
+	const char	*Section = ListImage_Take(i, &Length);
+
+	if( Section == NULL || Length % DataLength != 0 )
+	{
+		return -1;
+	}
+
+	a -> Data = (char *)Section;
+	a -> DataLength = DataLength;
+	a -> Used = Length / DataLength;
+	a -> Allocated = a -> Used;
+
+	return 0;
+}
+
+int ListImage_TakeBuffer(ListImage *i, ExtendableBuffer *eb)
+{
+	uint32_t	Length;
+	const char	*Section = ListImage_Take(i, &Length);
+
+	if( Section == NULL )
+	{
+		return -1;
+	}
+
+	eb -> Data = (char *)Section;
+	eb -> Used = Length;
+	eb -> Allocated = Length;
+	eb -> InitialSize = 0;
+	eb -> GuardSize = 0;
+
+	return 0;
+}
+
+void ListImage_Unmap(ListImage *i)
+{
+	if( i -> Start == NULL )
+	{
+		return;
+	}
+
+#ifdef WIN32
+	UnmapViewOfFile(i -> Start);
+	CloseHandle(i -> Mapping);
+#else /* WIN32 */
+	munmap(i -> Start, i -> Length);
+#endif /* WIN32 */
+
+	i -> Start = NULL;
+}
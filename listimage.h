@@ -0,0 +1,94 @@
+#ifndef LISTIMAGE_H_INCLUDED
+#define LISTIMAGE_H_INCLUDED
+
+#include <stdio.h>
+#include "array.h"
+#include "extendablebuffer.h"
+#include "common.h"
+
+/* A ListImage is a hosts file or a domain list compiled into the buffers of
+ * the containers holding it, written one after another to a file. Everything
+ * in those buffers refers to the others by offsets and subscripts, never by
+ * addresses, so the file can be mapped read-only and used as it is: loading
+ * takes no parsing, and processes mapping the same image share its pages.
+ *
+ * An image remembers the size and a checksum of the text file it was compiled
+ * from, and is not used once that file has changed.
+ */
+
+#define	LISTIMAGE_HOSTS		1
+#define	LISTIMAGE_DOMAINS	2
+#define	LISTIMAGE_GFWLIST	3
+
+typedef struct _ListImage{
+	char		*Start; /* NULL if nothing is mapped */
+	uint32_t	Length;
+	uint32_t	Next; /* Where the next section starts, while taking */
+#ifdef WIN32
+	HANDLE		Mapping;
+#endif /* WIN32 */
+} ListImage;
+
+#define	ListImage_IsMapped(i_ptr)	((i_ptr) -> Start != NULL)
+
+void ListImage_GetPath(char *Buffer, int BufferLength, const char *Source);
+/* Description:
+ *  Get the path of the image of `Source', which is `Source' followed by
+ *  `.bin'.
+ */
+
+FILE *ListImage_Create(const char *File, const char *Source, uint32_t Kind);
+/* Description:
+ *  Start writing an image compiled from `Source'. It is written to a
+ *  temporary file, and takes the place of `File' in ListImage_Close(), so
+ *  that processes still mapping the old image are not disturbed.
+ * Return value:
+ *  The stream to put sections to, NULL on failure.
+ */
+
+int ListImage_Put(FILE *fp, const void *Data, uint32_t Length);
+
+int ListImage_PutArray(FILE *fp, const Array *a);
+
+int ListImage_PutBuffer(FILE *fp, const ExtendableBuffer *eb);
+/* Description:
+ *  Write a section, the elements of an Array or the used bytes of an
+ *  ExtendableBuffer.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+int ListImage_Close(FILE *fp, const char *File, BOOL Completed);
+/* Description:
+ *  Finish writing an image. If `Completed' is FALSE, or writing failed, the
+ *  temporary file is removed and `File' is left as it was.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+int ListImage_Map(ListImage *i, const char *File, const char *Source, uint32_t Kind);
+/* Description:
+ *  Map an image read-only. If `Source' can be read, it must be the file the
+ *  image was compiled from, unchanged since.
+ * Return value:
+ *  0 on success, a non-zero value otherwise, `i' is left unmapped then.
+ */
+
+const char *ListImage_Take(ListImage *i, uint32_t *Length);
+
+int ListImage_TakeArray(ListImage *i, Array *a, int DataLength);
+
+int ListImage_TakeBuffer(ListImage *i, ExtendableBuffer *eb);
+/* Description:
+ *  Take the next section, in the order they were put. An Array or an
+ *  ExtendableBuffer taken refers to the mapping, it must not be changed or
+ *  freed, the mapping is released by ListImage_Unmap() instead.
+ * Return value:
+ *  ListImage_Take() returns the section, NULL if there are no more. The
+ *  others return 0 on success, a non-zero value if there is no section left
+ *  or its length does not fit.
+ */
+
+void ListImage_Unmap(ListImage *i);
+
+#endif // LISTIMAGE_H_INCLUDED
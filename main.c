@@ -21,6 +21,10 @@
 #include "querydnsinterface.h"
 #include "request_response.h"
 #include "debug.h"
+#include "hosts.h"
+#include "gfwlist.h"
+#include "excludedlist.h"
+#include "selftest.h"
 
 #define VERSION__ "5.0.9"
 
@@ -191,13 +195,15 @@ void Probe(int Threshold)
 	StringChunk_Free(&s, TRUE);
 }
 
-void Test(const char *ServerAddress)
+void Test(const char *ServerAddress, int NumberOfThreads)
 {
 	ThreadHandle	t;
 
-	uint32_t	Counter = 0;
+	uint32_t	*Counters;
 
-	struct TestServerArguments	Args = {ServerAddress, &Counter};
+	struct TestServerArguments	*Args;
+
+	int	loop;
 
 	if( ServerAddress == NULL )
 	{
@@ -205,16 +211,42 @@ void Test(const char *ServerAddress)
 		return;
 	}
 
-	CREATE_THREAD(TestServer, &Args, t);
-	DETACH_THREAD(t);
+	if( NumberOfThreads < 1 )
+	{
+		NumberOfThreads = 1;
+	}
+
+	Counters = SafeMalloc(sizeof(uint32_t) * NumberOfThreads);
+	Args = SafeMalloc(sizeof(struct TestServerArguments) * NumberOfThreads);
+	if( Counters == NULL || Args == NULL )
+	{
+		return;
+	}
+
+	/* One counter per thread, so that they never contend on it */
+	for( loop = 0; loop != NumberOfThreads; ++loop )
+	{
+		Counters[loop] = 0;
+		Args[loop].ServerAddress = ServerAddress;
+		Args[loop].Counter = Counters + loop;
+
+		CREATE_THREAD(TestServer, Args + loop, t);
+		DETACH_THREAD(t);
+	}
 
     while( TRUE )
     {
+		uint32_t	Sum = 0;
+
 		SLEEP(1000);
 
-		printf("Requrests per second : %u\n", Counter);
+		for( loop = 0; loop != NumberOfThreads; ++loop )
+		{
+			Sum += Counters[loop];
+			Counters[loop] = 0;
+		}
 
-		Counter = 0;
+		printf("Requrests per second : %u (%d thread(s))\n", Sum, NumberOfThreads);
     }
 }
 
@@ -252,9 +284,48 @@ void PrepareEnvironment(void)
 }
 #endif
 
+void CompileList(const char *Type, const char *File)
+{
+	int	Ret;
+
+	if( Type == NULL || File == NULL )
+	{
+		printf("Usage : -C <hosts|gfwlist|domains> <FILE>\n");
+		exit(1);
+	}
+
+	if( strcmp(Type, "hosts") == 0 )
+	{
+		Ret = DynamicHosts_Compile(File);
+	} else if( strcmp(Type, "gfwlist") == 0 )
+	{
+		Ret = GfwList_Compile(File);
+	} else if( strcmp(Type, "domains") == 0 )
+	{
+		Ret = ExcludedList_Compile(File);
+	} else {
+		printf("Unknown list type `%s'.\n", Type);
+		exit(1);
+	}
+
+	if( Ret != 0 )
+	{
+		printf("Compiling %s failed.\n", File);
+		exit(1);
+	}
+
+	printf("%s compiled into %s.bin.\n", File, File);
+	exit(0);
+}
+
 int ArgParse(int argc, char *argv_ori[])
 {
 	char **argv = argv_ori;
+
+	const char	*TestServerAddress = NULL;
+	BOOL		Testing = FALSE;
+	int			TestThreads = 1;
+
 	++argv;
     while(*argv != NULL)
     {
@@ -269,6 +340,14 @@ int ArgParse(int argc, char *argv_ori[])
 				  "  -e         Show only error messages.\n"
 				  "  -d         Daemon mode. Running at background.\n"
 				  "  -P         Try to probe all the fake IP addresses held in false DNS responses.\n"
+				  "  -T <IP>    Measure requests per second of the DNS server <IP>.\n"
+				  "  -t <NUM>   Number of querying threads used by `-T', 1 by default.\n"
+				  "  -C <TYPE> <FILE>\n"
+				  "             Compile <FILE> into <FILE>.bin, which is mapped instead of\n"
+				  "             <FILE> being loaded while <FILE> is unchanged. <TYPE> is one\n"
+				  "             of `hosts', `gfwlist' and `domains'.\n"
+				  "  -S <NAME>  Run the self test <NAME>, or all of them if <NAME> is `all',\n"
+				  "             and print what they measure. Without <NAME>, list them.\n"
 #ifndef WIN32
 				  "\n"
 				  "  -p         Prepare needed environment.\n"
@@ -328,17 +407,42 @@ int ArgParse(int argc, char *argv_ori[])
 
         if( strcmp("-T", *argv) == 0 )
         {
-			ShowMassages = FALSE;
-			ErrorMessages = FALSE;
-#ifdef WIN32
-			SetConsoleTitle("dnsforwarder - testing");
-#endif
+			Testing = TRUE;
+			TestServerAddress = *(++argv);
+			if( TestServerAddress != NULL )
+			{
+				++argv;
+			}
+            continue;
+        }
+
+        if( strcmp("-C", *argv) == 0 )
+        {
+			ShowMassages = FALSE;
+			CompileList(argv[1], argv[1] == NULL ? NULL : argv[2]);
+
 			++argv;
-			Test(*argv);
+            continue;
+        }
 
-			exit(0);
+        if( strcmp("-S", *argv) == 0 )
+        {
+			if( argv[1] == NULL )
+			{
+				SelfTest_List();
+				exit(0);
+			}
 
-			++argv;
+			exit(SelfTest(argv[1]) == 0 ? 0 : 1);
+        }
+
+        if( strcmp("-t", *argv) == 0 )
+        {
+			if( *(++argv) != NULL )
+			{
+				TestThreads = atoi(*argv);
+				++argv;
+			}
             continue;
         }
 
@@ -356,6 +460,20 @@ int ArgParse(int argc, char *argv_ori[])
 		PRINTM("Unrecognisable arg `%s'. Try `-h'.\n", *argv);
         ++argv;
     }
+
+	/* Testing is deferred until all arguments are parsed, so that `-t' may
+	 * appear on either side of `-T' */
+	if( Testing == TRUE )
+	{
+		ShowMassages = FALSE;
+		ErrorMessages = FALSE;
+#ifdef WIN32
+		SetConsoleTitle("dnsforwarder - testing");
+#endif
+		Test(TestServerAddress, TestThreads);
+
+		exit(0);
+	}
 
     return 0;
 }
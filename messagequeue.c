@@ -0,0 +1,165 @@
+#include <string.h>
+#include "messagequeue.h"
+
+#ifdef MESSAGEQUEUE_AVAILABLE
+
+#include <sys/eventfd.h>
+#include "utils.h"
+
+#ifdef __ATOMIC_ACQUIRE
+#define	LOAD_ACQUIRE(ptr)			__atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define	STORE_RELEASE(ptr, val)		__atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define	EXCHANGE(ptr, val)			__atomic_exchange_n((ptr), (val), __ATOMIC_SEQ_CST)
+#else /* __ATOMIC_ACQUIRE */
+#define	LOAD_ACQUIRE(ptr)			__sync_fetch_and_add((ptr), 0)
+#define	STORE_RELEASE(ptr, val)		(__sync_synchronize(), *(ptr) = (val))
+#define	EXCHANGE(ptr, val)			(__sync_synchronize(), __sync_lock_test_and_set((ptr), (val)))
+#endif /* __ATOMIC_ACQUIRE */
+
+#define	COMPARE_AND_SWAP(ptr, old, new)	__sync_bool_compare_and_swap((ptr), (old), (new))
+
+#define	MessageQueue_GetSlot(q_ptr, pos)	((MessageQueue_Slot *)((q_ptr) -> Slots + ((pos) & (q_ptr) -> Mask) * (q_ptr) -> SlotLength))
+
+int MessageQueue_Init(MessageQueue *q, int Capacity, int MessageLength)
+{
+	uint32_t	loop;
+
+	if( Capacity < 2 || (Capacity & (Capacity - 1)) != 0 )
+	{
+		return -1;
+	}
+
+	/* Keep each slot on its own cache lines */
+	q -> SlotLength = ROUND_UP(sizeof(MessageQueue_Slot) + MessageLength, 64);
+	q -> MessageLength = MessageLength;
+	q -> Mask = Capacity - 1;
+
+	q -> Slots = SafeMalloc(q -> SlotLength * Capacity);
+	if( q -> Slots == NULL )
+	{
+		return -2;
+	}
+
+	q -> EventFd = eventfd(0, EFD_NONBLOCK);
+	if( q -> EventFd < 0 )
+	{
+		SafeFree(q -> Slots);
+		return -3;
+	}
+
+	for( loop = 0; loop != (uint32_t)Capacity; ++loop )
+	{
+		MessageQueue_GetSlot(q, loop) -> Sequence = loop;
+	}
+
+	q -> Head = 0;
+	q -> Tail = 0;
+	q -> Signalled = 0;
+
+	__sync_synchronize();
+
+	return 0;
+}
+
+int MessageQueue_Push(MessageQueue *q, const char *Content, int Length)
+{
+	MessageQueue_Slot	*Slot;
+	uint32_t	Position = q -> Head;
+
+	if( Length > q -> MessageLength || Length < 0 )
+	{
+		return -1;
+	}
+
+	/* Claim a slot */
+	while( TRUE )
+	{
+		int32_t	Difference;
+
+		Slot = MessageQueue_GetSlot(q, Position);
+		Difference = (int32_t)(LOAD_ACQUIRE(&(Slot -> Sequence)) - Position);
+
+		if( Difference == 0 )
+		{
+			if( COMPARE_AND_SWAP(&(q -> Head), Position, Position + 1) )
+			{
+				break;
+			}
+		} else if( Difference < 0 )
+		{
+			/* Full */
+			return -1;
+		}
+
+		Position = q -> Head;
+	}
+
+	Slot -> Length = Length;
+	memcpy(Slot + 1, Content, Length);
+	STORE_RELEASE(&(Slot -> Sequence), Position + 1);
+
+	/* Only the first message since the last rearm needs a wakeup */
+	if( EXCHANGE(&(q -> Signalled), 1) == 0 )
+	{
+		uint64_t	One = 1;
+
+		write(q -> EventFd, &One, sizeof(One));
+	}
+
+	return Length;
+}
+
+static BOOL MessageQueue_IsEmpty(MessageQueue *q)
+{
+	return LOAD_ACQUIRE(&(MessageQueue_GetSlot(q, q -> Tail) -> Sequence)) != q -> Tail + 1;
+}
+
+/* Called when the queue looks empty. Clears `EventFd' so that select() will
+ * wait, and raises it again if a message slipped in meanwhile.
+ *
+ * `EventFd' is drained before `Signalled' is cleared. The other way round, a
+ * producer seeing `Signalled' cleared could write `EventFd' just before the
+ * read, and have its wakeup eaten while `Signalled' stays set. */
+static void MessageQueue_Rearm(MessageQueue *q)
+{
+	uint64_t	Value;
+
+	read(q -> EventFd, &Value, sizeof(Value));
+	EXCHANGE(&(q -> Signalled), 0);
+	__sync_synchronize();
+
+	if( !MessageQueue_IsEmpty(q) && EXCHANGE(&(q -> Signalled), 1) == 0 )
+	{
+		Value = 1;
+		write(q -> EventFd, &Value, sizeof(Value));
+	}
+}
+
+int MessageQueue_Pop(MessageQueue *q, char *Buffer, int BufferLength)
+{
+	MessageQueue_Slot	*Slot;
+	int	Length;
+
+	if( MessageQueue_IsEmpty(q) )
+	{
+		MessageQueue_Rearm(q);
+		return 0;
+	}
+
+	Slot = MessageQueue_GetSlot(q, q -> Tail);
+
+	Length = Slot -> Length < BufferLength ? Slot -> Length : BufferLength;
+	memcpy(Buffer, Slot + 1, Length);
+
+	STORE_RELEASE(&(Slot -> Sequence), q -> Tail + q -> Mask + 1);
+	++(q -> Tail);
+
+	if( MessageQueue_IsEmpty(q) )
+	{
+		MessageQueue_Rearm(q);
+	}
+
+	return Length;
+}
+
+#endif /* MESSAGEQUEUE_AVAILABLE */
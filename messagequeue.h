@@ -0,0 +1,81 @@
+#ifndef MESSAGEQUEUE_H_INCLUDED
+#define MESSAGEQUEUE_H_INCLUDED
+
+#include "common.h"
+
+/* A bounded ring of fixed-size slots, which many threads may push messages
+ * into and exactly one thread pops them from. Pushing and popping take no
+ * lock. An eventfd is signalled while the queue is non-empty, so the popping
+ * thread can wait for messages with select() together with its sockets.
+ *
+ * Only available on Linux with GCC-compatible compilers, otherwise the
+ * internal interfaces keep using loopback sockets.
+ */
+#if defined(__linux__) && defined(__GNUC__)
+#define MESSAGEQUEUE_AVAILABLE
+#endif
+
+#ifdef MESSAGEQUEUE_AVAILABLE
+
+typedef struct _MessageQueue_Slot {
+	/* Equals the position the slot is ready to be pushed to, or that
+	 * position plus one when it holds a message not popped yet. */
+	volatile uint32_t	Sequence;
+
+	int		Length;
+
+	/* Message content follows */
+} MessageQueue_Slot;
+
+typedef struct _MessageQueue {
+	char		*Slots;
+	int			SlotLength;
+	int			MessageLength;
+	uint32_t	Mask;
+
+	/* Next position to push to, shared by pushing threads */
+	volatile uint32_t	Head;
+
+	/* Next position to pop from, owned by the popping thread */
+	uint32_t	Tail;
+
+	/* Whether `EventFd' has been written since the last rearm */
+	volatile int	Signalled;
+
+	int			EventFd;
+} MessageQueue;
+
+int MessageQueue_Init(MessageQueue *q, int Capacity, int MessageLength);
+/* Description:
+ *  Initialize a MessageQueue.
+ * Parameters:
+ *  q             : The MessageQueue to be initialized.
+ *  Capacity      : The number of slots, must be a power of 2.
+ *  MessageLength : The maximum length of one message.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+int MessageQueue_Push(MessageQueue *q, const char *Content, int Length);
+/* Description:
+ *  Copy a message into the queue. May be called from any thread.
+ * Return value:
+ *  `Length' on success, -1 if the queue is full or the message is too long.
+ */
+
+int MessageQueue_Pop(MessageQueue *q, char *Buffer, int BufferLength);
+/* Description:
+ *  Take the oldest message out of the queue. Only one thread may call this.
+ *  A message longer than `BufferLength' is truncated.
+ * Return value:
+ *  The length of the message copied, or 0 if the queue is empty.
+ */
+
+#define	MessageQueue_GetFd(q_ptr)	((q_ptr) -> EventFd)
+/* Description:
+ *  The descriptor to wait on, readable while the queue has messages.
+ */
+
+#endif /* MESSAGEQUEUE_AVAILABLE */
+
+#endif // MESSAGEQUEUE_H_INCLUDED
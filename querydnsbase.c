@@ -1,4 +1,5 @@
 #include <time.h>
+#include <string.h>
 #ifdef WIN32
 #include <winsock2.h>
 #else
@@ -218,6 +219,47 @@ static int QueryFromServer(char *Content, int ContentLength, SOCKET ThisSocket)
 	return InternalInterface_SendTo(Interface, ThisSocket, Content, ContentLength);
 }
 
+/* Requests are answered from the cache by several threads at once */
+#ifdef WIN32
+#define	IDENTIFIER_NEXT(ptr)	InterlockedIncrement(ptr)
+#else /* WIN32 */
+#define	IDENTIFIER_NEXT(ptr)	__sync_add_and_fetch((ptr), 1)
+#endif /* WIN32 */
+
+/* Query the question of a request answered from the cache again, in the
+ * background, so that the cache gets refreshed */
+static void RefreshCache(const char *Content, SOCKET ThisSocket)
+{
+	static volatile long	NewIdentifier = 0;
+
+	struct _RefreshEntity {
+		ControlHeader	Header;
+		char			Entity[384];
+	} RefreshEntity;
+
+	const char	*RequestEntity = Content + sizeof(ControlHeader);
+	int			QuestionLength = DNSJumpOverQuestionRecords(RequestEntity) - DNSJumpHeader(RequestEntity);
+	DNSHeader	*NewHeader = (DNSHeader *)RefreshEntity.Entity;
+
+	if( QuestionLength <= 0 || DNS_HEADER_LENGTH + QuestionLength > sizeof(RefreshEntity.Entity) )
+	{
+		return;
+	}
+
+	memcpy(&(RefreshEntity.Header), Content, sizeof(ControlHeader));
+	RefreshEntity.Header.Refresh = TRUE;
+	strcpy(RefreshEntity.Header.Agent, "Refresh");
+
+	memset(NewHeader, 0, DNS_HEADER_LENGTH);
+	NewHeader -> Identifier = (uint16_t)IDENTIFIER_NEXT(&NewIdentifier);
+	NewHeader -> Flags.RecursionDesired = 1;
+	NewHeader -> QuestionCount = htons(1);
+
+	memcpy(RefreshEntity.Entity + DNS_HEADER_LENGTH, DNSJumpHeader(RequestEntity), QuestionLength);
+
+	QueryFromServer((char *)&RefreshEntity, sizeof(ControlHeader) + DNS_HEADER_LENGTH + QuestionLength, ThisSocket);
+}
+
 static int DNSFetchFromHosts(char *Content, int ContentLength, SOCKET ThisSocket)
 {
 	switch ( Hosts_Try(Content, &ContentLength) )
@@ -275,11 +317,19 @@ int QueryBase(char *Content, int ContentLength, int BufferLength, SOCKET ThisSoc
 
 		if( StateOfReceiving < 0 )
 		{
-			StateOfReceiving = DNSCache_FetchFromCache(RequestEntity, ContentLength - sizeof(ControlHeader), BufferLength - sizeof(ControlHeader));
+			BOOL	Refresh;
+
+			StateOfReceiving = DNSCache_FetchFromCache(RequestEntity, ContentLength - sizeof(ControlHeader), BufferLength - sizeof(ControlHeader), &Refresh);
 			if( StateOfReceiving > 0 )
 			{
 				ShowNormalMassage(Header -> Agent, Header -> RequestingDomain, RequestEntity, StateOfReceiving, 'C');
 				DomainStatistic_Add(Header -> RequestingDomain, &(Header -> RequestingDomainHashValue), STATISTIC_TYPE_CACHE);
+
+				if( Refresh == TRUE )
+				{
+					RefreshCache(Content, ThisSocket);
+				}
+
 				return StateOfReceiving;
 			}
 		} else {
@@ -47,6 +47,12 @@ int QueryDNSInterfaceInit(char *ConfigFile)
     TmpTypeDescriptor.boolean = FALSE;
     ConfigAddOption(&ConfigInfo, "OpenLocalTCP", STRATEGY_DEFAULT, TYPE_BOOLEAN, TmpTypeDescriptor, "Local TCP is opened");
 
+    TmpTypeDescriptor.INT32 = 1;
+    ConfigAddOption(&ConfigInfo, "UDPThreads", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor, NULL);
+
+    TmpTypeDescriptor.INT32 = 1;
+    ConfigAddOption(&ConfigInfo, "UDPBatchSize", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor, NULL);
+
 
     TmpTypeDescriptor.str = "TCP";
     ConfigAddOption(&ConfigInfo, "PrimaryServer", STRATEGY_REPLACE, TYPE_STRING, TmpTypeDescriptor, "Primary server");
@@ -63,6 +69,9 @@ int QueryDNSInterfaceInit(char *ConfigFile)
     TmpTypeDescriptor.boolean = FALSE;
     ConfigAddOption(&ConfigInfo, "ParallelQuery", STRATEGY_DEFAULT, TYPE_BOOLEAN, TmpTypeDescriptor, "UDP Parallel Query");
 
+    TmpTypeDescriptor.boolean = TRUE;
+    ConfigAddOption(&ConfigInfo, "HedgedQuery", STRATEGY_DEFAULT, TYPE_BOOLEAN, TmpTypeDescriptor, NULL);
+
     TmpTypeDescriptor.str = NULL;
     ConfigAddOption(&ConfigInfo, "ExcludedDomain", STRATEGY_APPEND, TYPE_STRING, TmpTypeDescriptor, NULL);
 
@@ -115,6 +124,9 @@ int QueryDNSInterfaceInit(char *ConfigFile)
 
 	ConfigAddAlias(&ConfigInfo, "address", "AppendHosts");
 
+    TmpTypeDescriptor.boolean = FALSE;
+    ConfigAddOption(&ConfigInfo, "CompileLists", STRATEGY_DEFAULT, TYPE_BOOLEAN, TmpTypeDescriptor, NULL);
+
 
 	TmpTypeDescriptor.boolean = TRUE;
     ConfigAddOption(&ConfigInfo, "UseCache", STRATEGY_DEFAULT, TYPE_BOOLEAN, TmpTypeDescriptor, "Use cache");
@@ -146,6 +158,24 @@ int QueryDNSInterfaceInit(char *ConfigFile)
     TmpTypeDescriptor.boolean = FALSE;
     ConfigAddOption(&ConfigInfo, "OverwriteCache", STRATEGY_DEFAULT, TYPE_BOOLEAN, TmpTypeDescriptor, NULL);
 
+    TmpTypeDescriptor.INT32 = 4096;
+    ConfigAddOption(&ConfigInfo, "ResponseCacheSize", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor, NULL);
+
+    TmpTypeDescriptor.INT32 = 8;
+    ConfigAddOption(&ConfigInfo, "CacheShards", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor, NULL);
+
+    TmpTypeDescriptor.INT32 = 0;
+    ConfigAddOption(&ConfigInfo, "HugePageCache", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor, NULL);
+
+    TmpTypeDescriptor.INT32 = 0;
+    ConfigAddOption(&ConfigInfo, "PrefetchThreshold", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor, NULL);
+
+    TmpTypeDescriptor.INT32 = 0;
+    ConfigAddOption(&ConfigInfo, "ServeStale", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor, NULL);
+
+    TmpTypeDescriptor.INT32 = 3600;
+    ConfigAddOption(&ConfigInfo, "NegativeCacheMaxTTL", STRATEGY_DEFAULT, TYPE_INT32, TmpTypeDescriptor, NULL);
+
 
     TmpTypeDescriptor.str = NULL;
     ConfigAddOption(&ConfigInfo, "DisabledType", STRATEGY_APPEND, TYPE_STRING, TmpTypeDescriptor, NULL);
@@ -13,6 +13,8 @@
 #include "excludedlist.h"
 #include "addresslist.h"
 #include "internalsocket.h"
+#include "reactor.h"
+#include "tcpframer.h"
 
 /* Variables */
 static BOOL			Inited = FALSE;
@@ -26,6 +28,8 @@ static int			RefusingResponseCode = 0;
 
 static QueryContext	Context;
 
+static Reactor		TCPReactor;
+
 /* Functions */
 int QueryDNSListenTCPInit(ConfigFileInfo *ConfigInfo)
 {
@@ -44,73 +48,29 @@ int QueryDNSListenTCPInit(ConfigFileInfo *ConfigInfo)
 
 	TCPOutcomeSocket = InternalInterface_TryBindLocal(10000, &TCPOutcomeAddress);
 
-	InternalInterface_InitQueryContext(&Context);
-
-	Inited = TRUE;
-
-	return 0;
-}
-
-static int Query(char *Content, int ContentLength, int BufferLength, SOCKET ThisSocket)
-{
-	int State;
-	uint16_t TCPLength = htons(ContentLength - sizeof(ControlHeader));
-
-	ControlHeader	*Header = (ControlHeader *)Content;
-
-	char *RequestEntity = Content + sizeof(ControlHeader);
-
-	Header -> RequestingDomain[0] = '\0';
-	DNSGetHostName(RequestEntity,
-				   DNSJumpHeader(RequestEntity),
-				   Header -> RequestingDomain
-				   );
-
-	StrToLower(Header -> RequestingDomain);
-
-	Header -> RequestingType =
-		(DNSRecordType)DNSGetRecordType(DNSJumpHeader(RequestEntity));
-
-	Header -> RequestingDomainHashValue = ELFHash(Header -> RequestingDomain, 0);
-
-	State = QueryBase(Content, ContentLength, BufferLength, TCPOutcomeSocket);
-
-	switch( State )
+	/* Clients may send many queries at a time, whose answers come back in a
+	 * burst */
 	{
-		case QUERY_RESULT_SUCCESS:
-			InternalInterface_QueryContextAddTCP(&Context, Header, ThisSocket);
-			return 0;
-			break;
+		int	BufferSize = 1024 * 1024;
 
-		case QUERY_RESULT_DISABLE:
-			((DNSHeader *)(RequestEntity)) -> Flags.Direction = 1;
-			((DNSHeader *)(RequestEntity)) -> Flags.RecursionAvailable = 1;
-			((DNSHeader *)(RequestEntity)) -> Flags.ResponseCode = RefusingResponseCode;
-			send(ThisSocket, (const char *)&TCPLength, 2, 0);
-			send(ThisSocket, RequestEntity, ContentLength - sizeof(ControlHeader), 0);
-			return -1;
-			break;
+		setsockopt(TCPOutcomeSocket, SOL_SOCKET, SO_RCVBUF, (const char *)&BufferSize, sizeof(BufferSize));
+	}
 
-		case QUERY_RESULT_ERROR:
-			return -1;
-			break;
+	InternalInterface_InitQueryContext(&Context);
 
-		default: /* Cache */
-			{
-				uint16_t NewTCPLength = htons(State);
+	Inited = TRUE;
 
-				send(ThisSocket, (const char *)&NewTCPLength, 2, 0);
-				send(ThisSocket, RequestEntity, State, 0);
-				return 0;
-			}
-			break;
-	}
+	return 0;
 }
 
 typedef struct _SocketInfo {
 	SOCKET	Socket;
 	char	Address[LENGTH_OF_IPV6_ADDRESS_ASCII + 1];
 	time_t	TimeAdd;
+
+	/* Queries may come in pieces, answers are queued until the client takes
+	 * them */
+	TCPFramer	Framer;
 } SocketInfo;
 
 static Bst	si;
@@ -125,38 +85,30 @@ static int InitSocketInfo(void)
 	return Bst_Init(&si, NULL, sizeof(SocketInfo), (int (*)(const void *, const void *))SocketInfoCompare);
 }
 
-static SOCKET SocketInfoMatch(fd_set *ReadySet, fd_set *ReadSet, char *ClientAddress, int32_t *Number)
+/* Find the client owning `Socket' and refresh its active time */
+static SocketInfo *SocketInfoMatch(SOCKET Socket, int32_t *Number)
 {
-	int32_t Start = -1;
-	SocketInfo *Info;
+	SocketInfo	Key;
+	SocketInfo	*Info;
+	int32_t		Found;
 
-	time_t	Now = time(NULL);
+	Key.Socket = Socket;
 
-	Info = Bst_Enum(&si, &Start);
-	while( Info != NULL )
+	Found = Bst_Search(&si, &Key, NULL);
+	if( Found < 0 )
 	{
-		if( FD_ISSET(Info -> Socket, ReadySet) )
-		{
-			Info -> TimeAdd = Now;
-			strcpy(ClientAddress, Info -> Address);
-			if( Number != NULL )
-			{
-				*Number = Start;
-			}
-			return Info -> Socket;
-		}
+		return NULL;
+	}
 
-		if( Now - Info -> TimeAdd > 2 )
-		{
-			CLOSE_SOCKET(Info -> Socket);
-			FD_CLR(Info -> Socket, ReadSet);
-			Bst_Delete_ByNumber(&si, Start);
-		}
+	Info = Bst_GetDataByNumber(&si, Found);
+	Info -> TimeAdd = time(NULL);
 
-		Info = Bst_Enum(&si, &Start);
+	if( Number != NULL )
+	{
+		*Number = Found;
 	}
 
-	return INVALID_SOCKET;
+	return Info;
 }
 
 static int SocketInfoAdd(SOCKET Socket, const char *Address)
@@ -167,10 +119,76 @@ static int SocketInfoAdd(SOCKET Socket, const char *Address)
 	strcpy(New.Address, Address);
 	New.TimeAdd = time(NULL);
 
-	return Bst_Add(&si, &New);
+	if( TCPFramer_Init(&(New.Framer), Socket) != 0 )
+	{
+		return -1;
+	}
+
+	if( Bst_Add(&si, &New) < 0 )
+	{
+		TCPFramer_Free(&(New.Framer));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void SocketInfoClose(SocketInfo *Info, int32_t Number)
+{
+	Reactor_Remove(&TCPReactor, Info -> Socket);
+	CLOSE_SOCKET(Info -> Socket);
+	TCPFramer_Free(&(Info -> Framer));
+
+	Bst_Delete_ByNumber(&si, Number);
+}
+
+static void ClientWritable(SOCKET Socket, void *Arg)
+{
+	int32_t		Number;
+	SocketInfo	*Info = SocketInfoMatch(Socket, &Number);
+
+	if( Info == NULL )
+	{
+		return;
+	}
+
+	switch( TCPFramer_Flush(&(Info -> Framer)) )
+	{
+		case -1:
+			INFO("Lost TCP connection to client %s.\n", Info -> Address);
+			SocketInfoClose(Info, Number);
+			break;
+
+		case 0:
+			Reactor_SetWritable(&TCPReactor, Socket, NULL);
+			break;
+
+		default:
+			break;
+	}
+}
+
+/* Send a message to a client, the part not sent at once is sent when the
+ * client takes it */
+static void SocketInfoSend(SocketInfo *Info, int32_t Number, const char *Message, int Length)
+{
+	switch( TCPFramer_Send(&(Info -> Framer), Message, Length) )
+	{
+		case -1:
+			INFO("Lost TCP connection to client %s.\n", Info -> Address);
+			SocketInfoClose(Info, Number);
+			break;
+
+		case 0:
+			break;
+
+		default:
+			Reactor_SetWritable(&TCPReactor, Info -> Socket, ClientWritable);
+			break;
+	}
 }
 
-static BOOL SocketInfoSwep(fd_set *ReadSet)
+static BOOL SocketInfoSwep(void)
 {
 	int32_t Start = -1;
 	SocketInfo *Info;
@@ -182,12 +200,9 @@ static BOOL SocketInfoSwep(fd_set *ReadSet)
 	{
 		if( Now - Info -> TimeAdd > 2 )
 		{
-			CLOSE_SOCKET(Info -> Socket);
-			FD_CLR(Info -> Socket, ReadSet);
-
 			INFO("TCP connection to client %s closed.\n", Info -> Address);
 
-			Bst_Delete_ByNumber(&si, Start);
+			SocketInfoClose(Info, Start);
 		}
 
 		Info = Bst_Enum(&si, &Start);
@@ -196,6 +211,55 @@ static BOOL SocketInfoSwep(fd_set *ReadSet)
 	return Bst_IsEmpty(&si);
 }
 
+static int Query(char *Content, int ContentLength, int BufferLength, SocketInfo *Info, int32_t Number)
+{
+	int State;
+
+	ControlHeader	*Header = (ControlHeader *)Content;
+
+	char *RequestEntity = Content + sizeof(ControlHeader);
+
+	Header -> RequestingDomain[0] = '\0';
+	DNSGetHostName(RequestEntity,
+				   DNSJumpHeader(RequestEntity),
+				   Header -> RequestingDomain
+				   );
+
+	StrToLower(Header -> RequestingDomain);
+
+	Header -> RequestingType =
+		(DNSRecordType)DNSGetRecordType(DNSJumpHeader(RequestEntity));
+
+	Header -> RequestingDomainHashValue = ELFHash(Header -> RequestingDomain, 0);
+
+	State = QueryBase(Content, ContentLength, BufferLength, TCPOutcomeSocket);
+
+	switch( State )
+	{
+		case QUERY_RESULT_SUCCESS:
+			InternalInterface_QueryContextAddTCP(&Context, Header, Info -> Socket);
+			return 0;
+			break;
+
+		case QUERY_RESULT_DISABLE:
+			((DNSHeader *)(RequestEntity)) -> Flags.Direction = 1;
+			((DNSHeader *)(RequestEntity)) -> Flags.RecursionAvailable = 1;
+			((DNSHeader *)(RequestEntity)) -> Flags.ResponseCode = RefusingResponseCode;
+			SocketInfoSend(Info, Number, RequestEntity, ContentLength - sizeof(ControlHeader));
+			return -1;
+			break;
+
+		case QUERY_RESULT_ERROR:
+			return -1;
+			break;
+
+		default: /* Cache */
+			SocketInfoSend(Info, Number, RequestEntity, State);
+			return 0;
+			break;
+	}
+}
+
 static void SendBack(char *Result, int Length)
 {
 	ControlHeader	*Header = (ControlHeader *)Result;
@@ -203,8 +267,8 @@ static void SendBack(char *Result, int Length)
 	uint16_t		Identifier = *(uint16_t *)RequestEntity;
 	int32_t			Number;
 	QueryContextEntry	*Entry;
-	uint16_t	 	EntityLength = Length - sizeof(ControlHeader);
-	uint16_t	 	EntityLength_n = htons(EntityLength);
+	SocketInfo		*Info;
+	int32_t			InfoNumber;
 
 	Number = InternalInterface_QueryContextFind(&Context, Identifier, Header -> RequestingDomainHashValue);
 	if( Number < 0 )
@@ -212,21 +276,127 @@ static void SendBack(char *Result, int Length)
 		return;
 	}
 
-	Entry = Bst_GetDataByNumber(&Context, Number);
+	Entry = InternalInterface_QueryContextGetByNumber(&Context, Number);
 
-	send(Entry -> Context.Socket, (const char *)&EntityLength_n, 2, 0);
-	send(Entry -> Context.Socket, RequestEntity, EntityLength, 0);
+	Info = SocketInfoMatch(Entry -> Context.Socket, &InfoNumber);
+	if( Info != NULL )
+	{
+		SocketInfoSend(Info, InfoNumber, RequestEntity, Length - sizeof(ControlHeader));
+	}
 
 	InternalInterface_QueryContextRemoveByNumber(&Context, Number);
+}
+
+static char		RequestEntity[2048];
+
+static void ClientReady(SOCKET Socket, void *Arg)
+{
+	ControlHeader	*Header = (ControlHeader *)RequestEntity;
+	SocketInfo	*Info;
+	int32_t		Number;
+	int			State;
 
+	Info = SocketInfoMatch(Socket, &Number);
+	if( Info == NULL )
+	{
+		return;
+	}
+
+	strcpy(Header -> Agent, Info -> Address);
+
+	if( TCPFramer_Receive(&(Info -> Framer)) != 0 )
+	{
+		INFO("Lost TCP connection to client %s.\n", Header -> Agent);
+		SocketInfoClose(Info, Number);
+		return;
+	}
+
+	/* Queries may come in pieces, or several at a time */
+	while( (State = TCPFramer_Next(&(Info -> Framer),
+								   RequestEntity + sizeof(ControlHeader),
+								   sizeof(RequestEntity) - sizeof(ControlHeader)
+								   )
+			) != 0 )
+	{
+		if( State < 0 )
+		{
+			continue;
+		}
+
+		Query(RequestEntity, State + sizeof(ControlHeader), sizeof(RequestEntity), Info, Number);
+
+		/* Sending may have failed and closed the connection */
+		Info = SocketInfoMatch(Socket, &Number);
+		if( Info == NULL )
+		{
+			return;
+		}
+	}
 }
 
-static int QueryDNSListenTCP(void)
+static void AcceptReady(SOCKET Socket, void *Arg)
 {
-	int		MaxFd = TCPIncomeSocket > TCPOutcomeSocket ? TCPIncomeSocket : TCPOutcomeSocket;
+	SOCKET			NewSocket;
+	Address_Type	Address;
+	socklen_t		AddrLen;
 
-	static fd_set	ReadSet, ReadySet;
+	char	AddressString[LENGTH_OF_IPV6_ADDRESS_ASCII + 1];
 
+	if( MAIN_FAMILY == AF_INET )
+	{
+		AddrLen = sizeof(struct sockaddr);
+		NewSocket = accept(Socket,
+						  (struct sockaddr *)&(Address.Addr.Addr4),
+						  (socklen_t *)&AddrLen
+						  );
+	} else {
+		AddrLen = sizeof(struct sockaddr_in6);
+		NewSocket = accept(Socket,
+						  (struct sockaddr *)&(Address.Addr.Addr6),
+						  (socklen_t *)&AddrLen
+						  );
+	}
+
+	if( NewSocket != INVALID_SOCKET )
+	{
+		if( Reactor_Add(&TCPReactor, NewSocket, ClientReady, NULL) != 0 )
+		{
+			CLOSE_SOCKET(NewSocket);
+			return;
+		}
+
+		if( MAIN_FAMILY == AF_INET )
+		{
+			strcpy(AddressString, inet_ntoa(Address.Addr.Addr4.sin_addr));
+		} else {
+			IPv6AddressToAsc(&(Address.Addr.Addr6.sin6_addr), AddressString);
+		}
+
+		if( SocketInfoAdd(NewSocket, AddressString) != 0 )
+		{
+			Reactor_Remove(&TCPReactor, NewSocket);
+			CLOSE_SOCKET(NewSocket);
+			return;
+		}
+
+		INFO("TCP connection to client %s established.\n", AddressString);
+	}
+}
+
+static void OutcomeReady(SOCKET Socket, void *Arg)
+{
+	static char Result[sizeof(ControlHeader) + 65535];
+	int	State;
+
+	State = recvfrom(Socket, Result, sizeof(Result), 0, NULL, NULL);
+	if( State > 0 )
+	{
+		SendBack(Result, State);
+	}
+}
+
+static int QueryDNSListenTCP(void)
+{
 	int		NumberOfQueryBeforeSwep = 0;
 
 	static const struct timeval	LongTime = {3600, 0};
@@ -234,7 +404,6 @@ static int QueryDNSListenTCP(void)
 
 	struct timeval	TimeLimit = LongTime;
 
-	static char		RequestEntity[2048];
 	ControlHeader	*Header = (ControlHeader *)RequestEntity;
 
 	InternalInterface_InitControlHeader(Header);
@@ -244,17 +413,17 @@ static int QueryDNSListenTCP(void)
 
 	InitSocketInfo();
 
-	FD_ZERO(&ReadSet);
-	FD_ZERO(&ReadySet);
+	if( Reactor_Init(&TCPReactor) != 0 )
+	{
+		return -1;
+	}
 
-	FD_SET(TCPIncomeSocket, &ReadSet);
-	FD_SET(TCPOutcomeSocket, &ReadSet);
+	Reactor_Add(&TCPReactor, TCPIncomeSocket, AcceptReady, NULL);
+	Reactor_Add(&TCPReactor, TCPOutcomeSocket, OutcomeReady, NULL);
 
 	while( TRUE )
 	{
-		ReadySet = ReadSet;
-
-		switch( select(MaxFd + 1, &ReadySet, NULL, NULL, &TimeLimit) )
+		switch( Reactor_Wait(&TCPReactor, &TimeLimit) )
 		{
 			case SOCKET_ERROR:
 				ERRORMSG("\n\n\n\n\n\n\n\n\n\n");
@@ -263,9 +432,9 @@ static int QueryDNSListenTCP(void)
 				break;
 
 			case 0:
-				if( SocketInfoSwep(&ReadSet) == TRUE )
+				if( SocketInfoSwep() == TRUE )
 				{
-					Bst_Reset(&Context);
+					InternalInterface_QueryContextReset(&Context);
 					TimeLimit = LongTime;
 				} else {
 					InternalInterface_QueryContextSwep(&Context, 10, NULL);
@@ -282,98 +451,9 @@ static int QueryDNSListenTCP(void)
 				if( NumberOfQueryBeforeSwep > 1024 )
 				{
 					InternalInterface_QueryContextSwep(&Context, 2, NULL);
-					SocketInfoSwep(&ReadSet);
+					SocketInfoSwep();
 					NumberOfQueryBeforeSwep = 0;
 				}
-
-				if( FD_ISSET(TCPIncomeSocket, &ReadySet) )
-				{
-					SOCKET			NewSocket;
-					Address_Type	Address;
-					socklen_t		AddrLen;
-
-					char	AddressString[LENGTH_OF_IPV6_ADDRESS_ASCII + 1];
-
-					if( MAIN_FAMILY == AF_INET )
-					{
-						AddrLen = sizeof(struct sockaddr);
-						NewSocket = accept(TCPIncomeSocket,
-										  (struct sockaddr *)&(Address.Addr.Addr4),
-										  (socklen_t *)&AddrLen
-										  );
-					} else {
-						AddrLen = sizeof(struct sockaddr_in6);
-						NewSocket = accept(TCPIncomeSocket,
-										  (struct sockaddr *)&(Address.Addr.Addr6),
-										  (socklen_t *)&AddrLen
-										  );
-					}
-
-					if( NewSocket != INVALID_SOCKET )
-					{
-						FD_SET(NewSocket, &ReadSet);
-
-						if( MAIN_FAMILY == AF_INET )
-						{
-							strcpy(AddressString, inet_ntoa(Address.Addr.Addr4.sin_addr));
-						} else {
-							IPv6AddressToAsc(&(Address.Addr.Addr6.sin6_addr), AddressString);
-						}
-
-						if( NewSocket > MaxFd )
-						{
-							MaxFd = NewSocket;
-						}
-
-						SocketInfoAdd(NewSocket, AddressString);
-						INFO("TCP connection to client %s established.\n", AddressString);
-					}
-
-				} else if( FD_ISSET(TCPOutcomeSocket, &ReadySet) )
-				{
-					static char Result[2048];
-					int	State;
-
-					State = recvfrom(TCPOutcomeSocket, Result, sizeof(Result), 0, NULL, NULL);
-					if( State > 0 )
-					{
-						SendBack(Result, State);
-					}
-				} else {
-					SOCKET	Socket;
-					int		State;
-
-					int32_t	Number;
-
-					Socket = SocketInfoMatch(&ReadySet, &ReadSet, Header -> Agent, &Number);
-
-					if( Socket != INVALID_SOCKET )
-					{
-						uint16_t TCPLength;
-
-						if( recv(Socket, (char *)&TCPLength, 2, MSG_NOSIGNAL) < 2 )
-						{
-							Bst_Delete_ByNumber(&si, Number);
-							FD_CLR(Socket, &ReadSet);
-							CLOSE_SOCKET(Socket);
-							break;
-						}
-
-						TCPLength = ntohs(TCPLength);
-
-						State = recv(Socket, RequestEntity + sizeof(ControlHeader), sizeof(RequestEntity) - sizeof(ControlHeader), MSG_NOSIGNAL);
-						if( State < 1 )
-						{
-							Bst_Delete_ByNumber(&si, Number);
-							FD_CLR(Socket, &ReadSet);
-							CLOSE_SOCKET(Socket);
-							INFO("Lost TCP connection to client %s.\n", Header -> Agent);
-							break;
-						}
-
-						Query(RequestEntity, State + sizeof(ControlHeader), sizeof(RequestEntity), Socket);
-					}
-				}
 			break;
 		}
 	}
@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* recvmmsg(), sendmmsg() */
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -12,47 +15,156 @@
 #include "excludedlist.h"
 #include "internalsocket.h"
 
+/* recvmmsg()/sendmmsg() are Linux only, MSG_WAITFORONE tells whether the
+ * C library declares them. */
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define UDP_BATCHING
+#endif
+
+#define	UDP_ENTITY_LENGTH	(2048 + 2 * sizeof(ControlHeader))
+
 /* Variables */
 static BOOL			Inited = FALSE;
 
-static SOCKET		UDPIncomeSocket;
+#ifdef UDP_BATCHING
+typedef struct _UDPBatchEntry {
+	Address_Type	ClientAddr;
+	struct iovec	Vector;
+
+	char	RequestEntity[UDP_ENTITY_LENGTH];
+} UDPBatchEntry;
+#endif /* UDP_BATCHING */
+
+typedef struct _UDPWorker {
+	SOCKET	IncomeSocket;
+	SOCKET	OutcomeSocket;
+
+	char	RequestEntity[UDP_ENTITY_LENGTH];
+
+#ifdef UDP_BATCHING
+	UDPBatchEntry	*Batch;
+
+	struct mmsghdr	*RecvMessages;
+	struct mmsghdr	*SendMessages;
+	struct iovec	*SendVectors;
+#endif /* UDP_BATCHING */
+} UDPWorker;
+
+static UDPWorker	*Workers = NULL;
 
-static SOCKET		UDPOutcomeSocket;
+static int			NumberOfWorkers = 1;
 
 static int			MaximumMessageSize;
 
 static int			RefusingResponseCode = 0;
 
+#define	MAXIMUM_UDP_THREADS	64
+
+/* Number of datagrams taken by one recvmmsg(), 1 means no batching */
+static int			BatchSize = 1;
+
+#define	MAXIMUM_UDP_BATCH_SIZE	256
+
 /* Functions */
-int QueryDNSListenUDPInit(ConfigFileInfo *ConfigInfo)
+static int QueryDNSListenUDPInitWorker(UDPWorker *Worker, int Number)
 {
-	RefusingResponseCode = ConfigGetInt32(ConfigInfo, "RefusingResponseCode");
-	UDPIncomeSocket = InternalInterface_Open2(MAIN_WORKING_ADDRESS, MAIN_WORKING_PORT, INTERNAL_INTERFACE_UDP_INCOME);
-	if( UDPIncomeSocket == INVALID_SOCKET )
+	if( Number == 0 )
+	{
+		if( NumberOfWorkers > 1 )
+		{
+			Worker -> IncomeSocket = InternalInterface_Open2ReusePort(MAIN_WORKING_ADDRESS, MAIN_WORKING_PORT, INTERNAL_INTERFACE_UDP_INCOME);
+		} else {
+			Worker -> IncomeSocket = InternalInterface_Open2(MAIN_WORKING_ADDRESS, MAIN_WORKING_PORT, INTERNAL_INTERFACE_UDP_INCOME);
+		}
+	} else {
+		struct sockaddr	*Address;
+
+		InternalInterface_GetAddress(INTERNAL_INTERFACE_UDP_INCOME, &Address);
+		Worker -> IncomeSocket = InternalInterface_OpenASocketReusePort(MAIN_FAMILY, Address);
+	}
+
+	if( Worker -> IncomeSocket == INVALID_SOCKET )
 	{
 		ShowFatalMessage("Creating UDP socket failed.", GET_LAST_ERROR());
 		return -1;
-	} else {
-		INFO("UDP socket %s:%d created.\n", MAIN_WORKING_ADDRESS, MAIN_WORKING_PORT);
 	}
 
-	InternalInterface_GetAddress(INTERNAL_INTERFACE_UDP_INCOME, NULL);
-	UDPOutcomeSocket = socket(MAIN_FAMILY, SOCK_DGRAM, IPPROTO_UDP);
-	if( UDPOutcomeSocket == INVALID_SOCKET )
+	Worker -> OutcomeSocket = socket(MAIN_FAMILY, SOCK_DGRAM, IPPROTO_UDP);
+	if( Worker -> OutcomeSocket == INVALID_SOCKET )
 	{
 		ShowFatalMessage("Creating UDP outcome socket failed.", GET_LAST_ERROR());
 		return -1;
 	}
 
+	return 0;
+}
+
+int QueryDNSListenUDPInit(ConfigFileInfo *ConfigInfo)
+{
+	int loop;
+
+	RefusingResponseCode = ConfigGetInt32(ConfigInfo, "RefusingResponseCode");
+
+	NumberOfWorkers = ConfigGetInt32(ConfigInfo, "UDPThreads");
+	if( NumberOfWorkers < 1 )
+	{
+		NumberOfWorkers = 1;
+	} else if( NumberOfWorkers > MAXIMUM_UDP_THREADS )
+	{
+		NumberOfWorkers = MAXIMUM_UDP_THREADS;
+	}
+
+#ifndef INTERNAL_INTERFACE_REUSEPORT
+	if( NumberOfWorkers > 1 )
+	{
+		INFO("SO_REUSEPORT is not available, `UDPThreads' is ignored.\n");
+		NumberOfWorkers = 1;
+	}
+#endif /* INTERNAL_INTERFACE_REUSEPORT */
+
+	BatchSize = ConfigGetInt32(ConfigInfo, "UDPBatchSize");
+	if( BatchSize < 1 )
+	{
+		BatchSize = 1;
+	} else if( BatchSize > MAXIMUM_UDP_BATCH_SIZE )
+	{
+		BatchSize = MAXIMUM_UDP_BATCH_SIZE;
+	}
+
+#ifndef UDP_BATCHING
+	if( BatchSize > 1 )
+	{
+		INFO("recvmmsg() is not available, `UDPBatchSize' is ignored.\n");
+		BatchSize = 1;
+	}
+#endif /* UDP_BATCHING */
+
+	Workers = SafeMalloc(sizeof(UDPWorker) * NumberOfWorkers);
+	if( Workers == NULL )
+	{
+		return -1;
+	}
+
+	for( loop = 0; loop != NumberOfWorkers; ++loop )
+	{
+		if( QueryDNSListenUDPInitWorker(Workers + loop, loop) != 0 )
+		{
+			return -1;
+		}
+	}
+
+	INFO("UDP socket %s:%d created (%d thread(s)).\n", MAIN_WORKING_ADDRESS, MAIN_WORKING_PORT, NumberOfWorkers);
+
 	Inited = TRUE;
 
 	return 0;
 }
 
-static int Query(char *Content, int ContentLength, int BufferLength, Address_Type *ClientAddr)
+/* Returns the length of the message to be sent back to the client, which is
+ * stored at `*SendBack', or 0 if nothing should be sent back right now. */
+static int Query(UDPWorker *Worker, char *Content, int ContentLength, int BufferLength, Address_Type *ClientAddr, char **SendBack)
 {
 	int SendBackLength = 0;
-	int ret = 0;
 
 	int State;
 
@@ -87,11 +199,11 @@ static int Query(char *Content, int ContentLength, int BufferLength, Address_Typ
 		Header -> RequestingDomainHashValue = ELFHash(Header -> RequestingDomain, 0);
 	}
 
-	State = QueryBase(Content, ContentLength, BufferLength, UDPOutcomeSocket);
+	State = QueryBase(Content, ContentLength, BufferLength, Worker -> OutcomeSocket);
 	switch( State )
 	{
 		case QUERY_RESULT_SUCCESS:
-			ret = 0;
+		case QUERY_RESULT_ERROR:
 			break;
 
 		case QUERY_RESULT_DISABLE:
@@ -99,40 +211,57 @@ static int Query(char *Content, int ContentLength, int BufferLength, Address_Typ
 			((DNSHeader *)(RequestEntity)) -> Flags.RecursionAvailable = 1;
 			((DNSHeader *)(RequestEntity)) -> Flags.ResponseCode = RefusingResponseCode;
 			SendBackLength = ContentLength - sizeof(ControlHeader);
-			ret = -1;
-			break;
-
-		case QUERY_RESULT_ERROR:
-			ret = -1;
 			break;
 
 		default: /* Cache */
 			SendBackLength = State;
-			ret = 0;
 			break;
 	}
 
-	if( SendBackLength > 0 )
+	if( SendBackLength > 0 && Header -> NeededHeader == TRUE )
 	{
-		if( Header -> NeededHeader == TRUE )
+		SendBackLength += sizeof(ControlHeader);
+		RequestEntity -= sizeof(ControlHeader);
+	}
+
+	*SendBack = RequestEntity;
+
+	return SendBackLength;
+}
+
+static void QueryDNSListenUDPReceivingFailed(Address_Type *ClientAddr)
+{
+	if( ErrorMessages == TRUE )
+	{
+		int		ErrorNum = GET_LAST_ERROR();
+		char	ErrorMessage[320];
+
+		ErrorMessage[0] ='\0';
+
+		GetErrorMsg(ErrorNum, ErrorMessage, sizeof(ErrorMessage));
+		if( MAIN_FAMILY == AF_INET )
 		{
-			SendBackLength += sizeof(ControlHeader);
-			RequestEntity -= sizeof(ControlHeader);
-		}
+			printf("An error occured while receiving from %s : %d : %s .\n",
+				   inet_ntoa(ClientAddr -> Addr.Addr4.sin_addr),
+				   ErrorNum,
+				   ErrorMessage
+				   );
+		} else {
+			char Addr[LENGTH_OF_IPV6_ADDRESS_ASCII] = {0};
 
-		sendto(UDPIncomeSocket,
-			   RequestEntity,
-			   SendBackLength,
-			   0,
-			   (struct sockaddr *)&(ClientAddr -> Addr),
-			   GetAddressLength(MAIN_FAMILY)
-			   );
-	}
+			IPv6AddressToAsc(&(ClientAddr -> Addr.Addr6.sin6_addr), Addr);
+
+			printf("An error occured while receiving from %s : %d : %s .\n",
+				   Addr,
+				   ErrorNum,
+				   ErrorMessage
+				   );
 
-	return ret;
+		}
+	}
 }
 
-static int QueryDNSListenUDP(void)
+static int QueryDNSListenUDP(UDPWorker *Worker)
 {
 	socklen_t		AddrLen;
 
@@ -140,9 +269,11 @@ static int QueryDNSListenUDP(void)
 
 	int				State;
 
-	static char		RequestEntity[2048 + 2 * sizeof(ControlHeader)];
+	char			*RequestEntity = Worker -> RequestEntity;
 	ControlHeader	*Header = (ControlHeader *)RequestEntity;
 
+	char			*SendBack;
+
 	InternalInterface_InitControlHeader(Header);
 	Header -> NeededHeader = FALSE;
 	ClientAddr.family = MAIN_FAMILY;
@@ -155,9 +286,9 @@ static int QueryDNSListenUDP(void)
 		if( MAIN_FAMILY == AF_INET )
 		{
 			AddrLen = sizeof(struct sockaddr);
-			State = recvfrom(UDPIncomeSocket,
+			State = recvfrom(Worker -> IncomeSocket,
 							 RequestEntity + sizeof(ControlHeader),
-							 sizeof(RequestEntity) - sizeof(ControlHeader),
+							 sizeof(Worker -> RequestEntity) - sizeof(ControlHeader),
 							 0,
 							 (struct sockaddr *)&(ClientAddr.Addr.Addr4),
 							 &AddrLen
@@ -165,9 +296,9 @@ static int QueryDNSListenUDP(void)
 
 		} else {
 			AddrLen = sizeof(struct sockaddr_in6);
-			State = recvfrom(UDPIncomeSocket,
+			State = recvfrom(Worker -> IncomeSocket,
 							 RequestEntity + sizeof(ControlHeader),
-							 sizeof(RequestEntity) - sizeof(ControlHeader),
+							 sizeof(Worker -> RequestEntity) - sizeof(ControlHeader),
 							 0,
 							 (struct sockaddr *)&(ClientAddr.Addr.Addr6),
 							 &AddrLen
@@ -177,48 +308,189 @@ static int QueryDNSListenUDP(void)
 
 		if(State < 1)
 		{
-			if( ErrorMessages == TRUE )
+			QueryDNSListenUDPReceivingFailed(&ClientAddr);
+			continue;
+		}
+
+		State = Query(Worker, RequestEntity, State + sizeof(ControlHeader), sizeof(Worker -> RequestEntity), &ClientAddr, &SendBack);
+		if( State > 0 )
+		{
+			sendto(Worker -> IncomeSocket,
+				   SendBack,
+				   State,
+				   0,
+				   (struct sockaddr *)&(ClientAddr.Addr),
+				   GetAddressLength(MAIN_FAMILY)
+				   );
+		}
+	}
+
+	return 0;
+}
+
+#ifdef UDP_BATCHING
+static int QueryDNSListenUDPBatchInit(UDPWorker *Worker)
+{
+	int loop;
+
+	Worker -> Batch = SafeMalloc(sizeof(UDPBatchEntry) * BatchSize);
+	Worker -> RecvMessages = SafeMalloc(sizeof(struct mmsghdr) * BatchSize);
+	Worker -> SendMessages = SafeMalloc(sizeof(struct mmsghdr) * BatchSize);
+	Worker -> SendVectors = SafeMalloc(sizeof(struct iovec) * BatchSize);
+
+	if( Worker -> Batch == NULL ||
+		Worker -> RecvMessages == NULL ||
+		Worker -> SendMessages == NULL ||
+		Worker -> SendVectors == NULL
+		)
+	{
+		return -1;
+	}
+
+	memset(Worker -> RecvMessages, 0, sizeof(struct mmsghdr) * BatchSize);
+	memset(Worker -> SendMessages, 0, sizeof(struct mmsghdr) * BatchSize);
+
+	for( loop = 0; loop != BatchSize; ++loop )
+	{
+		UDPBatchEntry	*Entry = Worker -> Batch + loop;
+		ControlHeader	*Header = (ControlHeader *)(Entry -> RequestEntity);
+
+		InternalInterface_InitControlHeader(Header);
+		Header -> NeededHeader = FALSE;
+		Entry -> ClientAddr.family = MAIN_FAMILY;
+
+		Entry -> Vector.iov_base = Entry -> RequestEntity + sizeof(ControlHeader);
+		Entry -> Vector.iov_len = sizeof(Entry -> RequestEntity) - sizeof(ControlHeader);
+
+		Worker -> RecvMessages[loop].msg_hdr.msg_name = &(Entry -> ClientAddr.Addr);
+		Worker -> RecvMessages[loop].msg_hdr.msg_iov = &(Entry -> Vector);
+		Worker -> RecvMessages[loop].msg_hdr.msg_iovlen = 1;
+
+		Worker -> SendMessages[loop].msg_hdr.msg_iov = Worker -> SendVectors + loop;
+		Worker -> SendMessages[loop].msg_hdr.msg_iovlen = 1;
+		Worker -> SendMessages[loop].msg_hdr.msg_namelen = GetAddressLength(MAIN_FAMILY);
+	}
+
+	return 0;
+}
+
+/* Sends the first `Count' messages of `Worker -> SendMessages', resorting to
+ * sendto() for those sendmmsg() could not take. */
+static void QueryDNSListenUDPBatchFlush(UDPWorker *Worker, int Count)
+{
+	int Sent = 0;
+
+	while( Sent < Count )
+	{
+		int State = sendmmsg(Worker -> IncomeSocket, Worker -> SendMessages + Sent, Count - Sent, 0);
+
+		if( State < 1 )
+		{
+			struct msghdr	*Message = &(Worker -> SendMessages[Sent].msg_hdr);
+
+			/* Skip the one that failed, so it cannot stall the others */
+			sendto(Worker -> IncomeSocket,
+				   Message -> msg_iov -> iov_base,
+				   Message -> msg_iov -> iov_len,
+				   0,
+				   (struct sockaddr *)(Message -> msg_name),
+				   Message -> msg_namelen
+				   );
+
+			State = 1;
+		}
+
+		Sent += State;
+	}
+}
+
+static int QueryDNSListenUDPBatch(UDPWorker *Worker)
+{
+	if( QueryDNSListenUDPBatchInit(Worker) != 0 )
+	{
+		ERRORMSG("Batching UDP I/O failed, falling back.\n");
+		return QueryDNSListenUDP(Worker);
+	}
+
+	while( TRUE )
+	{
+		int	NumberOfReceived;
+		int	NumberToSend = 0;
+		int	loop;
+
+		for( loop = 0; loop != BatchSize; ++loop )
+		{
+			Worker -> RecvMessages[loop].msg_hdr.msg_namelen = sizeof(Worker -> Batch[loop].ClientAddr.Addr);
+		}
+
+		/* Block for the first datagram, then take whatever else is queued */
+		NumberOfReceived = recvmmsg(Worker -> IncomeSocket, Worker -> RecvMessages, BatchSize, MSG_WAITFORONE, NULL);
+		if( NumberOfReceived < 1 )
+		{
+			if( GET_LAST_ERROR() == ENOSYS )
 			{
-				int		ErrorNum = GET_LAST_ERROR();
-				char	ErrorMessage[320];
-
-				ErrorMessage[0] ='\0';
-
-				GetErrorMsg(ErrorNum, ErrorMessage, sizeof(ErrorMessage));
-				if( MAIN_FAMILY == AF_INET )
-				{
-					printf("An error occured while receiving from %s : %d : %s .\n",
-						   inet_ntoa(ClientAddr.Addr.Addr4.sin_addr),
-						   ErrorNum,
-						   ErrorMessage
-						   );
-				} else {
-					char Addr[LENGTH_OF_IPV6_ADDRESS_ASCII] = {0};
-
-					IPv6AddressToAsc(&(ClientAddr.Addr.Addr6.sin6_addr), Addr);
-
-					printf("An error occured while receiving from %s : %d : %s .\n",
-						   Addr,
-						   ErrorNum,
-						   ErrorMessage
-						   );
-
-				}
+				INFO("recvmmsg() is not supported, falling back.\n");
+				return QueryDNSListenUDP(Worker);
 			}
+
+			QueryDNSListenUDPReceivingFailed(&(Worker -> Batch[0].ClientAddr));
 			continue;
 		}
 
-		Query(RequestEntity, State + sizeof(ControlHeader), sizeof(RequestEntity), &ClientAddr);
+		for( loop = 0; loop != NumberOfReceived; ++loop )
+		{
+			UDPBatchEntry	*Entry = Worker -> Batch + loop;
+			char			*SendBack;
+			int				SendBackLength;
+
+			if( Worker -> RecvMessages[loop].msg_len < 1 )
+			{
+				continue;
+			}
 
+			SendBackLength = Query(Worker,
+								   Entry -> RequestEntity,
+								   Worker -> RecvMessages[loop].msg_len + sizeof(ControlHeader),
+								   sizeof(Entry -> RequestEntity),
+								   &(Entry -> ClientAddr),
+								   &SendBack
+								   );
+
+			if( SendBackLength > 0 )
+			{
+				Worker -> SendVectors[NumberToSend].iov_base = SendBack;
+				Worker -> SendVectors[NumberToSend].iov_len = SendBackLength;
+				Worker -> SendMessages[NumberToSend].msg_hdr.msg_name = &(Entry -> ClientAddr.Addr);
+
+				++NumberToSend;
+			}
+		}
+
+		QueryDNSListenUDPBatchFlush(Worker, NumberToSend);
 	}
 
 	return 0;
 }
+#endif /* UDP_BATCHING */
 
 void QueryDNSListenUDPStart(void)
 {
-	ThreadHandle t;
+	int loop;
+
+	for( loop = 0; loop != NumberOfWorkers; ++loop )
+	{
+		ThreadHandle t;
 
-	CREATE_THREAD(QueryDNSListenUDP, NULL, t);
-	DETACH_THREAD(t);
+#ifdef UDP_BATCHING
+		if( BatchSize > 1 )
+		{
+			CREATE_THREAD(QueryDNSListenUDPBatch, Workers + loop, t);
+		} else {
+			CREATE_THREAD(QueryDNSListenUDP, Workers + loop, t);
+		}
+#else /* UDP_BATCHING */
+		CREATE_THREAD(QueryDNSListenUDP, Workers + loop, t);
+#endif /* UDP_BATCHING */
+		DETACH_THREAD(t);
+	}
 }
@@ -0,0 +1,285 @@
+#include <string.h>
+#include "reactor.h"
+
+#ifdef REACTOR_EPOLL
+
+#include <sys/epoll.h>
+
+#define	REACTOR_EVENTS_PER_WAIT	64
+
+int Reactor_Init(Reactor *r)
+{
+	r -> EpollFd = epoll_create(REACTOR_EVENTS_PER_WAIT);
+	if( r -> EpollFd < 0 )
+	{
+		return -1;
+	}
+
+	return Array_Init(&(r -> Handlers), sizeof(Reactor_Handler), 16, FALSE, NULL);
+}
+
+int Reactor_Add(Reactor *r, SOCKET Socket, Reactor_Callback Callback, void *Arg)
+{
+	Reactor_Handler	*Handler;
+	struct epoll_event	Event;
+
+	if( Socket < 0 )
+	{
+		return -1;
+	}
+
+	while( r -> Handlers.Used <= Socket )
+	{
+		Reactor_Handler	Empty = {INVALID_SOCKET, NULL, NULL, NULL, 0};
+
+		if( Array_PushBack(&(r -> Handlers), &Empty, NULL) < 0 )
+		{
+			return -2;
+		}
+	}
+
+	Handler = Array_GetBySubscript(&(r -> Handlers), Socket);
+
+	Handler -> Socket = Socket;
+	Handler -> Callback = Callback;
+	Handler -> Arg = Arg;
+	Handler -> WriteCallback = NULL;
+	++(Handler -> Generation);
+
+	memset(&Event, 0, sizeof(Event));
+	Event.events = EPOLLIN;
+	Event.data.u64 = ((uint64_t)(Handler -> Generation) << 32) | (uint32_t)Socket;
+
+	if( epoll_ctl(r -> EpollFd, EPOLL_CTL_ADD, Socket, &Event) != 0 )
+	{
+		if( errno != EEXIST || epoll_ctl(r -> EpollFd, EPOLL_CTL_MOD, Socket, &Event) != 0 )
+		{
+			Handler -> Socket = INVALID_SOCKET;
+			Handler -> Callback = NULL;
+			return -3;
+		}
+	}
+
+	return 0;
+}
+
+int Reactor_Remove(Reactor *r, SOCKET Socket)
+{
+	Reactor_Handler	*Handler = Array_GetBySubscript(&(r -> Handlers), Socket);
+	struct epoll_event	Event; /* Kernels before 2.6.9 require non-NULL */
+
+	if( Handler == NULL || Handler -> Callback == NULL )
+	{
+		return -1;
+	}
+
+	Handler -> Socket = INVALID_SOCKET;
+	Handler -> Callback = NULL;
+	Handler -> WriteCallback = NULL;
+
+	return epoll_ctl(r -> EpollFd, EPOLL_CTL_DEL, Socket, &Event);
+}
+
+int Reactor_SetWritable(Reactor *r, SOCKET Socket, Reactor_Callback Callback)
+{
+	Reactor_Handler	*Handler = Array_GetBySubscript(&(r -> Handlers), Socket);
+	struct epoll_event	Event;
+
+	if( Handler == NULL || Handler -> Callback == NULL )
+	{
+		return -1;
+	}
+
+	Handler -> WriteCallback = Callback;
+
+	memset(&Event, 0, sizeof(Event));
+	Event.events = Callback == NULL ? EPOLLIN : EPOLLIN | EPOLLOUT;
+	Event.data.u64 = ((uint64_t)(Handler -> Generation) << 32) | (uint32_t)Socket;
+
+	return epoll_ctl(r -> EpollFd, EPOLL_CTL_MOD, Socket, &Event);
+}
+
+int Reactor_Wait(Reactor *r, struct timeval *TimeLimit)
+{
+	struct epoll_event	Events[REACTOR_EVENTS_PER_WAIT];
+	int	TimeOut = -1;
+	int	NumberOfEvents;
+	int	loop;
+
+	if( TimeLimit != NULL )
+	{
+		TimeOut = TimeLimit -> tv_sec * 1000 + TimeLimit -> tv_usec / 1000;
+	}
+
+	NumberOfEvents = epoll_wait(r -> EpollFd, Events, REACTOR_EVENTS_PER_WAIT, TimeOut);
+	if( NumberOfEvents < 0 )
+	{
+		return errno == EINTR ? 0 : SOCKET_ERROR;
+	}
+
+	for( loop = 0; loop != NumberOfEvents; ++loop )
+	{
+		SOCKET		Socket = (SOCKET)(uint32_t)(Events[loop].data.u64);
+		uint32_t	Generation = (uint32_t)(Events[loop].data.u64 >> 32);
+
+		Reactor_Handler	*Handler = Array_GetBySubscript(&(r -> Handlers), Socket);
+
+		/* The handler may be gone or replaced by an earlier callback */
+		if( Handler == NULL || Handler -> Callback == NULL || Handler -> Generation != Generation )
+		{
+			continue;
+		}
+
+		if( Handler -> WriteCallback != NULL && (Events[loop].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) )
+		{
+			Handler -> WriteCallback(Socket, Handler -> Arg);
+
+			/* Also by the write callback */
+			Handler = Array_GetBySubscript(&(r -> Handlers), Socket);
+			if( Handler == NULL || Handler -> Callback == NULL || Handler -> Generation != Generation )
+			{
+				continue;
+			}
+		}
+
+		if( Events[loop].events & (EPOLLIN | EPOLLERR | EPOLLHUP) )
+		{
+			Handler -> Callback(Socket, Handler -> Arg);
+		}
+	}
+
+	return NumberOfEvents;
+}
+
+#else /* REACTOR_EPOLL */
+
+int Reactor_Init(Reactor *r)
+{
+	FD_ZERO(&(r -> ReadSet));
+	FD_ZERO(&(r -> WriteSet));
+	r -> MaxFd = 0;
+
+	return Array_Init(&(r -> Handlers), sizeof(Reactor_Handler), 8, FALSE, NULL);
+}
+
+int Reactor_Add(Reactor *r, SOCKET Socket, Reactor_Callback Callback, void *Arg)
+{
+	Reactor_Handler	New = {Socket, Callback, Arg, NULL, 0};
+	int	loop;
+
+	for( loop = 0; loop != r -> Handlers.Used; ++loop )
+	{
+		Reactor_Handler	*Handler = Array_GetBySubscript(&(r -> Handlers), loop);
+
+		if( Handler -> Socket == INVALID_SOCKET )
+		{
+			memcpy(Handler, &New, sizeof(Reactor_Handler));
+			break;
+		}
+	}
+
+	if( loop == r -> Handlers.Used && Array_PushBack(&(r -> Handlers), &New, NULL) < 0 )
+	{
+		return -1;
+	}
+
+	FD_SET(Socket, &(r -> ReadSet));
+	if( Socket > r -> MaxFd )
+	{
+		r -> MaxFd = Socket;
+	}
+
+	return 0;
+}
+
+int Reactor_Remove(Reactor *r, SOCKET Socket)
+{
+	int	loop;
+
+	for( loop = 0; loop != r -> Handlers.Used; ++loop )
+	{
+		Reactor_Handler	*Handler = Array_GetBySubscript(&(r -> Handlers), loop);
+
+		if( Handler -> Socket == Socket )
+		{
+			Handler -> Socket = INVALID_SOCKET;
+			Handler -> Callback = NULL;
+			Handler -> WriteCallback = NULL;
+
+			FD_CLR(Socket, &(r -> ReadSet));
+			FD_CLR(Socket, &(r -> ReadySet));
+			FD_CLR(Socket, &(r -> WriteSet));
+			FD_CLR(Socket, &(r -> WritableSet));
+
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int Reactor_SetWritable(Reactor *r, SOCKET Socket, Reactor_Callback Callback)
+{
+	int	loop;
+
+	for( loop = 0; loop != r -> Handlers.Used; ++loop )
+	{
+		Reactor_Handler	*Handler = Array_GetBySubscript(&(r -> Handlers), loop);
+
+		if( Handler -> Socket == Socket )
+		{
+			Handler -> WriteCallback = Callback;
+
+			if( Callback == NULL )
+			{
+				FD_CLR(Socket, &(r -> WriteSet));
+				FD_CLR(Socket, &(r -> WritableSet));
+			} else {
+				FD_SET(Socket, &(r -> WriteSet));
+			}
+
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int Reactor_Wait(Reactor *r, struct timeval *TimeLimit)
+{
+	int	NumberOfEvents;
+	int	loop;
+
+	r -> ReadySet = r -> ReadSet;
+	r -> WritableSet = r -> WriteSet;
+
+	NumberOfEvents = select(r -> MaxFd + 1, &(r -> ReadySet), &(r -> WritableSet), NULL, TimeLimit);
+	if( NumberOfEvents <= 0 )
+	{
+		return NumberOfEvents;
+	}
+
+	for( loop = 0; loop < r -> Handlers.Used; ++loop )
+	{
+		Reactor_Handler	*Handler = Array_GetBySubscript(&(r -> Handlers), loop);
+
+		if( Handler -> Socket != INVALID_SOCKET && FD_ISSET(Handler -> Socket, &(r -> WritableSet)) )
+		{
+			FD_CLR(Handler -> Socket, &(r -> WritableSet));
+			Handler -> WriteCallback(Handler -> Socket, Handler -> Arg);
+
+			/* The write callback may have removed it, or added others */
+			Handler = Array_GetBySubscript(&(r -> Handlers), loop);
+		}
+
+		if( Handler -> Socket != INVALID_SOCKET && FD_ISSET(Handler -> Socket, &(r -> ReadySet)) )
+		{
+			FD_CLR(Handler -> Socket, &(r -> ReadySet));
+			Handler -> Callback(Handler -> Socket, Handler -> Arg);
+		}
+	}
+
+	return NumberOfEvents;
+}
+
+#endif /* REACTOR_EPOLL */
@@ -0,0 +1,93 @@
+#ifndef REACTOR_H_INCLUDED
+#define REACTOR_H_INCLUDED
+
+#include "array.h"
+#include "common.h"
+
+/* A Reactor waits on a set of sockets and calls the callback registered for
+ * each one that becomes readable, or writable if asked for. It is built on epoll where available, so
+ * that dispatching an event costs O(1) and the number of sockets is not
+ * limited by FD_SETSIZE. Elsewhere it falls back to select().
+ *
+ * A Reactor is used by only one thread.
+ */
+#ifdef __linux__
+#define REACTOR_EPOLL
+#endif
+
+typedef void (*Reactor_Callback)(SOCKET Socket, void *Arg);
+
+typedef struct _Reactor_Handler {
+	SOCKET				Socket;
+	Reactor_Callback	Callback;
+	void				*Arg;
+
+	/* NULL if writability is not watched */
+	Reactor_Callback	WriteCallback;
+
+	/* Bumped each time the slot is reused, so events reported for a socket
+	 * removed earlier in the same round are not delivered to its successor */
+	uint32_t			Generation;
+} Reactor_Handler;
+
+typedef struct _Reactor {
+	/* With epoll, indexed by socket. Otherwise a list, with free entries
+	 * marked by INVALID_SOCKET. */
+	Array	Handlers;
+
+#ifdef REACTOR_EPOLL
+	int		EpollFd;
+#else /* REACTOR_EPOLL */
+	fd_set	ReadSet;
+	fd_set	WriteSet;
+	SOCKET	MaxFd;
+
+	/* The ready sets of the current round, Reactor_Remove() clears sockets
+	 * from them so that callbacks never see a removed socket */
+	fd_set	ReadySet;
+	fd_set	WritableSet;
+#endif /* REACTOR_EPOLL */
+} Reactor;
+
+int Reactor_Init(Reactor *r);
+/* Description:
+ *  Initialize a Reactor.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+int Reactor_Add(Reactor *r, SOCKET Socket, Reactor_Callback Callback, void *Arg);
+/* Description:
+ *  Start watching a socket. `Callback' will be called with `Socket' and `Arg'
+ *  each time the socket is readable.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+int Reactor_Remove(Reactor *r, SOCKET Socket);
+/* Description:
+ *  Stop watching a socket. Must be called before the socket is closed. It is
+ *  safe to call it from a callback, for any socket.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+int Reactor_SetWritable(Reactor *r, SOCKET Socket, Reactor_Callback Callback);
+/* Description:
+ *  Start watching the writability of a socket added, `Callback' will be
+ *  called each time it is writable. Stop watching if `Callback' is NULL.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+int Reactor_Wait(Reactor *r, struct timeval *TimeLimit);
+/* Description:
+ *  Wait until some sockets are ready or `TimeLimit' expires, and run the
+ *  callbacks of the ready sockets. The write callback of a socket runs
+ *  before its read callback.
+ * Return value:
+ *  The number of sockets got ready, 0 if time expired, or SOCKET_ERROR on
+ *  failures.
+ */
+
+#endif // REACTOR_H_INCLUDED
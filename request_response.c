@@ -7,12 +7,22 @@
 #include "addresschunk.h"
 #include "ipchunk.h"
 #include "internalsocket.h"
+#include "reactor.h"
+#include "tcpframer.h"
 #include "utils.h"
 #include "common.h"
 
 static AddressChunk	Addresses;
 static BOOL			ParallelQuery;
 
+/* With parallel query, a query is sent to the best server first, and to the
+ * next one each time no answer comes in time, instead of to all at once */
+static BOOL			HedgedQuery;
+
+/* Written by the UDP querying thread only */
+static uint32_t		HedgesFired = 0;
+static uint32_t		HedgesWon = 0;
+
 static sa_family_t	ParallelMainFamily;
 static Array		Addresses_Array;
 
@@ -79,7 +89,12 @@ int InitAddress(ConfigFileInfo *ConfigInfo)
 		Itr = StringList_GetNext(udpaddrs, Itr);
 	}
 
+	/* The UDP querying socket is first opened of the family of the first
+	 * server, with or without parallel query */
+	AddressChunk_GetOneUDPBySubscript(&Addresses, &ParallelMainFamily, 0);
+
 	ParallelQuery = ConfigGetBoolean(ConfigInfo, "ParallelQuery");
+	HedgedQuery = ConfigGetBoolean(ConfigInfo, "HedgedQuery");
 	if( ParallelQuery == TRUE )
 	{
 		int NumberOfAddr;
@@ -96,9 +111,6 @@ int InitAddress(ConfigFileInfo *ConfigInfo)
 			ERRORMSG("No UDP server specified, cannot use parallel query.\n")
 			ParallelQuery = FALSE;
 		} else {
-
-			AddressChunk_GetOneUDPBySubscript(&Addresses, &ParallelMainFamily, 0);
-
 			if( ParallelMainFamily == AF_INET )
 			{
 				AddrLen = sizeof(struct sockaddr);
@@ -128,18 +140,35 @@ int InitAddress(ConfigFileInfo *ConfigInfo)
 
 }
 
+void PrintServerStatistic(FILE *fp)
+{
+	fprintf(fp, "Servers:\n");
+	AddressChunk_PrintStatistic(&Addresses, fp);
+
+	if( ParallelQuery == TRUE && HedgedQuery == TRUE )
+	{
+		fprintf(fp, "Hedged queries : %u fired, %u won\n", HedgesFired, HedgesWon);
+	}
+}
+
+/* `Server' is set to the subscript of the server got, or -1 if it is a
+ * dedicated one or all are got. With hedged parallel query, the best one is
+ * got, the others are asked later if needed. */
 static sa_family_t GetAddress(ControlHeader		*Header,
 							  DNSQuaryProtocol	ProtocolUsed,
 							  struct sockaddr	**Addresses_List,
 							  int				*NumberOfAddresses,
-							  sa_family_t		*Family
+							  sa_family_t		*Family,
+							  int				*Server
 							  )
 {
+	*Server = -1;
+
 	*Addresses_List = AddressChunk_GetDedicated(&Addresses, Family, Header -> RequestingDomain, &(Header -> RequestingDomainHashValue));
 
 	if( *Addresses_List == NULL )
 	{
-		if( ProtocolUsed == DNS_QUARY_PROTOCOL_UDP && ParallelQuery == TRUE )
+		if( ProtocolUsed == DNS_QUARY_PROTOCOL_UDP && ParallelQuery == TRUE && HedgedQuery == FALSE )
 		{
 			*Addresses_List = (struct sockaddr *)Addresses_Array.Data;
 			if( NumberOfAddresses != NULL )
@@ -148,7 +177,7 @@ static sa_family_t GetAddress(ControlHeader		*Header,
 			}
 			*Family = ParallelMainFamily;
 		} else {
-			*Addresses_List = AddressChunk_GetOne(&Addresses, Family, ProtocolUsed);
+			*Addresses_List = AddressChunk_GetOne(&Addresses, Family, ProtocolUsed, Server);
 			if( NumberOfAddresses != NULL )
 			{
 				*NumberOfAddresses = 1;
@@ -241,7 +270,11 @@ static BOOL DoIPMiscellaneous(const char *RequestEntity, const char *Domain, BOO
 {
 	int		AnswerCount;
 
-	if( ((DNSHeader *)RequestEntity) -> Flags.ResponseCode != 0 )
+	/* Name errors are passed on like answers, other errors are dropped in
+	 * the hope of a better response */
+	if( ((DNSHeader *)RequestEntity) -> Flags.ResponseCode != 0 &&
+		((DNSHeader *)RequestEntity) -> Flags.ResponseCode != DNS_RCODE_NAME_ERROR
+		)
 	{
 		return TRUE;
 	}
@@ -370,13 +403,45 @@ ItrEnd:
 	}
 }
 
+/* Send an answer to one client, `Header' is sent along if `NeededHeader' */
+static void SendBackTo(SOCKET Socket,
+					   ControlHeader *Header,
+					   int Length,
+					   BOOL NeededHeader,
+					   Address_Type *BackAddress
+					   )
+{
+	if( NeededHeader == TRUE )
+	{
+		sendto(Socket,
+				(const char *)Header,
+				Length,
+				0,
+				(const struct sockaddr *)&(BackAddress -> Addr),
+				GetAddressLength(BackAddress -> family)
+				);
+
+	} else {
+		sendto(Socket,
+				(const char *)(Header + 1),
+				Length - sizeof(ControlHeader),
+				0,
+				(const struct sockaddr *)&(BackAddress -> Addr),
+				GetAddressLength(BackAddress -> family)
+				);
+	}
+}
+
+/* `Server' is the subscript of the server answering, -1 if not known */
 static void SendBack(SOCKET Socket,
 					 ControlHeader *Header,
 					 QueryContext *Context,
 					 int Length,
 					 char Protocal,
 					 StatisticType Type,
-					 BOOL NeededBlock
+					 BOOL NeededBlock,
+					 DNSQuaryProtocol ProtocolUsed,
+					 int Server
 					 )
 {
 	char	*RequestEntity = (char *)(Header + 1);
@@ -392,37 +457,65 @@ static void SendBack(SOCKET Socket,
 
 	Header -> RequestingDomainHashValue = ELFHash(Header -> RequestingDomain, 0);
 
-	QueryContextNumber = InternalInterface_QueryContextFind(Context, *(uint16_t *)RequestEntity, Header -> RequestingDomainHashValue);
+	QueryContextNumber = InternalInterface_QueryContextFindAnswer(Context, RequestEntity, Header -> RequestingDomain, Header -> RequestingDomainHashValue);
 	if( QueryContextNumber >= 0 )
 	{
-		ThisContext = Bst_GetDataByNumber(Context, QueryContextNumber);
+		int32_t	WaiterNumber;
 
-		DomainStatistic_Add(Header -> RequestingDomain, &(Header -> RequestingDomainHashValue), Type);
+		ThisContext = InternalInterface_QueryContextGetByNumber(Context, QueryContextNumber);
+
+		if( ThisContext -> Refresh == FALSE )
+		{
+			DomainStatistic_Add(Header -> RequestingDomain, &(Header -> RequestingDomainHashValue), Type);
+		}
 
 		if( DoIPMiscellaneous(RequestEntity, Header -> RequestingDomain, NeededBlock, ThisContext -> EDNSEnabled) == FALSE )
 		{
-			if( ThisContext -> NeededHeader == TRUE )
+			if( ThisContext -> Server < 0 || Server == ThisContext -> Server )
 			{
-				sendto(Socket,
-						(const char *)Header,
-						Length,
-						0,
-						(const struct sockaddr *)&(ThisContext -> Context.BackAddress.Addr),
-						GetAddressLength(ThisContext -> Context.BackAddress.family)
-						);
+				AddressChunk_Answered(&Addresses, ProtocolUsed, Server, GetMicroseconds() - ThisContext -> TimeSent);
+			} else {
+				/* Answered by a server the query was hedged with, when it
+				 * was asked is not kept */
+				AddressChunk_Answered(&Addresses, ProtocolUsed, Server, -1);
+
+				if( ProtocolUsed == DNS_QUARY_PROTOCOL_UDP && ParallelQuery == TRUE && HedgedQuery == TRUE )
+				{
+					++HedgesWon;
+				}
+			}
 
+			if( ThisContext -> Refresh == TRUE )
+			{
+				/* The client has been answered from the cache */
 			} else {
-				sendto(Socket,
-						RequestEntity,
-						Length - sizeof(ControlHeader),
-						0,
-						(const struct sockaddr *)&(ThisContext -> Context.BackAddress.Addr),
-						GetAddressLength(ThisContext -> Context.BackAddress.family)
-						);
+				SendBackTo(Socket, Header, Length, ThisContext -> NeededHeader, &(ThisContext -> Context.BackAddress));
 			}
 
-			InternalInterface_QueryContextRemoveByNumber(Context, QueryContextNumber);
 			ShowNormalMassage(ThisContext -> Agent, Header -> RequestingDomain, RequestEntity, Length - sizeof(ControlHeader), Protocal);
+
+			/* Those asked the same meanwhile are sent the same answer, each
+			 * with its own identifier */
+			for( WaiterNumber = ThisContext -> Waiters;
+				 WaiterNumber >= 0;
+				 WaiterNumber = InternalInterface_QueryContextGetWaiter(Context, WaiterNumber) -> Next
+				 )
+			{
+				QueryContextWaiter	*Waiter = InternalInterface_QueryContextGetWaiter(Context, WaiterNumber);
+
+				if( Waiter -> Refresh == TRUE )
+				{
+					continue;
+				}
+
+				*(uint16_t *)RequestEntity = Waiter -> Identifier;
+
+				DomainStatistic_Add(Header -> RequestingDomain, &(Header -> RequestingDomainHashValue), Type);
+				SendBackTo(Socket, Header, Length, Waiter -> NeededHeader, &(Waiter -> BackAddress));
+				ShowNormalMassage(Waiter -> Agent, Header -> RequestingDomain, RequestEntity, Length - sizeof(ControlHeader), Protocal);
+			}
+
+			InternalInterface_QueryContextRemoveByNumber(Context, QueryContextNumber);
 			DNSCache_AddItemsToCache(RequestEntity, time(NULL));
 		}
 	} else {
@@ -474,10 +567,7 @@ static void TCPSwepOutput(QueryContextEntry *Entry, int Number)
 	ShowTimeOutMassage(Entry -> Agent, Entry -> Type, Entry -> Domain, 'T');
 	DomainStatistic_Add(Entry -> Domain, &(Entry -> HashValue), STATISTIC_TYPE_REFUSED);
 
-	if( Number == 1 )
-	{
-		AddressChunk_Advance(&Addresses, DNS_QUARY_PROTOCOL_TCP);
-	}
+	AddressChunk_Failed(&Addresses, DNS_QUARY_PROTOCOL_TCP, Entry -> Server, Entry -> TimeSent);
 }
 
 static SOCKET ConnectToTCPServer(struct sockaddr *ServerAddress, sa_family_t Family, const char *Type)
@@ -617,195 +707,602 @@ static int TCPProxyPreparation(SOCKET Sock, const struct sockaddr	*NestedAddress
 
 }
 
-int QueryDNSViaTCP(void)
+/* State of the TCP querying thread */
+static Reactor		TCPReactor;
+static QueryContext	TCPContext;
+
+static SOCKET		TCPSendBackSocket;
+
+/* Answers over TCP may be as long as the 2-byte length allows */
+static char			TCPRequestEntity[sizeof(ControlHeader) + 65535];
+
+/* Connections to TCP servers are kept in a pool and reused. Queries are
+ * pipelined on them (RFC 7766) without waiting for the answers before, which
+ * are matched to the queries by `TCPContext' in whatever order they come. */
+#define	TCP_POOL_SIZE				16
+
+/* A server gets another connection only when all of its connections have
+ * this many queries outstanding */
+#define	TCP_PIPELINE_DEPTH			32
+#define	TCP_CONNECTIONS_PER_SERVER	4
+
+/* In seconds */
+#define	TCP_CONNECT_TIMEOUT			2
+#define	TCP_IDLE_TIMEOUT			120
+
+typedef struct _TCPConnection {
+	SOCKET			Sock; /* INVALID_SOCKET if the entry is free */
+	struct sockaddr	*Server;
+	sa_family_t		Family;
+	int				Subscript; /* Of `Server', -1 if it is a dedicated one */
+
+	/* Connecting is not waited for, queries are queued in `Framer' until it
+	 * is done */
+	BOOL			Connecting;
+	TCPFramer		Framer;
+
+	/* Queries sent or queued and not answered yet, each a TCPInFlight
+	 * followed by the query with its ControlHeader. They are sent again on
+	 * another connection if this one is closed (RFC 7766). */
+	ExtendableBuffer	InFlight;
+	int				Outstanding; /* The number of them */
+	time_t			LastActive;
+} TCPConnection;
+
+typedef struct _TCPInFlight {
+	int		Length; /* Of the query with its ControlHeader */
+	BOOL	Retried;
+} TCPInFlight;
+
+/* Each query kept is padded for the next TCPInFlight to be aligned */
+#define	TCP_IN_FLIGHT_STEP(length)	(sizeof(TCPInFlight) + (((length) + 7) & ~7))
+
+static TCPConnection	TCPPool[TCP_POOL_SIZE];
+
+static int TCPPool_Query(struct sockaddr *Server, sa_family_t Family, int Subscript, const char *RequestEntity, int Length, BOOL Retried);
+
+/* Whether a query kept by a connection is still waiting for its answer */
+static BOOL TCPPool_Pending(const ControlHeader *Header)
 {
-	static QueryContext	Context;
+	return InternalInterface_QueryContextFindAnswer(&TCPContext,
+													(const char *)(Header + 1),
+													Header -> RequestingDomain,
+													Header -> RequestingDomainHashValue
+													) >= 0;
+}
 
-	SOCKET	TCPQueryIncomeSocket;
-	SOCKET	TCPQueryOutcomeSocket;
-	SOCKET	SendBackSocket;
+static void TCPPool_Keep(TCPConnection *c, const char *RequestEntity, int Length, BOOL Retried)
+{
+	TCPInFlight	*f = (TCPInFlight *)ExtendableBuffer_Expand(&(c -> InFlight), TCP_IN_FLIGHT_STEP(Length), NULL);
 
-	int		NumberOfQueryBeforeSwep = 0;
+	if( f == NULL )
+	{
+		return;
+	}
 
-	static fd_set	ReadSet, ReadySet;
+	f -> Length = Length;
+	f -> Retried = Retried;
+	memcpy(f + 1, RequestEntity, Length);
 
-	static const struct timeval	LongTime = {3600, 0};
-	static const struct timeval	ShortTime = {10, 0};
+	++(c -> Outstanding);
+}
 
-	struct timeval	TimeLimit = LongTime;
+/* Forget the query kept by `c' an answer is to, or all those no longer
+ * waited for (answered on another connection, or timed out) if `HashValue'
+ * is -1 */
+static void TCPPool_Forget(TCPConnection *c, uint16_t Identifier, int HashValue)
+{
+	uint32_t	Offset = 0;
 
-	int		MaxFd;
+	while( Offset < ExtendableBuffer_GetEndOffset(&(c -> InFlight)) )
+	{
+		TCPInFlight		*f = (TCPInFlight *)ExtendableBuffer_GetPositionByOffset(&(c -> InFlight), Offset);
+		ControlHeader	*Header = (ControlHeader *)(f + 1);
 
-	static char		RequestEntity[2048];
-	ControlHeader	*Header = (ControlHeader *)RequestEntity;
+		if( HashValue == -1 ?
+				TCPPool_Pending(Header) == FALSE :
+				Header -> RequestingDomainHashValue == HashValue && *(uint16_t *)(Header + 1) == Identifier
+			)
+		{
+			ExtendableBuffer_Eliminate(&(c -> InFlight), Offset, TCP_IN_FLIGHT_STEP(f -> Length));
+			--(c -> Outstanding);
 
-	sa_family_t		LastFamily = MAIN_FAMILY;
-	struct sockaddr	*LastAddress = NULL;
+			if( HashValue != -1 )
+			{
+				return;
+			}
+		} else {
+			Offset += TCP_IN_FLIGHT_STEP(f -> Length);
+		}
+	}
+}
 
-	TCPQueryIncomeSocket = InternalInterface_TryOpenLocal(10100, INTERNAL_INTERFACE_TCP_QUERY);
-	TCPQueryOutcomeSocket = INVALID_SOCKET;
+/* The queries not answered are sent again on another connection to the same
+ * server, but only once, those failed again are left to be swept */
+static void TCPPool_Close(TCPConnection *c)
+{
+	ExtendableBuffer	Left = c -> InFlight;
+	struct sockaddr	*Server = c -> Server;
+	sa_family_t	Family = c -> Family;
+	int			Subscript = c -> Subscript;
+	uint32_t	Offset = 0;
 
-	SendBackSocket = InternalInterface_GetSocket(INTERNAL_INTERFACE_UDP_INCOME);
+	Reactor_Remove(&TCPReactor, c -> Sock);
+	CloseTCPConnection(c -> Sock);
 
-	MaxFd = TCPQueryIncomeSocket;
-	FD_ZERO(&ReadSet);
-	FD_ZERO(&ReadySet);
-	FD_SET(TCPQueryIncomeSocket, &ReadSet);
+	c -> Sock = INVALID_SOCKET;
+	c -> Connecting = FALSE;
+	c -> Outstanding = 0;
+	TCPFramer_Reset(&(c -> Framer), INVALID_SOCKET);
 
-	InternalInterface_InitQueryContext(&Context);
+	/* `c' may be taken again by sending them */
+	ExtendableBuffer_Init(&(c -> InFlight), 0, -1);
 
-	while( TRUE )
+	while( Offset < ExtendableBuffer_GetEndOffset(&Left) )
 	{
-		ReadySet = ReadSet;
+		TCPInFlight		*f = (TCPInFlight *)ExtendableBuffer_GetPositionByOffset(&Left, Offset);
+		ControlHeader	*Header = (ControlHeader *)(f + 1);
 
-		switch( select(MaxFd + 1, &ReadySet, NULL, NULL, &TimeLimit) )
+		if( f -> Retried == FALSE && TCPPool_Pending(Header) == TRUE )
 		{
-			case SOCKET_ERROR:
-				ERRORMSG("\n\n\n\n\n\n\n\n\n\n");
-				ERRORMSG(" !!!!! Something bad happend, please restert this program.\n");
-				while( TRUE ) SLEEP(100000);
+			INFO("Sending %s again over TCP.\n", Header -> RequestingDomain);
+			TCPPool_Query(Server, Family, Subscript, (const char *)Header, f -> Length, TRUE);
+		}
+
+		Offset += TCP_IN_FLIGHT_STEP(f -> Length);
+	}
+
+	ExtendableBuffer_Free(&Left);
+}
+
+static void TCPOutcomeReady(SOCKET Socket, void *Arg)
+{
+	TCPConnection	*c = (TCPConnection *)Arg;
+	ControlHeader	*Header = (ControlHeader *)TCPRequestEntity;
+	uint16_t		Identifier;
+	int	State;
+
+	if( TCPFramer_Receive(&(c -> Framer)) != 0 )
+	{
+		TCPPool_Close(c);
+
+		INFO("TCP %s closed the connection.\n", TCPProxies == NULL ? "server" : "proxy");
+		return;
+	}
+
+	/* Answers may come in pieces, or several at a time */
+	while( (State = TCPFramer_Next(&(c -> Framer),
+								   TCPRequestEntity + sizeof(ControlHeader),
+								   sizeof(TCPRequestEntity) - sizeof(ControlHeader)
+								   )
+			) != 0 )
+	{
+		if( State < 0 )
+		{
+			/* Only an empty message gets here, not the server's fault */
+			INFO("Empty TCP message discarded.\n");
+			continue;
+		}
+
+		c -> LastActive = time(NULL);
+
+		/* Sending back changes it for those waiting */
+		Identifier = *(uint16_t *)(Header + 1);
+
+		SendBack(TCPSendBackSocket, Header, &TCPContext, State + sizeof(ControlHeader), 'T', STATISTIC_TYPE_TCP, FALSE, DNS_QUARY_PROTOCOL_TCP, c -> Subscript);
+
+		TCPPool_Forget(c, Identifier, Header -> RequestingDomainHashValue);
+	}
+}
+
+/* The socket takes more of the queries queued */
+static void TCPPool_Writable(SOCKET Socket, void *Arg)
+{
+	TCPConnection	*c = (TCPConnection *)Arg;
+	int	Left = TCPFramer_Flush(&(c -> Framer));
+
+	if( Left < 0 )
+	{
+		TCPPool_Close(c);
+	} else if( Left == 0 )
+	{
+		Reactor_SetWritable(&TCPReactor, Socket, NULL);
+	}
+}
+
+/* The connecting finished, one way or the other */
+static void TCPPool_Connected(SOCKET Socket, void *Arg)
+{
+	TCPConnection	*c = (TCPConnection *)Arg;
+	int			Error = 0;
+	socklen_t	ErrorLength = sizeof(Error);
+
+	Reactor_SetWritable(&TCPReactor, Socket, NULL);
+
+	if( getsockopt(Socket, SOL_SOCKET, SO_ERROR, (char *)&Error, &ErrorLength) != 0 || Error != 0 )
+	{
+		INFO("Cannot connect to TCP server.\n");
+		AddressChunk_Failed(&Addresses, DNS_QUARY_PROTOCOL_TCP, c -> Subscript, GetMicroseconds());
+		TCPPool_Close(c);
+		return;
+	}
+
+	INFO("TCP connection to server established.\n");
+
+	c -> Connecting = FALSE;
+	c -> LastActive = time(NULL);
+
+	/* Send the queries queued meanwhile */
+	switch( TCPFramer_Flush(&(c -> Framer)) )
+	{
+		case -1:
+			TCPPool_Close(c);
+			break;
+
+		case 0:
+			break;
+
+		default:
+			Reactor_SetWritable(&TCPReactor, Socket, TCPPool_Writable);
+			break;
+	}
+}
+
+static TCPConnection *TCPPool_Open(struct sockaddr *Server, sa_family_t Family, int Subscript)
+{
+	TCPConnection	*c = NULL;
+	int	loop;
+	int	KeepAlive = 1;
+	int	NoDelay = 1;
+
+	for( loop = 0; loop != TCP_POOL_SIZE; ++loop )
+	{
+		TCPConnection	*Itr = TCPPool + loop;
+
+		if( Itr -> Sock == INVALID_SOCKET )
+		{
+			c = Itr;
+			break;
+		}
+
+		/* Otherwise take the place of the connection idle for the longest */
+		if( Itr -> Connecting == FALSE &&
+			Itr -> Outstanding == 0 &&
+			(c == NULL || Itr -> LastActive < c -> LastActive)
+			)
+		{
+			c = Itr;
+		}
+	}
+
+	if( c == NULL )
+	{
+		return NULL;
+	}
+
+	if( c -> Sock != INVALID_SOCKET )
+	{
+		TCPPool_Close(c);
+	}
+
+	if( TCPProxies == NULL )
+	{
+		c -> Sock = socket(Family, SOCK_STREAM, IPPROTO_TCP);
+		if( c -> Sock == INVALID_SOCKET )
+		{
+			ERRORMSG("Cannot create socket for TCP query.\n");
+			return NULL;
+		}
+
+		SetSocketNonBlock(c -> Sock, TRUE);
+
+		c -> Connecting = FALSE;
+		if( connect(c -> Sock, Server, GetAddressLength(Family)) != 0 )
+		{
+			if( GET_LAST_ERROR() != CONNECT_FUNCTION_BLOCKED )
+			{
+				ERRORMSG("Cannot connect to TCP server.\n");
+				CLOSE_SOCKET(c -> Sock);
+				c -> Sock = INVALID_SOCKET;
+				return NULL;
+			}
+
+			c -> Connecting = TRUE;
+		}
+	} else {
+		/* Talking with a proxy is not done in the background */
+		struct sockaddr	*NewProxy;
+		sa_family_t	ProxyFamily;
+
+		NewProxy = AddressList_GetOne(TCPProxies, &ProxyFamily);
+		c -> Sock = ConnectToTCPServer(NewProxy, ProxyFamily, "TCP proxy");
+		if( c -> Sock == INVALID_SOCKET )
+		{
+			AddressList_Advance(TCPProxies);
+			return NULL;
+		}
+
+		if( TCPProxyPreparation(c -> Sock, Server, Family) != 0 )
+		{
+			ERRORMSG("Cannot communicate with TCP proxy.\n");
+			CloseTCPConnection(c -> Sock);
+			c -> Sock = INVALID_SOCKET;
+			AddressList_Advance(TCPProxies);
+			return NULL;
+		}
+
+		c -> Connecting = FALSE;
+	}
+
+	/* Queries are small and sent one by one, not to be held by Nagle */
+	setsockopt(c -> Sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&NoDelay, sizeof(NoDelay));
+	setsockopt(c -> Sock, SOL_SOCKET, SO_KEEPALIVE, (const char *)&KeepAlive, sizeof(KeepAlive));
+
+	c -> Server = Server;
+	c -> Family = Family;
+	c -> Subscript = Subscript;
+	c -> Outstanding = 0;
+	c -> LastActive = time(NULL);
+
+	TCPFramer_Reset(&(c -> Framer), c -> Sock);
+
+	Reactor_Add(&TCPReactor, c -> Sock, TCPOutcomeReady, c);
+
+	if( c -> Connecting == TRUE )
+	{
+		Reactor_SetWritable(&TCPReactor, c -> Sock, TCPPool_Connected);
+	}
+
+	return c;
+}
+
+/* Get the connection to `Server' with the fewest queries outstanding, open a
+ * new one if there is none or all are busy */
+static TCPConnection *TCPPool_Get(struct sockaddr *Server, sa_family_t Family, int Subscript)
+{
+	TCPConnection	*Best = NULL;
+	int	Count = 0;
+	int	loop;
+
+	for( loop = 0; loop != TCP_POOL_SIZE; ++loop )
+	{
+		TCPConnection	*Itr = TCPPool + loop;
+
+		if( Itr -> Sock != INVALID_SOCKET && Itr -> Server == Server && Itr -> Family == Family )
+		{
+			++Count;
+
+			if( Best == NULL || Itr -> Outstanding < Best -> Outstanding )
+			{
+				Best = Itr;
+			}
+		}
+	}
+
+	if( Best == NULL ||
+		(Best -> Outstanding >= TCP_PIPELINE_DEPTH && Count < TCP_CONNECTIONS_PER_SERVER)
+		)
+	{
+		TCPConnection	*New = TCPPool_Open(Server, Family, Subscript);
+
+		if( New != NULL )
+		{
+			return New;
+		}
+	}
+
+	return Best;
+}
+
+/* Send a query on a connection to `Server', which keeps it until answered */
+static int TCPPool_Query(struct sockaddr *Server, sa_family_t Family, int Subscript, const char *RequestEntity, int Length, BOOL Retried)
+{
+	TCPConnection	*c = TCPPool_Get(Server, Family, Subscript);
+
+	if( c == NULL )
+	{
+		return -1;
+	}
+
+	TCPPool_Keep(c, RequestEntity, Length, Retried);
+
+	if( c -> Connecting == TRUE )
+	{
+		TCPFramer_Queue(&(c -> Framer), RequestEntity + sizeof(ControlHeader), Length - sizeof(ControlHeader));
+	} else {
+		c -> LastActive = time(NULL);
+
+		switch( TCPFramer_Send(&(c -> Framer), RequestEntity + sizeof(ControlHeader), Length - sizeof(ControlHeader)) )
+		{
+			case -1:
+				TCPPool_Close(c);
 				break;
 
 			case 0:
-				if( InternalInterface_QueryContextSwep(&Context, 10, TCPSwepOutput) == TRUE )
-				{
-					TimeLimit = LongTime;
-				} else {
-					TimeLimit = ShortTime;
-				}
-
-				NumberOfQueryBeforeSwep = 0;
 				break;
 
 			default:
-				TimeLimit = ShortTime;
+				/* The rest is sent when the socket is writable */
+				Reactor_SetWritable(&TCPReactor, c -> Sock, TCPPool_Writable);
+				break;
+		}
+	}
 
-				++NumberOfQueryBeforeSwep;
-				if( NumberOfQueryBeforeSwep > 1024 )
-				{
-					InternalInterface_QueryContextSwep(&Context, 2, TCPSwepOutput);
-					NumberOfQueryBeforeSwep = 0;
-				}
+	return 0;
+}
 
-				if( FD_ISSET(TCPQueryIncomeSocket, &ReadySet) )
-				{
-					int	State;
-					uint16_t	TCPLength;
-					sa_family_t	NewFamily;
-					struct sockaddr	*NewAddress;
+/* Give up connections taking too long to connect or idle for too long, and
+ * once a second the queries no longer waited for. Returns whether some are
+ * still connecting. */
+static BOOL TCPPool_Sweep(time_t Now)
+{
+	static time_t	LastForgotten = 0;
+
+	BOOL	Connecting = FALSE;
+	BOOL	Forget = (Now != LastForgotten);
+	int	loop;
 
-					State = recvfrom(TCPQueryIncomeSocket,
+	LastForgotten = Now;
+
+	for( loop = 0; loop != TCP_POOL_SIZE; ++loop )
+	{
+		TCPConnection	*c = TCPPool + loop;
+
+		if( c -> Sock == INVALID_SOCKET )
+		{
+			continue;
+		}
+
+		if( c -> Connecting == TRUE )
+		{
+			if( Now - c -> LastActive >= TCP_CONNECT_TIMEOUT )
+			{
+				INFO("Connecting to TCP server timed out.\n");
+				AddressChunk_Failed(&Addresses, DNS_QUARY_PROTOCOL_TCP, c -> Subscript, GetMicroseconds());
+				TCPPool_Close(c);
+			} else {
+				Connecting = TRUE;
+			}
+
+			continue;
+		}
+
+		if( Forget == TRUE )
+		{
+			TCPPool_Forget(c, 0, -1);
+		}
+
+		if( Now - c -> LastActive >= TCP_IDLE_TIMEOUT )
+		{
+			TCPPool_Close(c);
+		}
+	}
+
+	return Connecting;
+}
+
+static void TCPIncomeReady(SOCKET Socket, void *Arg)
+{
+	int	State;
+	sa_family_t	NewFamily;
+	struct sockaddr	*NewAddress;
+
+	char			*RequestEntity = TCPRequestEntity;
+	ControlHeader	*Header = (ControlHeader *)RequestEntity;
+
+	int				Server;
+	int32_t			Number;
+
+	State = InternalInterface_Receive(INTERNAL_INTERFACE_TCP_QUERY,
 									RequestEntity,
-									sizeof(RequestEntity),
-									0,
-									NULL,
-									NULL
+									sizeof(TCPRequestEntity)
 									);
 
-					if( State < 1 )
-					{
-						break;
-					}
+	if( State < 1 )
+	{
+		return;
+	}
 
-					GetAddress((ControlHeader *)RequestEntity, DNS_QUARY_PROTOCOL_TCP, &NewAddress, NULL, &NewFamily);
-					if( NewFamily != LastFamily || NewAddress != LastAddress || TCPSocketIsHealthy(TCPQueryOutcomeSocket) == FALSE )
-					{
-						if( TCPQueryOutcomeSocket != INVALID_SOCKET )
-						{
-							FD_CLR(TCPQueryOutcomeSocket, &ReadSet);
-							CLOSE_SOCKET(TCPQueryOutcomeSocket);
-						}
-
-						if( TCPProxies == NULL )
-						{
-							TCPQueryOutcomeSocket = ConnectToTCPServer(NewAddress, NewFamily, "TCP server");
-							if( TCPQueryOutcomeSocket == INVALID_SOCKET )
-							{
-								LastFamily = AF_UNSPEC;
-								AddressChunk_Advance(&Addresses, DNS_QUARY_PROTOCOL_TCP);
-								break;
-							}
-						} else {
-							struct sockaddr	*NewProxy;
-							sa_family_t	ProxyFamily;
-							int ret;
-
-							NewProxy = AddressList_GetOne(TCPProxies, &ProxyFamily);
-							TCPQueryOutcomeSocket = ConnectToTCPServer(NewProxy, ProxyFamily, "TCP proxy");
-							if( TCPQueryOutcomeSocket == INVALID_SOCKET )
-							{
-								LastFamily = AF_UNSPEC;
-								AddressList_Advance(TCPProxies);
-								break;
-							}
+	/* The same question is in flight, wait for its answer */
+	if( InternalInterface_QueryContextAttach(&TCPContext, Header) >= 0 )
+	{
+		return;
+	}
 
-							if( TCPProxyPreparation(TCPQueryOutcomeSocket, NewAddress, NewFamily) != 0 )
-							{
-								ERRORMSG("Cannot communicate with TCP proxy.\n");
-								LastFamily = AF_UNSPEC;
-								CloseTCPConnection(TCPQueryOutcomeSocket);
-								TCPQueryOutcomeSocket = INVALID_SOCKET;
-								AddressList_Advance(TCPProxies);
-								break;
-							}
-						}
+	GetAddress((ControlHeader *)RequestEntity, DNS_QUARY_PROTOCOL_TCP, &NewAddress, NULL, &NewFamily, &Server);
 
-						LastFamily = NewFamily;
-						LastAddress = NewAddress;
-						if( TCPQueryOutcomeSocket > MaxFd )
-						{
-							MaxFd = TCPQueryOutcomeSocket;
-						}
+	/* Added first, the query is sent again if the connection fails */
+	Number = InternalInterface_QueryContextAddUDP(&TCPContext, Header);
+	if( Number < 0 )
+	{
+		return;
+	}
 
-						FD_SET(TCPQueryOutcomeSocket, &ReadSet);
-					}
+	InternalInterface_QueryContextGetByNumber(&TCPContext, Number) -> Server = Server;
 
-					InternalInterface_QueryContextAddUDP(&Context, Header);
+	if( TCPPool_Query(NewAddress, NewFamily, Server, RequestEntity, State, FALSE) != 0 )
+	{
+		AddressChunk_Failed(&Addresses, DNS_QUARY_PROTOCOL_TCP, Server, GetMicroseconds());
+		InternalInterface_QueryContextRemoveByNumber(&TCPContext, Number);
+	}
+}
 
-					TCPLength = htons(State - sizeof(ControlHeader));
-					send(TCPQueryOutcomeSocket, (const char *)&TCPLength, 2, MSG_NOSIGNAL);
-					send(TCPQueryOutcomeSocket, RequestEntity + sizeof(ControlHeader), State - sizeof(ControlHeader), MSG_NOSIGNAL);
+int QueryDNSViaTCP(void)
+{
+	SOCKET	TCPQueryIncomeSocket;
 
-				} else {
-					int	State;
-					uint16_t	TCPLength;
+	int		NumberOfQueryBeforeSwep = 0;
+	time_t	LastSwep = 0;
+	int		loop;
 
-					if( recv(TCPQueryOutcomeSocket, (char *)&TCPLength, 2, MSG_NOSIGNAL) < 2 )
-					{
-                        CloseTCPConnection(TCPQueryOutcomeSocket);
-                        FD_CLR(TCPQueryOutcomeSocket, &ReadSet);
+	static const struct timeval	LongTime = {3600, 0};
+	static const struct timeval	ShortTime = {10, 0};
+	static const struct timeval	ConnectingTime = {1, 0};
 
-                        INFO("TCP %s closed the connection.\n", TCPProxies == NULL ? "server" : "proxy");
-						break;
-					}
+	struct timeval	TimeLimit = LongTime;
 
-					TCPLength = ntohs(TCPLength);
+	TCPQueryIncomeSocket = InternalInterface_OpenQueue(10100, INTERNAL_INTERFACE_TCP_QUERY);
 
-					if( TCPLength > sizeof(RequestEntity) - sizeof(ControlHeader) )
-					{
-						ClearTCPSocketBuffer(TCPQueryOutcomeSocket, TCPLength);
-						AddressChunk_Advance(&Addresses, DNS_QUARY_PROTOCOL_TCP);
-						INFO("TCP stream is longer than the buffer, discarded.\n");
-						break;
-					}
+	TCPSendBackSocket = InternalInterface_GetSocket(INTERNAL_INTERFACE_UDP_INCOME);
 
-					State = recv(TCPQueryOutcomeSocket,
-								RequestEntity + sizeof(ControlHeader),
-								TCPLength,
-								MSG_NOSIGNAL
-								);
+	if( Reactor_Init(&TCPReactor) != 0 )
+	{
+		return -1;
+	}
 
-					if( State != TCPLength )
-					{
-						CloseTCPConnection(TCPQueryOutcomeSocket);
-						FD_CLR(TCPQueryOutcomeSocket, &ReadSet);
-						AddressChunk_Advance(&Addresses, DNS_QUARY_PROTOCOL_TCP);
-						INFO("TCP stream is too short, server may have some failures.\n");
-						break;
-					}
+	for( loop = 0; loop != TCP_POOL_SIZE; ++loop )
+	{
+		TCPPool[loop].Sock = INVALID_SOCKET;
+		TCPPool[loop].Connecting = FALSE;
+		TCPFramer_Init(&(TCPPool[loop].Framer), INVALID_SOCKET);
+		ExtendableBuffer_Init(&(TCPPool[loop].InFlight), 0, -1);
+	}
 
-					SendBack(SendBackSocket, Header, &Context, State + sizeof(ControlHeader), 'T', STATISTIC_TYPE_TCP, FALSE);
+	Reactor_Add(&TCPReactor, TCPQueryIncomeSocket, TCPIncomeReady, NULL);
+
+	InternalInterface_InitQueryContext(&TCPContext);
+
+	while( TRUE )
+	{
+		switch( Reactor_Wait(&TCPReactor, &TimeLimit) )
+		{
+			case SOCKET_ERROR:
+				ERRORMSG("\n\n\n\n\n\n\n\n\n\n");
+				ERRORMSG(" !!!!! Something bad happend, please restert this program.\n");
+				while( TRUE ) SLEEP(100000);
+				break;
+
+			case 0:
+				if( InternalInterface_QueryContextSwep(&TCPContext, 10, TCPSwepOutput) == TRUE )
+				{
+					TimeLimit = LongTime;
+				} else {
+					TimeLimit = ShortTime;
 				}
+
+				NumberOfQueryBeforeSwep = 0;
+				LastSwep = time(NULL);
+				break;
+
+			default:
+				TimeLimit = ShortTime;
+
+				/* Also once a second, so that a server not answering is
+				 * noticed under a steady load */
+				++NumberOfQueryBeforeSwep;
+				if( NumberOfQueryBeforeSwep > 1024 || time(NULL) != LastSwep )
+				{
+					InternalInterface_QueryContextSwep(&TCPContext, 10, TCPSwepOutput);
+					NumberOfQueryBeforeSwep = 0;
+					LastSwep = time(NULL);
+				}
+			break;
+		}
+
+		/* Connecting is timed out here */
+		if( TCPPool_Sweep(time(NULL)) == TRUE )
+		{
+			TimeLimit = ConnectingTime;
 		}
 	}
 }
@@ -914,59 +1411,367 @@ static void UDPSwepOutput(QueryContextEntry *Entry, int Number)
 	ShowTimeOutMassage(Entry -> Agent, Entry -> Type, Entry -> Domain, 'U');
 	DomainStatistic_Add(Entry -> Domain, &(Entry -> HashValue), STATISTIC_TYPE_REFUSED);
 
-	if( Number == 1 && ParallelQuery == FALSE )
+	AddressChunk_Failed(&Addresses, DNS_QUARY_PROTOCOL_UDP, Entry -> Server, Entry -> TimeSent);
+}
+
+/* State of the UDP querying thread */
+static Reactor		UDPReactor;
+static QueryContext	UDPContext;
+
+static SOCKET		UDPQueryOutcomeSocket;
+static SOCKET		UDPSendBackSocket;
+static sa_family_t	UDPLastFamily;
+
+static char			UDPRequestEntity[2048];
+
+/* Hedging of a query, each is timed by an entry in `UDPHedgeTimers' */
+#define	UDP_HEDGE_QUERY_LENGTH	512
+
+typedef struct _UDPHedge {
+	/* The key of the query in UDPContext */
+	uint32_t	Identifier;
+	int32_t		HashValue;
+
+	/* The servers asked, bit `i' for the subscript `i' */
+	uint32_t	Asked;
+
+	int			Length;
+	char		Query[UDP_HEDGE_QUERY_LENGTH];
+} UDPHedge;
+
+typedef struct _UDPHedgeTimer {
+	int64_t		Due; /* See GetMicroseconds() */
+	int32_t		Hedge;
+} UDPHedgeTimer;
+
+static Array		UDPHedges; /* Of UDPHedge */
+static Array		UDPHedgesFree; /* Of int32_t, subscripts in `UDPHedges' */
+static Array		UDPHedgeTimers; /* A min-heap by `Due' */
+
+#define	UDPHedgeTimer_Get(i)	((UDPHedgeTimer *)Array_GetBySubscript(&UDPHedgeTimers, (i)))
+
+static void UDPHedgeTimer_Swap(int32_t One, int32_t Another)
+{
+	UDPHedgeTimer	Tmp = *UDPHedgeTimer_Get(One);
+
+	*UDPHedgeTimer_Get(One) = *UDPHedgeTimer_Get(Another);
+	*UDPHedgeTimer_Get(Another) = Tmp;
+}
+
+static int UDPHedgeTimer_Push(int64_t Due, int32_t Hedge)
+{
+	UDPHedgeTimer	New = {Due, Hedge};
+	int32_t	Here = Array_PushBack(&UDPHedgeTimers, &New, NULL);
+
+	if( Here < 0 )
+	{
+		return -1;
+	}
+
+	while( Here > 0 && UDPHedgeTimer_Get((Here - 1) / 2) -> Due > Due )
 	{
-		AddressChunk_Advance(&Addresses, DNS_QUARY_PROTOCOL_UDP);
+		UDPHedgeTimer_Swap(Here, (Here - 1) / 2);
+		Here = (Here - 1) / 2;
 	}
+
+	return 0;
 }
 
-int QueryDNSViaUDP(void)
+static void UDPHedgeTimer_Pop(void)
 {
-	static QueryContext	Context;
+	int32_t	Count = Array_GetUsed(&UDPHedgeTimers) - 1;
+	int32_t	Here = 0;
 
+	UDPHedgeTimer_Swap(0, Count);
+	UDPHedgeTimers.Used = Count;
+
+	while( TRUE )
+	{
+		int32_t	Smallest = Here;
+		int32_t	Child = 2 * Here + 1;
+
+		if( Child < Count && UDPHedgeTimer_Get(Child) -> Due < UDPHedgeTimer_Get(Smallest) -> Due )
+		{
+			Smallest = Child;
+		}
+
+		if( Child + 1 < Count && UDPHedgeTimer_Get(Child + 1) -> Due < UDPHedgeTimer_Get(Smallest) -> Due )
+		{
+			Smallest = Child + 1;
+		}
+
+		if( Smallest == Here )
+		{
+			break;
+		}
+
+		UDPHedgeTimer_Swap(Here, Smallest);
+		Here = Smallest;
+	}
+}
+
+static void UDPHedge_Free(int32_t Hedge)
+{
+	Array_PushBack(&UDPHedgesFree, &Hedge, NULL);
+}
+
+/* Hedge a query just sent to `Server' */
+static void UDPHedge_Start(QueryContextEntry *Entry, int Server, const char *Query, int Length)
+{
+	int32_t		Hedge;
+	UDPHedge	*h;
+
+	if( Length > UDP_HEDGE_QUERY_LENGTH || Server >= 32 )
+	{
+		return;
+	}
+
+	if( Array_IsEmpty(&UDPHedgesFree) )
+	{
+		Hedge = Array_PushBack(&UDPHedges, NULL, NULL);
+		if( Hedge < 0 )
+		{
+			return;
+		}
+	} else {
+		Hedge = *(int32_t *)Array_GetBySubscript(&UDPHedgesFree, Array_GetUsed(&UDPHedgesFree) - 1);
+		--(UDPHedgesFree.Used);
+	}
+
+	if( UDPHedgeTimer_Push(GetMicroseconds() + AddressChunk_HedgeDelay(&Addresses, Server), Hedge) != 0 )
+	{
+		UDPHedge_Free(Hedge);
+		return;
+	}
+
+	h = Array_GetBySubscript(&UDPHedges, Hedge);
+	h -> Identifier = Entry -> Identifier;
+	h -> HashValue = Entry -> HashValue;
+	h -> Asked = (uint32_t)1 << Server;
+	h -> Length = Length;
+	memcpy(h -> Query, Query, Length);
+
+	Entry -> Hedge = Hedge;
+}
+
+/* Send the queries not answered in time to the next servers, and return the
+ * time to wait for the next to be due */
+static struct timeval *UDPHedge_Fire(struct timeval *TimeLimit, struct timeval *Buffer)
+{
+	int64_t	Now = GetMicroseconds();
+	int64_t	Wait;
+
+	while( !Array_IsEmpty(&UDPHedgeTimers) && UDPHedgeTimer_Get(0) -> Due <= Now )
+	{
+		int32_t	Hedge = UDPHedgeTimer_Get(0) -> Hedge;
+		UDPHedge	*h = Array_GetBySubscript(&UDPHedges, Hedge);
+		int32_t		Number;
+		QueryContextEntry	*Entry;
+		struct sockaddr	*Next;
+		int			Server;
+
+		UDPHedgeTimer_Pop();
+
+		/* Those answered or timed out are done with */
+		Number = InternalInterface_QueryContextFind(&UDPContext, h -> Identifier, h -> HashValue);
+		if( Number < 0 )
+		{
+			UDPHedge_Free(Hedge);
+			continue;
+		}
+
+		Entry = InternalInterface_QueryContextGetByNumber(&UDPContext, Number);
+		if( Entry -> Hedge != Hedge )
+		{
+			UDPHedge_Free(Hedge);
+			continue;
+		}
+
+		Next = AddressChunk_GetHedge(&Addresses, UDPLastFamily, h -> Asked, &Server);
+		if( Next == NULL || UDPQueryOutcomeSocket == INVALID_SOCKET )
+		{
+			/* All have been asked */
+			Entry -> Hedge = -1;
+			UDPHedge_Free(Hedge);
+			continue;
+		}
+
+		sendto(UDPQueryOutcomeSocket, h -> Query, h -> Length, 0, Next, GetAddressLength(UDPLastFamily));
+		++HedgesFired;
+
+		h -> Asked |= (uint32_t)1 << Server;
+		UDPHedgeTimer_Push(Now + AddressChunk_HedgeDelay(&Addresses, Server), Hedge);
+	}
+
+	if( Array_IsEmpty(&UDPHedgeTimers) )
+	{
+		return TimeLimit;
+	}
+
+	/* Rounded up to milliseconds, not to wake up too early and spin */
+	Wait = (UDPHedgeTimer_Get(0) -> Due - Now + 999) / 1000 * 1000;
+	if( Wait >= (int64_t)TimeLimit -> tv_sec * 1000000 + TimeLimit -> tv_usec )
+	{
+		return TimeLimit;
+	}
+
+	Buffer -> tv_sec = Wait / 1000000;
+	Buffer -> tv_usec = Wait % 1000000;
+
+	return Buffer;
+}
+
+static void UDPOutcomeReady(SOCKET Socket, void *Arg)
+{
+	int State;
+	Address_Type	From;
+	socklen_t		FromLength = sizeof(From.Addr);
+
+	State = recvfrom(Socket,
+					UDPRequestEntity + sizeof(ControlHeader),
+					sizeof(UDPRequestEntity) - sizeof(ControlHeader),
+					0,
+					(struct sockaddr *)&(From.Addr),
+					&FromLength
+					);
+
+	if( State < 1 )
+	{
+		return;
+	}
+
+	/* Which server answered, as all may have been asked */
+	SendBack(UDPSendBackSocket, (ControlHeader *)UDPRequestEntity, &UDPContext, State + sizeof(ControlHeader), 'U', STATISTIC_TYPE_UDP, UDPAntiPollution,
+			 DNS_QUARY_PROTOCOL_UDP, AddressChunk_Find(&Addresses, DNS_QUARY_PROTOCOL_UDP, (struct sockaddr *)&(From.Addr))
+			 );
+}
+
+static void UDPIncomeReady(SOCKET Socket, void *Arg)
+{
+	int State;
+	struct sockaddr	*NewAddress;
+	int	NumberOfAddresses;
+	sa_family_t	NewFamily;
+	int		Server;
+	int32_t	Number;
+
+	char			*RequestEntity = UDPRequestEntity;
+	ControlHeader	*Header = (ControlHeader *)RequestEntity;
+
+	State = InternalInterface_Receive(INTERNAL_INTERFACE_UDP_QUERY,
+									RequestEntity,
+									sizeof(UDPRequestEntity)
+									);
+
+	if( State < 1 )
+	{
+		return;
+	}
+
+	if( UDPAppendEDNSOpt == TRUE && DNSGetAdditionalCount(RequestEntity + sizeof(ControlHeader)) == 0 )
+	{
+		memcpy(RequestEntity + State, OptPseudoRecord, OPT_PSEUDORECORD_LENGTH);
+
+		DNSSetAdditionalCount(RequestEntity + sizeof(ControlHeader), 1);
+
+		State += OPT_PSEUDORECORD_LENGTH;
+	}
+
+	/* The same question is in flight, wait for its answer */
+	if( InternalInterface_QueryContextAttach(&UDPContext, Header) >= 0 )
+	{
+		return;
+	}
+
+	Number = InternalInterface_QueryContextAddUDP(&UDPContext, Header);
+
+	GetAddress((ControlHeader *)RequestEntity, DNS_QUARY_PROTOCOL_UDP, &NewAddress, &NumberOfAddresses, &NewFamily, &Server);
+
+	if( Number >= 0 )
+	{
+		InternalInterface_QueryContextGetByNumber(&UDPContext, Number) -> Server = Server;
+	}
+
+	if( NewFamily != UDPLastFamily )
+	{
+		if( UDPQueryOutcomeSocket != INVALID_SOCKET )
+		{
+			Reactor_Remove(&UDPReactor, UDPQueryOutcomeSocket);
+			CLOSE_SOCKET(UDPQueryOutcomeSocket);
+		}
+
+		UDPQueryOutcomeSocket = InternalInterface_OpenASocket(NewFamily, NULL);
+		if( UDPQueryOutcomeSocket == INVALID_SOCKET )
+		{
+			UDPLastFamily = AF_UNSPEC;
+			return;
+		}
+
+		UDPLastFamily = NewFamily;
+		Reactor_Add(&UDPReactor, UDPQueryOutcomeSocket, UDPOutcomeReady, NULL);
+	}
+
+	SendQueryViaUDP(UDPQueryOutcomeSocket,
+					RequestEntity + sizeof(ControlHeader),
+					State - sizeof(ControlHeader),
+					NewAddress,
+					NumberOfAddresses,
+					NewFamily
+					);
+
+	if( ParallelQuery == TRUE && HedgedQuery == TRUE && Server >= 0 && Number >= 0 )
+	{
+		UDPHedge_Start(InternalInterface_QueryContextGetByNumber(&UDPContext, Number),
+					   Server,
+					   RequestEntity + sizeof(ControlHeader),
+					   State - sizeof(ControlHeader)
+					   );
+	}
+}
+
+int QueryDNSViaUDP(void)
+{
 	SOCKET	UDPQueryIncomeSocket;
-	SOCKET	UDPQueryOutcomeSocket;
-	SOCKET	SendBackSocket;
 
 	int		NumberOfQueryBeforeSwep = 0;
-
-	static fd_set	ReadSet, ReadySet;
+	time_t	LastSwep = 0;
 
 	static const struct timeval	LongTime = {3600, 0};
 	static const struct timeval	ShortTime = {5, 0};
 
 	struct timeval	TimeLimit = LongTime;
+	struct timeval	HedgeTime;
 
-	int		MaxFd;
-
-	sa_family_t		LastFamily = ParallelMainFamily;
+	UDPLastFamily = ParallelMainFamily;
 
-	static char		RequestEntity[2048];
-	ControlHeader	*Header = (ControlHeader *)RequestEntity;
-
-	UDPQueryIncomeSocket =	InternalInterface_TryOpenLocal(10125, INTERNAL_INTERFACE_UDP_QUERY);
+	UDPQueryIncomeSocket =	InternalInterface_OpenQueue(10125, INTERNAL_INTERFACE_UDP_QUERY);
 	UDPQueryOutcomeSocket = InternalInterface_OpenASocket(ParallelMainFamily, NULL);
 
-	SendBackSocket = InternalInterface_GetSocket(INTERNAL_INTERFACE_UDP_INCOME);
+	UDPSendBackSocket = InternalInterface_GetSocket(INTERNAL_INTERFACE_UDP_INCOME);
 
 	if( UDPQueryOutcomeSocket == INVALID_SOCKET )
 	{
 		return -1;
 	}
 
-	MaxFd = UDPQueryIncomeSocket > UDPQueryOutcomeSocket ? UDPQueryIncomeSocket : UDPQueryOutcomeSocket;
-	FD_ZERO(&ReadSet);
-	FD_ZERO(&ReadySet);
-	FD_SET(UDPQueryIncomeSocket, &ReadSet);
-	FD_SET(UDPQueryOutcomeSocket, &ReadSet);
+	if( Reactor_Init(&UDPReactor) != 0 )
+	{
+		return -1;
+	}
+
+	Reactor_Add(&UDPReactor, UDPQueryIncomeSocket, UDPIncomeReady, NULL);
+	Reactor_Add(&UDPReactor, UDPQueryOutcomeSocket, UDPOutcomeReady, NULL);
 
-	InternalInterface_InitQueryContext(&Context);
+	InternalInterface_InitQueryContext(&UDPContext);
+
+	Array_Init(&UDPHedges, sizeof(UDPHedge), 0, FALSE, NULL);
+	Array_Init(&UDPHedgesFree, sizeof(int32_t), 0, FALSE, NULL);
+	Array_Init(&UDPHedgeTimers, sizeof(UDPHedgeTimer), 0, FALSE, NULL);
 
 	while( TRUE )
 	{
-		ReadySet = ReadSet;
-
-		switch( select(MaxFd + 1, &ReadySet, NULL, NULL, &TimeLimit) )
+		/* Not to wait past the next hedge */
+		switch( Reactor_Wait(&UDPReactor, UDPHedge_Fire(&TimeLimit, &HedgeTime)) )
 		{
 			case SOCKET_ERROR:
 				ERRORMSG("\n\n\n\n\n\n\n\n\n\n");
@@ -975,7 +1780,7 @@ int QueryDNSViaUDP(void)
 				break;
 
 			case 0:
-				if( InternalInterface_QueryContextSwep(&Context, 2, UDPSwepOutput) == TRUE )
+				if( InternalInterface_QueryContextSwep(&UDPContext, 2, UDPSwepOutput) == TRUE )
 				{
 					TimeLimit = LongTime;
 				} else {
@@ -983,99 +1788,20 @@ int QueryDNSViaUDP(void)
 				}
 
 				NumberOfQueryBeforeSwep = 0;
+				LastSwep = time(NULL);
 				break;
 
 			default:
 				TimeLimit = ShortTime;
 
+				/* Also once a second, so that a server not answering is
+				 * noticed under a steady load */
 				++NumberOfQueryBeforeSwep;
-				if( NumberOfQueryBeforeSwep > 1024 )
+				if( NumberOfQueryBeforeSwep > 1024 || time(NULL) != LastSwep )
 				{
-					InternalInterface_QueryContextSwep(&Context, 5, UDPSwepOutput);
+					InternalInterface_QueryContextSwep(&UDPContext, 5, UDPSwepOutput);
 					NumberOfQueryBeforeSwep = 0;
-				}
-
-				if( FD_ISSET(UDPQueryIncomeSocket, &ReadySet) )
-				{
-					int State;
-					struct sockaddr	*NewAddress;
-					int	NumberOfAddresses;
-					sa_family_t	NewFamily;
-
-					State = recvfrom(UDPQueryIncomeSocket,
-									RequestEntity,
-									sizeof(RequestEntity),
-									0,
-									NULL,
-									NULL
-									);
-
-					if( State < 1 )
-					{
-						break;
-					}
-
-					if( UDPAppendEDNSOpt == TRUE && DNSGetAdditionalCount(RequestEntity + sizeof(ControlHeader)) == 0 )
-					{
-						memcpy(RequestEntity + State, OptPseudoRecord, OPT_PSEUDORECORD_LENGTH);
-
-						DNSSetAdditionalCount(RequestEntity + sizeof(ControlHeader), 1);
-
-						State += OPT_PSEUDORECORD_LENGTH;
-					}
-
-					InternalInterface_QueryContextAddUDP(&Context, Header);
-
-					GetAddress((ControlHeader *)RequestEntity, DNS_QUARY_PROTOCOL_UDP, &NewAddress, &NumberOfAddresses, &NewFamily);
-
-					if( NewFamily != LastFamily )
-					{
-						if( UDPQueryOutcomeSocket != INVALID_SOCKET )
-						{
-							FD_CLR(UDPQueryOutcomeSocket, &ReadSet);
-							CLOSE_SOCKET(UDPQueryOutcomeSocket);
-						}
-
-						UDPQueryOutcomeSocket = InternalInterface_OpenASocket(NewFamily, NULL);
-						if( UDPQueryOutcomeSocket == INVALID_SOCKET )
-						{
-							LastFamily = AF_UNSPEC;
-							break;
-						}
-
-						LastFamily = NewFamily;
-						if( UDPQueryOutcomeSocket > MaxFd )
-						{
-							MaxFd = UDPQueryOutcomeSocket;
-						}
-						FD_SET(UDPQueryOutcomeSocket, &ReadSet);
-					}
-
-					SendQueryViaUDP(UDPQueryOutcomeSocket,
-									RequestEntity + sizeof(ControlHeader),
-									State - sizeof(ControlHeader),
-									NewAddress,
-									NumberOfAddresses,
-									NewFamily
-									);
-
-				} else {
-					int State;
-
-					State = recvfrom(UDPQueryOutcomeSocket,
-									RequestEntity + sizeof(ControlHeader),
-									sizeof(RequestEntity) - sizeof(ControlHeader),
-									0,
-									NULL,
-									NULL
-									);
-
-					if( State < 1 )
-					{
-						break;
-					}
-
-					SendBack(SendBackSocket, Header, &Context, State + sizeof(ControlHeader), 'U', STATISTIC_TYPE_UDP, UDPAntiPollution);
+					LastSwep = time(NULL);
 				}
 			break;
 		}
@@ -1203,7 +1929,8 @@ int TestServer(struct TestServerArguments *Args)
 	char	NewlyReceived[2048];
 
 	Args -> ServerAddress = GoToNextNonSpace(Args -> ServerAddress);
-	if( strchr(Args -> ServerAddress, ':') != NULL && *(Args -> ServerAddress) != '[' )
+	/* A bare IPv6 address has more than one colon, `IPv4:Port' has just one */
+	if( strchr(Args -> ServerAddress, ':') != strrchr(Args -> ServerAddress, ':') && *(Args -> ServerAddress) != '[' )
 	{
 		char ServerAddress_Regulated[LENGTH_OF_IPV6_ADDRESS_ASCII + 3];
 		sprintf(ServerAddress_Regulated, "[%s]", Args -> ServerAddress);
@@ -8,6 +8,11 @@
 
 int InitAddress(ConfigFileInfo *ConfigInfo);
 
+void PrintServerStatistic(FILE *fp);
+/* Description:
+ *  Print how each server is doing, see AddressList_PrintStatistic().
+ */
+
 BOOL SocketIsStillReadable(SOCKET Sock, int timeout);
 
 void ClearSocketBuffer(SOCKET Sock);
@@ -0,0 +1,246 @@
+#include <string.h>
+#include "responsecache.h"
+#include "dnsparser.h"
+#include "dnsgenerator.h"
+#include "rwlock.h"
+#include "utils.h"
+
+#define	RESPONSE_CACHE_ENTRY_LENGTH	512
+#define	RESPONSE_CACHE_MAX_RECORDS	32
+
+/* Entries are guarded by a set of locks, so that threads answering
+ * different questions seldom wait for each other */
+#define	RESPONSE_CACHE_LOCKS		64
+
+typedef struct _ResponseCache_Entry {
+	uint32_t	HashValue;
+	time_t		TimeAdded;
+
+	/* The shortest TTL in the answers, 0 if the entry is empty */
+	uint32_t	TTL;
+
+	uint16_t	QuestionLength;
+	uint16_t	AnswerLength;
+	uint16_t	AnswerCount;
+
+	/* Where the TTLs are, relative to the answer section */
+	uint16_t	TTLOffsets[RESPONSE_CACHE_MAX_RECORDS];
+
+	/* The question followed by the answer section */
+	char		Data[RESPONSE_CACHE_ENTRY_LENGTH];
+} ResponseCache_Entry;
+
+static ResponseCache_Entry	*Entries = NULL;
+static uint32_t				Mask;
+static BOOL					NoExpiring;
+static uint32_t				RefreshBefore;
+
+static RWLock				Locks[RESPONSE_CACHE_LOCKS];
+
+/* FNV-1a, questions may contain zeros */
+static uint32_t ResponseCache_Hash(const char *Question, int Length)
+{
+	uint32_t	Hash = 2166136261U;
+
+	while( Length > 0 )
+	{
+		Hash ^= *(const unsigned char *)Question;
+		Hash *= 16777619U;
+
+		++Question;
+		--Length;
+	}
+
+	return Hash;
+}
+
+int ResponseCache_Init(int NumberOfEntries, BOOL IgnoreTTL, int RefreshTime)
+{
+	uint32_t	Count = 1;
+	int			loop;
+
+	if( NumberOfEntries <= 0 )
+	{
+		return 0;
+	}
+
+	while( Count < (uint32_t)NumberOfEntries )
+	{
+		Count <<= 1;
+	}
+
+	Entries = SafeMalloc(sizeof(ResponseCache_Entry) * Count);
+	if( Entries == NULL )
+	{
+		return -1;
+	}
+
+	for( loop = 0; loop != (int)Count; ++loop )
+	{
+		Entries[loop].TTL = 0;
+	}
+
+	for( loop = 0; loop != RESPONSE_CACHE_LOCKS; ++loop )
+	{
+		RWLock_Init(Locks[loop]);
+	}
+
+	Mask = Count - 1;
+	NoExpiring = IgnoreTTL;
+	RefreshBefore = RefreshTime > 0 ? RefreshTime : 0;
+
+	return 0;
+}
+
+int ResponseCache_Fetch(char *RequestContent, int RequestLength, int BufferLength, time_t CurrentTime)
+{
+	const char	*Question = DNSJumpHeader(RequestContent);
+	int			QuestionLength = RequestLength - DNS_HEADER_LENGTH;
+
+	uint32_t	HashValue;
+	ResponseCache_Entry	*Entry;
+	RWLock		*Lock;
+
+	char		*Answers = RequestContent + RequestLength;
+	uint32_t	Elapsed;
+	int			loop;
+
+	if( Entries == NULL ||
+		DNSGetQuestionCount(RequestContent) != 1 ||
+		QuestionLength <= 0 ||
+		QuestionLength > RESPONSE_CACHE_ENTRY_LENGTH
+		)
+	{
+		return -1;
+	}
+
+	HashValue = ResponseCache_Hash(Question, QuestionLength);
+	Entry = Entries + (HashValue & Mask);
+	Lock = Locks + ((HashValue & Mask) % RESPONSE_CACHE_LOCKS);
+
+	RWLock_RdLock(*Lock);
+
+	if( Entry -> TTL == 0 ||
+		Entry -> HashValue != HashValue ||
+		Entry -> QuestionLength != QuestionLength ||
+		memcmp(Entry -> Data, Question, QuestionLength) != 0
+		)
+	{
+		RWLock_UnRLock(*Lock);
+		return -1;
+	}
+
+	Elapsed = CurrentTime - Entry -> TimeAdded;
+
+	if( (NoExpiring == FALSE && (Elapsed >= Entry -> TTL || Entry -> TTL - Elapsed < RefreshBefore)) ||
+		RequestLength + Entry -> AnswerLength > BufferLength
+		)
+	{
+		RWLock_UnRLock(*Lock);
+		return -1;
+	}
+
+	memcpy(Answers, Entry -> Data + QuestionLength, Entry -> AnswerLength);
+
+	if( NoExpiring == FALSE )
+	{
+		for( loop = 0; loop != Entry -> AnswerCount; ++loop )
+		{
+			char	*TTLPos = Answers + Entry -> TTLOffsets[loop];
+
+			SET_32_BIT_U_INT(TTLPos, (uint32_t)GET_32_BIT_U_INT(TTLPos) - Elapsed);
+		}
+	}
+
+	DNSSetAnswerCount(RequestContent, Entry -> AnswerCount);
+
+	RequestLength += Entry -> AnswerLength;
+
+	RWLock_UnRLock(*Lock);
+
+	return RequestLength;
+}
+
+void ResponseCache_Store(const char *Message, int Length, time_t CurrentTime)
+{
+	const char	*Question = DNSJumpHeader(Message);
+	const char	*AnswerStart;
+	const char	*MessageEnd = Message + Length;
+	const char	*Record;
+
+	int			QuestionLength, AnswerLength;
+	int			AnswerCount = DNSGetAnswerCount(Message);
+
+	uint16_t	TTLOffsets[RESPONSE_CACHE_MAX_RECORDS];
+	uint32_t	MinTTL = 0xFFFFFFFF;
+
+	uint32_t	HashValue;
+	ResponseCache_Entry	*Entry;
+	RWLock		*Lock;
+
+	int			loop;
+
+	if( Entries == NULL ||
+		DNSGetQuestionCount(Message) != 1 ||
+		DNSGetNameServerCount(Message) != 0 ||
+		DNSGetAdditionalCount(Message) != 0 ||
+		AnswerCount == 0 ||
+		AnswerCount > RESPONSE_CACHE_MAX_RECORDS
+		)
+	{
+		return;
+	}
+
+	AnswerStart = DNSJumpOverQuestionRecords(Message);
+	QuestionLength = AnswerStart - Question;
+	AnswerLength = MessageEnd - AnswerStart;
+
+	if( AnswerLength <= 0 || QuestionLength + AnswerLength > RESPONSE_CACHE_ENTRY_LENGTH )
+	{
+		return;
+	}
+
+	Record = AnswerStart;
+	for( loop = 0; loop != AnswerCount; ++loop )
+	{
+		const char	*TTLPos = DNSJumpOverName(Record) + 4;
+		uint32_t	TTL;
+
+		if( TTLPos + 6 > MessageEnd )
+		{
+			return;
+		}
+
+		TTL = GET_32_BIT_U_INT(TTLPos);
+		if( TTL < MinTTL )
+		{
+			MinTTL = TTL;
+		}
+
+		TTLOffsets[loop] = TTLPos - AnswerStart;
+
+		Record += DNSGetARecordLength(Record);
+	}
+
+	if( MinTTL == 0 || Record != MessageEnd )
+	{
+		return;
+	}
+
+	HashValue = ResponseCache_Hash(Question, QuestionLength);
+	Entry = Entries + (HashValue & Mask);
+	Lock = Locks + ((HashValue & Mask) % RESPONSE_CACHE_LOCKS);
+
+	RWLock_WrLock(*Lock);
+
+	Entry -> HashValue = HashValue;
+	Entry -> TimeAdded = CurrentTime;
+	Entry -> TTL = MinTTL;
+	Entry -> QuestionLength = QuestionLength;
+	Entry -> AnswerLength = AnswerLength;
+	Entry -> AnswerCount = AnswerCount;
+	memcpy(Entry -> TTLOffsets, TTLOffsets, sizeof(uint16_t) * AnswerCount);
+	memcpy(Entry -> Data, Question, QuestionLength + AnswerLength);
+
+	RWLock_UnWLock(*Lock);
+}
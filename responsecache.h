@@ -0,0 +1,42 @@
+#ifndef RESPONSECACHE_H_INCLUDED
+#define RESPONSECACHE_H_INCLUDED
+
+#include <time.h>
+#include "common.h"
+
+/* A ResponseCache keeps the compressed answer section assembled for a
+ * question, so a repeated question is answered with a single lookup and a
+ * copy, instead of following CNAMEs and compressing again.
+ *
+ * An entry lives as long as the shortest TTL in it, entries are placed by
+ * hash and a newer entry simply replaces an older one in the same place.
+ */
+
+int ResponseCache_Init(int NumberOfEntries, BOOL IgnoreTTL, int RefreshTime);
+/* Description:
+ *  Initialize the response cache.
+ * Parameters:
+ *  NumberOfEntries : Rounded up to a power of 2, 0 disables the cache.
+ *  IgnoreTTL       : If TRUE, entries never expire and TTLs are kept as is.
+ *  RefreshTime     : Entries with less than this many seconds left are not
+ *                    served, so that the caller can notice and refresh them.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+int ResponseCache_Fetch(char *RequestContent, int RequestLength, int BufferLength, time_t CurrentTime);
+/* Description:
+ *  Look up the question of a request without EDNS pseudo record, and append
+ *  the cached answers to it.
+ * Return value:
+ *  The length of the new message, or -1 if not found. The header except the
+ *  answer count is left to the caller.
+ */
+
+void ResponseCache_Store(const char *Message, int Length, time_t CurrentTime);
+/* Description:
+ *  Remember the answer section of a message with one question, no authority
+ *  and no additional records.
+ */
+
+#endif // RESPONSECACHE_H_INCLUDED
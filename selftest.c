@@ -0,0 +1,1394 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <sched.h>
+#include <sys/wait.h>
+#endif /* WIN32 */
+#include "selftest.h"
+#include "internalsocket.h"
+#include "messagequeue.h"
+#include "dnscache.h"
+#include "cacheht.h"
+#include "dnsgenerator.h"
+#include "dnsparser.h"
+#include "readconfig.h"
+#include "domaintrie.h"
+#include "stringchunk.h"
+#include "dnsrelated.h"
+#include "utils.h"
+#include "common.h"
+
+#define	CHECK(condition)	if( !(condition) ) \
+							{ \
+								printf("  FAILED at %s:%d : %s\n", __FILE__, __LINE__, #condition); \
+								return -1; \
+							}
+
+static double ElapsedNanoseconds(int64_t Start, int Count)
+{
+	return (GetMicroseconds() - Start) * 1000.0 / (Count > 0 ? Count : 1);
+}
+
+/* QueryContext */
+
+#define	QUERY_CONTEXT_COUNT	100000
+
+static int QueryContextExpired;
+
+static void QueryContextCount(QueryContextEntry *Entry, int Number)
+{
+	++QueryContextExpired;
+}
+
+static int AddContext(QueryContext *Context, int Number)
+{
+	char			Buffer[sizeof(ControlHeader) + 512];
+	ControlHeader	*Header = (ControlHeader *)Buffer;
+	uint16_t		Identifier = (uint16_t)Number;
+
+	memset(Buffer, 0, sizeof(Buffer));
+	InternalInterface_InitControlHeader(Header);
+
+	sprintf(Header -> RequestingDomain, "host%d.example.com", Number);
+	Header -> RequestingDomainHashValue = Number;
+	Header -> RequestingType = DNS_TYPE_A;
+	memcpy(Header + 1, &Identifier, sizeof(Identifier));
+
+	return InternalInterface_QueryContextAddTCP(Context, Header, INVALID_SOCKET);
+}
+
+static int32_t FindContext(QueryContext *Context, int Number)
+{
+	return InternalInterface_QueryContextFind(Context, (uint16_t)Number, Number);
+}
+
+/* Age of the entry `Number' in the aging test, never close to the timeouts
+ * swept with, so that a second passing meanwhile does not matter */
+static int QueryContextAge(int Number)
+{
+	int	Age = (Number * 7919) % 10000;
+	int	Near = Age % 1000;
+
+	return Near < 20 || Near > 980 ? Age + 50 : Age;
+}
+
+static int SelfTest_QueryContext(void)
+{
+	static const int	TimeOuts[] = {9000, 5000, 3000, 1000, 10, -5};
+
+	QueryContext	Context;
+	int64_t			Start;
+	time_t			Now;
+	int				loop;
+	int				Count;
+	int				Left;
+	int				Capacity;
+
+	CHECK(InternalInterface_InitQueryContext(&Context) == 0);
+
+	/* Adding, finding and removing */
+	Start = GetMicroseconds();
+	for( loop = 0; loop != QUERY_CONTEXT_COUNT; ++loop )
+	{
+		CHECK(AddContext(&Context, loop) >= 0);
+	}
+	printf("  add    : %.0f ns/context, %d contexts\n", ElapsedNanoseconds(Start, QUERY_CONTEXT_COUNT), QUERY_CONTEXT_COUNT);
+
+	Start = GetMicroseconds();
+	for( loop = 0; loop != QUERY_CONTEXT_COUNT; ++loop )
+	{
+		int32_t	Number = FindContext(&Context, loop);
+
+		CHECK(Number >= 0);
+		CHECK(InternalInterface_QueryContextGetByNumber(&Context, Number) -> HashValue == loop);
+	}
+	printf("  find   : %.0f ns/context\n", ElapsedNanoseconds(Start, QUERY_CONTEXT_COUNT));
+
+	/* Nothing is expired, a sweep must not depend on how many are in flight */
+	QueryContextExpired = 0;
+	Start = GetMicroseconds();
+	InternalInterface_QueryContextSwep(&Context, 3600, QueryContextCount);
+	printf("  sweep  : %.0f ns with %d in flight, none expired\n", ElapsedNanoseconds(Start, 1), QUERY_CONTEXT_COUNT);
+	CHECK(QueryContextExpired == 0);
+
+	Start = GetMicroseconds();
+	for( loop = 0; loop < QUERY_CONTEXT_COUNT; loop += 2 )
+	{
+		InternalInterface_QueryContextRemove(&Context, (uint16_t)loop, loop);
+	}
+	printf("  remove : %.0f ns/context\n", ElapsedNanoseconds(Start, QUERY_CONTEXT_COUNT / 2));
+
+	for( loop = 0; loop != QUERY_CONTEXT_COUNT; ++loop )
+	{
+		CHECK((FindContext(&Context, loop) >= 0) == (loop % 2 == 1));
+	}
+
+	QueryContextExpired = 0;
+	Start = GetMicroseconds();
+	InternalInterface_QueryContextSwep(&Context, -5, QueryContextCount);
+	printf("  expire : %.0f ns/context, by one sweep\n", ElapsedNanoseconds(Start, QUERY_CONTEXT_COUNT / 2));
+	CHECK(QueryContextExpired == QUERY_CONTEXT_COUNT / 2);
+	CHECK(InternalInterface_QueryContextIsEmpty(&Context));
+
+	/* Aging, entries are made older and relinked by a rehash, so that they
+	 * spread over both levels of the wheel and beyond */
+	InternalInterface_QueryContextReset(&Context);
+	Now = time(NULL);
+
+	for( loop = 0; loop != QUERY_CONTEXT_COUNT / 2; ++loop )
+	{
+		CHECK(AddContext(&Context, loop) >= 0);
+	}
+
+	for( loop = 0; loop != QUERY_CONTEXT_COUNT / 2; ++loop )
+	{
+		int32_t	Number = FindContext(&Context, loop);
+
+		CHECK(Number >= 0);
+		InternalInterface_QueryContextGetByNumber(&Context, Number) -> TimeAdd = Now - QueryContextAge(loop);
+	}
+
+	Capacity = Context.Capacity;
+	for( loop = QUERY_CONTEXT_COUNT / 2; Context.Capacity == Capacity; ++loop )
+	{
+		CHECK(AddContext(&Context, loop) >= 0);
+	}
+
+	Left = Context.Used;
+
+	for( Count = 0; Count != sizeof(TimeOuts) / sizeof(TimeOuts[0]); ++Count )
+	{
+		int	Expected = 0;
+
+		for( loop = 0; loop != QUERY_CONTEXT_COUNT / 2; ++loop )
+		{
+			int	Age = QueryContextAge(loop);
+
+			if( Age > TimeOuts[Count] && (Count == 0 || Age <= TimeOuts[Count - 1]) )
+			{
+				++Expected;
+			}
+		}
+
+		if( TimeOuts[Count] < 0 )
+		{
+			/* And those added to make the rehash happen */
+			Expected += Left - QUERY_CONTEXT_COUNT / 2;
+		}
+
+		QueryContextExpired = 0;
+		InternalInterface_QueryContextSwep(&Context, TimeOuts[Count], QueryContextCount);
+		printf("  aging  : %d expired older than %d s\n", QueryContextExpired, TimeOuts[Count]);
+		CHECK(QueryContextExpired == Expected);
+	}
+
+	CHECK(InternalInterface_QueryContextIsEmpty(&Context));
+
+	/* Questions of domains sharing a hash value are not to be mixed up */
+	{
+		char			Buffer[sizeof(ControlHeader) + 512];
+		ControlHeader	*Header = (ControlHeader *)Buffer;
+		char			*DNSBody = (char *)(Header + 1);
+		int32_t			Number;
+
+		memset(Buffer, 0, sizeof(Buffer));
+		InternalInterface_InitControlHeader(Header);
+
+		strcpy(Header -> RequestingDomain, "one.example.com");
+		Header -> RequestingDomainHashValue = 1;
+		Number = InternalInterface_QueryContextAddUDP(&Context, Header);
+		CHECK(Number >= 0);
+
+		strcpy(Header -> RequestingDomain, "two.example.com");
+		CHECK(InternalInterface_QueryContextAttach(&Context, Header) < 0);
+		CHECK(InternalInterface_QueryContextFindAnswer(&Context, DNSBody, "two.example.com", 1) < 0);
+
+		strcpy(Header -> RequestingDomain, "One.Example.COM");
+		CHECK(InternalInterface_QueryContextAttach(&Context, Header) == Number);
+		CHECK(InternalInterface_QueryContextFindAnswer(&Context, DNSBody, "ONE.example.com", 1) == Number);
+		printf("  hash   : domains sharing a hash value kept apart\n");
+	}
+
+	return 0;
+}
+
+#ifdef MESSAGEQUEUE_AVAILABLE
+
+/* MessageQueue, producers push in bursts, so that the queue keeps running
+ * empty and the consumer keeps rearming it while messages come in. */
+
+#define	QUEUE_PRODUCERS		4
+#define	QUEUE_MESSAGES		500000 /* Of each producer */
+#define	QUEUE_CAPACITY		256
+
+typedef struct _QueueMessage {
+	uint32_t	Producer;
+	uint32_t	Sequence;
+} QueueMessage;
+
+typedef struct _QueueProducer {
+	MessageQueue	*Queue;
+	uint32_t		Producer;
+	uint32_t		Full; /* Times the queue was found full */
+} QueueProducer;
+
+static void *QueueProduce(QueueProducer *p)
+{
+	QueueMessage	m;
+	uint32_t		Seed = p -> Producer + 1;
+
+	m.Producer = p -> Producer;
+
+	for( m.Sequence = 0; m.Sequence != QUEUE_MESSAGES; ++(m.Sequence) )
+	{
+		while( MessageQueue_Push(p -> Queue, (const char *)&m, sizeof(m)) < 0 )
+		{
+			++(p -> Full);
+			sched_yield();
+		}
+
+		/* Pause now and then for a random while */
+		Seed = Seed * 1103515245 + 12345;
+		if( (Seed >> 16) % 64 == 0 )
+		{
+			volatile int	Spin = (Seed >> 8) % 2048;
+
+			while( Spin > 0 )
+			{
+				--Spin;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static int SelfTest_MessageQueue(void)
+{
+	MessageQueue	Queue;
+	QueueProducer	Producers[QUEUE_PRODUCERS];
+	ThreadHandle	Threads[QUEUE_PRODUCERS];
+	uint32_t		Expected[QUEUE_PRODUCERS];
+	uint32_t		Received = 0;
+	uint32_t		Wakeups = 0;
+	uint32_t		Full = 0;
+	int64_t			Start;
+	int				Batch;
+	int				loop;
+
+	CHECK(MessageQueue_Init(&Queue, QUEUE_CAPACITY, sizeof(QueueMessage)) == 0);
+
+	Start = GetMicroseconds();
+
+	for( loop = 0; loop != QUEUE_PRODUCERS; ++loop )
+	{
+		Expected[loop] = 0;
+		Producers[loop].Queue = &Queue;
+		Producers[loop].Producer = loop;
+		Producers[loop].Full = 0;
+		CHECK(CREATE_THREAD(QueueProduce, Producers + loop, Threads[loop]) == 0);
+	}
+
+	while( Received != QUEUE_PRODUCERS * QUEUE_MESSAGES )
+	{
+		fd_set			ReadSet;
+		struct timeval	TimeLimit = {2, 0};
+		QueueMessage	m;
+
+		FD_ZERO(&ReadSet);
+		FD_SET(MessageQueue_GetFd(&Queue), &ReadSet);
+
+		/* Messages left in the queue without the descriptor readable, the
+		 * wakeup is lost */
+		if( select(MessageQueue_GetFd(&Queue) + 1, &ReadSet, NULL, NULL, &TimeLimit) <= 0 )
+		{
+			printf("  %u of %u messages received, no wakeup for 2 s\n", Received, QUEUE_PRODUCERS * QUEUE_MESSAGES);
+			CHECK(FALSE);
+		}
+
+		++Wakeups;
+
+		/* A few messages at a time, as the querying threads take them, so
+		 * that the queue is rearmed while producers push */
+		for( Batch = Wakeups % 8; Batch >= 0; --Batch )
+		{
+			if( MessageQueue_Pop(&Queue, (char *)&m, sizeof(m)) != sizeof(m) )
+			{
+				break;
+			}
+
+			/* Each producer's messages come in order, none lost */
+			CHECK(m.Producer < QUEUE_PRODUCERS);
+			CHECK(m.Sequence == Expected[m.Producer]);
+
+			++(Expected[m.Producer]);
+			++Received;
+		}
+	}
+
+	for( loop = 0; loop != QUEUE_PRODUCERS; ++loop )
+	{
+		pthread_join(Threads[loop], NULL);
+		Full += Producers[loop].Full;
+	}
+
+	printf("  %u messages from %d producers : %.0f ns/message, %u wakeups, queue full %u times\n",
+			Received,
+			QUEUE_PRODUCERS,
+			ElapsedNanoseconds(Start, Received),
+			Wakeups,
+			Full
+			);
+
+	return 0;
+}
+
+/* Transports between a listening thread and a querying thread, a message
+ * as large as a forwarded query is echoed back and forth, so that the round
+ * trip includes the waking up of the other thread. */
+
+#define	TRANSPORT_ROUNDS			100000
+#define	TRANSPORT_MESSAGE_LENGTH	(sizeof(ControlHeader) + 64)
+
+typedef struct _TransportEcho {
+	/* The in-process queues, to and from the echoing thread */
+	MessageQueue	To;
+	MessageQueue	From;
+
+	/* The loopback sockets, the echoing thread receives with `Echo' */
+	SOCKET			Main;
+	SOCKET			Echo;
+	struct sockaddr_in	MainAddress;
+	struct sockaddr_in	EchoAddress;
+} TransportEcho;
+
+static BOOL TransportWait(int Fd)
+{
+	fd_set			ReadSet;
+	struct timeval	TimeLimit = {2, 0};
+
+	FD_ZERO(&ReadSet);
+	FD_SET(Fd, &ReadSet);
+
+	return select(Fd + 1, &ReadSet, NULL, NULL, &TimeLimit) > 0;
+}
+
+static void *TransportEchoQueue(TransportEcho *t)
+{
+	char	Buffer[TRANSPORT_MESSAGE_LENGTH];
+	int		Rounds = 0;
+
+	while( Rounds != TRANSPORT_ROUNDS && TransportWait(MessageQueue_GetFd(&(t -> To))) )
+	{
+		int	Length;
+
+		while( (Length = MessageQueue_Pop(&(t -> To), Buffer, sizeof(Buffer))) > 0 )
+		{
+			MessageQueue_Push(&(t -> From), Buffer, Length);
+			++Rounds;
+		}
+	}
+
+	return NULL;
+}
+
+static void *TransportEchoSocket(TransportEcho *t)
+{
+	char	Buffer[TRANSPORT_MESSAGE_LENGTH];
+	int		Rounds;
+
+	for( Rounds = 0; Rounds != TRANSPORT_ROUNDS && TransportWait(t -> Echo); ++Rounds )
+	{
+		int	Length = recvfrom(t -> Echo, Buffer, sizeof(Buffer), 0, NULL, NULL);
+
+		sendto(t -> Echo, Buffer, Length, 0, (const struct sockaddr *)&(t -> MainAddress), sizeof(t -> MainAddress));
+	}
+
+	return NULL;
+}
+
+static SOCKET TransportOpenSocket(struct sockaddr_in *Address)
+{
+	SOCKET		s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	socklen_t	Length = sizeof(*Address);
+
+	if( s == INVALID_SOCKET )
+	{
+		return INVALID_SOCKET;
+	}
+
+	memset(Address, 0, sizeof(*Address));
+	Address -> sin_family = AF_INET;
+	Address -> sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	Address -> sin_port = 0;
+
+	if( bind(s, (const struct sockaddr *)Address, sizeof(*Address)) != 0 ||
+		getsockname(s, (struct sockaddr *)Address, &Length) != 0
+		)
+	{
+		CLOSE_SOCKET(s);
+		return INVALID_SOCKET;
+	}
+
+	return s;
+}
+
+static int SelfTest_Transport(void)
+{
+	TransportEcho	t;
+	ThreadHandle	Thread;
+	char			Buffer[TRANSPORT_MESSAGE_LENGTH];
+	int64_t			Start;
+	int				loop;
+
+	memset(Buffer, 0x5A, sizeof(Buffer));
+
+	/* In-process queues */
+	CHECK(MessageQueue_Init(&(t.To), 256, TRANSPORT_MESSAGE_LENGTH) == 0);
+	CHECK(MessageQueue_Init(&(t.From), 256, TRANSPORT_MESSAGE_LENGTH) == 0);
+	CHECK(CREATE_THREAD(TransportEchoQueue, &t, Thread) == 0);
+
+	Start = GetMicroseconds();
+	for( loop = 0; loop != TRANSPORT_ROUNDS; ++loop )
+	{
+		CHECK(MessageQueue_Push(&(t.To), Buffer, sizeof(Buffer)) == sizeof(Buffer));
+		CHECK(TransportWait(MessageQueue_GetFd(&(t.From))));
+		CHECK(MessageQueue_Pop(&(t.From), Buffer, sizeof(Buffer)) == sizeof(Buffer));
+	}
+	printf("  queue    : %.0f ns one way, %d bytes each\n", ElapsedNanoseconds(Start, TRANSPORT_ROUNDS * 2), (int)sizeof(Buffer));
+
+	pthread_join(Thread, NULL);
+
+	/* Loopback sockets, as the internal interfaces used before */
+	t.Main = TransportOpenSocket(&(t.MainAddress));
+	t.Echo = TransportOpenSocket(&(t.EchoAddress));
+	CHECK(t.Main != INVALID_SOCKET && t.Echo != INVALID_SOCKET);
+	CHECK(CREATE_THREAD(TransportEchoSocket, &t, Thread) == 0);
+
+	Start = GetMicroseconds();
+	for( loop = 0; loop != TRANSPORT_ROUNDS; ++loop )
+	{
+		CHECK(sendto(t.Main, Buffer, sizeof(Buffer), 0, (const struct sockaddr *)&(t.EchoAddress), sizeof(t.EchoAddress)) == sizeof(Buffer));
+		CHECK(TransportWait(t.Main));
+		CHECK(recvfrom(t.Main, Buffer, sizeof(Buffer), 0, NULL, NULL) == sizeof(Buffer));
+	}
+	printf("  loopback : %.0f ns one way\n", ElapsedNanoseconds(Start, TRANSPORT_ROUNDS * 2));
+
+	pthread_join(Thread, NULL);
+
+	CLOSE_SOCKET(t.Main);
+	CLOSE_SOCKET(t.Echo);
+
+	return 0;
+}
+
+#endif /* MESSAGEQUEUE_AVAILABLE */
+
+/* DNSCache, answers with a CNAME chain of two hops and 8 A records, as
+ * given by content delivery networks, are fetched from the RRset cache */
+
+#define	CACHE_NAMES		1000
+#define	CACHE_FETCHES	1000000
+#define	CACHE_ANSWERS	10
+
+static char *CachePutName(char *Here, const char *Name)
+{
+	while( *Name != '\0' )
+	{
+		const char	*Dot = strchr(Name, '.');
+		int			Length = Dot == NULL ? (int)strlen(Name) : Dot - Name;
+
+		*Here = Length;
+		memcpy(Here + 1, Name, Length);
+		Here += Length + 1;
+
+		Name += Length;
+		if( *Name == '.' )
+		{
+			++Name;
+		}
+	}
+
+	*Here = '\0';
+
+	return Here + 1;
+}
+
+static char *CachePutRecord(char *Here, const char *Name, uint16_t Type, const char *Data, int DataLength)
+{
+	Here = CachePutName(Here, Name);
+
+	SET_16_BIT_U_INT(Here, Type);
+	SET_16_BIT_U_INT(Here + 2, DNS_CLASS_IN);
+	SET_32_BIT_U_INT(Here + 4, 3600);
+	SET_16_BIT_U_INT(Here + 8, DataLength);
+	memcpy(Here + 10, Data, DataLength);
+
+	return Here + 10 + DataLength;
+}
+
+/* The question of the name `Number', answered if `Response' is TRUE */
+static int CacheMakeMessage(char *Buffer, int Number, BOOL Response)
+{
+	char	Names[3][64];
+	char	Data[64];
+	char	*Here = Buffer + DNS_HEADER_LENGTH;
+	int		loop;
+
+	sprintf(Names[0], "www%d.example.com", Number);
+	sprintf(Names[1], "cdn%d.example.net", Number);
+	sprintf(Names[2], "edge%d.example.org", Number);
+
+	memset(Buffer, 0, DNS_HEADER_LENGTH);
+	SET_16_BIT_U_INT(Buffer, Number);
+	SET_16_BIT_U_INT(Buffer + 2, Response ? 0x8180 : 0x0100);
+	SET_16_BIT_U_INT(Buffer + 4, 1);
+	SET_16_BIT_U_INT(Buffer + 6, Response ? CACHE_ANSWERS : 0);
+
+	Here = CachePutName(Here, Names[0]);
+	SET_16_BIT_U_INT(Here, DNS_TYPE_A);
+	SET_16_BIT_U_INT(Here + 2, DNS_CLASS_IN);
+	Here += 4;
+
+	if( Response )
+	{
+		for( loop = 0; loop != 2; ++loop )
+		{
+			Here = CachePutRecord(Here, Names[loop], DNS_TYPE_CNAME, Data, CachePutName(Data, Names[loop + 1]) - Data);
+		}
+
+		for( loop = 0; loop != CACHE_ANSWERS - 2; ++loop )
+		{
+			Data[0] = 10;
+			Data[1] = Number >> 8;
+			Data[2] = Number;
+			Data[3] = loop;
+			Here = CachePutRecord(Here, Names[2], DNS_TYPE_A, Data, 4);
+		}
+	}
+
+	return Here - Buffer;
+}
+
+/* A memory cache with the whole-response cache disabled, all other options
+ * left as by default */
+static int CacheInit(int Shards)
+{
+	ConfigFileInfo	ConfigInfo;
+	VType			Value;
+
+	CHECK(ConfigInitInfo(&ConfigInfo) == 0);
+
+	Value.boolean = TRUE;
+	ConfigAddOption(&ConfigInfo, "UseCache", STRATEGY_DEFAULT, TYPE_BOOLEAN, Value, NULL);
+	ConfigAddOption(&ConfigInfo, "MemoryCache", STRATEGY_DEFAULT, TYPE_BOOLEAN, Value, NULL);
+
+	Value.INT32 = 8 * 1048576;
+	ConfigAddOption(&ConfigInfo, "CacheSize", STRATEGY_DEFAULT, TYPE_INT32, Value, NULL);
+
+	Value.INT32 = -1;
+	ConfigAddOption(&ConfigInfo, "OverrideTTL", STRATEGY_DEFAULT, TYPE_INT32, Value, NULL);
+
+	Value.INT32 = 1;
+	ConfigAddOption(&ConfigInfo, "MultipleTTL", STRATEGY_DEFAULT, TYPE_INT32, Value, NULL);
+
+	Value.INT32 = Shards;
+	ConfigAddOption(&ConfigInfo, "CacheShards", STRATEGY_DEFAULT, TYPE_INT32, Value, NULL);
+
+	CHECK(DNSCache_Init(&ConfigInfo) == 0);
+
+	return 0;
+}
+
+static int SelfTest_Cache(void)
+{
+	static char		Requests[CACHE_NAMES][64];
+	static int		RequestLengths[CACHE_NAMES];
+
+	char			Buffer[2048];
+	int64_t			Start;
+	int				loop;
+
+	CHECK(CacheInit(8) == 0);
+
+	for( loop = 0; loop != CACHE_NAMES; ++loop )
+	{
+		CacheMakeMessage(Buffer, loop, TRUE);
+		CHECK(DNSCache_AddItemsToCache(Buffer, time(NULL)) == 0);
+
+		RequestLengths[loop] = CacheMakeMessage(Requests[loop], loop, FALSE);
+	}
+
+	Start = GetMicroseconds();
+	for( loop = 0; loop != CACHE_FETCHES; ++loop )
+	{
+		BOOL	Refresh;
+		int		Length = RequestLengths[loop % CACHE_NAMES];
+
+		memcpy(Buffer, Requests[loop % CACHE_NAMES], Length);
+		CHECK(DNSCache_FetchFromCache(Buffer, Length, sizeof(Buffer), &Refresh) > Length);
+		CHECK(DNSGetAnswerCount(Buffer) == CACHE_ANSWERS);
+	}
+	printf("  hit    : %.0f ns/fetch, %d names of %d answers each\n", ElapsedNanoseconds(Start, CACHE_FETCHES), CACHE_NAMES, CACHE_ANSWERS);
+
+	return 0;
+}
+
+#ifndef WIN32
+
+/* DNSCache shared by threads, readers fetch answers while writers add them
+ * again, with the cache in one shard and in several. The cache is set up
+ * only once in a process, so each setting is run in a child process. */
+
+#define	SHARDS_READERS	4
+#define	SHARDS_WRITERS	4
+#define	SHARDS_FETCHES	125000 /* Of each reader */
+#define	SHARDS_ADDS		12500 /* Of each writer */
+#define	SHARDS_THREADS	(SHARDS_READERS + SHARDS_WRITERS)
+
+static char	ShardsRequests[CACHE_NAMES][64];
+static int	ShardsRequestLengths[CACHE_NAMES];
+static char	ShardsResponses[CACHE_NAMES][512];
+
+typedef struct _ShardsWorker {
+	uint32_t	Seed;
+	int			Failed;
+} ShardsWorker;
+
+static int ShardsNextName(ShardsWorker *w)
+{
+	w -> Seed = w -> Seed * 1103515245 + 12345;
+
+	return (w -> Seed >> 16) % CACHE_NAMES;
+}
+
+static void *ShardsRead(ShardsWorker *w)
+{
+	char	Buffer[2048];
+	int		loop;
+
+	for( loop = 0; loop != SHARDS_FETCHES; ++loop )
+	{
+		int		Name = ShardsNextName(w);
+		int		Length = ShardsRequestLengths[Name];
+		BOOL	Refresh;
+
+		/* All the names stay in the cache while being added again */
+		memcpy(Buffer, ShardsRequests[Name], Length);
+		if( DNSCache_FetchFromCache(Buffer, Length, sizeof(Buffer), &Refresh) <= Length ||
+			DNSGetAnswerCount(Buffer) != CACHE_ANSWERS
+			)
+		{
+			++(w -> Failed);
+		}
+	}
+
+	return NULL;
+}
+
+static void *ShardsWrite(ShardsWorker *w)
+{
+	char	Buffer[sizeof(ShardsResponses[0])];
+	int		loop;
+
+	for( loop = 0; loop != SHARDS_ADDS; ++loop )
+	{
+		memcpy(Buffer, ShardsResponses[ShardsNextName(w)], sizeof(Buffer));
+		if( DNSCache_AddItemsToCache(Buffer, time(NULL)) != 0 )
+		{
+			++(w -> Failed);
+		}
+	}
+
+	return NULL;
+}
+
+static int ShardsRun(int Shards)
+{
+	ShardsWorker	Workers[SHARDS_THREADS];
+	ThreadHandle	Threads[SHARDS_THREADS];
+	char			Buffer[sizeof(ShardsResponses[0])];
+	int64_t			Start;
+	double			Seconds;
+	int				Failed = 0;
+	int				loop;
+
+	CHECK(CacheInit(Shards) == 0);
+
+	for( loop = 0; loop != CACHE_NAMES; ++loop )
+	{
+		memcpy(Buffer, ShardsResponses[loop], sizeof(Buffer));
+		CHECK(DNSCache_AddItemsToCache(Buffer, time(NULL)) == 0);
+	}
+
+	Start = GetMicroseconds();
+
+	for( loop = 0; loop != SHARDS_THREADS; ++loop )
+	{
+		Workers[loop].Seed = loop + 1;
+		Workers[loop].Failed = 0;
+
+		if( loop < SHARDS_READERS )
+		{
+			CHECK(CREATE_THREAD(ShardsRead, Workers + loop, Threads[loop]) == 0);
+		} else {
+			CHECK(CREATE_THREAD(ShardsWrite, Workers + loop, Threads[loop]) == 0);
+		}
+	}
+
+	for( loop = 0; loop != SHARDS_THREADS; ++loop )
+	{
+		pthread_join(Threads[loop], NULL);
+		Failed += Workers[loop].Failed;
+	}
+
+	Seconds = (GetMicroseconds() - Start) / 1000000.0;
+
+	printf("  %d shard%s : %.0f k fetches/s and %.0f k adds/s, %d readers and %d writers\n",
+			Shards,
+			Shards == 1 ? " " : "s",
+			SHARDS_READERS * SHARDS_FETCHES / Seconds / 1000,
+			SHARDS_WRITERS * SHARDS_ADDS / Seconds / 1000,
+			SHARDS_READERS,
+			SHARDS_WRITERS
+			);
+
+	CHECK(Failed == 0);
+
+	return 0;
+}
+
+static int SelfTest_Shards(void)
+{
+	static const int	Settings[] = {1, 8};
+
+	unsigned int	loop;
+
+	for( loop = 0; loop != CACHE_NAMES; ++loop )
+	{
+		ShardsRequestLengths[loop] = CacheMakeMessage(ShardsRequests[loop], loop, FALSE);
+		CHECK(CacheMakeMessage(ShardsResponses[loop], loop, TRUE) <= (int)sizeof(ShardsResponses[loop]));
+	}
+
+	for( loop = 0; loop != sizeof(Settings) / sizeof(Settings[0]); ++loop )
+	{
+		pid_t	Child;
+		int		Status;
+
+		/* Not to have what is buffered printed by the child again */
+		fflush(stdout);
+
+		Child = fork();
+		CHECK(Child >= 0);
+
+		if( Child == 0 )
+		{
+			int	Result = ShardsRun(Settings[loop]);
+
+			fflush(stdout);
+			_exit(Result == 0 ? 0 : 1);
+		}
+
+		CHECK(waitpid(Child, &Status, 0) == Child);
+		CHECK(WIFEXITED(Status) && WEXITSTATUS(Status) == 0);
+	}
+
+	return 0;
+}
+
+#endif /* WIN32 */
+
+/* CacheHT, lookups of names in it and of names not in it, with the keys
+ * formatted as the cache does, in tables of a few sizes */
+
+#define	CACHEHT_LOOKUPS		1000000
+#define	CACHEHT_CHUNK		64
+
+static int CacheHTMakeKey(char *Buffer, const char *Prefix, int Number)
+{
+	return sprintf(Buffer, "%s%d.example%d.com\1" "1\1" "1", Prefix, Number, Number % 13);
+}
+
+/* The node holding `Key', as DNSCache_FindFromCache() finds it */
+static Cht_Node *CacheHTFind(CacheHT *h, const char *Base, const char *Key, int Length)
+{
+	Cht_Node	*Node = NULL;
+
+	while( (Node = CacheHT_Get(h, Key, Node, NULL)) != NULL )
+	{
+		if( memcmp(Key, Base + Node -> Offset + 1, Length + 1) == 0 )
+		{
+			return Node;
+		}
+	}
+
+	return NULL;
+}
+
+static int CacheHTLookUp(int Entries, int Size)
+{
+	CacheHT	h;
+	char	*Base = SafeMalloc(Size);
+	int32_t	End = 0;
+	int		Inserted;
+	char	Key[64];
+	int64_t	Start;
+	double	Hit;
+	int		loop;
+
+	CHECK(Base != NULL);
+	CHECK(CacheHT_Init(&h, Base, Size) == 0);
+
+	/* Until the table or the region is full */
+	for( Inserted = 0; Inserted != Entries; ++Inserted )
+	{
+		Cht_Node	*Node;
+		BOOL		NewCreated;
+		int32_t		Subscript = CacheHT_FindUnusedNode(&h, CACHEHT_CHUNK, &Node, Base + End + CACHEHT_CHUNK, &NewCreated);
+
+		if( Subscript < 0 )
+		{
+			break;
+		}
+
+		if( NewCreated == TRUE )
+		{
+			Node -> Offset = End;
+			End += CACHEHT_CHUNK;
+		}
+
+		Node -> TTL = 3600;
+		Node -> TimeAdded = time(NULL);
+
+		CacheHTMakeKey(Key, "host", Inserted);
+		Base[Node -> Offset] = 0;
+		strcpy(Base + Node -> Offset + 1, Key);
+
+		CHECK(CacheHT_InsertToSlot(&h, Key, Subscript, Node, NULL) == 0);
+	}
+
+	CHECK(Inserted > 0);
+
+	Start = GetMicroseconds();
+	for( loop = 0; loop != CACHEHT_LOOKUPS; ++loop )
+	{
+		int	Length = CacheHTMakeKey(Key, "host", (int)(((uint32_t)loop * 2654435761U) % Inserted));
+
+		CHECK(CacheHTFind(&h, Base, Key, Length) != NULL);
+	}
+	Hit = ElapsedNanoseconds(Start, CACHEHT_LOOKUPS);
+
+	Start = GetMicroseconds();
+	for( loop = 0; loop != CACHEHT_LOOKUPS; ++loop )
+	{
+		int	Length = CacheHTMakeKey(Key, "miss", loop);
+
+		CHECK(CacheHTFind(&h, Base, Key, Length) == NULL);
+	}
+
+	printf("  %6d entries, %4d KB : hit %.0f ns, miss %.0f ns\n", Inserted, Size / 1024, Hit, ElapsedNanoseconds(Start, CACHEHT_LOOKUPS));
+
+	SafeFree(Base);
+
+	return 0;
+}
+
+static int SelfTest_CacheHT(void)
+{
+	CHECK(CacheHTLookUp(10000, 1048576) == 0);
+	CHECK(CacheHTLookUp(50000, 8 * 1048576) == 0);
+	CHECK(CacheHTLookUp(120000, 8 * 1048576) == 0);
+
+	return 0;
+}
+
+/* DomainTrie, against matching every parent suffix in a StringChunk as
+ * domain lists were matched before. The list looks like the gfwlist, a
+ * trace of names is matched, about a third of which are on the list or
+ * under its domains. */
+
+#define	TRIE_DOMAINS	20000
+#define	TRIE_NAMES		1000000
+
+static const char *const TrieSuffixes[] = {"com", "net", "org", "io", "co.uk", "com.hk", "jp", "tv"};
+
+#define	TRIE_SUFFIXES	(sizeof(TrieSuffixes) / sizeof(TrieSuffixes[0]))
+
+static uint32_t TrieRandom(uint32_t *Seed)
+{
+	*Seed = *Seed * 1103515245 + 12345;
+
+	return *Seed >> 8;
+}
+
+static void TrieMakeDomain(char *Buffer, int Number)
+{
+	/* Some domains are listed by one of their hosts only */
+	if( Number % 5 == 0 )
+	{
+		sprintf(Buffer, "cdn.site%d.%s", Number, TrieSuffixes[Number % TRIE_SUFFIXES]);
+	} else {
+		sprintf(Buffer, "site%d.%s", Number, TrieSuffixes[Number % TRIE_SUFFIXES]);
+	}
+}
+
+static void TrieMakeName(char *Buffer, uint32_t *Seed)
+{
+	uint32_t	r = TrieRandom(Seed);
+	char		Domain[64];
+
+	switch( r % 6 )
+	{
+		case 0:
+			TrieMakeDomain(Buffer, TrieRandom(Seed) % TRIE_DOMAINS);
+			break;
+
+		case 1:
+			TrieMakeDomain(Domain, TrieRandom(Seed) % TRIE_DOMAINS);
+			sprintf(Buffer, "img%u.static.%s", TrieRandom(Seed) % 100, Domain);
+			break;
+
+		default:
+			/* Not on the list, some sharing the suffixes of domains on it */
+			sprintf(Buffer,
+					"www.%ssite%u.%s",
+					r % 6 == 2 ? "other" : "",
+					TrieRandom(Seed) % (TRIE_DOMAINS * 4) + TRIE_DOMAINS,
+					TrieSuffixes[TrieRandom(Seed) % TRIE_SUFFIXES]
+					);
+			break;
+	}
+}
+
+/* How MatchDomain() in excludedlist.c worked before the trie */
+static BOOL TrieMatchSuffixes(StringChunk *List, const char *Domain)
+{
+	if( StringChunk_Match(List, Domain, NULL, NULL) == TRUE )
+	{
+		return TRUE;
+	}
+
+	Domain = strchr(Domain + 1, '.');
+
+	while( Domain != NULL )
+	{
+		if( StringChunk_Match_NoWildCard(List, Domain, NULL, NULL) == TRUE ||
+			StringChunk_Match_NoWildCard(List, Domain + 1, NULL, NULL) == TRUE
+			)
+		{
+			return TRUE;
+		}
+
+		Domain = strchr(Domain + 1, '.');
+	}
+
+	return FALSE;
+}
+
+static int SelfTest_DomainTrie(void)
+{
+	static char		Names[TRIE_NAMES][48];
+	static BOOL		Results[TRIE_NAMES];
+
+	DomainTrie	Trie;
+	StringChunk	Chunk;
+	char		Domain[64];
+	uint32_t	Seed = 1;
+	int64_t		Start;
+	double		Old;
+	int			Matched = 0;
+	int			loop;
+
+	CHECK(DomainTrie_Init(&Trie) == 0);
+	CHECK(StringChunk_Init(&Chunk, NULL) == 0);
+
+	for( loop = 0; loop != TRIE_DOMAINS; ++loop )
+	{
+		TrieMakeDomain(Domain, loop);
+		CHECK(DomainTrie_Add(&Trie, Domain) == 0);
+		CHECK(StringChunk_Add(&Chunk, Domain, NULL, 0) == 0);
+	}
+
+	for( loop = 0; loop != TRIE_NAMES; ++loop )
+	{
+		TrieMakeName(Names[loop], &Seed);
+	}
+
+	Start = GetMicroseconds();
+	for( loop = 0; loop != TRIE_NAMES; ++loop )
+	{
+		Results[loop] = TrieMatchSuffixes(&Chunk, Names[loop]);
+	}
+	Old = ElapsedNanoseconds(Start, TRIE_NAMES);
+
+	Start = GetMicroseconds();
+	for( loop = 0; loop != TRIE_NAMES; ++loop )
+	{
+		if( DomainTrie_Match(&Trie, Names[loop]) != Results[loop] )
+		{
+			printf("  `%s' is matched differently\n", Names[loop]);
+			CHECK(FALSE);
+		}
+
+		Matched += Results[loop];
+	}
+
+	printf("  %d domains, %d names, %d%% matched : suffixes %.0f ns/name, trie %.0f ns/name\n",
+			TRIE_DOMAINS,
+			TRIE_NAMES,
+			Matched / (TRIE_NAMES / 100),
+			Old,
+			ElapsedNanoseconds(Start, TRIE_NAMES)
+			);
+
+	DomainTrie_Free(&Trie);
+	StringChunk_Free(&Chunk, TRUE);
+
+	return 0;
+}
+
+/* StringChunk, domains with wildcards are loaded and matched, against trying
+ * every one of them in turn as they were matched before. About a fifth of
+ * the names are made from a rule. */
+
+#define	WILDCARD_NAMES	1000
+
+static void WildCardMakeRule(char *Buffer, int Number)
+{
+	switch( Number % 4 )
+	{
+		case 0:
+			sprintf(Buffer, "*.ads%d.example%d.com", Number, Number % 97);
+			break;
+
+		case 1:
+			sprintf(Buffer, "track?%d.*.net", Number);
+			break;
+
+		case 2:
+			sprintf(Buffer, "*cdn%d-*.org", Number);
+			break;
+
+		default:
+			sprintf(Buffer, "img%d.*.static%d.io", Number, Number % 89);
+			break;
+	}
+}
+
+static void WildCardMakeName(char *Buffer, int Rules, uint32_t *Seed)
+{
+	uint32_t	r = TrieRandom(Seed);
+	int			Number = TrieRandom(Seed) % Rules;
+
+	if( r % 5 != 0 )
+	{
+		sprintf(Buffer, "www.site%u.example%u.com", TrieRandom(Seed) % 100000, r % 97);
+		return;
+	}
+
+	switch( Number % 4 )
+	{
+		case 0:
+			sprintf(Buffer, "www.ads%d.example%d.com", Number, Number % 97);
+			break;
+
+		case 1:
+			sprintf(Buffer, "tracka%d.eu.net", Number);
+			break;
+
+		case 2:
+			sprintf(Buffer, "edgecdn%d-7.org", Number);
+			break;
+
+		default:
+			sprintf(Buffer, "img%d.a.b.static%d.io", Number, Number % 89);
+			break;
+	}
+}
+
+#define	WILDCARD_RULES	100000
+
+static char	WildCardRules[WILDCARD_RULES][40];
+
+/* The first rule a name matches, tried in turn, -1 if none */
+static int WildCardMatchInTurn(int Rules, const char *Name)
+{
+	int	loop;
+
+	for( loop = 0; loop != Rules; ++loop )
+	{
+		if( WILDCARD_MATCH(WildCardRules[loop], Name) == WILDCARD_MATCHED )
+		{
+			return loop;
+		}
+	}
+
+	return -1;
+}
+
+static int WildCardMatch(int Rules)
+{
+	static char	Names[WILDCARD_NAMES][48];
+	static int	Expected[WILDCARD_NAMES];
+	static int	Results[WILDCARD_NAMES];
+
+	StringChunk	Chunk;
+	uint32_t	Seed = 1;
+	int64_t		Start;
+	double		Load;
+	double		Memory;
+	double		Old;
+	int			Matched = 0;
+	int			loop;
+
+	for( loop = 0; loop != Rules; ++loop )
+	{
+		WildCardMakeRule(WildCardRules[loop], loop);
+	}
+
+	for( loop = 0; loop != WILDCARD_NAMES; ++loop )
+	{
+		WildCardMakeName(Names[loop], Rules, &Seed);
+	}
+
+	Start = GetMicroseconds();
+	CHECK(StringChunk_Init(&Chunk, NULL) == 0);
+	for( loop = 0; loop != Rules; ++loop )
+	{
+		CHECK(StringChunk_Add(&Chunk, WildCardRules[loop], (const char *)&loop, sizeof(loop)) == 0);
+	}
+	Load = (GetMicroseconds() - Start) / 1000.0;
+
+	/* The index of the fragments */
+	Memory = ((double)Chunk.W_Nodes.Allocated * Chunk.W_Nodes.DataLength +
+			  (double)Chunk.W_Capacity * sizeof(StringChunk_Edge) +
+			  (double)Chunk.List_W_Pos.Allocated * Chunk.List_W_Pos.DataLength
+			  ) / 1048576;
+
+	Start = GetMicroseconds();
+	for( loop = 0; loop != WILDCARD_NAMES; ++loop )
+	{
+		Expected[loop] = WildCardMatchInTurn(Rules, Names[loop]);
+	}
+	Old = ElapsedNanoseconds(Start, WILDCARD_NAMES) / 1000;
+
+	Start = GetMicroseconds();
+	for( loop = 0; loop != WILDCARD_NAMES; ++loop )
+	{
+		char	*Data = NULL;
+		int		Found = -1;
+
+		if( StringChunk_Match_OnlyWildCard(&Chunk, Names[loop], &Data) == TRUE )
+		{
+			memcpy(&Found, Data, sizeof(Found));
+		}
+
+		Results[loop] = Found;
+	}
+
+	for( loop = 0; loop != WILDCARD_NAMES; ++loop )
+	{
+		if( Results[loop] != Expected[loop] )
+		{
+			printf("  `%s' is matched differently\n", Names[loop]);
+			CHECK(FALSE);
+		}
+
+		if( Results[loop] >= 0 )
+		{
+			++Matched;
+		}
+	}
+
+	printf("  %6d rules, %d%% matched : loaded in %.1f ms, index %.1f MB, in turn %.1f us/name, indexed %.1f us/name\n",
+			Rules,
+			Matched * 100 / WILDCARD_NAMES,
+			Load,
+			Memory,
+			Old,
+			ElapsedNanoseconds(Start, WILDCARD_NAMES) / 1000
+			);
+
+	StringChunk_Free(&Chunk, TRUE);
+
+	return 0;
+}
+
+static int SelfTest_WildCard(void)
+{
+	CHECK(WildCardMatch(1000) == 0);
+	CHECK(WildCardMatch(10000) == 0);
+	CHECK(WildCardMatch(100000) == 0);
+
+	return 0;
+}
+
+#ifndef WIN32
+
+/* Pages backing the cache, a chain of dependent random probes runs over a
+ * region mapped as the cache is with each HugePageCache setting */
+
+#define	PAGES_REGION	(1024 * 1048576)
+#define	PAGES_LINE		64
+#define	PAGES_PROBES	20000000
+#define	PAGES_HUGE		2097152
+
+/* Link the lines of the region into one random cycle (Sattolo's
+ * algorithm), each line holding the number of the next */
+static void PagesLink(char *Region)
+{
+	uint32_t	Lines = PAGES_REGION / PAGES_LINE;
+	uint64_t	Seed = 88172645463325252ULL;
+	uint32_t	loop;
+
+	for( loop = 0; loop != Lines; ++loop )
+	{
+		*(uint32_t *)(Region + (size_t)loop * PAGES_LINE) = loop;
+	}
+
+	for( loop = Lines - 1; loop > 0; --loop )
+	{
+		uint32_t	*One = (uint32_t *)(Region + (size_t)loop * PAGES_LINE);
+		uint32_t	*Another;
+		uint32_t	Tmp;
+
+		Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		Another = (uint32_t *)(Region + (size_t)((Seed >> 33) % loop) * PAGES_LINE);
+
+		Tmp = *One;
+		*One = *Another;
+		*Another = Tmp;
+	}
+}
+
+static int PagesChase(const char *Name, char *Region)
+{
+	uint32_t	Line = 0;
+	int64_t		Start;
+	int			loop;
+
+	PagesLink(Region);
+
+	Start = GetMicroseconds();
+	for( loop = 0; loop != PAGES_PROBES; ++loop )
+	{
+		Line = *(volatile uint32_t *)(Region + (size_t)Line * PAGES_LINE);
+	}
+	printf("  %-22s : %.1f ns/probe\n", Name, ElapsedNanoseconds(Start, PAGES_PROBES));
+
+	CHECK(Line < PAGES_REGION / PAGES_LINE);
+
+	return 0;
+}
+
+static int SelfTest_Pages(void)
+{
+	char	*Region;
+
+	Region = mmap(NULL, PAGES_REGION, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	CHECK(Region != MAP_FAILED);
+#ifdef MADV_NOHUGEPAGE
+	madvise(Region, PAGES_REGION, MADV_NOHUGEPAGE);
+#endif /* MADV_NOHUGEPAGE */
+	CHECK(PagesChase("4K pages", Region) == 0);
+	munmap(Region, PAGES_REGION);
+
+#ifdef MADV_HUGEPAGE
+	Region = mmap(NULL, PAGES_REGION + PAGES_HUGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	CHECK(Region != MAP_FAILED);
+	{
+		char	*Start = (char *)ROUND_UP((size_t)Region, PAGES_HUGE);
+
+		if( madvise(Start, PAGES_REGION, MADV_HUGEPAGE) == 0 )
+		{
+			CHECK(PagesChase("transparent huge pages", Start) == 0);
+		} else {
+			printf("  transparent huge pages are not available\n");
+		}
+	}
+	munmap(Region, PAGES_REGION + PAGES_HUGE);
+#endif /* MADV_HUGEPAGE */
+
+#ifdef MAP_HUGETLB
+	Region = mmap(NULL, PAGES_REGION, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	if( Region != MAP_FAILED )
+	{
+		CHECK(PagesChase("MAP_HUGETLB", Region) == 0);
+		munmap(Region, PAGES_REGION);
+	} else {
+		printf("  MAP_HUGETLB is not available, %d huge pages are needed (vm.nr_hugepages)\n", PAGES_REGION / PAGES_HUGE);
+	}
+#endif /* MAP_HUGETLB */
+
+	return 0;
+}
+
+#endif /* WIN32 */
+
+static const struct {
+	const char	*Name;
+	int			(*Function)(void);
+	const char	*Description;
+} Tests[] = {
+	{"querycontext", SelfTest_QueryContext, "100k in-flight queries added, found, removed and expired"},
+	{"cache", SelfTest_Cache, "Answers with CNAME chains fetched from the RRset cache"},
+#ifndef WIN32
+	{"shards", SelfTest_Shards, "Threads fetching from and adding to the cache, in 1 and in 8 shards"},
+#endif /* WIN32 */
+	{"cacheht", SelfTest_CacheHT, "Lookups hitting and missing the index of cache nodes"},
+	{"domaintrie", SelfTest_DomainTrie, "A gfwlist-like list matched against a trace of names"},
+	{"wildcard", SelfTest_WildCard, "Up to 100k domains with wildcards loaded and matched"},
+#ifndef WIN32
+	{"pages", SelfTest_Pages, "Random probes over 1 GB with each kind of pages backing the cache"},
+#endif /* WIN32 */
+#ifdef MESSAGEQUEUE_AVAILABLE
+	{"messagequeue", SelfTest_MessageQueue, "Producers and a consumer racing on an in-process queue"},
+	{"transport", SelfTest_Transport, "Latency of in-process queues against loopback sockets"},
+#endif /* MESSAGEQUEUE_AVAILABLE */
+};
+
+#define	NUMBER_OF_TESTS	(sizeof(Tests) / sizeof(Tests[0]))
+
+void SelfTest_List(void)
+{
+	unsigned int	loop;
+
+	for( loop = 0; loop != NUMBER_OF_TESTS; ++loop )
+	{
+		printf("  %-14s %s\n", Tests[loop].Name, Tests[loop].Description);
+	}
+}
+
+int SelfTest(const char *Name)
+{
+	unsigned int	loop;
+	int		Run = 0;
+	int		Failed = 0;
+
+	for( loop = 0; loop != NUMBER_OF_TESTS; ++loop )
+	{
+		if( Name != NULL && (strcmp(Name, "all") == 0 || strcmp(Name, Tests[loop].Name) == 0) )
+		{
+			printf("%s : %s\n", Tests[loop].Name, Tests[loop].Description);
+
+			if( Tests[loop].Function() != 0 )
+			{
+				++Failed;
+			} else {
+				printf("  passed\n");
+			}
+
+			++Run;
+		}
+	}
+
+	if( Run == 0 )
+	{
+		printf("Unknown test `%s'. The tests are:\n", Name == NULL ? "" : Name);
+		SelfTest_List();
+		return -1;
+	}
+
+	return Failed;
+}
@@ -0,0 +1,20 @@
+#ifndef SELFTEST_H_INCLUDED
+#define SELFTEST_H_INCLUDED
+
+/* Stress tests and benchmarks of the data structures behind the forwarder,
+ * run with `dnsforwarder -S <NAME>'. Each test checks its results and
+ * prints what it measured. */
+
+int SelfTest(const char *Name);
+/* Description:
+ *  Run the test `Name', or all of them if `Name' is `all'.
+ * Return value:
+ *  0 if all tests run passed, a non-zero value otherwise.
+ */
+
+void SelfTest_List(void);
+/* Description:
+ *  Print the names of all tests.
+ */
+
+#endif // SELFTEST_H_INCLUDED
@@ -220,3 +220,47 @@ void SimpleHT_Free(SimpleHT *ht)
 	Array_Free(&(ht -> Slots));
 	Array_Free(&(ht -> Nodes));
 }
+
+int SimpleHT_Save(SimpleHT *ht, FILE *fp)
+{
+	uint32_t	Sizes[2];
+
+	Sizes[0] = ht -> MaxLoadFactor;
+	Sizes[1] = ht -> LeftSpace;
+
+	if( ListImage_PutArray(fp, &(ht -> Slots)) != 0 ||
+		ListImage_PutArray(fp, &(ht -> Nodes)) != 0 ||
+		ListImage_Put(fp, Sizes, sizeof(Sizes)) != 0
+		)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+int SimpleHT_Map(SimpleHT *ht, ListImage *i, int DataLength, int (*HashFunction)(const char *, int))
+{
+	const uint32_t	*Sizes;
+	uint32_t		Length;
+
+	if( ListImage_TakeArray(i, &(ht -> Slots), sizeof(Sht_Slot)) != 0 ||
+		ListImage_TakeArray(i, &(ht -> Nodes), sizeof(Sht_NodeHead) + DataLength) != 0 ||
+		Array_GetUsed(&(ht -> Slots)) == 0
+		)
+	{
+		return -1;
+	}
+
+	Sizes = (const uint32_t *)ListImage_Take(i, &Length);
+	if( Sizes == NULL || Length != 2 * sizeof(uint32_t) )
+	{
+		return -2;
+	}
+
+	ht -> MaxLoadFactor = Sizes[0];
+	ht -> LeftSpace = Sizes[1];
+	ht -> HashFunction = HashFunction;
+
+	return 0;
+}
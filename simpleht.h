@@ -2,6 +2,7 @@
 #define SIMPLEHT_H_INCLUDED
 
 #include "array.h"
+#include "listimage.h"
 
 typedef struct _Sht_NodeHead{
 	int32_t	Next;
@@ -28,5 +29,15 @@ const char *SimpleHT_Find(SimpleHT *ht, const char *Key, int KeyLength, int *Has
 const char *SimpleHT_Enum(SimpleHT *ht, int32_t *Start);
 
 void SimpleHT_Free(SimpleHT *ht);
+
+int SimpleHT_Save(SimpleHT *ht, FILE *fp);
+
+int SimpleHT_Map(SimpleHT *ht, ListImage *i, int DataLength, int (*HashFunction)(const char *, int));
+/* Description:
+ *  Write a SimpleHT to a ListImage, and take it back from the mapping. One
+ *  taken must not be changed or freed.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
 
 #endif // SIMPLEHT_H_INCLUDED
@@ -259,6 +259,52 @@ int Hosts_InitContainer(HostsContainer	*Container)
 		return -6;
 	}
 
+	Container -> Image.Start = NULL;
+
+	return 0;
+}
+
+int Hosts_SaveContainer(HostsContainer *Container, const char *File, const char *Source)
+{
+	FILE	*fp = ListImage_Create(File, Source, LISTIMAGE_HOSTS);
+	BOOL	Completed;
+
+	if( fp == NULL )
+	{
+		return -1;
+	}
+
+	Completed = ListImage_PutBuffer(fp, &(Container -> Domains)) == 0 &&
+				ListImage_PutBuffer(fp, &(Container -> IPs)) == 0 &&
+				StringChunk_Save(&(Container -> Ipv4Hosts), fp) == 0 &&
+				StringChunk_Save(&(Container -> Ipv6Hosts), fp) == 0 &&
+				StringChunk_Save(&(Container -> CNameHosts), fp) == 0 &&
+				StringChunk_Save(&(Container -> ExcludedDomains), fp) == 0;
+
+	return ListImage_Close(fp, File, Completed);
+}
+
+int Hosts_MapContainer(HostsContainer *Container, const char *File, const char *Source)
+{
+	ListImage	*i = &(Container -> Image);
+
+	if( ListImage_Map(i, File, Source, LISTIMAGE_HOSTS) != 0 )
+	{
+		return -1;
+	}
+
+	if( ListImage_TakeBuffer(i, &(Container -> Domains)) != 0 ||
+		ListImage_TakeBuffer(i, &(Container -> IPs)) != 0 ||
+		StringChunk_Map(&(Container -> Ipv4Hosts), i, &(Container -> Domains)) != 0 ||
+		StringChunk_Map(&(Container -> Ipv6Hosts), i, &(Container -> Domains)) != 0 ||
+		StringChunk_Map(&(Container -> CNameHosts), i, &(Container -> Domains)) != 0 ||
+		StringChunk_Map(&(Container -> ExcludedDomains), i, &(Container -> Domains)) != 0
+		)
+	{
+		ListImage_Unmap(i);
+		return -2;
+	}
+
 	return 0;
 }
 
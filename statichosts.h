@@ -21,6 +21,9 @@ typedef struct _HostsContainer{
 /*	StringChunk	ExcludedIPs;*/
 
 	ExtendableBuffer	IPs;
+
+	/* Where all above are, if mapped */
+	ListImage	Image;
 } HostsContainer;
 
 extern HostsContainer	MainStaticContainer;
@@ -42,6 +45,21 @@ typedef enum _HostsRecordType{
 
 int Hosts_InitContainer(HostsContainer	*Container);
 
+int Hosts_SaveContainer(HostsContainer *Container, const char *File, const char *Source);
+/* Description:
+ *  Save a container of hosts compiled from `Source' to the image `File'.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+int Hosts_MapContainer(HostsContainer *Container, const char *File, const char *Source);
+/* Description:
+ *  Map a container from the image `File', if it is up to date with `Source',
+ *  instead of initializing it. Nothing can be added to a container mapped.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
 HostsRecordType Hosts_LoadFromMetaLine(HostsContainer *Container, char *MetaLine);
 
 int StaticHosts_Init(ConfigFileInfo *ConfigInfo);
@@ -1,4 +1,5 @@
 #include <string.h>
+#include <ctype.h>
 #include "stringchunk.h"
 #include "utils.h"
 
@@ -7,6 +8,19 @@ typedef struct _EntryForString{
 	int32_t	OffsetOfData;
 } EntryForString;
 
+typedef struct _EntryForWildCard{
+	int32_t	OffsetOfString;
+	int32_t	OffsetOfData;
+	int32_t	Next; /* The next domain having the same fragment, -1 if none */
+} EntryForWildCard;
+
+typedef struct _WildCardNode{
+	int32_t	First; /* The first domain whose fragment ends here, -1 if none */
+	int32_t	Count; /* How many */
+} WildCardNode;
+
+#define	EDGE_HASH(Parent, Character)	(((uint32_t)(Parent) * 2654435761U) ^ (unsigned char)(Character))
+
 int StringChunk_Init(StringChunk *dl, StringList *List)
 {
 	if( dl == NULL )
@@ -19,7 +33,7 @@ int StringChunk_Init(StringChunk *dl, StringList *List)
 		return -1;
 	}
 
-	if( Array_Init(&(dl -> List_W_Pos), sizeof(EntryForString), 0, FALSE, NULL) != 0 )
+	if( Array_Init(&(dl -> List_W_Pos), sizeof(EntryForWildCard), 0, FALSE, NULL) != 0 )
 	{
 		SimpleHT_Free(&(dl -> List_Pos));
 		return -2;
@@ -31,6 +45,20 @@ int StringChunk_Init(StringChunk *dl, StringList *List)
 		Array_Free(&(dl -> List_W_Pos));
 		return -3;
 	}
+
+	if( Array_Init(&(dl -> W_Nodes), sizeof(WildCardNode), 0, FALSE, NULL) != 0 )
+	{
+		SimpleHT_Free(&(dl -> List_Pos));
+		Array_Free(&(dl -> List_W_Pos));
+		ExtendableBuffer_Free(&(dl -> AdditionalDataChunk));
+		return -6;
+	}
+
+	/* Allocated with the first domain with wildcards */
+	dl -> W_Edges = NULL;
+	dl -> W_Capacity = 0;
+	dl -> W_Used = 0;
+	dl -> W_NoFragment = -1;
 
 	if( List == NULL )
 	{
@@ -51,6 +79,209 @@ int StringChunk_Init(StringChunk *dl, StringList *List)
 	return 0;
 }
 
+/* Returns the slot holding the edge, or the empty slot where it would be */
+static StringChunk_Edge *StringChunk_EdgeSlot(StringChunk *dl, int32_t Parent, char Character)
+{
+	uint32_t	Mask = dl -> W_Capacity - 1;
+	uint32_t	i = EDGE_HASH(Parent, Character) & Mask;
+
+	while( dl -> W_Edges[i].Parent >= 0 )
+	{
+		if( dl -> W_Edges[i].Parent == Parent &&
+			dl -> W_Edges[i].Character == Character
+			)
+		{
+			break;
+		}
+
+		i = (i + 1) & Mask;
+	}
+
+	return dl -> W_Edges + i;
+}
+
+static int32_t StringChunk_WildCardChild(StringChunk *dl, int32_t Parent, char Character)
+{
+	StringChunk_Edge *e = StringChunk_EdgeSlot(dl, Parent, Character);
+
+	return e -> Parent >= 0 ? e -> Child : -1;
+}
+
+/* Make room for one more edge, keeping the table at most 3/4 full */
+static int StringChunk_GrowEdges(StringChunk *dl)
+{
+	StringChunk_Edge	*Old = dl -> W_Edges;
+	int32_t				OldCapacity = dl -> W_Capacity;
+	int					loop;
+
+	if( (dl -> W_Used + 1) * 4 <= dl -> W_Capacity * 3 )
+	{
+		return 0;
+	}
+
+	dl -> W_Capacity = OldCapacity == 0 ? 64 : OldCapacity * 2;
+	dl -> W_Edges = SafeMalloc(sizeof(StringChunk_Edge) * dl -> W_Capacity);
+	if( dl -> W_Edges == NULL )
+	{
+		dl -> W_Edges = Old;
+		dl -> W_Capacity = OldCapacity;
+		return -1;
+	}
+
+	for( loop = 0; loop != dl -> W_Capacity; ++loop )
+	{
+		dl -> W_Edges[loop].Parent = -1;
+	}
+
+	for( loop = 0; loop != OldCapacity; ++loop )
+	{
+		if( Old[loop].Parent >= 0 )
+		{
+			*StringChunk_EdgeSlot(dl, Old[loop].Parent, Old[loop].Character) = Old[loop];
+		}
+	}
+
+	SafeFree(Old);
+
+	return 0;
+}
+
+/* Choose the literal fragment of a domain with wildcards to index it by.
+ * Short fragments appear in too many names, and those already shared by many
+ * domains would have all of them tried, so the one scoring lowest in
+ * (Count + 1) * 32 ^ (-Length) is chosen. Returns where it starts, or -1 if
+ * there is none. */
+static int StringChunk_Fragment(StringChunk *dl, const char *Str, int *Length)
+{
+	int			Start = -1;
+	uint64_t	Best = 0;
+	int			loop;
+
+	*Length = 0;
+
+	/* Brackets are wildcards to fnmatch() */
+	if( strchr(Str, '[') != NULL )
+	{
+		return -1;
+	}
+
+	for( loop = 0; Str[loop] != '\0'; )
+	{
+		int			Run = strcspn(Str + loop, "*?");
+		int32_t		Count = 0;
+		uint64_t	Score;
+
+		if( Run > 0 )
+		{
+			int32_t	Node = 0;
+			int		i;
+
+			for( i = loop; i != loop + Run && Node >= 0 && dl -> W_Capacity > 0; ++i )
+			{
+				Node = StringChunk_WildCardChild(dl, Node, tolower((unsigned char)Str[i]));
+			}
+
+			if( Node >= 0 && dl -> W_Capacity > 0 )
+			{
+				Count = ((WildCardNode *)Array_GetBySubscript(&(dl -> W_Nodes), Node)) -> Count;
+			}
+
+			Score = (uint64_t)(Count + 1) << (5 * (Run < 6 ? 6 - Run : 0));
+			if( Start < 0 || Score < Best || (Score == Best && Run > *Length) )
+			{
+				Start = loop;
+				*Length = Run;
+				Best = Score;
+			}
+		}
+
+		loop += Run;
+		if( Str[loop] != '\0' )
+		{
+			++loop;
+		}
+	}
+
+	return Start;
+}
+
+static int StringChunk_AddWildCard(StringChunk *dl, const char *Str, const EntryForString *Entry)
+{
+	EntryForWildCard	New;
+	int32_t				Subscript;
+	int32_t				*First;
+	int					Start, Length;
+
+	New.OffsetOfString = Entry -> OffsetOfString;
+	New.OffsetOfData = Entry -> OffsetOfData;
+
+	Start = StringChunk_Fragment(dl, Str, &Length);
+	if( Start < 0 )
+	{
+		First = &(dl -> W_NoFragment);
+	} else {
+		WildCardNode	*Node;
+		int32_t			Parent = 0;
+		int				loop;
+
+		if( Array_GetUsed(&(dl -> W_Nodes)) == 0 )
+		{
+			WildCardNode	Root = {-1, 0};
+
+			if( Array_PushBack(&(dl -> W_Nodes), &Root, NULL) < 0 )
+			{
+				return -1;
+			}
+		}
+
+		/* Case is ignored here, the domains found are checked exactly */
+		for( loop = Start; loop != Start + Length; ++loop )
+		{
+			char				Character = tolower((unsigned char)Str[loop]);
+			StringChunk_Edge	*e;
+
+			if( StringChunk_GrowEdges(dl) != 0 )
+			{
+				return -2;
+			}
+
+			e = StringChunk_EdgeSlot(dl, Parent, Character);
+			if( e -> Parent < 0 )
+			{
+				WildCardNode	Empty = {-1, 0};
+
+				e -> Child = Array_PushBack(&(dl -> W_Nodes), &Empty, NULL);
+				if( e -> Child < 0 )
+				{
+					return -3;
+				}
+
+				e -> Parent = Parent;
+				e -> Character = Character;
+				++(dl -> W_Used);
+			}
+
+			Parent = e -> Child;
+		}
+
+		Node = (WildCardNode *)Array_GetBySubscript(&(dl -> W_Nodes), Parent);
+		++(Node -> Count);
+		First = &(Node -> First);
+	}
+
+	New.Next = *First;
+
+	Subscript = Array_PushBack(&(dl -> List_W_Pos), &New, NULL);
+	if( Subscript < 0 )
+	{
+		return -4;
+	}
+
+	*First = Subscript;
+
+	return 0;
+}
+
 int StringChunk_Add(StringChunk	*dl,
 					const char	*Str,
 					const char	*AdditionalData,
@@ -90,7 +321,10 @@ int StringChunk_Add(StringChunk	*dl,
 
 	if( ContainWildCard(Str) )
 	{
-		Array_PushBack(&(dl -> List_W_Pos), &NewEntry, NULL);
+		if( StringChunk_AddWildCard(dl, Str, &NewEntry) != 0 )
+		{
+			return -2;
+		}
 	} else {
 		SimpleHT_Add(&(dl -> List_Pos), Str, 0, (const char *)&NewEntry, NULL);
 	}
@@ -135,41 +369,86 @@ BOOL StringChunk_Match_NoWildCard(StringChunk	*dl,
 
 }
 
+/* Check the domains chained from `Subscript', returns the smallest subscript
+ * of those matched, `Best' if none is smaller */
+static int32_t StringChunk_TryWildCards(StringChunk *dl, const char *Str, int32_t Subscript, int32_t Best)
+{
+	while( Subscript >= 0 )
+	{
+		EntryForWildCard *FoundEntry = (EntryForWildCard *)Array_GetBySubscript(&(dl -> List_W_Pos), Subscript);
+
+		if( Subscript < Best &&
+			WILDCARD_MATCH(StringList_GetByOffset(dl -> List, FoundEntry -> OffsetOfString), Str) == WILDCARD_MATCHED
+			)
+		{
+			Best = Subscript;
+		}
+
+		Subscript = FoundEntry -> Next;
+	}
+
+	return Best;
+}
+
 BOOL StringChunk_Match_OnlyWildCard(StringChunk	*dl,
 									const char	*Str,
 									char		**Data
 									)
 {
-	EntryForString *FoundEntry;
+	EntryForWildCard *FoundEntry;
 
-	const char *FoundString;
+	int32_t	Best = Array_GetUsed(&(dl -> List_W_Pos));
+	int32_t	None = Best;
 
-	int loop;
+	const char *Start;
 
-	for( loop = 0; loop != Array_GetUsed(&(dl -> List_W_Pos)); ++loop )
+	if( Best == 0 )
 	{
-		FoundEntry = (EntryForString *)Array_GetBySubscript(&(dl -> List_W_Pos), loop);
-		if( FoundEntry != NULL )
+		return FALSE;
+	}
+
+	Best = StringChunk_TryWildCards(dl, Str, dl -> W_NoFragment, Best);
+
+	/* Only the domains whose fragment appears in `Str' can match. Walk the
+	 * trie from every position, so the cost depends on the length of `Str'
+	 * and of the fragments, not on how many domains there are. The first
+	 * domain added still wins, as it did when all were tried in order. */
+	for( Start = Str; *Start != '\0' && dl -> W_Capacity > 0; ++Start )
+	{
+		const char	*Itr;
+		int32_t		Node = 0;
+
+		for( Itr = Start; *Itr != '\0'; ++Itr )
 		{
-			FoundString = StringList_GetByOffset(dl -> List, FoundEntry -> OffsetOfString);
-			if( WILDCARD_MATCH(FoundString, Str) == WILDCARD_MATCHED )
+			Node = StringChunk_WildCardChild(dl, Node, tolower((unsigned char)*Itr));
+			if( Node < 0 )
 			{
-				if( FoundEntry -> OffsetOfData >= 0 && Data != NULL )
-				{
-					*Data = ExtendableBuffer_GetPositionByOffset(
-													&(dl -> AdditionalDataChunk),
-													FoundEntry -> OffsetOfData
-													);
-				}
-				return TRUE;
+				break;
 			}
 
-		} else {
-			return FALSE;
+			Best = StringChunk_TryWildCards(dl,
+											Str,
+											((WildCardNode *)Array_GetBySubscript(&(dl -> W_Nodes), Node)) -> First,
+											Best
+											);
 		}
 	}
 
-	return FALSE;
+	if( Best == None )
+	{
+		return FALSE;
+	}
+
+	FoundEntry = (EntryForWildCard *)Array_GetBySubscript(&(dl -> List_W_Pos), Best);
+	if( FoundEntry -> OffsetOfData >= 0 && Data != NULL )
+	{
+		*Data = ExtendableBuffer_GetPositionByOffset(
+										&(dl -> AdditionalDataChunk),
+										FoundEntry -> OffsetOfData
+										);
+	}
+
+	return TRUE;
 }
 
 BOOL StringChunk_Match(StringChunk *dl, const char *Str, int *HashValue, char **Data)
@@ -214,10 +493,82 @@ const char *StringChunk_Enum_NoWildCard(StringChunk *dl, int32_t *Start, char **
 	}
 }
 
+int StringChunk_Save(StringChunk *dl, FILE *fp)
+{
+	int32_t	Numbers[2];
+
+	Numbers[0] = dl -> W_Used;
+	Numbers[1] = dl -> W_NoFragment;
+
+	if( SimpleHT_Save(&(dl -> List_Pos), fp) != 0 ||
+		ListImage_PutArray(fp, &(dl -> List_W_Pos)) != 0 ||
+		ListImage_PutArray(fp, &(dl -> W_Nodes)) != 0 ||
+		ListImage_Put(fp, dl -> W_Edges, dl -> W_Capacity * sizeof(StringChunk_Edge)) != 0 ||
+		ListImage_Put(fp, Numbers, sizeof(Numbers)) != 0 ||
+		ListImage_PutBuffer(fp, &(dl -> AdditionalDataChunk)) != 0
+		)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+int StringChunk_Map(StringChunk *dl, ListImage *i, StringList *List)
+{
+	const int32_t	*Numbers;
+	uint32_t		Length;
+
+	dl -> List = List;
+
+	if( SimpleHT_Map(&(dl -> List_Pos), i, sizeof(EntryForString), ELFHash) != 0 ||
+		ListImage_TakeArray(i, &(dl -> List_W_Pos), sizeof(EntryForWildCard)) != 0 ||
+		ListImage_TakeArray(i, &(dl -> W_Nodes), sizeof(WildCardNode)) != 0
+		)
+	{
+		return -1;
+	}
+
+	dl -> W_Edges = (StringChunk_Edge *)ListImage_Take(i, &Length);
+	if( dl -> W_Edges == NULL || Length % sizeof(StringChunk_Edge) != 0 )
+	{
+		return -2;
+	}
+
+	dl -> W_Capacity = Length / sizeof(StringChunk_Edge);
+
+	Numbers = (const int32_t *)ListImage_Take(i, &Length);
+	if( Numbers == NULL || Length != 2 * sizeof(int32_t) )
+	{
+		return -3;
+	}
+
+	dl -> W_Used = Numbers[0];
+	dl -> W_NoFragment = Numbers[1];
+
+	/* Edges are probed with a mask until an empty slot is met */
+	if( (dl -> W_Capacity & (dl -> W_Capacity - 1)) != 0 ||
+		dl -> W_Used < 0 ||
+		dl -> W_Used > dl -> W_Capacity / 4 * 3
+		)
+	{
+		return -3;
+	}
+
+	if( ListImage_TakeBuffer(i, &(dl -> AdditionalDataChunk)) != 0 )
+	{
+		return -4;
+	}
+
+	return 0;
+}
+
 void StringChunk_Free(StringChunk *dl, BOOL FreeStringList)
 {
 	SimpleHT_Free(&(dl -> List_Pos));
 	Array_Free(&(dl -> List_W_Pos));
+	Array_Free(&(dl -> W_Nodes));
+	SafeFree(dl -> W_Edges);
 	ExtendableBuffer_Free(&(dl -> AdditionalDataChunk));
 
 	if( FreeStringList == TRUE )
@@ -6,6 +6,13 @@
 #include "array.h"
 #include "extendablebuffer.h"
 
+/* An edge of the trie of wildcard fragments */
+typedef struct _StringChunk_Edge{
+	int32_t	Parent;
+	int32_t	Child;
+	char	Character;
+} StringChunk_Edge;
+
 typedef struct _StringChunk{
 	StringList	*List;
 
@@ -15,6 +22,15 @@ typedef struct _StringChunk{
 	/* Positions of every domain in `List_W', offsets */
 	Array		List_W_Pos;
 
+	/* A literal fragment of every domain in `List_W', in a trie. A name is
+	 * only tried against the domains whose fragment it contains, see
+	 * StringChunk_Match_OnlyWildCard(). */
+	Array		W_Nodes;
+	StringChunk_Edge	*W_Edges; /* Open addressing, -1 `Parent' if empty */
+	int32_t		W_Capacity; /* A power of 2 */
+	int32_t		W_Used;
+	int32_t		W_NoFragment; /* The first domain having no fragment */
+
 	/* Chunk of all additional datas */
 	ExtendableBuffer	AdditionalDataChunk;
 
@@ -44,6 +60,23 @@ BOOL StringChunk_Match(StringChunk *dl, const char *Str, int *HashValue, char **
 
 const char *StringChunk_Enum_NoWildCard(StringChunk *dl, int32_t *Start, char **Data);
 
+#define	StringChunk_Count(dl_ptr)	(Array_GetUsed(&((dl_ptr) -> List_Pos.Nodes)) + Array_GetUsed(&((dl_ptr) -> List_W_Pos)))
+/* Description:
+ *  The number of strings added.
+ */
+
+int StringChunk_Save(StringChunk *dl, FILE *fp);
+
+int StringChunk_Map(StringChunk *dl, ListImage *i, StringList *List);
+/* Description:
+ *  Write a StringChunk to a ListImage, and take it back from the mapping.
+ *  `List' is not written, it is to be written and taken separately, and
+ *  given to StringChunk_Map(). A StringChunk taken must not be changed or
+ *  freed.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
 void StringChunk_Free(StringChunk *dl, BOOL FreeStringList);
 
 #endif // STRINGCHUNK_H_INCLUDED
@@ -0,0 +1,269 @@
+#include <string.h>
+#include "tcpframer.h"
+#include "request_response.h"
+#include "dnsparser.h"
+#include "dnsgenerator.h"
+
+#ifdef WIN32
+#define	WOULD_BLOCK(e)	((e) == WSAEWOULDBLOCK)
+#else /* WIN32 */
+#include <sys/uio.h>
+#define	WOULD_BLOCK(e)	((e) == EAGAIN || (e) == EWOULDBLOCK || (e) == EINTR)
+#endif /* WIN32 */
+
+/* Bytes asked from the socket each time */
+#define	RECEIVE_SIZE	4096
+
+/* No message is longer than 65535 bytes, while a peer not reading what it is
+ * sent is not waited for forever */
+#define	IN_LIMIT		(2 * 65537)
+#define	OUT_LIMIT		(1024 * 1024)
+
+int TCPFramer_Init(TCPFramer *f, SOCKET Socket)
+{
+	f -> Socket = Socket;
+	f -> Head = 0;
+
+	if( ExtendableBuffer_Init(&(f -> In), 0, IN_LIMIT) != 0 ||
+		ExtendableBuffer_Init(&(f -> Out), 0, OUT_LIMIT) != 0
+		)
+	{
+		return -1;
+	}
+
+	if( Socket != INVALID_SOCKET )
+	{
+		SetSocketNonBlock(Socket, TRUE);
+	}
+
+	return 0;
+}
+
+void TCPFramer_Reset(TCPFramer *f, SOCKET Socket)
+{
+	f -> Socket = Socket;
+	f -> Head = 0;
+
+	ExtendableBuffer_Reset(&(f -> In));
+	ExtendableBuffer_Reset(&(f -> Out));
+
+	if( Socket != INVALID_SOCKET )
+	{
+		SetSocketNonBlock(Socket, TRUE);
+	}
+}
+
+int TCPFramer_Receive(TCPFramer *f)
+{
+	int	State;
+
+	/* Move what is left of a message to the front */
+	if( f -> Head > 0 )
+	{
+		ExtendableBuffer_Eliminate(&(f -> In), 0, f -> Head);
+		f -> Head = 0;
+	}
+
+	if( ExtendableBuffer_GuarantyLeft(&(f -> In), RECEIVE_SIZE) == FALSE )
+	{
+		return -1;
+	}
+
+	State = recv(f -> Socket,
+				 ExtendableBuffer_GetData(&(f -> In)) + ExtendableBuffer_GetEndOffset(&(f -> In)),
+				 RECEIVE_SIZE,
+				 MSG_NOSIGNAL
+				 );
+
+	if( State > 0 )
+	{
+		ExtendableBuffer_SetEndOffset(&(f -> In), ExtendableBuffer_GetEndOffset(&(f -> In)) + State);
+		return 0;
+	}
+
+	if( State < 0 && WOULD_BLOCK(GET_LAST_ERROR()) )
+	{
+		return 0;
+	}
+
+	return -1;
+}
+
+int TCPFramer_Next(TCPFramer *f, char *Buffer, int BufferLength)
+{
+	const char	*Here = ExtendableBuffer_GetData(&(f -> In)) + f -> Head;
+	uint32_t	Left = ExtendableBuffer_GetEndOffset(&(f -> In)) - f -> Head;
+	int			Length;
+
+	if( Left < 2 )
+	{
+		return 0;
+	}
+
+	Length = (uint16_t)GET_16_BIT_U_INT(Here);
+	if( Left < 2 + (uint32_t)Length )
+	{
+		return 0;
+	}
+
+	f -> Head += 2 + Length;
+
+	if( f -> Head == ExtendableBuffer_GetEndOffset(&(f -> In)) )
+	{
+		ExtendableBuffer_SetEndOffset(&(f -> In), 0);
+		f -> Head = 0;
+	}
+
+	if( Length == 0 || Length > BufferLength )
+	{
+		return -1;
+	}
+
+	/* `Here' stays valid, the buffer is only moved by receiving */
+	memcpy(Buffer, Here + 2, Length);
+
+	return Length;
+}
+
+int TCPFramer_Queue(TCPFramer *f, const char *Message, int Length)
+{
+	char	*Here = ExtendableBuffer_Expand(&(f -> Out), 2 + Length, NULL);
+
+	if( Here == NULL )
+	{
+		return -1;
+	}
+
+	SET_16_BIT_U_INT(Here, Length);
+	memcpy(Here + 2, Message, Length);
+
+	return 0;
+}
+
+/* Send the length and the message in one call, returns the number of bytes
+ * sent, 0 if none can be sent now */
+static int TCPFramer_SendVector(TCPFramer *f, const char *Prefix, const char *Message, int Length)
+{
+#ifdef WIN32
+	WSABUF	Buffers[2];
+	DWORD	Sent = 0;
+
+	Buffers[0].buf = (char *)Prefix;
+	Buffers[0].len = 2;
+	Buffers[1].buf = (char *)Message;
+	Buffers[1].len = Length;
+
+	if( WSASend(f -> Socket, Buffers, 2, &Sent, 0, NULL, NULL) != 0 )
+	{
+		return WOULD_BLOCK(GET_LAST_ERROR()) ? 0 : -1;
+	}
+
+	return (int)Sent;
+#else /* WIN32 */
+	struct iovec	Buffers[2];
+	struct msghdr	Header;
+	int				Sent;
+
+	Buffers[0].iov_base = (void *)Prefix;
+	Buffers[0].iov_len = 2;
+	Buffers[1].iov_base = (void *)Message;
+	Buffers[1].iov_len = Length;
+
+	memset(&Header, 0, sizeof(Header));
+	Header.msg_iov = Buffers;
+	Header.msg_iovlen = 2;
+
+	/* Not writev(), which can not have SIGPIPE suppressed */
+	Sent = sendmsg(f -> Socket, &Header, MSG_NOSIGNAL);
+	if( Sent < 0 )
+	{
+		return WOULD_BLOCK(GET_LAST_ERROR()) ? 0 : -1;
+	}
+
+	return Sent;
+#endif /* WIN32 */
+}
+
+int TCPFramer_Send(TCPFramer *f, const char *Message, int Length)
+{
+	char	Prefix[2];
+	int		Sent;
+
+	/* Messages are not to overtake those queued */
+	if( TCPFramer_Queued(f) > 0 )
+	{
+		if( TCPFramer_Queue(f, Message, Length) != 0 )
+		{
+			return -1;
+		}
+
+		return TCPFramer_Flush(f);
+	}
+
+	SET_16_BIT_U_INT(Prefix, Length);
+
+	Sent = TCPFramer_SendVector(f, Prefix, Message, Length);
+	if( Sent < 0 )
+	{
+		return -1;
+	}
+
+	if( Sent == 2 + Length )
+	{
+		return 0;
+	}
+
+	/* Queue what is left */
+	if( Sent < 2 )
+	{
+		if( ExtendableBuffer_Add(&(f -> Out), Prefix + Sent, 2 - Sent) < 0 )
+		{
+			return -1;
+		}
+
+		Sent = 2;
+	}
+
+	if( ExtendableBuffer_Add(&(f -> Out), Message + (Sent - 2), Length - (Sent - 2)) < 0 )
+	{
+		return -1;
+	}
+
+	return TCPFramer_Queued(f);
+}
+
+int TCPFramer_Flush(TCPFramer *f)
+{
+	int	Sent;
+
+	if( TCPFramer_Queued(f) == 0 )
+	{
+		return 0;
+	}
+
+	Sent = send(f -> Socket,
+				ExtendableBuffer_GetData(&(f -> Out)),
+				TCPFramer_Queued(f),
+				MSG_NOSIGNAL
+				);
+
+	if( Sent < 0 )
+	{
+		return WOULD_BLOCK(GET_LAST_ERROR()) ? TCPFramer_Queued(f) : -1;
+	}
+
+	if( Sent == TCPFramer_Queued(f) )
+	{
+		ExtendableBuffer_Reset(&(f -> Out));
+	} else {
+		ExtendableBuffer_Eliminate(&(f -> Out), 0, Sent);
+	}
+
+	return TCPFramer_Queued(f);
+}
+
+void TCPFramer_Free(TCPFramer *f)
+{
+	ExtendableBuffer_Free(&(f -> In));
+	ExtendableBuffer_Free(&(f -> Out));
+}
@@ -0,0 +1,83 @@
+#ifndef TCPFRAMER_H_INCLUDED
+#define TCPFRAMER_H_INCLUDED
+
+#include "extendablebuffer.h"
+#include "common.h"
+
+/* A TCPFramer splits the stream of a non-blocking TCP socket into DNS
+ * messages, each preceded by its 2-byte length (RFC 1035 4.2.2), and frames
+ * the messages to be sent the same way.
+ *
+ * Bytes received are kept until a whole message has arrived, so a message may
+ * come in any number of pieces, and several may come in one piece. Messages
+ * that can not be sent at once are queued in order, and all queued are sent
+ * together when the socket is writable again.
+ */
+
+typedef struct _TCPFramer {
+	SOCKET				Socket;
+
+	/* Received, not yet taken by TCPFramer_Next() */
+	ExtendableBuffer	In;
+	uint32_t			Head; /* Where the next message in `In' starts */
+
+	/* Framed, not yet sent */
+	ExtendableBuffer	Out;
+} TCPFramer;
+
+int TCPFramer_Init(TCPFramer *f, SOCKET Socket);
+/* Description:
+ *  Initialize a TCPFramer and make `Socket' non-blocking.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+int TCPFramer_Receive(TCPFramer *f);
+/* Description:
+ *  Receive what is available on the socket, without blocking.
+ * Return value:
+ *  0 on success, even if nothing was received. A non-zero value if the
+ *  connection was closed or failed.
+ */
+
+int TCPFramer_Next(TCPFramer *f, char *Buffer, int BufferLength);
+/* Description:
+ *  Take the next whole message received, without its length.
+ * Return value:
+ *  The length of the message, or 0 if there is no whole message yet. -1 if
+ *  the message was longer than `BufferLength', it is discarded then.
+ */
+
+int TCPFramer_Queue(TCPFramer *f, const char *Message, int Length);
+/* Description:
+ *  Frame a message and queue it without sending.
+ * Return value:
+ *  0 on success, a non-zero value otherwise.
+ */
+
+int TCPFramer_Send(TCPFramer *f, const char *Message, int Length);
+/* Description:
+ *  Frame a message and send it with its length in one call. What can not be
+ *  sent at once is queued, as is the whole message if others are queued.
+ * Return value:
+ *  The number of bytes left queued, -1 if the connection failed.
+ */
+
+int TCPFramer_Flush(TCPFramer *f);
+/* Description:
+ *  Send the messages queued, as many bytes as the socket takes.
+ * Return value:
+ *  The number of bytes left queued, -1 if the connection failed.
+ */
+
+#define TCPFramer_Queued(f_ptr)	((int)ExtendableBuffer_GetUsedBytes(&((f_ptr) -> Out)))
+
+void TCPFramer_Reset(TCPFramer *f, SOCKET Socket);
+/* Description:
+ *  Drop all received and queued, and start over on `Socket', which is made
+ *  non-blocking.
+ */
+
+void TCPFramer_Free(TCPFramer *f);
+
+#endif // TCPFRAMER_H_INCLUDED
@@ -153,6 +153,42 @@ char *GetCurDateAndTime(char *Buffer, int BufferLength)
 	return Buffer;
 }
 
+#ifndef WIN32
+#include <sys/time.h>
+#endif /* WIN32 */
+/* A monotonic clock, so that setting the system time does not skew the
+ * intervals measured */
+int64_t GetMicroseconds(void)
+{
+#ifdef WIN32
+	/* Never fails since Windows XP */
+	static LARGE_INTEGER	Frequency = {0};
+	LARGE_INTEGER			Counter;
+
+	if( Frequency.QuadPart == 0 )
+	{
+		QueryPerformanceFrequency(&Frequency);
+	}
+
+	QueryPerformanceCounter(&Counter);
+
+	return (int64_t)(Counter.QuadPart / Frequency.QuadPart) * 1000000 +
+			(int64_t)(Counter.QuadPart % Frequency.QuadPart) * 1000000 / Frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else /* WIN32 */
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif /* WIN32 */
+}
+
 int	Base64Decode(const char *File)
 {
 #ifdef WIN32
@@ -69,6 +69,12 @@ int GetErrorMsg(int Code, char *Buffer, int BufferLength);
 
 char *GetCurDateAndTime(char *Buffer, int BufferLength);
 
+int64_t GetMicroseconds(void);
+/* Description:
+ *  Get the time of a monotonic clock in microseconds, for measuring
+ *  intervals. It is not related to the time of day.
+ */
+
 #ifndef WIN32
 int Execute(const char *Cmd);
 #endif /* WIN32 */